@@ -29,7 +29,11 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -39,8 +43,9 @@
 #include <log.h>
 
 #include "vmmapi.h"
-
-extern char *vmname;
+#include "dm.h"
+#include "dm_string.h"
+#include "page_merge.h"
 
 #define HUGETLB_LV1		0
 #define HUGETLB_LV2		1
@@ -61,6 +66,20 @@ extern char *vmname;
 #define SYS_NR_HUGEPAGES  "nr_hugepages"
 #define SYS_FREE_HUGEPAGES  "free_hugepages"
 
+#define SYS_PATH_CPU  "/sys/devices/system/cpu/"
+
+/* memory policies of mbind(2), to avoid the dependency on libnuma */
+#define HUGETLB_MPOL_PREFERRED	1
+#define HUGETLB_MPOL_INTERLEAVE	3
+#define MAX_NUMA_NODES		64
+
+/* max threads used to prefault or zero one memory segment */
+#define MEM_OP_MAX_THREADS	8
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
 /* File used for lock between different processes access to hugetlbfs.
  * We observed when access hugetlbfs from different process to allocate
  * huge page at the same time could fail. So use file lock here to make
@@ -133,10 +152,22 @@ static struct hugetlb_info hugetlb_priv[HUGETLB_LV_MAX] = {
 	},
 };
 
+/* mem_task record the range one thread prefaults or zeroes */
+struct mem_task {
+	char *addr;
+	size_t len;
+	size_t pagesz;
+	bool zero;
+};
+
 static void *ptr;
 static size_t total_size;
+/* the guest memory ranges mmap'ed so far, and the files they come from */
+static struct hugetlb_mem_region mem_regions[HUGETLB_MEM_REGIONS_MAX];
+static int nr_mem_regions;
 static int hugetlb_lv_max;
 static int lock_fd;
+static uint64_t numa_nodemask;
 
 static int lock_acrn_hugetlb(void)
 {
@@ -256,6 +287,143 @@ static bool should_enable_hugetlb_level(int level)
 	        hugetlb_priv[level].highmem > 0);
 }
 
+/* get the NUMA nodes of the pCPUs in cpu_bitmap, from their sysfs node link */
+static uint64_t get_cpu_nodemask(uint64_t cpu_bitmap)
+{
+	char path[MAX_PATH_LEN];
+	struct dirent *entry;
+	uint64_t nodemask = 0UL;
+	DIR *dir;
+	int cpu, node;
+
+	for (cpu = 0; cpu < 64; cpu++) {
+		if ((cpu_bitmap & (1UL << cpu)) == 0UL)
+			continue;
+
+		snprintf(path, MAX_PATH_LEN, "%scpu%d/", SYS_PATH_CPU, cpu);
+		dir = opendir(path);
+		if (dir == NULL) {
+			pr_warn("can't open %s, skip pcpu %d for numa affinity\n",
+				path, cpu);
+			continue;
+		}
+
+		while ((entry = readdir(dir)) != NULL) {
+			if ((strncmp(entry->d_name, "node", 4) == 0) &&
+				(dm_strtoi(entry->d_name + 4, NULL, 10, &node) == 0) &&
+				(node >= 0) && (node < MAX_NUMA_NODES)) {
+				nodemask |= (1UL << node);
+				break;
+			}
+		}
+		closedir(dir);
+	}
+
+	return nodemask;
+}
+
+/*
+ * Prefer the node of the VM's pCPUs if they all belong to one node, else
+ * interleave the memory across their nodes. Unlike MPOL_BIND, both policies
+ * let the kernel fall back to other nodes when a node runs out of hugepages,
+ * since the reservation above is not done per node.
+ */
+static void bind_numa_nodes(void *addr, size_t len)
+{
+	unsigned long nodemask = numa_nodemask;
+	int mode;
+
+	if (nodemask == 0UL)
+		return;
+
+	if ((nodemask & (nodemask - 1UL)) == 0UL)
+		mode = HUGETLB_MPOL_PREFERRED;
+	else
+		mode = HUGETLB_MPOL_INTERLEAVE;
+
+	if (syscall(SYS_mbind, addr, len, mode, &nodemask,
+			MAX_NUMA_NODES + 1, 0) < 0)
+		pr_warn("mbind 0x%lx@%p to nodes 0x%lx failed, errno: %d\n",
+			len, addr, nodemask, errno);
+}
+
+static void *mem_task_thread(void *arg)
+{
+	struct mem_task *task = arg;
+	char *addr = task->addr;
+	size_t i;
+
+	if (task->zero) {
+		memset(addr, 0, task->len);
+	} else if (madvise(addr, task->len, MADV_POPULATE_WRITE) != 0) {
+		/* kernels before 5.14 lack MADV_POPULATE_WRITE, touch the pages */
+		for (i = 0; i < task->len / task->pagesz; i++) {
+			*(volatile char *)addr = *addr;
+			addr += task->pagesz;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Prefault (have the hugepages allocated) or zero [addr, addr + len).
+ * Faulting in a hugepage means clearing it, so both dominate the setup and
+ * reset time of large VMs: split the range, at pagesz granularity, across
+ * threads.
+ */
+static void parallel_mem_op(char *addr, size_t len, size_t pagesz, bool zero)
+{
+	struct mem_task tasks[MEM_OP_MAX_THREADS];
+	pthread_t tids[MEM_OP_MAX_THREADS];
+	bool created[MEM_OP_MAX_THREADS];
+	size_t npages, per_thread, done = 0;
+	long ncpus;
+	int i, nthreads;
+
+	npages = len / pagesz;
+	if (npages == 0)
+		return;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = (ncpus > MEM_OP_MAX_THREADS) ? MEM_OP_MAX_THREADS :
+			((ncpus > 0) ? (int)ncpus : 1);
+	if (npages < nthreads)
+		nthreads = npages;
+	per_thread = (npages + nthreads - 1) / nthreads;
+
+	for (i = 0; i < nthreads && done < npages; i++) {
+		tasks[i].addr = addr + done * pagesz;
+		tasks[i].len = ((npages - done > per_thread) ?
+				per_thread : npages - done) * pagesz;
+		tasks[i].pagesz = pagesz;
+		tasks[i].zero = zero;
+		done += tasks[i].len / pagesz;
+
+		/* the first part is done by the caller itself */
+		created[i] = (i > 0) &&
+			(pthread_create(&tids[i], NULL, mem_task_thread, &tasks[i]) == 0);
+	}
+	nthreads = i;
+
+	mem_task_thread(&tasks[0]);
+	for (i = 1; i < nthreads; i++) {
+		if (created[i])
+			pthread_join(tids[i], NULL);
+		else
+			mem_task_thread(&tasks[i]);
+	}
+}
+
+static uint64_t elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000UL +
+		(now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
 /*
  * level  : hugepage level
  * len	  : region length for mmap
@@ -267,7 +435,7 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 {
 	char *addr;
 	size_t pagesz = 0;
-	int fd, i;
+	int fd;
 
 	if (level >= HUGETLB_LV_MAX) {
 		pr_err("exceed max hugetlb level");
@@ -282,15 +450,26 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 
 	pr_info("mmap 0x%lx@%p\n", len, addr);
 
+	if (nr_mem_regions < HUGETLB_MEM_REGIONS_MAX) {
+		mem_regions[nr_mem_regions].gpa = offset;
+		mem_regions[nr_mem_regions].size = len;
+		mem_regions[nr_mem_regions].hva = addr;
+		mem_regions[nr_mem_regions].fd = fd;
+		mem_regions[nr_mem_regions].offset = skip;
+		mem_regions[nr_mem_regions].pg_size =
+			hugetlb_priv[level].pg_size;
+		nr_mem_regions++;
+	}
+
+	/* the policy must be set before the hugepages are faulted in */
+	bind_numa_nodes(addr, len);
+
 	/* pre-allocate hugepages by touch them */
 	pagesz = hugetlb_priv[level].pg_size;
 
 	pr_info("touch %ld pages with pagesz 0x%lx\n", len/pagesz, pagesz);
 
-	for (i = 0; i < len/pagesz; i++) {
-		*(volatile char *)addr = *addr;
-		addr += pagesz;
-	}
+	parallel_mem_op(addr, len, pagesz, false);
 
 	return 0;
 }
@@ -689,7 +868,10 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	int level;
 	size_t lowmem, biosmem, highmem;
 	bool has_gap;
+	struct timespec setup_start, start;
 
+	clock_gettime(CLOCK_MONOTONIC, &setup_start);
+	nr_mem_regions = 0;
 	if (ctx->lowmem == 0) {
 		pr_err("vm requests 0 memory");
 		goto err;
@@ -740,11 +922,13 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	lock_acrn_hugetlb();
 
 	/* it will check each level memory need */
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	has_gap = hugetlb_check_memgap();
 	if (has_gap) {
 		if (!hugetlb_reserve_pages())
 			goto err_lock;
 	}
+	pr_info("hugepages reserved in %lu ms\n", elapsed_ms(&start));
 
 	/* align up total size with huge page size for vma alignment */
 	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
@@ -783,25 +967,37 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	}
 	pr_info("mmap ptr 0x%p -> baseaddr 0x%p\n", ptr, ctx->baseaddr);
 
+	numa_nodemask = 0UL;
+	if (numa_affinity) {
+		numa_nodemask = get_cpu_nodemask(acrn_get_cpu_affinity());
+		pr_info("guest memory numa nodemask 0x%lx\n", numa_nodemask);
+	}
+
 	/* mmap lowmem */
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (mmap_hugetlbfs(ctx, 0, get_lowmem_param, adj_lowmem_param) < 0) {
 		pr_err("lowmem mmap failed");
 		goto err_lock;
 	}
+	pr_info("lowmem 0x%lx setup in %lu ms\n", ctx->lowmem, elapsed_ms(&start));
 
 	/* mmap highmem */
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (mmap_hugetlbfs(ctx, ctx->highmem_gpa_base,
 				get_highmem_param, adj_highmem_param) < 0) {
 		pr_err("highmem mmap failed");
 		goto err_lock;
 	}
+	pr_info("highmem 0x%lx setup in %lu ms\n", ctx->highmem, elapsed_ms(&start));
 
 	/* mmap biosmem */
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (mmap_hugetlbfs(ctx, 4 * GB - ctx->biosmem,
 				get_biosmem_param, adj_biosmem_param) < 0) {
 		pr_err("biosmem mmap failed");
 		goto err_lock;
 	}
+	pr_info("biosmem 0x%lx setup in %lu ms\n", ctx->biosmem, elapsed_ms(&start));
 
 	unlock_acrn_hugetlb();
 
@@ -816,6 +1012,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	}
 
 	/* map ept for lowmem */
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (vm_map_memseg_vma(ctx, ctx->lowmem, 0,
 		(uint64_t)ctx->baseaddr, PROT_ALL) < 0)
 		goto err;
@@ -840,6 +1037,8 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 			PROT_ALL) < 0)
 			goto err;
 	}
+	pr_info("ept mapped in %lu ms\n", elapsed_ms(&start));
+	pr_info("guest memory setup in %lu ms\n", elapsed_ms(&setup_start));
 
 	return 0;
 
@@ -857,10 +1056,45 @@ err:
 	return -ENOMEM;
 }
 
+void hugetlb_zero_memory(struct vmctx *ctx)
+{
+	struct timespec start;
+
+	/* back the chunks freed by page merging before writing them */
+	page_merge_hold();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	parallel_mem_op(ctx->baseaddr, ctx->lowmem,
+			hugetlb_priv[HUGETLB_LV1].pg_size, true);
+	if (ctx->highmem > 0) {
+		parallel_mem_op(ctx->baseaddr + ctx->highmem_gpa_base,
+				ctx->highmem, hugetlb_priv[HUGETLB_LV1].pg_size, true);
+	}
+	pr_info("guest memory zeroed in %lu ms\n", elapsed_ms(&start));
+	page_merge_unhold();
+}
+
+/*
+ * Get the guest memory ranges and the hugetlbfs files they are mmap'ed
+ * from, for another process to map guest memory. Returns the number of
+ * ranges, at most max.
+ */
+int hugetlb_get_mem_regions(struct vmctx *ctx,
+		struct hugetlb_mem_region *regions, int max)
+{
+	int i;
+
+	for (i = 0; i < nr_mem_regions && i < max; i++)
+		regions[i] = mem_regions[i];
+
+	return i;
+}
+
 void hugetlb_unsetup_memory(struct vmctx *ctx)
 {
 	int level;
 
+	nr_mem_regions = 0;
+
 	if (total_size > 0) {
 		munmap(ptr, total_size);
 		total_size = 0;
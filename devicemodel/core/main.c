@@ -65,6 +65,9 @@
 #include "mmio_dev.h"
 #include "virtio.h"
 #include "pm_vuart.h"
+#include "snapshot.h"
+#include "metrics.h"
+#include "page_merge.h"
 #include "log.h"
 
 #define GUEST_NIO_PORT		0x488	/* guest upcalls via i/o port */
@@ -83,6 +86,7 @@ char *vsbl_file_name;
 char *ovmf_file_name;
 char *kernel_file_name;
 char *elf_file_name;
+char *restore_file_name;
 uint8_t trusty_enabled;
 char *mac_seed;
 bool stdio_in_use;
@@ -90,6 +94,8 @@ bool lapic_pt;
 bool is_rtvm;
 bool pt_tpm2;
 bool is_winvm;
+bool numa_affinity;
+static bool zero_on_reset;
 bool skip_pci_mem64bar_workaround = false;
 
 static int guest_ncpus;
@@ -99,6 +105,7 @@ static char mac_seed_str[50];
 static int pm_notify_channel;
 
 static int acpi;
+static int mptgen;
 
 static char *progname;
 static const int BSP;
@@ -168,12 +175,19 @@ usage(int code)
 		"       --vsbl: vsbl file path\n"
 		"       --ovmf: ovmf file path\n"
 		"       --cpu_affinity: list of pCPUs assigned to this VM\n"
+		"       --numa_affinity: place guest memory on the NUMA node(s) of the --cpu_affinity pCPUs\n"
+		"       --restore: resume the VM from a snapshot file taken in suspend state\n"
+		"       --zero_on_reset: zero guest memory on a warm reset of the VM too\n"
+		"       --page_merge: merge the identical pages of guest memory and free the zero ones\n"
+		"       --metrics: record the latency of the emulated I/O, for acrnctl metrics\n"
 		"       --part_info: guest partition info file path\n"
 		"       --enable_trusty: enable trusty for guest\n"
 		"       --debugexit: enable debug exit function\n"
 		"       --intr_monitor: enable interrupt storm monitor\n"
 		"            its params: threshold/s,probe-period(s),delay_time(ms),delay_duration(ms)\n"
-		"       --virtio_poll: enable virtio poll mode with poll interval with ns\n"
+		"       --virtio_poll: enable virtio poll mode with poll interval with ns,\n"
+		"                      or adaptive[:budget] to poll busy virtqueues with\n"
+		"                      up to budget percent of a CPU per device\n"
 		"       --acpidev_pt: acpi device ID args: HID in ACPI Table\n"
 		"       --mmiodev_pt: MMIO resources args: physical MMIO regions\n"
 		"       --vtpm2: Virtual TPM2 args: sock_path=$PATH_OF_SWTPM_SOCKET\n"
@@ -386,16 +400,39 @@ vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 
 #endif	/* #ifdef DEBUG_EPT_MISCONFIG */
 
+/* the guest wrote to a chunk freed by page merging */
+static void
+vmexit_restore_page(struct vmctx *ctx, struct vhm_request *vhm_req,
+		int *pvcpu)
+{
+	if (page_merge_access(vhm_req->reqs.mmio.address, 4096) < 0) {
+		pr_err("Can't back gpa 0x%lx again\n",
+			vhm_req->reqs.mmio.address);
+		exit(1);
+	}
+}
+
 static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 	[VM_EXITCODE_INOUT]  = vmexit_inout,
 	[VM_EXITCODE_MMIO_EMUL] = vmexit_mmio_emul,
 	[VM_EXITCODE_PCI_CFG] = vmexit_pci_emul,
+	[VM_EXITCODE_RESTORE_PAGE] = vmexit_restore_page,
 };
 
+/* the time the requests of each exit code take to be emulated */
+static const char *const vmexit_names[VM_EXITCODE_MAX] = {
+	[VM_EXITCODE_INOUT]  = "inout",
+	[VM_EXITCODE_MMIO_EMUL] = "mmio",
+	[VM_EXITCODE_PCI_CFG] = "pci_cfg",
+	[VM_EXITCODE_RESTORE_PAGE] = "restore_page",
+};
+static struct metrics_dev *vmexit_metrics;
+
 static void
 handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 {
 	enum vm_exitcode exitcode;
+	uint64_t t;
 
 	exitcode = vhm_req->type;
 	if (exitcode >= VM_EXITCODE_MAX || handler[exitcode] == NULL) {
@@ -404,7 +441,10 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 		exit(1);
 	}
 
+	t = metrics_now();
 	(*handler[exitcode])(ctx, vhm_req, &vcpu);
+	t = metrics_stamp_slot(vmexit_metrics, vcpu, exitcode, METRICS_BACKEND,
+		t);
 
 	/* We cannot notify the VHM/hypervisor on the request completion at this
 	 * point if the UOS is in suspend or system reset mode, as the VM is
@@ -418,6 +458,7 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 		return;
 
 	vm_notify_request_done(ctx, vcpu);
+	metrics_stamp_slot(vmexit_metrics, vcpu, exitcode, METRICS_COMPLETE, t);
 }
 
 static void
@@ -457,6 +498,9 @@ vm_init_vdevs(struct vmctx *ctx)
 
 	init_mem();
 	init_inout();
+	/* a slot per vCPU, they don't share the counters */
+	vmexit_metrics = metrics_register_slots("vmexit", VM_EXITCODE_MAX,
+		guest_ncpus, vmexit_names);
 	pci_irq_init(ctx);
 	atkbdc_init(ctx);
 	ioapic_init(ctx);
@@ -515,6 +559,8 @@ vrtc_fail:
 	atkbdc_deinit(ctx);
 	pci_irq_deinit(ctx);
 	ioapic_deinit();
+	metrics_unregister(vmexit_metrics);
+	vmexit_metrics = NULL;
 	return -1;
 }
 
@@ -542,6 +588,8 @@ vm_deinit_vdevs(struct vmctx *ctx)
 	pci_irq_deinit(ctx);
 	ioapic_deinit();
 	deinit_vtpm2(ctx);
+	metrics_unregister(vmexit_metrics);
+	vmexit_metrics = NULL;
 }
 
 static void
@@ -560,9 +608,6 @@ vm_reset_vdevs(struct vmctx *ctx)
 	 *
 	 * pci/ioapic deinit/init is needed because of dependency
 	 * of pci irq allocation/free.
-	 *
-	 * acpi build is necessary because irq for each vdev
-	 * could be assigned with different number after reset.
 	 */
 	atkbdc_deinit(ctx);
 
@@ -588,10 +633,26 @@ vm_reset_vdevs(struct vmctx *ctx)
 
 	ioapic_init(ctx);
 	init_pci(ctx);
+}
 
-	if (acpi) {
-		acpi_build(ctx, guest_ncpus);
+/*
+ * build the guest tables, MP etc.
+ */
+static int
+vm_build_tables(struct vmctx *ctx)
+{
+	int error = 0;
+
+	if (mptgen)
+		error = mptable_build(ctx, guest_ncpus);
+
+	if (!error && acpi) {
+		error = acpi_build(ctx, guest_ncpus);
+		if (error)
+			pr_err("acpi_build failed, error=%d\n", error);
 	}
+
+	return error;
 }
 
 static void
@@ -603,9 +664,10 @@ vm_system_reset(struct vmctx *ctx)
 	 *   1. pause VM
 	 *   2. flush and clear ioreqs
 	 *   3. reset virtual devices
-	 *   4. load software for UOS
-	 *   5. hypercall reset vm
+	 *   4. hypercall reset vm
+	 *   5. zero guest memory if asked to, and rebuild the guest tables
 	 *   6. reset suspend mode to VM_SUSPEND_NONE
+	 *   7. load software for UOS
 	 */
 
 	vm_pause(ctx);
@@ -629,6 +691,24 @@ vm_system_reset(struct vmctx *ctx)
 
 	vm_reset_vdevs(ctx);
 	vm_reset(ctx);
+
+	/*
+	 * A warm reset keeps guest memory by default, the guest may
+	 * expect pstore/ramoops or a crash kernel to survive it. With
+	 * --zero_on_reset it starts over from clean memory, as on its
+	 * first boot. The devices are reset and the vCPUs paused, so
+	 * nothing else writes guest memory at this point.
+	 */
+	if (zero_on_reset && !is_rtvm)
+		hugetlb_zero_memory(ctx);
+
+	/*
+	 * The guest tables are rebuilt, after the zeroing if any, acpi
+	 * also because irq for each vdev could be assigned with different
+	 * number after reset.
+	 */
+	vm_build_tables(ctx);
+
 	pr_info("%s: setting VM state to %s\n", __func__, vm_state_to_str(VM_SUSPEND_NONE));
 	vm_set_suspend_mode(VM_SUSPEND_NONE);
 
@@ -753,6 +833,11 @@ enum {
 	CMD_OPT_PM_NOTIFY_CHANNEL,
 	CMD_OPT_PM_BY_VUART,
 	CMD_OPT_WINDOWS,
+	CMD_OPT_NUMA_AFFINITY,
+	CMD_OPT_RESTORE,
+	CMD_OPT_ZERO_ON_RESET,
+	CMD_OPT_PAGE_MERGE,
+	CMD_OPT_METRICS,
 };
 
 static struct option long_options[] = {
@@ -794,6 +879,11 @@ static struct option long_options[] = {
 	{"pm_notify_channel",	required_argument,	0, CMD_OPT_PM_NOTIFY_CHANNEL},
 	{"pm_by_vuart",	required_argument,	0, CMD_OPT_PM_BY_VUART},
 	{"windows",		no_argument,		0, CMD_OPT_WINDOWS},
+	{"numa_affinity",	no_argument,		0, CMD_OPT_NUMA_AFFINITY},
+	{"restore",		required_argument,	0, CMD_OPT_RESTORE},
+	{"zero_on_reset",	no_argument,		0, CMD_OPT_ZERO_ON_RESET},
+	{"page_merge",		no_argument,		0, CMD_OPT_PAGE_MERGE},
+	{"metrics",		no_argument,		0, CMD_OPT_METRICS},
 	{0,			0,			0,  0  },
 };
 
@@ -803,7 +893,7 @@ int
 main(int argc, char *argv[])
 {
 	int c, error, ret=1;
-	int max_vcpus, mptgen;
+	int max_vcpus;
 	struct vmctx *ctx;
 	size_t memsize;
 	int option_idx = 0;
@@ -969,6 +1059,21 @@ main(int argc, char *argv[])
 		case CMD_OPT_WINDOWS:
 			is_winvm = true;
 			break;
+		case CMD_OPT_NUMA_AFFINITY:
+			numa_affinity = true;
+			break;
+		case CMD_OPT_RESTORE:
+			restore_file_name = optarg;
+			break;
+		case CMD_OPT_ZERO_ON_RESET:
+			zero_on_reset = true;
+			break;
+		case CMD_OPT_PAGE_MERGE:
+			page_merge_enabled = true;
+			break;
+		case CMD_OPT_METRICS:
+			metrics_enabled = true;
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -987,6 +1092,11 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (restore_file_name && acrn_sw_direct_boot()) {
+		pr_err("--restore needs vsbl or ovmf, not a kernel or ELF image\n");
+		exit(1);
+	}
+
 	if (!init_hugetlb()) {
 		pr_err("init_hugetlb failed\n");
 		exit(1);
@@ -1031,29 +1141,39 @@ main(int argc, char *argv[])
 			goto dev_fail;
 		}
 
-		/*
-		 * build the guest tables, MP etc.
-		 */
-		if (mptgen) {
-			error = mptable_build(ctx, guest_ncpus);
+		if (restore_file_name) {
+			/*
+			 * The guest tables and software are part of the
+			 * snapshot. Only the first launch is restored, a full
+			 * reset boots the guest as usual.
+			 */
+			pr_notice("vm_snapshot_restore\n");
+			error = vm_snapshot_restore(ctx, restore_file_name);
+			restore_file_name = NULL;
 			if (error) {
+				pr_err("vm_snapshot_restore failed, error=%d\n", error);
 				goto vm_fail;
 			}
-		}
 
-		if (acpi) {
-			error = acpi_build(ctx, guest_ncpus);
+			/* all but the copy of the images into guest memory */
+			pr_notice("acrn_sw_restore\n");
+			error = acrn_sw_restore(ctx);
+			if (error) {
+				pr_err("acrn_sw_restore failed, error=%d\n", error);
+				goto vm_fail;
+			}
+		} else {
+			error = vm_build_tables(ctx);
 			if (error) {
-				pr_err("acpi_build failed, error=%d\n", error);
 				goto vm_fail;
 			}
-		}
 
-		pr_notice("acrn_sw_load\n");
-		error = acrn_sw_load(ctx);
-		if (error) {
-			pr_err("acrn_sw_load failed, error=%d\n", error);
-			goto vm_fail;
+			pr_notice("acrn_sw_load\n");
+			error = acrn_sw_load(ctx);
+			if (error) {
+				pr_err("acrn_sw_load failed, error=%d\n", error);
+				goto vm_fail;
+			}
 		}
 
 		/*
@@ -1061,6 +1181,13 @@ main(int argc, char *argv[])
 		 */
 		/*setproctitle("%s", vmname);*/
 
+		pr_notice("page_merge_init\n");
+		error = page_merge_init(ctx);
+		if (error) {
+			pr_err("page_merge_init failed, error=%d\n", error);
+			goto vm_fail;
+		}
+
 		/*
 		 * Add CPU 0
 		 */
@@ -1088,6 +1215,7 @@ main(int argc, char *argv[])
 		}
 
 		vm_deinit_vdevs(ctx);
+		page_merge_deinit(ctx);
 		mevent_deinit();
 		vm_unsetup_memory(ctx);
 		vm_destroy(ctx);
@@ -1099,6 +1227,7 @@ main(int argc, char *argv[])
 
 vm_fail:
 	vm_deinit_vdevs(ctx);
+	page_merge_deinit(ctx);
 dev_fail:
 	mevent_deinit();
 mevent_fail:
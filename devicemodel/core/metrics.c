@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "metrics.h"
+#include "timer.h"
+#include "log.h"
+
+struct metrics_hist {
+	uint64_t	count;
+	uint64_t	sum_ns;
+	uint64_t	max_ns;
+	uint64_t	buckets[METRICS_BUCKETS];
+};
+
+/* a cache line apart, the queues are recorded by different threads */
+struct metrics_queue {
+	struct metrics_hist	stages[METRICS_STAGES];
+} __attribute__((aligned(64)));
+
+struct metrics_dev {
+	char			name[32];
+	int			nq;
+	int			nslots;
+	const char *const	*qnames;
+	struct metrics_queue	*queues;	/* nq of each slot */
+	LIST_ENTRY(metrics_dev)	list;
+};
+
+bool metrics_enabled;
+
+static const char *metrics_stage_names[METRICS_STAGES] = {
+	"submit", "backend", "complete"
+};
+
+/* the registry, the recording doesn't need it */
+static LIST_HEAD(metrics_list, metrics_dev) metrics_head =
+	LIST_HEAD_INITIALIZER(metrics_head);
+static pthread_mutex_t metrics_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+struct metrics_dev *
+metrics_register_slots(const char *name, int nq, int nslots,
+		       const char *const *qnames)
+{
+	struct metrics_dev *d;
+	size_t len;
+
+	if (!metrics_enabled || nq < 1 || nslots < 1)
+		return NULL;
+
+	d = calloc(1, sizeof(struct metrics_dev));
+	if (d == NULL)
+		return NULL;
+	len = (size_t)nq * nslots * sizeof(struct metrics_queue);
+	if (posix_memalign((void **)&d->queues, 64, len)) {
+		free(d);
+		return NULL;
+	}
+	memset(d->queues, 0, len);
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	d->nq = nq;
+	d->nslots = nslots;
+	d->qnames = qnames;
+
+	pthread_mutex_lock(&metrics_mtx);
+	LIST_INSERT_HEAD(&metrics_head, d, list);
+	pthread_mutex_unlock(&metrics_mtx);
+	return d;
+}
+
+struct metrics_dev *
+metrics_register(const char *name, int nq, const char *const *qnames)
+{
+	return metrics_register_slots(name, nq, 1, qnames);
+}
+
+void
+metrics_unregister(struct metrics_dev *d)
+{
+	if (d == NULL)
+		return;
+
+	pthread_mutex_lock(&metrics_mtx);
+	LIST_REMOVE(d, list);
+	pthread_mutex_unlock(&metrics_mtx);
+	free(d->queues);
+	free(d);
+}
+
+uint64_t
+metrics_now(void)
+{
+	struct timespec ts;
+
+	if (!metrics_enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+uint64_t
+metrics_stamp_slot(struct metrics_dev *d, int slot, int q,
+		   enum metrics_stage s, uint64_t start)
+{
+	struct metrics_hist *h;
+	uint64_t now, ns, max;
+	int b;
+
+	if (d == NULL || q < 0 || q >= d->nq || slot < 0 ||
+	    slot >= d->nslots)
+		return 0;
+	now = metrics_now();
+
+	ns = (now > start) ? now - start : 0;
+	b = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (b >= METRICS_BUCKETS)
+		b = METRICS_BUCKETS - 1;
+
+	h = &d->queues[slot * d->nq + q].stages[s];
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return now;
+}
+
+uint64_t
+metrics_stamp(struct metrics_dev *d, int q, enum metrics_stage s,
+	      uint64_t start)
+{
+	return metrics_stamp_slot(d, 0, q, s, start);
+}
+
+/* ns, in the unit which keeps it under 1000 */
+static void
+metrics_fmt(char *buf, size_t len, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, len, "%luns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, len, "%.1fus", ns / 1000.0);
+	else if (ns < NS_PER_SEC)
+		snprintf(buf, len, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buf, len, "%.1fs", ns / (double)NS_PER_SEC);
+}
+
+/* the sum of stage s of queue q over the slots */
+static void
+metrics_sum(struct metrics_dev *d, int q, int s, struct metrics_hist *sum)
+{
+	struct metrics_hist *h;
+	uint64_t max;
+	int slot, b;
+
+	memset(sum, 0, sizeof(*sum));
+	for (slot = 0; slot < d->nslots; slot++) {
+		h = &d->queues[slot * d->nq + q].stages[s];
+		sum->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+		sum->sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+		if (max > sum->max_ns)
+			sum->max_ns = max;
+		for (b = 0; b < METRICS_BUCKETS; b++)
+			sum->buckets[b] += __atomic_load_n(&h->buckets[b],
+				__ATOMIC_RELAXED);
+	}
+}
+
+static void
+metrics_dump_hist(FILE *fp, const char *stage, struct metrics_hist *h)
+{
+	char avg[16], max[16], lo[16];
+	uint64_t n;
+	int b;
+
+	if (h->count == 0)
+		return;
+	metrics_fmt(avg, sizeof(avg), h->sum_ns / h->count);
+	metrics_fmt(max, sizeof(max), h->max_ns);
+	fprintf(fp, "    %-8s %lu, avg %s, max %s\n", stage, h->count, avg,
+		max);
+
+	/* the lower bound of each bucket hit, and its count */
+	fprintf(fp, "     ");
+	for (b = 0; b < METRICS_BUCKETS; b++) {
+		n = h->buckets[b];
+		if (n == 0)
+			continue;
+		metrics_fmt(lo, sizeof(lo), b ? 1UL << b : 0);
+		fprintf(fp, " %s+:%lu", lo, n);
+	}
+	fprintf(fp, "\n");
+}
+
+void
+metrics_dump(FILE *fp)
+{
+	struct metrics_hist sums[METRICS_STAGES];
+	struct metrics_dev *d;
+	int q, s;
+
+	pthread_mutex_lock(&metrics_mtx);
+	LIST_FOREACH(d, &metrics_head, list) {
+		fprintf(fp, "%s\n", d->name);
+		for (q = 0; q < d->nq; q++) {
+			/* the queues nothing was recorded on are left out */
+			for (s = 0; s < METRICS_STAGES; s++)
+				metrics_sum(d, q, s, &sums[s]);
+			for (s = 0; s < METRICS_STAGES; s++)
+				if (sums[s].count)
+					break;
+			if (s == METRICS_STAGES)
+				continue;
+			if (d->qnames && d->qnames[q])
+				fprintf(fp, "  %s\n", d->qnames[q]);
+			else
+				fprintf(fp, "  q%d\n", q);
+			for (s = 0; s < METRICS_STAGES; s++)
+				metrics_dump_hist(fp, metrics_stage_names[s],
+					&sums[s]);
+		}
+	}
+	pthread_mutex_unlock(&metrics_mtx);
+}
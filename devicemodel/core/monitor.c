@@ -15,6 +15,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
 #include "dm.h"
@@ -23,6 +24,8 @@
 #include "acrn_mngr.h"
 #include "pm.h"
 #include "vmmapi.h"
+#include "snapshot.h"
+#include "metrics.h"
 #include "log.h"
 
 #define INTR_STORM_MONITOR_PERIOD	10 /* 10 seconds */
@@ -450,6 +453,106 @@ static void handle_blkrescan(struct mngr_msg *msg, int client_fd, void *param)
 	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
 }
 
+static void handle_snapshot(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct vm_ops *ops;
+	int ret = 0;
+	int count = 0;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	LIST_FOREACH(ops, &vm_ops_head, list) {
+		if (ops->ops->snapshot) {
+			ret += ops->ops->snapshot(ops->arg, msg->data.devargs);
+			count++;
+		}
+	}
+
+	if (!count) {
+		ack.data.err = -1;
+		pr_err("No handler for id:%u\r\n", msg->msgid);
+	} else
+		ack.data.err = ret;
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_blkthrottle(struct mngr_msg *msg, int client_fd,
+			       void *param)
+{
+	struct mngr_msg ack;
+	struct vm_ops *ops;
+	int ret = 0;
+	int count = 0;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	LIST_FOREACH(ops, &vm_ops_head, list) {
+		if (ops->ops->throttle) {
+			ret += ops->ops->throttle(ops->arg, msg->data.devargs);
+			count++;
+		}
+	}
+
+	if (!count) {
+		ack.data.err = -1;
+		pr_err("No handler for id:%u\r\n", msg->msgid);
+	} else
+		ack.data.err = ret;
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+/*
+ * The metrics go to a file of their own, written aside and renamed, so
+ * that the client only ever reads a whole dump.
+ */
+static void handle_metrics(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	char path[PATH_LEN], tmp[PATH_LEN + 4];
+	FILE *fp = NULL;
+	int fd;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+	ack.data.err = -1;
+
+	if (!metrics_enabled) {
+		pr_err("%s: acrn-dm runs without --metrics\n", __func__);
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), ACRN_DM_METRICS_FMT, vmname);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	unlink(tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		0600);
+	if (fd >= 0)
+		fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		pr_err("%s: failed to open %s\n", __func__, tmp);
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+
+	metrics_dump(fp);
+	if (fclose(fp) == 0 && rename(tmp, path) == 0)
+		ack.data.err = 0;
+	else
+		unlink(tmp);
+
+out:
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
 static struct monitor_vm_ops pmc_ops = {
 	.stop       = NULL,
 	.resume     = vm_monitor_resume,
@@ -457,6 +560,7 @@ static struct monitor_vm_ops pmc_ops = {
 	.pause      = NULL,
 	.unpause    = NULL,
 	.query      = vm_monitor_query,
+	.snapshot   = vm_monitor_snapshot,
 };
 
 int monitor_init(struct vmctx *ctx)
@@ -490,6 +594,10 @@ int monitor_init(struct vmctx *ctx)
 	ret += mngr_add_handler(monitor_fd, DM_RESUME, handle_resume, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_QUERY, handle_query, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_BLKRESCAN, handle_blkrescan, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_SNAPSHOT, handle_snapshot, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BLKTHROTTLE, handle_blkthrottle,
+				NULL);
+	ret += mngr_add_handler(monitor_fd, DM_METRICS, handle_metrics, NULL);
 
 	if (ret) {
 		pr_err("%s %d\r\n", __func__, __LINE__);
@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "vmmapi.h"
+#include "dm.h"
+#include "atomic.h"
+#include "page_merge.h"
+#include "log.h"
+
+#define CHUNK_SHIFT	21
+#define CHUNK_SIZE	(1UL << CHUNK_SHIFT)
+#define CHUNK_PAGES	(CHUNK_SIZE >> 12)
+
+/* the chunks scanned each second, 128MB */
+#define SCAN_CHUNKS	64
+
+#define PAGEMAP_PRESENT		(1UL << 63)
+#define PAGEMAP_PFN_MASK	((1UL << 55) - 1)
+
+/*
+ * A chunk moves from MAPPED to FREED through FREEING in the scan thread
+ * only, and back to MAPPED through RESTORING in whatever thread accesses
+ * it first; the others wait for it.
+ */
+enum chunk_state {
+	CHUNK_UNUSED,		/* not guest memory */
+	CHUNK_MAPPED,
+	CHUNK_FREEING,
+	CHUNK_FREED,
+	CHUNK_RESTORING,
+};
+
+struct merge_chunk {
+	uint64_t	sum;		/* of the content at the last pass */
+	uint64_t	nominated_sum;	/* of the content when nominated */
+	bool		nominated;
+	bool		stable;		/* sum unchanged over a pass */
+	int		region;		/* -1 if not on 2M hugepages */
+	int		state;
+	int		accessed;	/* mapped by vm_map_gpa() since the last pass */
+};
+
+bool page_merge_enabled;
+
+static struct vmctx *merge_ctx;
+static struct hugetlb_mem_region regions[HUGETLB_MEM_REGIONS_MAX];
+static struct merge_chunk *chunks;
+static size_t nr_chunks;
+static int nr_freed;
+static int pagemap_fd = -1;
+
+/* the scan thread, hold and disabled are protected by scan_mtx */
+static pthread_t scan_tid;
+static bool scan_started;
+static bool scan_stop;
+static pthread_mutex_t scan_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+static int hold;
+static bool disabled;
+static const char *disabled_why;
+
+static void *
+chunk_hva(size_t idx)
+{
+	return merge_ctx->baseaddr + (idx << CHUNK_SHIFT);
+}
+
+static uint64_t
+chunk_sum(const uint64_t *p)
+{
+	uint64_t sum = 0xcbf29ce484222325UL;
+	size_t i;
+
+	for (i = 0; i < CHUNK_SIZE / sizeof(uint64_t); i++) {
+		sum ^= p[i];
+		sum *= 0x100000001b3UL;
+	}
+
+	return sum;
+}
+
+/* the offset of the chunk in its hugetlbfs file */
+static uint64_t
+chunk_offset(size_t idx)
+{
+	const struct hugetlb_mem_region *r = &regions[chunks[idx].region];
+
+	return r->offset + (idx << CHUNK_SHIFT) - r->gpa;
+}
+
+/*
+ * The host physical address of the hugepage at off of fd, 0 if it can't
+ * be found. The PFN is only shown with CAP_SYS_ADMIN.
+ */
+static uint64_t
+chunk_hpa(int fd, uint64_t off)
+{
+	volatile uint8_t *p;
+	uint64_t entry = 0;
+
+	p = mmap(NULL, CHUNK_SIZE, PROT_READ, MAP_SHARED, fd, off);
+	if (p == MAP_FAILED)
+		return 0;
+
+	/* fault it in */
+	(void)p[0];
+	if (pread(pagemap_fd, &entry, sizeof(entry),
+			((uintptr_t)p >> 12) * sizeof(entry)) != sizeof(entry))
+		entry = 0;
+	munmap((void *)p, CHUNK_SIZE);
+
+	if ((entry & PAGEMAP_PRESENT) == 0)
+		return 0;
+	return (entry & PAGEMAP_PFN_MASK) << 12;
+}
+
+/*
+ * Free a chunk of zero pages: make it inaccessible to the DM, have the
+ * hypervisor give its host memory back, and return the hugepage to the
+ * pool. It's only freed if nothing mapped it since the last pass.
+ */
+static void
+free_chunk(size_t idx)
+{
+	struct merge_chunk *c = &chunks[idx];
+	struct page_merge_data data;
+	int expected = CHUNK_MAPPED;
+
+	if (!atomic_cmpxchg(&c->state, &expected, CHUNK_FREEING))
+		return;
+
+	/* pairs with page_merge_access(), which sets it then checks state */
+	if (atomic_load(&c->accessed))
+		goto fail;
+
+	if (mprotect(chunk_hva(idx), CHUNK_SIZE, PROT_NONE) < 0)
+		goto fail;
+
+	memset(&data, 0, sizeof(data));
+	data.op = PAGE_MERGE_FREE_BACKING;
+	data.gpa = idx << CHUNK_SHIFT;
+	if (vm_merge_pages(merge_ctx, &data) < 0) {
+		/* a page has been written meanwhile */
+		mprotect(chunk_hva(idx), CHUNK_SIZE, PROT_READ | PROT_WRITE);
+		goto fail;
+	}
+
+	if (fallocate(regions[c->region].fd,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			chunk_offset(idx), CHUNK_SIZE) < 0)
+		pr_warn("page merge: hugepage of gpa 0x%lx not freed, error %d\n",
+			data.gpa, errno);
+
+	atomic_add_fetch(&nr_freed, 1);
+	atomic_store(&c->state, CHUNK_FREED);
+	return;
+
+fail:
+	atomic_store(&c->state, CHUNK_MAPPED);
+}
+
+/* Back a freed chunk again, or wait for the thread doing it */
+static int
+restore_chunk(size_t idx)
+{
+	struct merge_chunk *c = &chunks[idx];
+	struct page_merge_data data;
+	int state, expected;
+	uint64_t hpa;
+
+	for (;;) {
+		state = atomic_load(&c->state);
+		if (state == CHUNK_MAPPED || state == CHUNK_UNUSED)
+			return 0;
+		expected = CHUNK_FREED;
+		if (state == CHUNK_FREED &&
+				atomic_cmpxchg(&c->state, &expected, CHUNK_RESTORING))
+			break;
+		sched_yield();
+	}
+
+	memset(&data, 0, sizeof(data));
+	data.op = PAGE_MERGE_RESTORE_BACKING;
+	data.gpa = idx << CHUNK_SHIFT;
+
+	/* the hugepage may have been taken by another VM meanwhile */
+	while (fallocate(regions[c->region].fd, 0, chunk_offset(idx),
+			CHUNK_SIZE) < 0) {
+		if (errno != ENOSPC)
+			goto fail;
+		pr_warn("page merge: no free hugepage to back gpa 0x%lx, retry\n",
+			data.gpa);
+		sleep(1);
+	}
+
+	hpa = chunk_hpa(regions[c->region].fd, chunk_offset(idx));
+	if (hpa == 0)
+		goto fail;
+
+	data.hpa = hpa;
+	if (vm_merge_pages(merge_ctx, &data) < 0)
+		goto fail;
+	if (mprotect(chunk_hva(idx), CHUNK_SIZE, PROT_READ | PROT_WRITE) < 0)
+		goto fail;
+
+	c->nominated = false;
+	c->stable = false;
+	atomic_sub_fetch(&nr_freed, 1);
+	atomic_store(&c->state, CHUNK_MAPPED);
+	return 0;
+
+fail:
+	pr_err("page merge: can't back gpa 0x%lx again, error %d\n",
+		data.gpa, errno);
+	atomic_store(&c->state, CHUNK_FREED);
+	return -1;
+}
+
+static void
+restore_all(void)
+{
+	size_t idx;
+
+	for (idx = 0; idx < nr_chunks && atomic_load(&nr_freed) > 0; idx++)
+		(void)restore_chunk(idx);
+}
+
+/*
+ * Nominate a chunk whose content hasn't changed, nor been mapped by the
+ * DM, over a whole pass, and free it if it only has zero pages.
+ */
+static void
+scan_chunk(size_t idx)
+{
+	struct merge_chunk *c = &chunks[idx];
+	struct page_merge_data data;
+	uint64_t sum;
+
+	if (atomic_load(&c->state) != CHUNK_MAPPED)
+		return;
+
+	sum = chunk_sum(chunk_hva(idx));
+	if (atomic_xchg(&c->accessed, 0) || sum != c->sum || !c->stable) {
+		c->stable = (sum == c->sum);
+		c->sum = sum;
+		return;
+	}
+
+	if (c->nominated && c->nominated_sum == sum)
+		return;
+
+	memset(&data, 0, sizeof(data));
+	data.op = PAGE_MERGE_NOMINATE;
+	data.gpa = idx << CHUNK_SHIFT;
+	data.size = CHUNK_SIZE;
+	if (vm_merge_pages(merge_ctx, &data) < 0) {
+		if (errno != EBUSY) {
+			pr_err("page merge: nomination failed, error %d, stop\n",
+				errno);
+			disabled = true;
+			disabled_why = "a failed nomination";
+		}
+		return;
+	}
+	c->nominated = true;
+	c->nominated_sum = sum;
+
+	if (data.zero_pages == CHUNK_PAGES && c->region >= 0)
+		free_chunk(idx);
+}
+
+static void *
+page_merge_scan(void *arg)
+{
+	struct timespec ts;
+	size_t idx = 0;
+	int n;
+
+	pthread_mutex_lock(&scan_mtx);
+	while (!scan_stop) {
+		for (n = 0; n < SCAN_CHUNKS && !disabled; n++) {
+			if (hold == 0)
+				scan_chunk(idx);
+			idx = (idx + 1) % nr_chunks;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&scan_cond, &scan_mtx, &ts);
+	}
+	pthread_mutex_unlock(&scan_mtx);
+
+	return NULL;
+}
+
+/* the region of the chunk if it's on 2M hugepages, -1 otherwise */
+static int
+chunk_region(uint64_t gpa, int nr_regions)
+{
+	int i;
+
+	for (i = 0; i < nr_regions; i++) {
+		if (gpa >= regions[i].gpa &&
+				gpa + CHUNK_SIZE <= regions[i].gpa + regions[i].size)
+			return (regions[i].pg_size == CHUNK_SIZE) ? i : -1;
+	}
+
+	return -1;
+}
+
+int
+page_merge_init(struct vmctx *ctx)
+{
+	uint64_t gpa, end;
+	size_t idx;
+	int nr_regions;
+
+	if (!page_merge_enabled)
+		return 0;
+
+	if (disabled || lapic_pt || is_rtvm) {
+		pr_err("page merge can't be used with %s\n",
+			disabled ? disabled_why : "an RT or LAPIC pass-through VM");
+		return -EINVAL;
+	}
+
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (pagemap_fd < 0) {
+		pr_err("page merge: can't open pagemap, error %d\n", errno);
+		return -errno;
+	}
+
+	end = (ctx->highmem > 0) ? ctx->highmem_gpa_base + ctx->highmem :
+		ctx->lowmem;
+	nr_chunks = end >> CHUNK_SHIFT;
+	chunks = calloc(nr_chunks, sizeof(*chunks));
+	if (chunks == NULL) {
+		close(pagemap_fd);
+		pagemap_fd = -1;
+		return -ENOMEM;
+	}
+
+	merge_ctx = ctx;
+	nr_freed = 0;
+	nr_regions = hugetlb_get_mem_regions(ctx, regions,
+			HUGETLB_MEM_REGIONS_MAX);
+	for (idx = 0; idx < nr_chunks; idx++) {
+		gpa = idx << CHUNK_SHIFT;
+		if (gpa + CHUNK_SIZE <= ctx->lowmem ||
+				(ctx->highmem > 0 && gpa >= ctx->highmem_gpa_base)) {
+			chunks[idx].state = CHUNK_MAPPED;
+			chunks[idx].region = chunk_region(gpa, nr_regions);
+		} else {
+			chunks[idx].state = CHUNK_UNUSED;
+			chunks[idx].region = -1;
+		}
+	}
+
+	scan_stop = false;
+	if (pthread_create(&scan_tid, NULL, page_merge_scan, NULL) != 0) {
+		pr_err("page merge: can't create the scan thread\n");
+		page_merge_deinit(ctx);
+		return -1;
+	}
+	pthread_setname_np(scan_tid, "page_merge");
+	scan_started = true;
+
+	return 0;
+}
+
+/* Called once the devices are stopped, the freed chunks go with the VM */
+void
+page_merge_deinit(struct vmctx *ctx)
+{
+	if (scan_started) {
+		pthread_mutex_lock(&scan_mtx);
+		scan_stop = true;
+		pthread_cond_signal(&scan_cond);
+		pthread_mutex_unlock(&scan_mtx);
+		pthread_join(scan_tid, NULL);
+		scan_started = false;
+	}
+
+	if (pagemap_fd >= 0) {
+		close(pagemap_fd);
+		pagemap_fd = -1;
+	}
+	free(chunks);
+	chunks = NULL;
+	nr_chunks = 0;
+	nr_freed = 0;
+	merge_ctx = NULL;
+}
+
+void
+page_merge_disable(const char *why)
+{
+	pthread_mutex_lock(&scan_mtx);
+	if (!disabled) {
+		disabled = true;
+		disabled_why = why;
+		if (scan_started)
+			pr_err("page merge stops, for %s\n", why);
+	}
+	pthread_mutex_unlock(&scan_mtx);
+
+	if (chunks != NULL)
+		restore_all();
+}
+
+void
+page_merge_hold(void)
+{
+	pthread_mutex_lock(&scan_mtx);
+	hold++;
+	pthread_mutex_unlock(&scan_mtx);
+
+	if (chunks != NULL)
+		restore_all();
+}
+
+void
+page_merge_unhold(void)
+{
+	pthread_mutex_lock(&scan_mtx);
+	hold--;
+	pthread_mutex_unlock(&scan_mtx);
+}
+
+int
+page_merge_access(uint64_t gpa, size_t len)
+{
+	size_t idx, last;
+	int ret = 0;
+
+	if (chunks == NULL || len == 0)
+		return 0;
+
+	last = (gpa + len - 1) >> CHUNK_SHIFT;
+	for (idx = gpa >> CHUNK_SHIFT; idx <= last && idx < nr_chunks; idx++) {
+		/* pairs with free_chunk(), which sets state then checks it */
+		atomic_store(&chunks[idx].accessed, 1);
+		if (atomic_load(&chunks[idx].state) != CHUNK_MAPPED &&
+				restore_chunk(idx) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Guest memory snapshot and restore.
+ *
+ * A snapshot is taken while the User VM is suspended to RAM (S3): the
+ * guest has then saved its own vCPU context in memory and quiesced its
+ * devices, and its drivers re-initialize the devices on resume. So the
+ * snapshot only needs guest memory and the BSP entry state, and a VM
+ * restored from it goes through the regular S3 resume path.
+ *
+ * Guest memory is mapped to the guest by the hypervisor EPT through
+ * pinned hugepages, there is no fault path back to the device model, so
+ * restore can't page memory in lazily: it reads the data extents of the
+ * sparse snapshot file into guest memory, in parallel, and leaves the
+ * holes to the zeroed hugepages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "acpi.h"
+#include "snapshot.h"
+#include "sw_load.h"
+#include "page_merge.h"
+#include "log.h"
+
+#define SNAPSHOT_PAGE_SIZE	4096UL
+#define SNAPSHOT_SEG_MAX	3
+#define RESTORE_MAX_THREADS	8
+/* restore work is split at this granularity */
+#define RESTORE_CHUNK_ALIGN	(2 * MB)
+
+struct mem_seg {
+	uint64_t gpa;
+	uint64_t len;
+};
+
+/* restore_task record the range of guest memory one thread reads in */
+struct restore_task {
+	struct vmctx *ctx;
+	const char *path;
+	uint64_t gpa;
+	uint64_t len;
+	int ret;
+};
+
+static int
+get_mem_segs(struct vmctx *ctx, struct mem_seg *segs)
+{
+	int n = 0;
+
+	segs[n].gpa = 0;
+	segs[n++].len = ctx->lowmem;
+	if (ctx->highmem > 0) {
+		segs[n].gpa = ctx->highmem_gpa_base;
+		segs[n++].len = ctx->highmem;
+	}
+	if (ctx->biosmem > 0) {
+		segs[n].gpa = 4 * GB - ctx->biosmem;
+		segs[n++].len = ctx->biosmem;
+	}
+
+	return n;
+}
+
+static uint64_t
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000UL +
+		(now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+static bool
+page_is_zero(const void *page)
+{
+	const uint64_t *p = page;
+	size_t i;
+
+	for (i = 0; i < SNAPSHOT_PAGE_SIZE / sizeof(uint64_t); i++) {
+		if (p[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+static int
+read_all(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+/* write the non-zero pages of one segment, zero pages are left as holes */
+static int
+save_mem_seg(int fd, struct vmctx *ctx, const struct mem_seg *seg,
+		uint64_t *saved)
+{
+	char *hva = ctx->baseaddr + seg->gpa;
+	uint64_t off, run = 0;
+	bool in_run = false;
+
+	for (off = 0; off <= seg->len; off += SNAPSHOT_PAGE_SIZE) {
+		if (off < seg->len && !page_is_zero(hva + off)) {
+			if (!in_run) {
+				run = off;
+				in_run = true;
+			}
+		} else if (in_run) {
+			if (write_all(fd, hva + run, off - run,
+					SNAPSHOT_MEM_OFFSET + seg->gpa + run) < 0)
+				return -1;
+			*saved += off - run;
+			in_run = false;
+		}
+	}
+
+	return 0;
+}
+
+int
+vm_snapshot_save(struct vmctx *ctx, const char *path)
+{
+	struct snapshot_header hdr;
+	struct mem_seg segs[SNAPSHOT_SEG_MAX];
+	struct timespec start;
+	uint64_t size, saved = 0;
+	int fd, i, nsegs, ret = -1;
+
+	if (acrn_sw_direct_boot()) {
+		pr_err("%s: a VM booted without firmware can't be restored\n",
+			__func__);
+		return -1;
+	}
+
+	if (vm_get_suspend_mode() != VM_SUSPEND_SUSPEND) {
+		pr_err("%s: snapshot can only be taken in suspend state\n",
+			__func__);
+		return -1;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_err("%s: failed to open %s, errno %d\n", __func__, path, errno);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.lowmem = ctx->lowmem;
+	hdr.highmem = ctx->highmem;
+	hdr.highmem_gpa_base = ctx->highmem_gpa_base;
+	hdr.biosmem = ctx->biosmem;
+	hdr.bsp_regs = ctx->bsp_regs;
+
+	/* size the file to cover all the segments, unwritten parts stay holes */
+	size = 4 * GB;
+	if (ctx->highmem > 0)
+		size = ctx->highmem_gpa_base + ctx->highmem;
+
+	if (write_all(fd, (const char *)&hdr, sizeof(hdr), 0) < 0 ||
+		ftruncate(fd, SNAPSHOT_MEM_OFFSET + size) < 0) {
+		pr_err("%s: failed to write %s header, errno %d\n",
+			__func__, path, errno);
+		goto out;
+	}
+
+	/* the chunks freed by page merging are read directly */
+	page_merge_hold();
+	nsegs = get_mem_segs(ctx, segs);
+	for (i = 0; i < nsegs; i++) {
+		if (save_mem_seg(fd, ctx, &segs[i], &saved) < 0) {
+			pr_err("%s: failed to write %s, errno %d\n",
+				__func__, path, errno);
+			page_merge_unhold();
+			goto out;
+		}
+	}
+	page_merge_unhold();
+
+	if (fdatasync(fd) < 0) {
+		pr_err("%s: failed to sync %s, errno %d\n", __func__, path, errno);
+		goto out;
+	}
+
+	pr_info("%s: 0x%lx bytes of guest memory saved to %s in %lu ms\n",
+		__func__, saved, path, elapsed_ms(&start));
+	ret = 0;
+
+out:
+	close(fd);
+	if (ret < 0)
+		unlink(path);
+	return ret;
+}
+
+/* read in the data extents of [gpa, gpa + len), holes are skipped */
+static void *
+restore_thread(void *arg)
+{
+	struct restore_task *task = arg;
+	uint64_t pos = task->gpa, end = task->gpa + task->len;
+	off_t data, hole;
+	int fd;
+
+	task->ret = -1;
+	fd = open(task->path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	while (pos < end) {
+		data = lseek(fd, SNAPSHOT_MEM_OFFSET + pos, SEEK_DATA);
+		if (data < 0) {
+			/* no more data till the end of the file */
+			if (errno == ENXIO)
+				break;
+			goto out;
+		}
+		data -= SNAPSHOT_MEM_OFFSET;
+		if (data >= end)
+			break;
+
+		hole = lseek(fd, SNAPSHOT_MEM_OFFSET + data, SEEK_HOLE);
+		if (hole < 0)
+			goto out;
+		hole -= SNAPSHOT_MEM_OFFSET;
+		if (hole > end)
+			hole = end;
+
+		if (read_all(fd, task->ctx->baseaddr + data, hole - data,
+				SNAPSHOT_MEM_OFFSET + data) < 0)
+			goto out;
+		pos = hole;
+	}
+	task->ret = 0;
+
+out:
+	close(fd);
+	return NULL;
+}
+
+static int
+restore_mem_seg(struct vmctx *ctx, const char *path, const struct mem_seg *seg)
+{
+	struct restore_task tasks[RESTORE_MAX_THREADS];
+	pthread_t tids[RESTORE_MAX_THREADS];
+	bool created[RESTORE_MAX_THREADS];
+	uint64_t chunk, done = 0;
+	int i, nthreads, ret = 0;
+
+	chunk = roundup2(seg->len / RESTORE_MAX_THREADS, RESTORE_CHUNK_ALIGN);
+	for (i = 0; i < RESTORE_MAX_THREADS && done < seg->len; i++) {
+		tasks[i].ctx = ctx;
+		tasks[i].path = path;
+		tasks[i].gpa = seg->gpa + done;
+		tasks[i].len = (seg->len - done > chunk) ? chunk : seg->len - done;
+		done += tasks[i].len;
+
+		/* the first part is done by the caller itself */
+		created[i] = (i > 0) &&
+			(pthread_create(&tids[i], NULL, restore_thread, &tasks[i]) == 0);
+	}
+	nthreads = i;
+
+	restore_thread(&tasks[0]);
+	for (i = 0; i < nthreads; i++) {
+		if (i > 0) {
+			if (created[i])
+				pthread_join(tids[i], NULL);
+			else
+				restore_thread(&tasks[i]);
+		}
+		ret |= tasks[i].ret;
+	}
+
+	return ret;
+}
+
+int
+vm_snapshot_restore(struct vmctx *ctx, const char *path)
+{
+	struct snapshot_header hdr;
+	struct mem_seg segs[SNAPSHOT_SEG_MAX];
+	struct timespec start;
+	int fd, i, nsegs, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("%s: failed to open %s, errno %d\n", __func__, path, errno);
+		return -1;
+	}
+	ret = read_all(fd, (char *)&hdr, sizeof(hdr), 0);
+	close(fd);
+
+	if (ret < 0 || hdr.magic != SNAPSHOT_MAGIC ||
+		hdr.version != SNAPSHOT_VERSION) {
+		pr_err("%s: %s is not a valid snapshot\n", __func__, path);
+		return -1;
+	}
+
+	if (hdr.lowmem != ctx->lowmem || hdr.highmem != ctx->highmem ||
+		hdr.highmem_gpa_base != ctx->highmem_gpa_base ||
+		hdr.biosmem != ctx->biosmem) {
+		pr_err("%s: memory layout of %s doesn't match this VM\n",
+			__func__, path);
+		return -1;
+	}
+
+	nsegs = get_mem_segs(ctx, segs);
+	for (i = 0; i < nsegs; i++) {
+		if (restore_mem_seg(ctx, path, &segs[i]) != 0) {
+			pr_err("%s: failed to read %s\n", __func__, path);
+			return -1;
+		}
+	}
+
+	/* resume from S3: enter the firmware with the wake status set */
+	ctx->bsp_regs = hdr.bsp_regs;
+	pm_backto_wakeup(ctx);
+
+	pr_info("%s: guest memory restored from %s in %lu ms\n",
+		__func__, path, elapsed_ms(&start));
+
+	return 0;
+}
+
+int
+vm_monitor_snapshot(void *arg, char *path)
+{
+	struct vmctx *ctx = (struct vmctx *)arg;
+
+	return vm_snapshot_save(ctx, path);
+}
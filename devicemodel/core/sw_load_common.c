@@ -295,3 +295,31 @@ acrn_sw_load(struct vmctx *ctx)
 	else
 		return -1;
 }
+
+/*
+ * Whether the guest kernel is entered directly, without a firmware. Such
+ * a guest has no wake vector to resume from, so it can't suspend to S3.
+ */
+bool
+acrn_sw_direct_boot(void)
+{
+	return !vsbl_file_name && !ovmf_file_name &&
+		(kernel_file_name || elf_file_name);
+}
+
+/*
+ * Set up the device model side of the guest software of a VM restored
+ * from a snapshot, whose memory already holds the images and tables.
+ * Only the firmware can resume a snapshot, taken in S3.
+ */
+int
+acrn_sw_restore(struct vmctx *ctx)
+{
+	if (vsbl_file_name)
+		return acrn_sw_restore_vsbl(ctx);
+	else if (ovmf_file_name)
+		return acrn_sw_restore_ovmf(ctx);
+
+	pr_err("SW_LOAD: a snapshot can only be restored with vsbl or ovmf\n");
+	return -1;
+}
@@ -110,17 +110,17 @@ acrn_parse_ovmf(char *arg)
 	return error;
 }
 
-static int
-acrn_prepare_ovmf(struct vmctx *ctx)
+/* open the ovmf image, at its start, if it's still the size it was parsed with */
+static FILE *
+acrn_open_ovmf(const char *mode)
 {
 	FILE *fp;
-	size_t read;
 
-	fp = fopen(ovmf_path, "r");
+	fp = fopen(ovmf_path, mode);
 	if (fp == NULL) {
 		pr_err("SW_LOAD ERR: could not open ovmf file: %s\n",
 			ovmf_path);
-		return -1;
+		return NULL;
 	}
 
 	fseek(fp, 0, SEEK_END);
@@ -128,10 +128,23 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 	if (ftell(fp) != ovmf_size) {
 		pr_err("SW_LOAD ERR: ovmf file changed\n");
 		fclose(fp);
-		return -1;
+		return NULL;
 	}
 
 	fseek(fp, 0, SEEK_SET);
+	return fp;
+}
+
+static int
+acrn_prepare_ovmf(struct vmctx *ctx)
+{
+	FILE *fp;
+	size_t read;
+
+	fp = acrn_open_ovmf("r");
+	if (fp == NULL)
+		return -1;
+
 	read = fread(ctx->baseaddr + OVMF_TOP(ctx) - ovmf_size,
 		sizeof(char), ovmf_size, fp);
 
@@ -192,6 +205,26 @@ acrn_sw_load_ovmf(struct vmctx *ctx)
 	return 0;
 }
 
+/*
+ * The image, with its NV storage, is part of the snapshot of a restored
+ * VM, only the bookkeeping of acrn_sw_load_ovmf is done again. The image
+ * file is checked as the NV storage is written back to it.
+ */
+int
+acrn_sw_restore_ovmf(struct vmctx *ctx)
+{
+	FILE *fp;
+
+	init_cmos_vrpmb(ctx);
+
+	fp = acrn_open_ovmf(writeback_nv_storage ? "r+" : "r");
+	if (fp == NULL)
+		return -1;
+	fclose(fp);
+
+	return 0;
+}
+
 /* The NV data section is the first 128KB in the OVMF image. At runtime,
  * it's copied into guest memory and behave as RAM to OVMF. It can be
  * accessed and updated by OVMF. To preserve NV section (referred to
@@ -208,22 +241,10 @@ acrn_writeback_ovmf_nvstorage(struct vmctx *ctx)
 	if (!writeback_nv_storage)
 		return 0;
 
-	fp = fopen(ovmf_path, "r+");
-	if (fp == NULL) {
-		pr_err("OVMF_WRITEBACK ERR: could not open ovmf file: %s\n",
-			ovmf_path);
-		return -1;
-	}
-
-	fseek(fp, 0, SEEK_END);
-
-	if (ftell(fp) != ovmf_size) {
-		pr_err("SW_LOAD ERR: ovmf file changed\n");
-		fclose(fp);
+	fp = acrn_open_ovmf("r+");
+	if (fp == NULL)
 		return -1;
-	}
 
-	fseek(fp, 0, SEEK_SET);
 	write = fwrite(ctx->baseaddr + OVMF_NVSTORAGE_OFFSET,
 		sizeof(char), OVMF_NVSTORAGE_SZ, fp);
 
@@ -242,6 +242,14 @@ acrn_prepare_vsbl(struct vmctx *ctx)
 	return 0;
 }
 
+/* the vsbl parameters and image are part of the snapshot of a restored VM */
+int
+acrn_sw_restore_vsbl(struct vmctx *ctx)
+{
+	init_cmos_vrpmb(ctx);
+	return 0;
+}
+
 int
 acrn_sw_load_vsbl(struct vmctx *ctx)
 {
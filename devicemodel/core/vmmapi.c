@@ -46,6 +46,7 @@
 #include "dm.h"
 #include "pci_core.h"
 #include "log.h"
+#include "page_merge.h"
 
 #define MAP_NOCORE 0
 #define MAP_ALIGNED_SUPER 0
@@ -179,6 +180,12 @@ int acrn_parse_cpu_affinity(char *opt)
 	return 0;
 }
 
+uint64_t
+acrn_get_cpu_affinity(void)
+{
+	return cpu_affinity_bitmap;
+}
+
 struct vmctx *
 vm_create(const char *name, uint64_t req_buf, int *vcpu_num)
 {
@@ -431,13 +438,8 @@ vm_unsetup_memory(struct vmctx *ctx)
 	 * Otherwise, VM can't be restart again.
 	 */
 
-	if (!is_rtvm) {
-		bzero((void *)ctx->baseaddr, ctx->lowmem);
-		if (ctx->highmem > 0) {
-			bzero((void *)(ctx->baseaddr + ctx->highmem_gpa_base),
-					ctx->highmem);
-		}
-	}
+	if (!is_rtvm)
+		hugetlb_zero_memory(ctx);
 
 	hugetlb_unsetup_memory(ctx);
 }
@@ -452,11 +454,12 @@ vm_unsetup_memory(struct vmctx *ctx)
 void *
 vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 {
+	void *hva = NULL;
 
 	if (ctx->lowmem > 0) {
 		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
 		    gaddr + len <= ctx->lowmem)
-			return (ctx->baseaddr + gaddr);
+			hva = ctx->baseaddr + gaddr;
 	}
 
 	if (ctx->highmem > 0) {
@@ -464,11 +467,15 @@ vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 			if (gaddr < ctx->highmem_gpa_base + ctx->highmem &&
 			    len <= ctx->highmem &&
 			    gaddr + len <= ctx->highmem_gpa_base + ctx->highmem)
-				return (ctx->baseaddr + gaddr);
+				hva = ctx->baseaddr + gaddr;
 		}
 	}
 
-	return NULL;
+	/* the range may be on a chunk freed by page merging */
+	if (hva != NULL && page_merge_access(gaddr, len) < 0)
+		hva = NULL;
+
+	return hva;
 }
 
 size_t
@@ -680,6 +687,12 @@ vm_intr_monitor(struct vmctx *ctx, void *intr_buf)
 	return ioctl(ctx->fd, IC_VM_INTR_MONITOR, intr_buf);
 }
 
+int
+vm_merge_pages(struct vmctx *ctx, struct page_merge_data *data)
+{
+	return ioctl(ctx->fd, IC_VM_MERGE_PAGES, data);
+}
+
 int
 vm_ioeventfd(struct vmctx *ctx, struct acrn_ioeventfd *args)
 {
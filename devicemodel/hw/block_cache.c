@@ -0,0 +1,539 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#include "types.h"
+#include "block_cache.h"
+#include "log.h"
+
+#define BLOCK_CACHE_MAGIC	0x48434b42	/* "BKCH" */
+#define BLOCK_CACHE_VERSION	2
+#define BLOCK_CACHE_BLOCK_SZ	4096
+/* a block is in one of the ways of the set its key hashes to */
+#define BLOCK_CACHE_WAYS	8
+/* blocks read at once on a miss, the malloc() stays off mmap() */
+#define BLOCK_CACHE_RUN		16
+/* how long to wait for another device model creating the segment */
+#define BLOCK_CACHE_WAIT_US	(1000 * 1000)
+
+/* the file a segment caches, it's stale if any of them changed */
+struct block_cache_key {
+	uint64_t		dev;
+	uint64_t		ino;
+	uint64_t		size;
+	uint64_t		mtime;	/* in ns */
+	uint64_t		ctime;	/* in ns, can't be set back */
+};
+
+struct block_cache_hdr {
+	uint32_t		magic;	/* set once the segment is ready */
+	uint32_t		version;
+	uint32_t		block_sz;
+	uint32_t		ways;
+	uint64_t		nsets;
+	uint64_t		size;	/* of the segment */
+	struct block_cache_key	key;
+};
+
+/*
+ * The state of a block. A reader takes it if seq is even and the same
+ * after the block is copied, so it's never locked for lookups.
+ */
+struct block_cache_tag {
+	uint32_t		seq;	/* odd while the block is written */
+	uint32_t		ref;	/* used since the clock hand passed */
+	uint64_t		blk;	/* plus 1, 0 if the block is free */
+};
+
+struct block_cache_set {
+	/* held to fill a block, never waited for, robust */
+	pthread_mutex_t		lock;
+	uint32_t		hand;	/* of the clock, the next way to evict */
+	struct block_cache_tag	tags[BLOCK_CACHE_WAYS];
+};
+
+struct block_cache_file {
+	int			fd;
+	off_t			size;
+	int			writer;	/* the segment is mapped writable */
+	size_t			len;
+	struct block_cache_hdr	*hdr;
+	struct block_cache_set	*sets;
+	uint8_t			*data;
+	struct block_cache_stats stats;
+};
+
+static uint64_t
+block_cache_mix(uint64_t h)
+{
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 29;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 32;
+	return h;
+}
+
+static void
+block_cache_layout(struct block_cache_file *f, struct block_cache_hdr *hdr)
+{
+	size_t off;
+
+	f->hdr = hdr;
+	f->sets = (struct block_cache_set *)
+		((uint8_t *)hdr + BLOCK_CACHE_BLOCK_SZ);
+	off = roundup2(BLOCK_CACHE_BLOCK_SZ +
+		hdr->nsets * sizeof(struct block_cache_set),
+		BLOCK_CACHE_BLOCK_SZ);
+	f->data = (uint8_t *)hdr + off;
+}
+
+/* the locks of the sets outlive the device model holding them */
+static int
+block_cache_init_locks(struct block_cache_hdr *hdr)
+{
+	struct block_cache_set *sets;
+	pthread_mutexattr_t attr;
+	uint64_t i;
+	int err;
+
+	sets = (struct block_cache_set *)((uint8_t *)hdr + BLOCK_CACHE_BLOCK_SZ);
+	if (pthread_mutexattr_init(&attr))
+		return -1;
+	err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (i = 0; !err && i < hdr->nsets; i++)
+		err = pthread_mutex_init(&sets[i].lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return err ? -1 : 0;
+}
+
+static int
+block_cache_key_eq(const struct block_cache_key *a,
+		   const struct block_cache_key *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+/*
+ * Map the segment of the file, creating it of size_mb MiB if it doesn't
+ * exist and this process owns the file. The blocks of a new segment are
+ * free, as it's zeroed. The owner replaces a stale segment, the others
+ * map it read-only.
+ */
+static int
+block_cache_map(struct block_cache_file *f, const struct stat *sbuf,
+		size_t size_mb)
+{
+	struct block_cache_hdr *hdr;
+	struct block_cache_key key;
+	struct stat shm;
+	char name[64];
+	size_t len, per_set;
+	int fd, creator, retry, i;
+
+	per_set = sizeof(struct block_cache_set) +
+		BLOCK_CACHE_WAYS * BLOCK_CACHE_BLOCK_SZ;
+	memset(&key, 0, sizeof(key));
+	key.dev = sbuf->st_dev;
+	key.ino = sbuf->st_ino;
+	key.size = sbuf->st_size;
+	key.mtime = sbuf->st_mtim.tv_sec * 1000000000ULL +
+		sbuf->st_mtim.tv_nsec;
+	key.ctime = sbuf->st_ctim.tv_sec * 1000000000ULL +
+		sbuf->st_ctim.tv_nsec;
+	snprintf(name, sizeof(name), "%s-%" PRIx64 "-%" PRIx64,
+		BLOCK_CACHE_SHM, key.dev, key.ino);
+	f->writer = (geteuid() == sbuf->st_uid);
+
+	for (retry = 0; retry < 2; retry++) {
+		creator = 0;
+		len = size_mb << 20;
+		if (f->writer) {
+			fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL,
+				S_IRUSR | S_IWUSR);
+			if (fd >= 0) {
+				creator = 1;
+				/* readable by those who can read the file */
+				if (fchmod(fd, S_IRUSR | S_IWUSR |
+				    (sbuf->st_mode & (S_IRGRP | S_IROTH))) ||
+				    ftruncate(fd, len) < 0) {
+					pr_err("block_cache: can't size %s, "
+						"error %d\n", name, errno);
+					shm_unlink(name);
+					close(fd);
+					return -1;
+				}
+			} else if (errno == EEXIST)
+				fd = shm_open(name, O_RDWR, 0);
+		} else
+			fd = shm_open(name, O_RDONLY, 0);
+		if (fd < 0) {
+			pr_err("block_cache: can't open %s, error %d\n",
+				name, errno);
+			return -1;
+		}
+
+		/* only the owner of the file writes its blocks */
+		if (fstat(fd, &shm) < 0 || shm.st_uid != sbuf->st_uid ||
+		    (shm.st_mode & (S_IWGRP | S_IWOTH))) {
+			pr_err("block_cache: %s isn't owned by the owner of "
+				"the file, remove it\n", name);
+			close(fd);
+			return -1;
+		}
+		for (i = 0; !creator && i < BLOCK_CACHE_WAIT_US / 1000; i++) {
+			if (shm.st_size > 0)
+				break;
+			usleep(1000);
+			if (fstat(fd, &shm) < 0)
+				break;
+		}
+		if (!creator)
+			len = shm.st_size;
+		if (len <= 2 * BLOCK_CACHE_BLOCK_SZ) {
+			pr_err("block_cache: %s is too small\n", name);
+			close(fd);
+			return -1;
+		}
+
+		hdr = mmap(NULL, len, PROT_READ | (f->writer ? PROT_WRITE : 0),
+			MAP_SHARED, fd, 0);
+		close(fd);
+		if (hdr == MAP_FAILED) {
+			pr_err("block_cache: can't map %s, error %d\n",
+				name, errno);
+			return -1;
+		}
+
+		if (creator) {
+			hdr->version = BLOCK_CACHE_VERSION;
+			hdr->block_sz = BLOCK_CACHE_BLOCK_SZ;
+			hdr->ways = BLOCK_CACHE_WAYS;
+			hdr->nsets = (len > 2 * BLOCK_CACHE_BLOCK_SZ) ?
+				(len - 2 * BLOCK_CACHE_BLOCK_SZ) / per_set : 0;
+			hdr->size = len;
+			hdr->key = key;
+			if (block_cache_init_locks(hdr) == 0)
+				__atomic_store_n(&hdr->magic,
+					BLOCK_CACHE_MAGIC, __ATOMIC_RELEASE);
+		} else {
+			for (i = 0; i < BLOCK_CACHE_WAIT_US / 1000; i++) {
+				if (__atomic_load_n(&hdr->magic,
+						__ATOMIC_ACQUIRE) ==
+						BLOCK_CACHE_MAGIC)
+					break;
+				usleep(1000);
+			}
+		}
+
+		if (hdr->magic != BLOCK_CACHE_MAGIC ||
+		    hdr->version != BLOCK_CACHE_VERSION ||
+		    hdr->block_sz != BLOCK_CACHE_BLOCK_SZ ||
+		    hdr->ways != BLOCK_CACHE_WAYS || hdr->size != len ||
+		    hdr->nsets == 0 ||
+		    hdr->nsets > (len - 2 * BLOCK_CACHE_BLOCK_SZ) / per_set) {
+			pr_err("block_cache: %s isn't a cache this device "
+				"model can use, remove it\n", name);
+			munmap(hdr, len);
+			return -1;
+		}
+
+		if (block_cache_key_eq(&hdr->key, &key))
+			break;
+
+		/* the file changed since its blocks were cached */
+		munmap(hdr, len);
+		if (!f->writer || retry > 0) {
+			pr_err("block_cache: %s is stale\n", name);
+			return -1;
+		}
+		shm_unlink(name);
+	}
+
+	f->len = len;
+	block_cache_layout(f, hdr);
+	pr_info("block_cache: %s, %lu blocks%s\n", name,
+		hdr->nsets * BLOCK_CACHE_WAYS, f->writer ? "" : ", read-only");
+	return 0;
+}
+
+/*
+ * Only the read-only regular files are cached: the blocks of a raw
+ * device can change without its times changing, and the times of some
+ * file systems are too coarse to tell a write right after the blocks
+ * are cached.
+ */
+struct block_cache_file *
+block_cache_open(int fd, size_t size_mb)
+{
+	struct block_cache_file *f;
+	struct stat sbuf;
+
+	if (fstat(fd, &sbuf) < 0)
+		return NULL;
+	if (!S_ISREG(sbuf.st_mode)) {
+		pr_err("block_cache: only regular files can be cached\n");
+		return NULL;
+	}
+	if (sbuf.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) {
+		pr_err("block_cache: the file is writable, make it read-only "
+			"to cache it\n");
+		return NULL;
+	}
+
+	f = calloc(1, sizeof(struct block_cache_file));
+	if (f == NULL)
+		return NULL;
+	f->fd = fd;
+	f->size = sbuf.st_size;
+	if (block_cache_map(f, &sbuf,
+			size_mb ? size_mb : BLOCK_CACHE_DEF_MB) < 0) {
+		free(f);
+		return NULL;
+	}
+	return f;
+}
+
+void
+block_cache_close(struct block_cache_file *f)
+{
+	/* the segment stays for the next device models */
+	munmap(f->hdr, f->len);
+	free(f);
+}
+
+static struct block_cache_set *
+block_cache_set(struct block_cache_file *f, uint64_t blk)
+{
+	return &f->sets[block_cache_mix(blk) % f->hdr->nsets];
+}
+
+static uint8_t *
+block_cache_data(struct block_cache_file *f, struct block_cache_set *set,
+		 int way)
+{
+	return f->data + ((set - f->sets) *
+		BLOCK_CACHE_WAYS + way) * (size_t)BLOCK_CACHE_BLOCK_SZ;
+}
+
+static int
+block_cache_match(struct block_cache_tag *tag, uint64_t blk)
+{
+	return __atomic_load_n(&tag->blk, __ATOMIC_RELAXED) == blk + 1;
+}
+
+/* copy len bytes of buf into the iovecs, from offset skip */
+static void
+block_cache_copyout(const struct iovec *iov, int iovcnt, size_t skip,
+		    const uint8_t *buf, size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		n = MIN(len, iov[i].iov_len - skip);
+		memcpy((uint8_t *)iov[i].iov_base + skip, buf, n);
+		buf += n;
+		len -= n;
+		skip = 0;
+	}
+}
+
+/*
+ * Copy len bytes of block blk, from boff, into the iovecs from offset
+ * skip if it's cached. The block may be replaced while it's copied, it's
+ * then a miss.
+ */
+static int
+block_cache_lookup(struct block_cache_file *f, uint64_t blk, size_t boff,
+		   size_t len, const struct iovec *iov, int iovcnt, size_t skip)
+{
+	struct block_cache_set *set = block_cache_set(f, blk);
+	struct block_cache_tag *tag;
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < BLOCK_CACHE_WAYS; i++) {
+		tag = &set->tags[i];
+		seq = __atomic_load_n(&tag->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || !block_cache_match(tag, blk))
+			continue;
+		block_cache_copyout(iov, iovcnt, skip,
+			block_cache_data(f, set, i) + boff, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&tag->seq, __ATOMIC_RELAXED) != seq)
+			return 0;
+		/* the segment is read-only to the others */
+		if (f->writer && !__atomic_load_n(&tag->ref, __ATOMIC_RELAXED))
+			__atomic_store_n(&tag->ref, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The device model filling a block of the set died with its lock held:
+ * free the blocks it was writing.
+ */
+static void
+block_cache_recover(struct block_cache_set *set)
+{
+	struct block_cache_tag *tag;
+	int i;
+
+	for (i = 0; i < BLOCK_CACHE_WAYS; i++) {
+		tag = &set->tags[i];
+		if (!(tag->seq & 1))
+			continue;
+		__atomic_store_n(&tag->blk, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&tag->seq, tag->seq + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_consistent(&set->lock);
+}
+
+/*
+ * Put block blk in its set, in place of the first one the clock hand
+ * finds unused since it last passed. If the set is being filled by
+ * another thread or device model, the block isn't cached.
+ */
+static void
+block_cache_fill(struct block_cache_file *f, uint64_t blk,
+		 const uint8_t *buf)
+{
+	struct block_cache_set *set = block_cache_set(f, blk);
+	struct block_cache_tag *tag;
+	uint32_t seq;
+	int i, way, err;
+
+	if (!f->writer)
+		return;
+	err = pthread_mutex_trylock(&set->lock);
+	if (err == EOWNERDEAD)
+		block_cache_recover(set);
+	else if (err)
+		return;
+
+	for (i = 0; i < BLOCK_CACHE_WAYS; i++) {
+		if (block_cache_match(&set->tags[i], blk))
+			goto unlock;
+	}
+
+	for (i = 0; i < 2 * BLOCK_CACHE_WAYS; i++) {
+		way = set->hand++ % BLOCK_CACHE_WAYS;
+		tag = &set->tags[way];
+		if (!__atomic_load_n(&tag->ref, __ATOMIC_RELAXED))
+			break;
+		__atomic_store_n(&tag->ref, 0, __ATOMIC_RELAXED);
+	}
+
+	seq = tag->seq;
+	__atomic_store_n(&tag->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&tag->blk, blk + 1, __ATOMIC_RELAXED);
+	memcpy(block_cache_data(f, set, way), buf, BLOCK_CACHE_BLOCK_SZ);
+	__atomic_store_n(&tag->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&f->stats.fills, 1, __ATOMIC_RELAXED);
+unlock:
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*
+ * Copy the blocks cached, and read the others from the file, a run of
+ * blocks at a time, filling the cache with them.
+ */
+ssize_t
+block_cache_preadv(struct block_cache_file *f, const struct iovec *iov,
+		   int iovcnt, off_t offset)
+{
+	size_t len, done, n, boff, rlen;
+	uint8_t *buf = NULL;
+	uint64_t blk;
+	ssize_t rc;
+	off_t pos, start;
+	int i;
+
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (offset >= f->size)
+		return 0;
+	len = MIN(len, f->size - offset);
+
+	for (done = 0; done < len; done += n) {
+		pos = offset + done;
+		blk = pos / BLOCK_CACHE_BLOCK_SZ;
+		boff = pos % BLOCK_CACHE_BLOCK_SZ;
+		n = MIN(len - done, BLOCK_CACHE_BLOCK_SZ - boff);
+		if (block_cache_lookup(f, blk, boff, n, iov, iovcnt, done)) {
+			__atomic_add_fetch(&f->stats.hits, 1,
+				__ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (!buf) {
+			buf = malloc(BLOCK_CACHE_RUN * BLOCK_CACHE_BLOCK_SZ);
+			if (!buf)
+				return -1;
+		}
+		start = pos - boff;
+		rlen = MIN(roundup2(offset + len - start, BLOCK_CACHE_BLOCK_SZ),
+			BLOCK_CACHE_RUN * BLOCK_CACHE_BLOCK_SZ);
+		rc = pread(f->fd, buf, rlen, start);
+		if (rc < 0) {
+			free(buf);
+			return -1;
+		}
+		if (rc <= boff)
+			break;
+
+		/* the last block of the file is cached padded with zeros */
+		if (start + rc == f->size) {
+			memset(buf + rc, 0, roundup2(rc, BLOCK_CACHE_BLOCK_SZ) -
+				rc);
+			rc = roundup2(rc, BLOCK_CACHE_BLOCK_SZ);
+		}
+		for (i = 0; (i + 1) * BLOCK_CACHE_BLOCK_SZ <= rc; i++) {
+			__atomic_add_fetch(&f->stats.misses, 1,
+				__ATOMIC_RELAXED);
+			block_cache_fill(f, blk + i,
+				buf + i * BLOCK_CACHE_BLOCK_SZ);
+		}
+
+		n = MIN(len - done, rc - boff);
+		block_cache_copyout(iov, iovcnt, done, buf + boff, n);
+		if (rc < rlen) {
+			done += n;
+			break;
+		}
+	}
+
+	free(buf);
+	return done;
+}
+
+void
+block_cache_get_stats(struct block_cache_file *f,
+		      struct block_cache_stats *stats)
+{
+	stats->hits = __atomic_load_n(&f->stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&f->stats.misses, __ATOMIC_RELAXED);
+	stats->fills = __atomic_load_n(&f->stats.fills, __ATOMIC_RELAXED);
+}
@@ -30,8 +30,12 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <errno.h>
 #include <err.h>
 #include <fcntl.h>
@@ -40,13 +44,19 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include "dm.h"
+#include "vmmapi.h"
 #include "block_if.h"
+#include "block_cache.h"
 #include "ahci.h"
 #include "dm_string.h"
+#include "mevent.h"
+#include "timer.h"
 #include "log.h"
+#include "page_merge.h"
 
 /*
  * Notes:
@@ -60,12 +70,83 @@
 #define F_OFD_SETLK	37
 #endif
 
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#define __NR_io_uring_enter	426
+#define __NR_io_uring_register	427
+#endif
+
 #define BLOCKIF_SIG	0xb109b109
 
 #define BLOCKIF_NUMTHR	8
-#define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
+#define BLOCKIF_MAXREQ	(256 + BLOCKIF_NUMTHR)
 #define MAX_DISCARD_SEGMENT	256
 
+/*
+ * io_uring engine: room for a writethru write and its fsync for each
+ * request, and for the cancels.
+ */
+#define BLOCKIF_URING_ENTRIES	512
+#define BLOCKIF_URING_MAXBUFS	64
+#define BLOCKIF_URING_BUFSZ	(1UL << 30)	/* max of a registered buffer */
+/* I/O threads for the requests io_uring can't run, all of them if COW */
+#define BLOCKIF_URING_NUMTHR	2
+
+/* user_data of an SQE: the index of its element, and what it is for */
+#define BLOCKIF_URING_IDX_MASK	0xffffUL
+#define BLOCKIF_URING_FSYNC	(1UL << 16)	/* fsync linked to a write */
+#define BLOCKIF_URING_CANCEL	(1UL << 17)
+#define BLOCKIF_URING_TIMER	(1UL << 18)	/* throttled requests due */
+
+/*
+ * nocache: the bounce buffers of the requests which aren't aligned for
+ * O_DIRECT. A request bigger than a buffer is bounced a piece at a time,
+ * and a buffer is allocated if the pool is empty.
+ */
+#define BLOCKIF_BOUNCE_NR	16
+#define BLOCKIF_BOUNCE_SZ	(256 * 1024)
+
+/*
+ * The default limits of a merged request, the option merge=<KiB>:<segs>
+ * sets others.
+ */
+#define BLOCKIF_MERGE_SZ	(256 * 1024)
+#define BLOCKIF_MERGE_SEGS	64
+
+/*
+ * Throttling: a token bucket per limit, refilled at its rate up to its
+ * burst. A read or write is let through if the buckets of its direction
+ * are not empty, and takes its tokens, 1 and its length, from them. The
+ * next ones wait in the queue till the buckets are refilled.
+ */
+enum blockif_limit {
+	BLOCKIF_IOPS_RD,
+	BLOCKIF_IOPS_WR,
+	BLOCKIF_BPS_RD,
+	BLOCKIF_BPS_WR,
+	BLOCKIF_LIMITS
+};
+
+static const char *blockif_limit_names[BLOCKIF_LIMITS] = {
+	"iops_rd", "iops_wr", "bps_rd", "bps_wr"
+};
+
+/*
+ * Copy-on-write overlay
+ *
+ * An overlay file holds the clusters written by the User VM, the others
+ * are read from a backing file, which is never written and can be shared
+ * by several User VMs. The header, in cluster 0, is followed by the L1
+ * table: the offsets of the L2 tables, each a cluster of the offsets of
+ * the data clusters, 0 if not allocated. The clusters are allocated at
+ * the end of the file, and written before the table pointing to them.
+ */
+#define BLOCKIF_COW_MAGIC	0x574f4341	/* "ACOW" */
+#define BLOCKIF_COW_VERSION	1
+#define BLOCKIF_COW_CLUSTER_BITS	16
+#define BLOCKIF_COW_BACKING_MAX	1024
+#define BLOCKIF_COW_L2_CACHE	32	/* L2 tables kept in memory */
+
 /*
  * Debug printf
  */
@@ -95,6 +176,96 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	uint64_t	     throttled;	/* ns, since when, or 0 */
+	int		     ncqe;	/* io_uring completions to come */
+	int		     sync;	/* run by an I/O thread, not io_uring */
+	TAILQ_ENTRY(blockif_elem) plink;	/* in procq, if sync */
+	int		     err;
+	uint8_t		     *bounce;	/* nocache, for the io_uring request */
+	struct iovec	     biov;
+	struct blockif_elem  *merged;	/* the next one merged into this */
+};
+
+struct blockif_bucket {
+	uint64_t		rate;	/* per second, no limit if 0 */
+	uint64_t		burst;
+	double			tokens;	/* in debt if < 0 */
+};
+
+/* the limits of a drive, shared by its contexts */
+struct blockif_throttle {
+	int			refs;
+	int			limited;	/* any rate set */
+	pthread_mutex_t		mtx;
+	struct blockif_bucket	buckets[BLOCKIF_LIMITS];
+	uint64_t		last;	/* ns, when the buckets were refilled */
+	/* the contexts, woken on a change, taken before their mutexes */
+	pthread_mutex_t		ctxs_mtx;
+	LIST_HEAD(, blockif_ctxt) ctxs;
+};
+
+struct blockif_cow_header {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		cluster_bits;
+	uint32_t		l1_size;	/* entries */
+	uint64_t		size;		/* of the drive */
+	uint64_t		l1_offset;
+	char			backing[BLOCKIF_COW_BACKING_MAX];
+} __attribute__((packed));
+
+struct blockif_cow_l2 {
+	uint64_t		off;	/* of the table, 0 if the entry is free */
+	uint64_t		*table;
+	uint64_t		used;	/* the least recently used is evicted */
+};
+
+/* shared by the contexts of a drive, the metadata is protected by mtx */
+struct blockif_cow {
+	int			refs;
+	int			bfd;	/* the backing file */
+	off_t			bsize;
+	size_t			cluster_sz;
+	int			cluster_bits;
+	int			l2_bits;
+	uint32_t		l1_size;
+	uint64_t		l1_offset;
+	uint64_t		*l1;
+	uint64_t		end;	/* of the overlay, clusters go there */
+	uint64_t		clock;
+	struct blockif_cow_l2	l2[BLOCKIF_COW_L2_CACHE];
+	uint8_t			*buf;	/* a cluster being copied on write */
+	uint64_t		allocs;
+	struct block_cache_file	*cache;	/* of the backing file, if not NULL */
+	pthread_mutex_t		mtx;
+};
+
+struct blockif_uring {
+	int			fd;
+	int			efd;	/* signaled on completions */
+	struct mevent		*mevp;
+
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_array;
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	unsigned int		tail;	/* SQEs queued, up to here */
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* guest memory, registered for the single buffer requests */
+	int			nbufs;
+	struct iovec		bufs[BLOCKIF_URING_MAXBUFS];
 };
 
 struct blockif_ctxt {
@@ -113,10 +284,48 @@ struct blockif_ctxt {
 	int			max_discard_seg;
 	int			discard_sector_alignment;
 	int			closing;
+	int			cpu;	/* the I/O threads run on, if >= 0 */
 	pthread_t		btid[BLOCKIF_NUMTHR];
+	pthread_t		ctid;	/* io_uring completions, if pinned */
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
 
+	/*
+	 * io_uring engine, instead of the threads, if not NULL. The
+	 * requests it can't run are left to the threads, in procq.
+	 */
+	struct blockif_uring	*ring;
+	int			plugged;
+	TAILQ_HEAD(, blockif_elem) procq;
+
+	/* O_DIRECT, its alignments, and the bounce buffers */
+	int			nocache;
+	int			dio_align;
+	int			dio_mem_align;
+	int			bounce_align;
+	pthread_mutex_t		bounce_mtx;
+	pthread_mutex_t		rmw_mtx;
+	int			nbounce;
+	uint8_t			*bounce[BLOCKIF_BOUNCE_NR];
+	struct blockif_stats	stats;
+
+	/* throttling, the requests waiting are pending in pendq */
+	struct blockif_throttle	*throttle;
+	LIST_ENTRY(blockif_ctxt) tlink;	/* in throttle->ctxs */
+	uint64_t		throttle_wait;	/* ns, till the next is due */
+	int			throttle_armed;	/* io_uring timeout queued */
+	struct __kernel_timespec throttle_ts;
+
+	/* copy-on-write overlay, if not NULL */
+	struct blockif_cow	*cow;
+
+	/* read-only, the reads go through the shared cache if not NULL */
+	struct block_cache_file	*cache;
+
+	/* the limits of a merged request, not merging if 0 */
+	size_t			merge_max;
+	int			merge_segs;
+
 	/* Request elements and free/pending/busy queues */
 	TAILQ_HEAD(, blockif_elem) freeq;
 	TAILQ_HEAD(, blockif_elem) pendq;
@@ -157,13 +366,588 @@ blockif_flush_cache(struct blockif_ctxt *bc)
 	return err;
 }
 
+/*
+ * nocache: O_DIRECT needs the offset and the length of an I/O aligned to
+ * the logical block size of the storage, and its buffers in memory too.
+ */
+static int
+blockif_dio_aligned(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	int i;
+
+	if ((br->offset + bc->sub_file_start_lba) & (bc->dio_align - 1))
+		return 0;
+	for (i = 0; i < br->iovcnt; i++) {
+		if (((uintptr_t)br->iov[i].iov_base & (bc->dio_mem_align - 1)) ||
+		    (br->iov[i].iov_len & (bc->dio_align - 1)))
+			return 0;
+	}
+	return 1;
+}
+
+static size_t
+blockif_iov_len(struct blockif_req *br)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < br->iovcnt; i++)
+		len += br->iov[i].iov_len;
+	return len;
+}
+
+/* copy between the request buffers, from offset skip, and buf */
+static void
+blockif_iov_copy(struct blockif_req *br, size_t skip, uint8_t *buf,
+		 size_t len, int to_iov)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < br->iovcnt && len > 0; i++) {
+		if (skip >= br->iov[i].iov_len) {
+			skip -= br->iov[i].iov_len;
+			continue;
+		}
+		n = MIN(len, br->iov[i].iov_len - skip);
+		if (to_iov)
+			memcpy((uint8_t *)br->iov[i].iov_base + skip, buf, n);
+		else
+			memcpy(buf, (uint8_t *)br->iov[i].iov_base + skip, n);
+		buf += n;
+		len -= n;
+		skip = 0;
+	}
+}
+
+static uint8_t *
+blockif_bounce_get(struct blockif_ctxt *bc)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&bc->bounce_mtx);
+	if (bc->nbounce > 0)
+		buf = bc->bounce[--bc->nbounce];
+	pthread_mutex_unlock(&bc->bounce_mtx);
+
+	if (!buf) {
+		__atomic_add_fetch(&bc->stats.bounce_allocs, 1,
+			__ATOMIC_RELAXED);
+		if (posix_memalign(&buf, bc->bounce_align, BLOCKIF_BOUNCE_SZ))
+			buf = NULL;
+	}
+	return buf;
+}
+
+static void
+blockif_bounce_put(struct blockif_ctxt *bc, uint8_t *buf)
+{
+	pthread_mutex_lock(&bc->bounce_mtx);
+	if (bc->nbounce < BLOCKIF_BOUNCE_NR) {
+		bc->bounce[bc->nbounce++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&bc->bounce_mtx);
+	free(buf);
+}
+
+static void
+blockif_bounce_free(struct blockif_ctxt *bc)
+{
+	while (bc->nbounce > 0)
+		free(bc->bounce[--bc->nbounce]);
+}
+
+/*
+ * Read or write the request through a bounce buffer, a piece at a time.
+ * The blocks the request only covers a part of are read, then written
+ * back with the data written to them.
+ */
+static ssize_t
+blockif_bounce_rw(struct blockif_ctxt *bc, struct blockif_req *br,
+		  enum blockop op)
+{
+	off_t off, pos, start, end;
+	size_t len, done, n;
+	ssize_t rc = 0;
+	uint8_t *buf;
+	int rmw;
+
+	buf = blockif_bounce_get(bc);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	off = br->offset + bc->sub_file_start_lba;
+	len = blockif_iov_len(br);
+	for (done = 0; done < len; done += n) {
+		pos = off + done;
+		start = rounddown2(pos, bc->dio_align);
+		n = MIN(len - done, BLOCKIF_BOUNCE_SZ - (pos - start));
+		end = roundup2(pos + n, bc->dio_align);
+		rmw = (op == BOP_WRITE && (start != pos || end != pos + n));
+
+		if (rmw) {
+			__atomic_add_fetch(&bc->stats.rmw, 1, __ATOMIC_RELAXED);
+			pthread_mutex_lock(&bc->rmw_mtx);
+		}
+		if (op == BOP_READ || rmw) {
+			/* short only past the end of the file */
+			rc = pread(bc->fd, buf, end - start, start);
+			if (rc >= 0 && rc < end - start)
+				memset(buf + rc, 0, end - start - rc);
+		}
+		if (op == BOP_WRITE && rc >= 0) {
+			blockif_iov_copy(br, done, buf + (pos - start), n, 0);
+			rc = pwrite(bc->fd, buf, end - start, start);
+		}
+		if (rmw)
+			pthread_mutex_unlock(&bc->rmw_mtx);
+
+		if (rc < 0)
+			break;
+		if (op == BOP_READ)
+			blockif_iov_copy(br, done, buf + (pos - start), n, 1);
+	}
+
+	blockif_bounce_put(bc, buf);
+	return (rc < 0) ? -1 : done;
+}
+
+/* the iovecs of the request from offset skip, for len bytes */
+static int
+blockif_iov_slice(struct blockif_req *br, size_t skip, size_t len,
+		  struct iovec *iov)
+{
+	size_t n;
+	int i, cnt = 0;
+
+	for (i = 0; i < br->iovcnt && len > 0; i++) {
+		if (skip >= br->iov[i].iov_len) {
+			skip -= br->iov[i].iov_len;
+			continue;
+		}
+		n = MIN(len, br->iov[i].iov_len - skip);
+		iov[cnt].iov_base = (uint8_t *)br->iov[i].iov_base + skip;
+		iov[cnt++].iov_len = n;
+		len -= n;
+		skip = 0;
+	}
+	return cnt;
+}
+
+static void
+blockif_cache_close(struct block_cache_file *cache)
+{
+	struct block_cache_stats stats;
+
+	block_cache_get_stats(cache, &stats);
+	pr_info("blockif: cache, %lu blocks hit, %lu missed, %lu filled\n",
+		stats.hits, stats.misses, stats.fills);
+	block_cache_close(cache);
+}
+
+static void
+blockif_cow_put(struct blockif_cow *cow)
+{
+	int i;
+
+	if (__atomic_sub_fetch(&cow->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (cow->l1)
+		pr_info("blockif: overlay, %lu clusters allocated\n",
+			cow->allocs);
+	for (i = 0; i < BLOCKIF_COW_L2_CACHE; i++)
+		free(cow->l2[i].table);
+	if (cow->cache)
+		blockif_cache_close(cow->cache);
+	if (cow->bfd >= 0)
+		close(cow->bfd);
+	free(cow->l1);
+	free(cow->buf);
+	pthread_mutex_destroy(&cow->mtx);
+	free(cow);
+}
+
+/* the L2 table at off, through the cache, called with cow->mtx held */
+static uint64_t *
+blockif_cow_l2(struct blockif_cow *cow, int fd, uint64_t off)
+{
+	struct blockif_cow_l2 *e, *victim = &cow->l2[0];
+	ssize_t rc;
+	int i;
+
+	for (i = 0; i < BLOCKIF_COW_L2_CACHE; i++) {
+		e = &cow->l2[i];
+		if (e->off == off) {
+			e->used = ++cow->clock;
+			return e->table;
+		}
+		if (e->used < victim->used)
+			victim = e;
+	}
+
+	victim->off = 0;
+	victim->used = 0;
+	if (!victim->table) {
+		victim->table = malloc(cow->cluster_sz);
+		if (!victim->table)
+			return NULL;
+	}
+	rc = pread(fd, victim->table, cow->cluster_sz, off);
+	if (rc != cow->cluster_sz) {
+		if (rc >= 0)
+			errno = EIO;
+		return NULL;
+	}
+	victim->off = off;
+	victim->used = ++cow->clock;
+	return victim->table;
+}
+
+/*
+ * Write buf to a new cluster at the end, called with cow->mtx held. The
+ * cluster is on the storage before any table points to it, so that a
+ * crash can't leave an entry to garbage.
+ */
+static uint64_t
+blockif_cow_alloc(struct blockif_cow *cow, int fd, const uint8_t *buf)
+{
+	uint64_t off = cow->end;
+	ssize_t rc;
+
+	rc = pwrite(fd, buf, cow->cluster_sz, off);
+	if (rc != cow->cluster_sz) {
+		if (rc >= 0)
+			errno = ENOSPC;
+		return 0;
+	}
+	if (fdatasync(fd))
+		return 0;
+	cow->end += cow->cluster_sz;
+	cow->allocs++;
+	return off;
+}
+
+/*
+ * Get the L2 table entry of the cluster at pos in entry, and its offset
+ * in eoff, with the table allocated if alloc is set, else a NULL entry if
+ * there is none. Called with cow->mtx held, returns -1 with errno set on
+ * failure.
+ */
+static int
+blockif_cow_entry(struct blockif_cow *cow, int fd, off_t pos, int alloc,
+		  uint64_t **entry, uint64_t *eoff)
+{
+	uint64_t i1, i2, off;
+	uint64_t *l2;
+
+	*entry = NULL;
+	i1 = pos >> (cow->cluster_bits + cow->l2_bits);
+	i2 = (pos >> cow->cluster_bits) & ((1UL << cow->l2_bits) - 1);
+	if (i1 >= cow->l1_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cow->l1[i1] == 0) {
+		if (!alloc)
+			return 0;
+		memset(cow->buf, 0, cow->cluster_sz);
+		off = blockif_cow_alloc(cow, fd, cow->buf);
+		if (off == 0)
+			return -1;
+		if (pwrite(fd, &off, sizeof(off),
+				cow->l1_offset + i1 * sizeof(off)) !=
+				sizeof(off))
+			return -1;
+		cow->l1[i1] = off;
+	}
+
+	l2 = blockif_cow_l2(cow, fd, cow->l1[i1]);
+	if (l2 == NULL)
+		return -1;
+	*entry = &l2[i2];
+	*eoff = cow->l1[i1] + i2 * sizeof(uint64_t);
+	return 0;
+}
+
+static ssize_t
+blockif_cow_backing_read(struct blockif_cow *cow, const struct iovec *iov,
+			 int cnt, off_t pos)
+{
+	if (cow->cache)
+		return block_cache_preadv(cow->cache, iov, cnt, pos);
+	return preadv(cow->bfd, iov, cnt, pos);
+}
+
+/*
+ * Read or write the request a cluster at a time: the allocated clusters
+ * in the overlay, the others from the backing file, or zeros past its
+ * end. A write to a cluster not allocated copies it from the backing
+ * file to a new one first.
+ */
+static ssize_t
+blockif_cow_rw(struct blockif_ctxt *bc, struct blockif_req *br,
+	       enum blockop op)
+{
+	struct blockif_cow *cow = bc->cow;
+	struct iovec iov[BLOCKIF_IOV_MAX], biov;
+	uint64_t *entry, data, eoff = 0;
+	size_t len, done, n, coff;
+	ssize_t rc = 0;
+	off_t pos, start;
+	int i, cnt;
+
+	len = blockif_iov_len(br);
+	for (done = 0; done < len; done += n) {
+		pos = br->offset + done;
+		coff = pos & (cow->cluster_sz - 1);
+		start = pos - coff;
+		n = MIN(len - done, cow->cluster_sz - coff);
+		cnt = blockif_iov_slice(br, done, n, iov);
+
+		pthread_mutex_lock(&cow->mtx);
+		if (blockif_cow_entry(cow, bc->fd, pos, op == BOP_WRITE,
+				&entry, &eoff) < 0) {
+			pthread_mutex_unlock(&cow->mtx);
+			return -1;
+		}
+		data = entry ? *entry : 0;
+
+		if (data == 0 && op == BOP_WRITE) {
+			memset(cow->buf, 0, cow->cluster_sz);
+			rc = 0;
+			if (start < cow->bsize) {
+				biov.iov_base = cow->buf;
+				biov.iov_len = MIN(cow->cluster_sz,
+					cow->bsize - start);
+				rc = blockif_cow_backing_read(cow, &biov, 1,
+					start);
+			}
+			if (rc >= 0) {
+				blockif_iov_copy(br, done, cow->buf + coff, n, 0);
+				data = blockif_cow_alloc(cow, bc->fd, cow->buf);
+			}
+			if (rc < 0 || data == 0 || pwrite(bc->fd, &data,
+					sizeof(data), eoff) != sizeof(data)) {
+				pthread_mutex_unlock(&cow->mtx);
+				return -1;
+			}
+			*entry = data;
+			pthread_mutex_unlock(&cow->mtx);
+			continue;
+		}
+		pthread_mutex_unlock(&cow->mtx);
+
+		if (data && op == BOP_WRITE)
+			rc = pwritev(bc->fd, iov, cnt, data + coff);
+		else if (data)
+			rc = preadv(bc->fd, iov, cnt, data + coff);
+		else {
+			rc = (pos < cow->bsize) ?
+				blockif_cow_backing_read(cow, iov, cnt, pos) : 0;
+			/* zeros past the end of the backing file */
+			for (i = 0; rc >= 0 && i < cnt; i++) {
+				if (rc >= iov[i].iov_len) {
+					rc -= iov[i].iov_len;
+					continue;
+				}
+				memset((uint8_t *)iov[i].iov_base + rc, 0,
+					iov[i].iov_len - rc);
+				rc = 0;
+			}
+		}
+		if (rc < 0)
+			return -1;
+	}
+
+	return done;
+}
+
+static uint64_t
+blockif_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Parse a limit, <name>=<rate>[:<burst>], into its bucket. Returns 1 if
+ * opt is one, 0 if it's not, -1 if it's not valid. The burst is a tenth
+ * of the rate by default.
+ */
+static int
+blockif_limit_parse(struct blockif_bucket *buckets, char *opt)
+{
+	unsigned long rate, burst;
+	char *cp;
+	size_t n;
+	int i;
+
+	for (i = 0; i < BLOCKIF_LIMITS; i++) {
+		n = strlen(blockif_limit_names[i]);
+		if (!strncmp(opt, blockif_limit_names[i], n) && opt[n] == '=')
+			break;
+	}
+	if (i == BLOCKIF_LIMITS)
+		return 0;
+
+	if (dm_strtoul(opt + n + 1, &cp, 10, &rate))
+		return -1;
+	burst = MAX(rate / 10, 1);
+	if (*cp == ':' && dm_strtoul(cp + 1, &cp, 10, &burst))
+		return -1;
+	if (*cp != '\0' || (rate && !burst))
+		return -1;
+
+	buckets[i].rate = rate;
+	buckets[i].burst = burst;
+	buckets[i].tokens = burst;
+	return 1;
+}
+
+static struct blockif_throttle *
+blockif_throttle_new(struct blockif_bucket *buckets)
+{
+	struct blockif_throttle *t;
+	int i;
+
+	t = calloc(1, sizeof(struct blockif_throttle));
+	if (t == NULL)
+		return NULL;
+	t->refs = 1;
+	pthread_mutex_init(&t->mtx, NULL);
+	pthread_mutex_init(&t->ctxs_mtx, NULL);
+	LIST_INIT(&t->ctxs);
+	for (i = 0; i < BLOCKIF_LIMITS; i++) {
+		t->buckets[i] = buckets[i];
+		if (buckets[i].rate)
+			t->limited = 1;
+	}
+	t->last = blockif_now();
+	return t;
+}
+
+static void
+blockif_throttle_put(struct blockif_throttle *t)
+{
+	if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	pthread_mutex_destroy(&t->ctxs_mtx);
+	pthread_mutex_destroy(&t->mtx);
+	free(t);
+}
+
+/* A context sharing the limits is woken when they change, till closed */
+static void
+blockif_throttle_attach(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->throttle->ctxs_mtx);
+	LIST_INSERT_HEAD(&bc->throttle->ctxs, bc, tlink);
+	pthread_mutex_unlock(&bc->throttle->ctxs_mtx);
+}
+
+static void
+blockif_throttle_detach(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->throttle->ctxs_mtx);
+	LIST_REMOVE(bc, tlink);
+	pthread_mutex_unlock(&bc->throttle->ctxs_mtx);
+}
+
+/*
+ * Take the tokens of a read or write of len bytes and return 0, or the
+ * ns till its buckets are refilled enough. Other requests go through.
+ */
+static uint64_t
+blockif_throttle_take(struct blockif_throttle *t, enum blockop op,
+		      size_t len)
+{
+	struct blockif_bucket *b;
+	uint64_t now, wait = 0;
+	int i, dir;
+
+	if ((op != BOP_READ && op != BOP_WRITE) ||
+	    !__atomic_load_n(&t->limited, __ATOMIC_ACQUIRE))
+		return 0;
+	dir = (op == BOP_WRITE);
+
+	pthread_mutex_lock(&t->mtx);
+	now = blockif_now();
+	for (i = 0; i < BLOCKIF_LIMITS; i++) {
+		b = &t->buckets[i];
+		if (!b->rate)
+			continue;
+		b->tokens = MIN((double)b->burst, b->tokens +
+			(double)(now - t->last) * b->rate / NS_PER_SEC);
+		if ((i & 1) == dir && b->tokens < 0)
+			wait = MAX(wait, (uint64_t)(-b->tokens * NS_PER_SEC /
+				b->rate) + 1);
+	}
+	t->last = now;
+
+	if (wait == 0) {
+		b = &t->buckets[BLOCKIF_IOPS_RD + dir];
+		if (b->rate)
+			b->tokens -= 1;
+		b = &t->buckets[BLOCKIF_BPS_RD + dir];
+		if (b->rate)
+			b->tokens -= len;
+	}
+	pthread_mutex_unlock(&t->mtx);
+	return wait;
+}
+
+/* be waits behind a throttled request */
+static void
+blockif_throttle_hold(struct blockif_elem *be)
+{
+	if (!be->throttled)
+		be->throttled = blockif_now();
+}
+
+/*
+ * Whether be can run now, else it stays pending, and bc->throttle_wait is
+ * the time till it's due at most. Called with bc->mtx held.
+ */
+static int
+blockif_throttle_admit(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	uint64_t wait;
+
+	if (bc->closing)
+		wait = 0;
+	else
+		wait = blockif_throttle_take(bc->throttle, be->op,
+			blockif_iov_len(be->req));
+
+	if (wait) {
+		blockif_throttle_hold(be);
+		if (!bc->throttle_wait || wait < bc->throttle_wait)
+			bc->throttle_wait = wait;
+		return 0;
+	}
+
+	if (be->throttled) {
+		__atomic_add_fetch(&bc->stats.throttled, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&bc->stats.throttle_ns,
+			blockif_now() - be->throttled, __ATOMIC_RELAXED);
+		be->throttled = 0;
+	}
+	return 1;
+}
+
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
 	struct blockif_elem *be, *tbe;
 	off_t off;
-	int i;
 
 	be = TAILQ_FIRST(&bc->freeq);
 	if (be == NULL || be->status != BST_FREE) {
@@ -177,9 +961,8 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	case BOP_READ:
 	case BOP_WRITE:
 	case BOP_DISCARD:
-		off = breq->offset;
-		for (i = 0; i < breq->iovcnt; i++)
-			off += breq->iov[i].iov_len;
+		/* the length is in resid when submitted, no need to walk iov */
+		off = breq->offset + breq->resid;
 		break;
 	default:
 		/* off = OFF_MAX; */
@@ -204,14 +987,69 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	return (be->status == BST_PEND);
 }
 
+/*
+ * Merge the pending reads or writes which follow be on the storage into
+ * it, within the limits. They are waiting for be, if not pending, and
+ * would be run one after the other anyway.
+ */
+static void
+blockif_merge(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem *be)
+{
+	struct blockif_elem *last = be, *tbe;
+	size_t len;
+	int segs;
+
+	if (be->op != BOP_READ && be->op != BOP_WRITE)
+		return;
+
+	len = blockif_iov_len(be->req);
+	segs = be->req->iovcnt;
+	for (;;) {
+		TAILQ_FOREACH(tbe, &bc->pendq, link) {
+			if (tbe->op == be->op && tbe->req->offset == last->block)
+				break;
+		}
+		if (tbe == NULL ||
+		    len + blockif_iov_len(tbe->req) > bc->merge_max ||
+		    segs + tbe->req->iovcnt > bc->merge_segs ||
+		    !blockif_throttle_admit(bc, tbe))
+			break;
+
+		len += blockif_iov_len(tbe->req);
+		segs += tbe->req->iovcnt;
+		TAILQ_REMOVE(&bc->pendq, tbe, link);
+		tbe->status = BST_BUSY;
+		tbe->tid = t;
+		TAILQ_INSERT_TAIL(&bc->busyq, tbe, link);
+		last->merged = tbe;
+		last = tbe;
+		__atomic_add_fetch(&bc->stats.merged, 1, __ATOMIC_RELAXED);
+	}
+
+	if (last != be)
+		__atomic_add_fetch(&bc->stats.merges, 1, __ATOMIC_RELAXED);
+}
+
 static int
 blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
+	int blocked[2] = { 0, 0 };
+	int dir;
 
+	/* the throttled requests stay pending, in order in each direction */
+	bc->throttle_wait = 0;
 	TAILQ_FOREACH(be, &bc->pendq, link) {
-		if (be->status == BST_PEND)
+		if (be->status != BST_PEND)
+			continue;
+		dir = (be->op == BOP_WRITE);
+		if (blocked[dir]) {
+			blockif_throttle_hold(be);
+			continue;
+		}
+		if (blockif_throttle_admit(bc, be))
 			break;
+		blocked[dir] = 1;
 	}
 	if (be == NULL)
 		return 0;
@@ -219,6 +1057,8 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 	be->status = BST_BUSY;
 	be->tid = t;
 	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	if (bc->merge_max)
+		blockif_merge(bc, t, be);
 	*bep = be;
 	return 1;
 }
@@ -239,6 +1079,7 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 	be->tid = 0;
 	be->status = BST_FREE;
 	be->req = NULL;
+	be->throttled = 0;
 	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
 }
 
@@ -326,19 +1167,51 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 	return 0;
 }
 
-static void
-blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
+static int
+blockif_rw(struct blockif_ctxt *bc, struct blockif_req *br, enum blockop op)
 {
-	struct blockif_req *br;
 	ssize_t len;
 	int err;
 
-	br = be->req;
 	err = 0;
-	switch (be->op) {
+	if (bc->nocache && (op == BOP_READ || op == BOP_WRITE)) {
+		__atomic_add_fetch(&bc->stats.reqs, 1, __ATOMIC_RELAXED);
+		if (!blockif_dio_aligned(bc, br) &&
+		    !(op == BOP_WRITE && bc->rdonly)) {
+			__atomic_add_fetch(&bc->stats.bounced, 1,
+				__ATOMIC_RELAXED);
+			len = blockif_bounce_rw(bc, br, op);
+			if (len < 0)
+				err = errno;
+			else {
+				br->resid -= len;
+				if (op == BOP_WRITE)
+					err = blockif_flush_cache(bc);
+			}
+			return err;
+		}
+	}
+
+	if (bc->cow && (op == BOP_READ || (op == BOP_WRITE && !bc->rdonly))) {
+		len = blockif_cow_rw(bc, br, op);
+		if (len < 0)
+			err = errno;
+		else {
+			br->resid -= len;
+			if (op == BOP_WRITE)
+				err = blockif_flush_cache(bc);
+		}
+		return err;
+	}
+
+	switch (op) {
 	case BOP_READ:
-		len = preadv(bc->fd, br->iov, br->iovcnt,
-				 br->offset + bc->sub_file_start_lba);
+		if (bc->cache)
+			len = block_cache_preadv(bc->cache, br->iov,
+				br->iovcnt, br->offset + bc->sub_file_start_lba);
+		else
+			len = preadv(bc->fd, br->iov, br->iovcnt,
+				br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
 		else
@@ -371,38 +1244,646 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 		break;
 	}
 
-	be->status = BST_DONE;
+	return err;
+}
+
+/*
+ * Run the requests merged into be as one, on the iovecs of them all, and
+ * split what's done back to them in order.
+ */
+static void
+blockif_proc_merged(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req mbr;
+	struct blockif_elem *tbe;
+	struct iovec iov[BLOCKIF_IOV_MAX];
+	size_t done, len;
+	int err;
+
+	mbr.iov = iov;
+	mbr.iovcnt = 0;
+	mbr.offset = be->req->offset;
+	mbr.resid = 0;
+	for (tbe = be; tbe; tbe = tbe->merged) {
+		memcpy(&mbr.iov[mbr.iovcnt], tbe->req->iov,
+			tbe->req->iovcnt * sizeof(struct iovec));
+		mbr.iovcnt += tbe->req->iovcnt;
+		mbr.resid += blockif_iov_len(tbe->req);
+	}
+
+	err = blockif_rw(bc, &mbr, be->op);
+
+	done = blockif_iov_len(&mbr) - mbr.resid;
+	for (tbe = be; tbe; tbe = tbe->merged) {
+		len = MIN(done, blockif_iov_len(tbe->req));
+		tbe->req->resid -= len;
+		done -= len;
+		tbe->status = BST_DONE;
+		(*tbe->req->callback)(tbe->req, err);
+	}
+}
+
+static void
+blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *br;
+	int err;
+
+	if (be->merged) {
+		blockif_proc_merged(bc, be);
+		return;
+	}
+
+	br = be->req;
+	err = blockif_rw(bc, br, be->op);
+	be->status = BST_DONE;
+
+	(*br->callback)(br, err);
+}
+
+static void *
+blockif_thr(void *arg)
+{
+	struct blockif_ctxt *bc;
+	struct blockif_elem *be, *next;
+	struct timespec ts;
+	pthread_t t;
+
+	bc = arg;
+	t = pthread_self();
+
+	pthread_mutex_lock(&bc->mtx);
+
+	for (;;) {
+		while (blockif_dequeue(bc, t, &be)) {
+			pthread_mutex_unlock(&bc->mtx);
+			blockif_proc(bc, be);
+			pthread_mutex_lock(&bc->mtx);
+			for (; be; be = next) {
+				next = be->merged;
+				be->merged = NULL;
+				blockif_complete(bc, be);
+			}
+		}
+		/* Check ctxt status here to see if exit requested */
+		if (bc->closing)
+			break;
+		/* till the first request throttled is due, if any */
+		if (bc->throttle_wait) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += bc->throttle_wait / NS_PER_SEC;
+			ts.tv_nsec += bc->throttle_wait % NS_PER_SEC;
+			if (ts.tv_nsec >= NS_PER_SEC) {
+				ts.tv_sec++;
+				ts.tv_nsec -= NS_PER_SEC;
+			}
+			pthread_cond_timedwait(&bc->cond, &bc->mtx, &ts);
+		} else
+			pthread_cond_wait(&bc->cond, &bc->mtx);
+	}
+
+	pthread_mutex_unlock(&bc->mtx);
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * io_uring engine
+ *
+ * The requests are queued as SQEs by the caller of blockif_request() and
+ * submitted with one syscall, at once or when the caller unplugs. The
+ * kernel signals the completions on an eventfd, and they are reaped by
+ * the mevent thread, or the completion thread of a pinned context, which
+ * calls the callbacks. No thread is waiting for an I/O, however many are
+ * in flight.
+ */
+static unsigned int
+blockif_uring_space(struct blockif_uring *r)
+{
+	return r->sq_entries -
+		(r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* a free SQE, NULL if the SQ ring is full */
+static struct io_uring_sqe *
+blockif_uring_sqe(struct blockif_uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+	    r->sq_entries)
+		return NULL;
+
+	idx = r->tail++ & r->sq_mask;
+	r->sq_array[idx] = idx;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* called with bc->mtx held */
+static void
+blockif_uring_submit(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *r = bc->ring;
+	unsigned int n;
+	int rc;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	n = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	while (n > 0) {
+		rc = syscall(__NR_io_uring_enter, r->fd, n, 0, 0, NULL, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			/* the rest is submitted after the next completions */
+			if (rc < 0 && errno != EAGAIN && errno != EBUSY)
+				WPRINTF(("blockif: io_uring_enter failed %d\n",
+					errno));
+			break;
+		}
+		n -= rc;
+	}
+}
+
+static int
+blockif_uring_buf(struct blockif_uring *r, const struct iovec *iov)
+{
+	uint8_t *base = iov->iov_base;
+	int i;
+
+	for (i = 0; i < r->nbufs; i++) {
+		if (base >= (uint8_t *)r->bufs[i].iov_base &&
+		    base + iov->iov_len <=
+		    (uint8_t *)r->bufs[i].iov_base + r->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+/* called with bc->mtx held */
+static void
+blockif_uring_issue(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_uring *r = bc->ring;
+	struct blockif_req *breq = be->req;
+	enum blockop op = be->op;
+	struct io_uring_sqe *sqe;
+	uint64_t idx;
+	size_t len;
+	int buf, rw, nsqe, full;
+
+	be->status = BST_BUSY;
+	be->ncqe = 1;
+	be->sync = 0;
+	be->err = 0;
+	be->bounce = NULL;
+	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	idx = be - bc->reqs;
+
+	/*
+	 * nocache: a request with misaligned buffers, but aligned on the
+	 * storage, and fitting in a bounce buffer is bounced here, the
+	 * others by blockif_proc() on an I/O thread.
+	 */
+	rw = (op == BOP_READ || (op == BOP_WRITE && !bc->rdonly)) &&
+		!bc->cow && !bc->cache;
+
+	/* a writethru write takes a linked fsync */
+	nsqe = (op == BOP_WRITE && !bc->wce) ? 2 : 1;
+	full = 0;
+	if ((rw || op == BOP_FLUSH) && blockif_uring_space(r) < nsqe) {
+		blockif_uring_submit(bc);
+		full = (blockif_uring_space(r) < nsqe);
+		if (full)
+			rw = 0;
+	}
+
+	if (rw && bc->nocache && !blockif_dio_aligned(bc, breq)) {
+		len = blockif_iov_len(breq);
+		if (((breq->offset + bc->sub_file_start_lba) | len) &
+		    (bc->dio_align - 1) || len > BLOCKIF_BOUNCE_SZ)
+			rw = 0;
+		else {
+			be->bounce = blockif_bounce_get(bc);
+			if (!be->bounce)
+				rw = 0;
+		}
+		if (be->bounce) {
+			__atomic_add_fetch(&bc->stats.reqs, 1,
+				__ATOMIC_RELAXED);
+			__atomic_add_fetch(&bc->stats.bounced, 1,
+				__ATOMIC_RELAXED);
+			be->biov.iov_base = be->bounce;
+			be->biov.iov_len = len;
+			if (op == BOP_WRITE)
+				blockif_iov_copy(breq, 0, be->bounce, len, 0);
+		}
+	} else if (rw && bc->nocache)
+		__atomic_add_fetch(&bc->stats.reqs, 1, __ATOMIC_RELAXED);
+
+	/*
+	 * io_uring can't discard a block device: the discards, the requests
+	 * failing right away, the ones to bounce a piece at a time and all
+	 * those of a COW or cached drive, flushes included, are run by
+	 * blockif_proc() on an I/O thread, rather than on the thread
+	 * reaping the completions. So are the requests finding the SQ ring
+	 * full, when the kernel can't take its entries yet.
+	 */
+	if (full || (!rw && (op != BOP_FLUSH || bc->cow || bc->cache))) {
+		be->sync = 1;
+		TAILQ_INSERT_TAIL(&bc->procq, be, plink);
+		pthread_cond_signal(&bc->cond);
+		return;
+	}
+
+	sqe = blockif_uring_sqe(r);
+	sqe->user_data = idx;
+
+	if (op == BOP_FLUSH) {
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->flags = IOSQE_FIXED_FILE;
+	} else {
+		buf = (breq->iovcnt == 1 && !be->bounce) ?
+			blockif_uring_buf(r, &breq->iov[0]) : -1;
+		if (be->bounce) {
+			sqe->opcode = (op == BOP_READ) ?
+				IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = (uintptr_t)&be->biov;
+			sqe->len = 1;
+		} else if (buf >= 0) {
+			sqe->opcode = (op == BOP_READ) ?
+				IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->addr = (uintptr_t)breq->iov[0].iov_base;
+			sqe->len = breq->iov[0].iov_len;
+			sqe->buf_index = buf;
+		} else {
+			sqe->opcode = (op == BOP_READ) ?
+				IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = (uintptr_t)breq->iov;
+			sqe->len = breq->iovcnt;
+		}
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->off = breq->offset + bc->sub_file_start_lba;
+
+		/* writethru: the fsync only runs if the write is complete */
+		if (op == BOP_WRITE && !bc->wce) {
+			sqe->flags |= IOSQE_IO_LINK;
+			sqe = blockif_uring_sqe(r);
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->user_data = idx | BLOCKIF_URING_FSYNC;
+			be->ncqe = 2;
+		}
+	}
+}
+
+/*
+ * Issue the throttled requests which are due, in order in each direction,
+ * and queue a timeout for the next one. Called with bc->mtx held.
+ */
+static void
+blockif_uring_release(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be, *tbe;
+	struct io_uring_sqe *sqe;
+	int blocked[2] = { 0, 0 };
+	int dir;
+
+	bc->throttle_wait = 0;
+	for (be = TAILQ_FIRST(&bc->pendq); be != NULL; be = tbe) {
+		tbe = TAILQ_NEXT(be, link);
+		dir = (be->op == BOP_WRITE);
+		if (blocked[dir]) {
+			blockif_throttle_hold(be);
+			continue;
+		}
+		if (!blockif_throttle_admit(bc, be)) {
+			blocked[dir] = 1;
+			continue;
+		}
+		TAILQ_REMOVE(&bc->pendq, be, link);
+		blockif_uring_issue(bc, be);
+	}
+
+	if (bc->throttle_wait && !bc->throttle_armed) {
+		bc->throttle_ts.tv_sec = bc->throttle_wait / NS_PER_SEC;
+		bc->throttle_ts.tv_nsec = bc->throttle_wait % NS_PER_SEC;
+		if (blockif_uring_space(bc->ring) < 1)
+			blockif_uring_submit(bc);
+		/* SQ ring full: the next completion calls this again */
+		sqe = blockif_uring_sqe(bc->ring);
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->addr = (uintptr_t)&bc->throttle_ts;
+			sqe->len = 1;
+			sqe->user_data = BLOCKIF_URING_TIMER;
+			bc->throttle_armed = 1;
+		}
+	}
+}
+
+/*
+ * Called with bc->mtx held, and a free element. A request throttled, or
+ * behind one, waits in pendq till it's due.
+ */
+static void
+blockif_uring_queue(struct blockif_ctxt *bc, struct blockif_req *breq,
+		    enum blockop op)
+{
+	struct blockif_elem *be;
+
+	be = TAILQ_FIRST(&bc->freeq);
+	TAILQ_REMOVE(&bc->freeq, be, link);
+	be->req = breq;
+	be->op = op;
+	be->status = BST_PEND;
+	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	if (TAILQ_FIRST(&bc->pendq) == be && blockif_throttle_admit(bc, be)) {
+		TAILQ_REMOVE(&bc->pendq, be, link);
+		blockif_uring_issue(bc, be);
+	} else
+		blockif_uring_release(bc);
+
+	if (!bc->plugged)
+		blockif_uring_submit(bc);
+}
+
+static void
+blockif_uring_reap(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *r = bc->ring;
+	struct blockif_elem *be, *done[BLOCKIF_MAXREQ];
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	int i, n = 0;
+
+	pthread_mutex_lock(&bc->mtx);
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &r->cqes[head & r->cq_mask];
+		if (cqe->user_data & BLOCKIF_URING_CANCEL)
+			continue;
+		if (cqe->user_data & BLOCKIF_URING_TIMER) {
+			bc->throttle_armed = 0;
+			continue;
+		}
+
+		be = &bc->reqs[cqe->user_data & BLOCKIF_URING_IDX_MASK];
+		if (cqe->user_data & BLOCKIF_URING_FSYNC) {
+			/* cancelled after a short write, not an error */
+			if (cqe->res < 0 && cqe->res != -ECANCELED && !be->err)
+				be->err = -cqe->res;
+		} else if (cqe->res < 0)
+			be->err = -cqe->res;
+		else if (be->op == BOP_READ || be->op == BOP_WRITE)
+			be->req->resid -= cqe->res;
+
+		if (--be->ncqe == 0)
+			done[n++] = be;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	if (!bc->throttle_armed && !TAILQ_EMPTY(&bc->pendq))
+		blockif_uring_release(bc);
+	if (!bc->plugged)
+		blockif_uring_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+
+	if (n == 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		be = done[i];
+		if (be->bounce) {
+			if (be->op == BOP_READ && !be->err)
+				blockif_iov_copy(be->req, 0, be->bounce,
+					be->biov.iov_len, 1);
+			blockif_bounce_put(bc, be->bounce);
+			be->bounce = NULL;
+		}
+		be->status = BST_DONE;
+		(*be->req->callback)(be->req, be->err);
+	}
+
+	pthread_mutex_lock(&bc->mtx);
+	for (i = 0; i < n; i++)
+		blockif_complete(bc, done[i]);
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+static void
+blockif_uring_handler(int fd, enum ev_type t, void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		WPRINTF(("blockif: eventfd read failed %d\n", errno));
+	blockif_uring_reap(bc);
+}
+
+/*
+ * The completions of a pinned context are reaped by a thread of its own,
+ * on the CPU of the context, instead of the mevent thread.
+ */
+static void *
+blockif_uring_thr(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct pollfd pfd;
+	uint64_t val;
+
+	pfd.fd = bc->ring->efd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			WPRINTF(("blockif: eventfd poll failed %d\n", errno));
+		if (read(pfd.fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			WPRINTF(("blockif: eventfd read failed %d\n", errno));
+		/* the rest is reaped by blockif_uring_close() */
+		if (__atomic_load_n(&bc->closing, __ATOMIC_ACQUIRE))
+			break;
+		blockif_uring_reap(bc);
+	}
+
+	return NULL;
+}
+
+/*
+ * The I/O threads of the io_uring engine run the requests it can't, one
+ * at a time each, till the context is closed.
+ */
+static void *
+blockif_uring_proc_thr(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_elem *be;
+	pthread_t t = pthread_self();
+
+	pthread_mutex_lock(&bc->mtx);
+	for (;;) {
+		while ((be = TAILQ_FIRST(&bc->procq)) != NULL) {
+			TAILQ_REMOVE(&bc->procq, be, plink);
+			be->tid = t;
+			pthread_mutex_unlock(&bc->mtx);
+			blockif_proc(bc, be);
+			pthread_mutex_lock(&bc->mtx);
+			blockif_complete(bc, be);
+		}
+		if (bc->closing)
+			break;
+		pthread_cond_wait(&bc->cond, &bc->mtx);
+	}
+	pthread_mutex_unlock(&bc->mtx);
+
+	return NULL;
+}
+
+static void
+blockif_uring_free(struct blockif_uring *r)
+{
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_sz);
+	if (r->sq_ring && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_sz);
+	if (r->efd >= 0)
+		close(r->efd);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r);
+}
+
+/* the ring and the context are freed once out of the mevent thread */
+static void
+blockif_uring_teardown(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+
+	blockif_uring_free(bc->ring);
+	blockif_bounce_free(bc);
+	if (bc->cow)
+		blockif_cow_put(bc->cow);
+	if (bc->cache)
+		blockif_cache_close(bc->cache);
+	blockif_throttle_put(bc->throttle);
+	free(bc);
+}
+
+/*
+ * Register the guest memory, so that the pages of the requests with a
+ * single buffer don't have to be looked up and pinned for each I/O.
+ */
+static void
+blockif_uring_register_bufs(struct blockif_uring *r)
+{
+	struct hugetlb_mem_region regions[HUGETLB_MEM_REGIONS_MAX];
+	uint64_t off;
+	int i, n;
+
+	/* the pinned pages would keep the freed chunks of page merging */
+	if (page_merge_enabled)
+		return;
+
+	n = hugetlb_get_mem_regions(NULL, regions, HUGETLB_MEM_REGIONS_MAX);
+	for (i = 0; i < n; i++) {
+		for (off = 0; off < regions[i].size &&
+		     r->nbufs < BLOCKIF_URING_MAXBUFS;
+		     off += BLOCKIF_URING_BUFSZ) {
+			r->bufs[r->nbufs].iov_base =
+				(uint8_t *)regions[i].hva + off;
+			r->bufs[r->nbufs].iov_len =
+				MIN(BLOCKIF_URING_BUFSZ, regions[i].size - off);
+			r->nbufs++;
+		}
+	}
 
-	(*br->callback)(br, err);
+	if (r->nbufs > 0 && syscall(__NR_io_uring_register, r->fd,
+			IORING_REGISTER_BUFFERS, r->bufs, r->nbufs) < 0) {
+		WPRINTF(("blockif: no registered buffers, error %d\n", errno));
+		r->nbufs = 0;
+	}
 }
 
-static void *
-blockif_thr(void *arg)
+static struct blockif_uring *
+blockif_uring_init(struct blockif_ctxt *bc)
 {
-	struct blockif_ctxt *bc;
-	struct blockif_elem *be;
-	pthread_t t;
+	struct blockif_uring *r;
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
 
-	bc = arg;
-	t = pthread_self();
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->efd = -1;
 
-	pthread_mutex_lock(&bc->mtx);
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, BLOCKIF_URING_ENTRIES, &p);
+	if (r->fd < 0) {
+		WPRINTF(("blockif: io_uring_setup failed %d\n", errno));
+		goto fail;
+	}
 
-	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
-			pthread_mutex_unlock(&bc->mtx);
-			blockif_proc(bc, be);
-			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
-		}
-		/* Check ctxt status here to see if exit requested */
-		if (bc->closing)
-			break;
-		pthread_cond_wait(&bc->cond, &bc->mtx);
+	r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_ring_sz = r->cq_ring_sz = MAX(r->sq_ring_sz,
+			r->cq_ring_sz);
+	r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else {
+		r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto fail;
 	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_entries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+	r->tail = *r->sq_tail;
+	cq = r->cq_ring;
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* the backing file is the fixed file 0 */
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+			&bc->fd, 1) < 0) {
+		WPRINTF(("blockif: io_uring file register failed %d\n", errno));
+		goto fail;
+	}
+	blockif_uring_register_bufs(r);
 
-	pthread_mutex_unlock(&bc->mtx);
-	pthread_exit(NULL);
+	r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->efd < 0 || syscall(__NR_io_uring_register, r->fd,
+			IORING_REGISTER_EVENTFD, &r->efd, 1) < 0) {
+		WPRINTF(("blockif: io_uring eventfd failed %d\n", errno));
+		goto fail;
+	}
+
+	return r;
+
+fail:
+	blockif_uring_free(r);
 	return NULL;
 }
 
@@ -487,18 +1968,258 @@ sub_file_unlock(struct blockif_ctxt *bc)
 }
 
 
+/*
+ * The O_DIRECT alignments: the logical block size of a block device, what
+ * the file system reports for a file, or else the file block size.
+ */
+static void
+blockif_dio_get_align(int fd, struct stat *sbuf, int *align, int *mem_align)
+{
+	int lbs;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+#endif
+
+	*align = *mem_align = sbuf->st_blksize;
+	if (S_ISBLK(sbuf->st_mode)) {
+		if (!ioctl(fd, BLKSSZGET, &lbs) && lbs > 0)
+			*align = *mem_align = lbs;
+		return;
+	}
+#ifdef STATX_DIOALIGN
+	if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+	    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+		*align = stx.stx_dio_offset_align;
+		*mem_align = stx.stx_dio_mem_align;
+	}
+#endif
+}
+
+static off_t
+blockif_cow_backing_size(int fd)
+{
+	struct stat sbuf;
+	uint64_t b;
+
+	if (fstat(fd, &sbuf) < 0)
+		return -1;
+	if (S_ISBLK(sbuf.st_mode))
+		return ioctl(fd, BLKGETSIZE64, &b) ? -1 : (off_t)b;
+	return sbuf.st_size;
+}
+
+/*
+ * Open the overlay in fd, or create it on backing if fd is empty. The
+ * backing file is the one in the header, unless another one is given.
+ */
+static struct blockif_cow *
+blockif_cow_open(int fd, const char *backing, int ro, off_t *size)
+{
+	struct blockif_cow_header hdr;
+	struct blockif_cow *cow;
+	struct stat sbuf;
+	size_t l1_sz;
+
+	cow = calloc(1, sizeof(*cow));
+	if (!cow)
+		return NULL;
+	cow->refs = 1;
+	cow->bfd = -1;
+	pthread_mutex_init(&cow->mtx, NULL);
+
+	if (fstat(fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+		pr_err("blockif: the overlay must be a regular file\n");
+		goto fail;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (sbuf.st_size == 0) {
+		if (!backing || ro) {
+			pr_err("blockif: no overlay to open\n");
+			goto fail;
+		}
+		cow->bfd = open(backing, O_RDONLY);
+		cow->bsize = (cow->bfd < 0) ? -1 :
+			blockif_cow_backing_size(cow->bfd);
+		if (cow->bsize <= 0 || (cow->bsize & (DEV_BSIZE - 1)) ||
+		    strlen(backing) >= BLOCKIF_COW_BACKING_MAX) {
+			pr_err("blockif: invalid backing file %s\n", backing);
+			goto fail;
+		}
+
+		hdr.magic = BLOCKIF_COW_MAGIC;
+		hdr.version = BLOCKIF_COW_VERSION;
+		hdr.cluster_bits = BLOCKIF_COW_CLUSTER_BITS;
+		hdr.size = cow->bsize;
+		hdr.l1_size = howmany(hdr.size, 1UL <<
+			(2 * hdr.cluster_bits - 3));
+		hdr.l1_offset = 1UL << hdr.cluster_bits;
+		strncpy(hdr.backing, backing, sizeof(hdr.backing) - 1);
+		l1_sz = roundup2(hdr.l1_size * sizeof(uint64_t),
+			1UL << hdr.cluster_bits);
+		if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    ftruncate(fd, hdr.l1_offset + l1_sz) < 0 ||
+		    fsync(fd) < 0) {
+			pr_err("blockif: failed to create the overlay %d\n",
+				errno);
+			goto fail;
+		}
+		sbuf.st_size = hdr.l1_offset + l1_sz;
+		pr_info("blockif: overlay created on %s\n", backing);
+	} else if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		   hdr.magic != BLOCKIF_COW_MAGIC ||
+		   hdr.version != BLOCKIF_COW_VERSION ||
+		   hdr.cluster_bits < 12 || hdr.cluster_bits > 21 ||
+		   (hdr.size & (DEV_BSIZE - 1)) || hdr.l1_size !=
+		   howmany(hdr.size, 1UL << (2 * hdr.cluster_bits - 3))) {
+		pr_err("blockif: not a valid overlay\n");
+		goto fail;
+	}
+
+	cow->cluster_bits = hdr.cluster_bits;
+	cow->cluster_sz = 1UL << hdr.cluster_bits;
+	cow->l2_bits = hdr.cluster_bits - 3;
+	cow->l1_size = hdr.l1_size;
+	cow->l1_offset = hdr.l1_offset;
+	cow->end = roundup2(sbuf.st_size, cow->cluster_sz);
+
+	if (cow->bfd < 0) {
+		hdr.backing[sizeof(hdr.backing) - 1] = '\0';
+		if (!backing)
+			backing = hdr.backing;
+		cow->bfd = open(backing, O_RDONLY);
+		cow->bsize = (cow->bfd < 0) ? -1 :
+			blockif_cow_backing_size(cow->bfd);
+		if (cow->bsize < 0) {
+			pr_err("blockif: invalid backing file %s\n", backing);
+			goto fail;
+		}
+	}
+
+	l1_sz = cow->l1_size * sizeof(uint64_t);
+	cow->l1 = malloc(l1_sz);
+	cow->buf = malloc(cow->cluster_sz);
+	if (!cow->l1 || !cow->buf ||
+	    pread(fd, cow->l1, l1_sz, cow->l1_offset) != l1_sz) {
+		pr_err("blockif: failed to read the overlay L1 table\n");
+		goto fail;
+	}
+
+	*size = hdr.size;
+	return cow;
+
+fail:
+	blockif_cow_put(cow);
+	return NULL;
+}
+
+static void
+blockif_pin(struct blockif_ctxt *bc, pthread_t tid)
+{
+	cpu_set_t cpuset;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(bc->cpu, &cpuset);
+	if (pthread_setaffinity_np(tid, sizeof(cpuset), &cpuset))
+		WPRINTF(("blockif: failed to pin thread to cpu %d\n", bc->cpu));
+}
+
+/*
+ * Set up the queues and the bounce buffers of a new context, and start
+ * its engine: io_uring if asked for and available, else the I/O threads.
+ */
+static void
+blockif_start(struct blockif_ctxt *bc, const char *ident, int uring)
+{
+	pthread_condattr_t cattr;
+	char tname[MAXCOMLEN + 1];
+	int i, nthr;
+
+	pthread_mutex_init(&bc->mtx, NULL);
+	/* the I/O threads wait for the throttled requests on this clock */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&bc->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	pthread_mutex_init(&bc->bounce_mtx, NULL);
+	pthread_mutex_init(&bc->rmw_mtx, NULL);
+	for (i = 0; i < BLOCKIF_BOUNCE_NR && bc->nocache; i++) {
+		if (posix_memalign((void **)&bc->bounce[i],
+				bc->bounce_align, BLOCKIF_BOUNCE_SZ))
+			break;
+		bc->nbounce++;
+	}
+	TAILQ_INIT(&bc->freeq);
+	TAILQ_INIT(&bc->pendq);
+	TAILQ_INIT(&bc->busyq);
+	TAILQ_INIT(&bc->procq);
+	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+		bc->reqs[i].status = BST_FREE;
+		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
+	}
+
+	if (uring) {
+		bc->ring = blockif_uring_init(bc);
+		if (bc->ring && bc->cpu >= 0) {
+			if (pthread_create(&bc->ctid, NULL, blockif_uring_thr,
+					bc) == 0) {
+				snprintf(tname, sizeof(tname), "blk-%s-cq",
+					ident);
+				pthread_setname_np(bc->ctid, tname);
+				blockif_pin(bc, bc->ctid);
+			} else {
+				bc->ctid = 0;
+				blockif_uring_free(bc->ring);
+				bc->ring = NULL;
+			}
+		} else if (bc->ring) {
+			bc->ring->mevp = mevent_add(bc->ring->efd, EVF_READ,
+				blockif_uring_handler, bc,
+				blockif_uring_teardown, bc);
+			if (!bc->ring->mevp) {
+				blockif_uring_free(bc->ring);
+				bc->ring = NULL;
+			}
+		}
+		if (!bc->ring)
+			pr_err("blockif: io_uring not available, using threads\n");
+	}
+
+	/* the threads of io_uring only run what it can't */
+	nthr = BLOCKIF_NUMTHR;
+	if (bc->ring && !bc->cow && !bc->cache)
+		nthr = BLOCKIF_URING_NUMTHR;
+	for (i = 0; i < nthr; i++) {
+		if (snprintf(tname, sizeof(tname), "blk-%s-%d",
+					ident, i) >= sizeof(tname)) {
+			pr_err("blk thread name too long");
+		}
+		pthread_create(&bc->btid[i], NULL,
+			bc->ring ? blockif_uring_proc_thr : blockif_thr, bc);
+		pthread_setname_np(bc->btid[i], tname);
+		if (bc->cpu >= 0)
+			blockif_pin(bc, bc->btid[i]);
+	}
+}
+
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
 {
-	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
-	int fd, i, sectsz;
-	int writeback, ro, candiscard, ssopt, pssopt;
+	int fd, sectsz;
+	int writeback, ro, candiscard, ssopt, pssopt, uring, nocache, cpu;
+	int merge_kb, merge_segs, overlay;
+	unsigned long cache_mb;
+	char *backing;
+	struct blockif_cow *cow;
+	struct blockif_bucket limits[BLOCKIF_LIMITS];
+	struct blockif_throttle *throttle;
+	int limit;
 	long sz;
 	long long b;
 	int err_code = -1;
@@ -526,6 +2247,31 @@ blockif_open(const char *optstr, const char *ident)
 
 	candiscard = 0;
 
+	/* the I/O threads by default */
+	uring = 0;
+
+	/* through the page cache by default */
+	nocache = 0;
+
+	/* the I/O threads run on any CPU by default */
+	cpu = -1;
+
+	/* no merging by default */
+	merge_kb = 0;
+	merge_segs = 0;
+
+	/* a raw file or device by default */
+	overlay = 0;
+	backing = NULL;
+	cow = NULL;
+
+	/* not through the shared cache by default */
+	cache_mb = 0;
+
+	/* no limits by default */
+	memset(limits, 0, sizeof(limits));
+	throttle = NULL;
+
 	/*
 	 * The first element in the optstring is always a pathname.
 	 * Optional elements follow
@@ -545,6 +2291,46 @@ blockif_open(const char *optstr, const char *ident)
 			writeback = 0;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "aio=io_uring"))
+			uring = 1;
+		else if (!strcmp(cp, "aio=threads"))
+			uring = 0;
+		else if (!strcmp(cp, "nocache"))
+			nocache = 1;
+		else if (!strcmp(cp, "cow"))
+			overlay = 1;
+		else if (!strncmp(cp, "cow=", strlen("cow="))) {
+			/* cow=<backing file>, created if empty */
+			overlay = 1;
+			backing = cp + 4;
+		} else if (!strcmp(cp, "cache"))
+			cache_mb = BLOCK_CACHE_DEF_MB;
+		else if (!strncmp(cp, "cache=", strlen("cache="))) {
+			/* cache=<MiB of the segment, if it's created> */
+			if (dm_strtoul(cp + 6, &cp, 10, &cache_mb) ||
+			    *cp != '\0' || cache_mb == 0) {
+				pr_err("Invalid cache option\n");
+				goto err;
+			}
+		} else if (!strcmp(cp, "merge")) {
+			merge_kb = BLOCKIF_MERGE_SZ / 1024;
+			merge_segs = BLOCKIF_MERGE_SEGS;
+		} else if (!strncmp(cp, "merge=", strlen("merge="))) {
+			/* merge=<max KiB>[:<max segments>] */
+			merge_segs = BLOCKIF_MERGE_SEGS;
+			if (dm_strtoi(cp + 6, &cp, 10, &merge_kb) ||
+			    (*cp == ':' &&
+			     dm_strtoi(cp + 1, &cp, 10, &merge_segs)) ||
+			    *cp != '\0' || merge_kb < 0 || merge_segs < 1 ||
+			    merge_segs > BLOCKIF_IOV_MAX) {
+				pr_err("Invalid merge option\n");
+				goto err;
+			}
+		} else if (!strncmp(cp, "cpu=", strlen("cpu="))) {
+			if (dm_strtoi(cp + 4, &cp, 10, &cpu) || *cp != '\0' ||
+			    cpu < 0 || cpu >= CPU_SETSIZE)
+				goto err;
+		}
 		else if (!strncmp(cp, "discard", strlen("discard"))) {
 			strsep(&cp, "=");
 			if (cp != NULL) {
@@ -579,12 +2365,32 @@ blockif_open(const char *optstr, const char *ident)
 				sub_file_assign = 1;
 			else
 				goto err;
+		} else if ((limit = blockif_limit_parse(limits, cp)) != 0) {
+			/* iops_rd, iops_wr, bps_rd, bps_wr=<rate>[:<burst>] */
+			if (limit < 0) {
+				pr_err("Invalid limit \"%s\"\n", cp);
+				goto err;
+			}
 		} else {
 			pr_err("Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
 	}
 
+	if (overlay && (nocache || sub_file_assign)) {
+		pr_err("cow can't be used with nocache or range\n");
+		goto err;
+	}
+
+	if (cache_mb && nocache) {
+		pr_err("cache can't be used with nocache\n");
+		goto err;
+	}
+
+	/* O_DIRECT has the devices DMA to guest memory */
+	if (nocache)
+		page_merge_disable("nocache");
+
 	/*
 	 * To support "writeback" and "writethru" mode switch during runtime,
 	 * O_SYNC is not used directly, as O_SYNC flag cannot dynamic change
@@ -592,10 +2398,14 @@ blockif_open(const char *optstr, const char *ident)
 	 * operation to emulate it.
 	 */
 
-	fd = open(nopt, ro ? O_RDONLY : O_RDWR);
-	if (fd < 0 && !ro) {
+	if (overlay && backing && !ro)
+		fd = open(nopt, O_RDWR | O_CREAT, 0600);
+	else
+		fd = open(nopt, (ro ? O_RDONLY : O_RDWR) |
+			(nocache ? O_DIRECT : 0));
+	if (fd < 0 && !ro && errno != EINVAL) {
 		/* Attempt a r/w fail with a r/o open */
-		fd = open(nopt, O_RDONLY);
+		fd = open(nopt, O_RDONLY | (nocache ? O_DIRECT : 0));
 		ro = 1;
 	}
 
@@ -609,6 +2419,12 @@ blockif_open(const char *optstr, const char *ident)
 		goto err;
 	}
 
+	/* the blocks cached must not change, but the overlay's aren't */
+	if (cache_mb && !ro && !overlay) {
+		pr_err("cache needs ro, or cow for the backing file\n");
+		goto err;
+	}
+
 	/*
 	 * Deal with raw devices
 	 */
@@ -657,6 +2473,15 @@ blockif_open(const char *optstr, const char *ident)
 			}
 		}
 
+	} else if (overlay) {
+		cow = blockif_cow_open(fd, backing, ro, &size);
+		if (!cow)
+			goto err;
+		if (candiscard) {
+			WPRINTF(("not support DISCARD on an overlay\n"));
+			candiscard = 0;
+		}
+		psectsz = sbuf.st_blksize;
 	} else {
 		if (size < DEV_BSIZE || (size & (DEV_BSIZE - 1))) {
 			WPRINTF(("%s size not corret, should be multiple of %d\n",
@@ -694,6 +2519,12 @@ blockif_open(const char *optstr, const char *ident)
 		psectoff = 0;
 	}
 
+	throttle = blockif_throttle_new(limits);
+	if (throttle == NULL) {
+		pr_err("calloc");
+		goto err;
+	}
+
 	bc = calloc(1, sizeof(struct blockif_ctxt));
 	if (bc == NULL) {
 		pr_err("calloc");
@@ -720,6 +2551,9 @@ blockif_open(const char *optstr, const char *ident)
 	}
 
 	bc->fd = fd;
+	bc->cow = cow;
+	bc->throttle = throttle;
+	blockif_throttle_attach(bc);
 	bc->isblk = S_ISBLK(sbuf.st_mode);
 	bc->candiscard = candiscard;
 	if (candiscard) {
@@ -737,24 +2571,27 @@ blockif_open(const char *optstr, const char *ident)
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
 	bc->wce = writeback;
-	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
-	TAILQ_INIT(&bc->freeq);
-	TAILQ_INIT(&bc->pendq);
-	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
-		bc->reqs[i].status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
+	bc->cpu = cpu;
+	bc->merge_max = (size_t)merge_kb * 1024;
+	bc->merge_segs = merge_segs;
+	if (nocache) {
+		bc->nocache = 1;
+		blockif_dio_get_align(fd, &sbuf, &bc->dio_align,
+			&bc->dio_mem_align);
+		bc->bounce_align = MAX(psectsz, bc->dio_mem_align);
+		pr_info("blockif: %s nocache, O_DIRECT alignment %d, "
+			"memory %d\n", nopt, bc->dio_align,
+			bc->dio_mem_align);
 	}
-
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		if (snprintf(tname, sizeof(tname), "blk-%s-%d",
-					ident, i) >= sizeof(tname)) {
-			pr_err("blk thread name too long");
-		}
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		pthread_setname_np(bc->btid[i], tname);
+	if (cache_mb) {
+		if (cow)
+			cow->cache = block_cache_open(cow->bfd, cache_mb);
+		else
+			bc->cache = block_cache_open(fd, cache_mb);
+		if (!bc->cache && !(cow && cow->cache))
+			pr_err("blockif: %s not cached\n", nopt);
 	}
+	blockif_start(bc, ident, uring);
 
 	/* free strdup memory */
 	if (nopt) {
@@ -768,11 +2605,72 @@ err:
 	if (nopt)
 		free(nopt);
 
+	if (cow)
+		blockif_cow_put(cow);
+	if (throttle)
+		blockif_throttle_put(throttle);
 	if (fd >= 0)
 		close(fd);
 	return NULL;
 }
 
+/*
+ * Open another context on the backing file of bc, with the same options
+ * and engine, but its own requests and I/O threads or io_uring, so that
+ * the contexts don't contend with one another. Its threads run on cpu,
+ * or where those of bc do if it's -1.
+ */
+struct blockif_ctxt *
+blockif_clone(struct blockif_ctxt *bc, const char *ident, int cpu)
+{
+	struct blockif_ctxt *nbc;
+
+	nbc = calloc(1, sizeof(struct blockif_ctxt));
+	if (nbc == NULL) {
+		pr_err("calloc");
+		return NULL;
+	}
+
+	/* a duplicate shares the sub file lock, which bc releases */
+	nbc->fd = dup(bc->fd);
+	if (nbc->fd < 0) {
+		pr_err("blockif: failed to dup the backing file %d\n", errno);
+		free(nbc);
+		return NULL;
+	}
+	nbc->isblk = bc->isblk;
+	nbc->candiscard = bc->candiscard;
+	nbc->rdonly = bc->rdonly;
+	nbc->size = bc->size;
+	nbc->sub_file_start_lba = bc->sub_file_start_lba;
+	nbc->sectsz = bc->sectsz;
+	nbc->psectsz = bc->psectsz;
+	nbc->psectoff = bc->psectoff;
+	nbc->max_discard_sectors = bc->max_discard_sectors;
+	nbc->max_discard_seg = bc->max_discard_seg;
+	nbc->discard_sector_alignment = bc->discard_sector_alignment;
+	nbc->wce = bc->wce;
+	nbc->nocache = bc->nocache;
+	nbc->dio_align = bc->dio_align;
+	nbc->dio_mem_align = bc->dio_mem_align;
+	nbc->bounce_align = bc->bounce_align;
+	if (bc->cow) {
+		nbc->cow = bc->cow;
+		__atomic_add_fetch(&bc->cow->refs, 1, __ATOMIC_ACQ_REL);
+	}
+	if (bc->cache)
+		nbc->cache = block_cache_open(nbc->fd, 0);
+	nbc->merge_max = bc->merge_max;
+	nbc->merge_segs = bc->merge_segs;
+	nbc->throttle = bc->throttle;
+	__atomic_add_fetch(&bc->throttle->refs, 1, __ATOMIC_ACQ_REL);
+	blockif_throttle_attach(nbc);
+	nbc->cpu = (cpu >= 0) ? cpu : bc->cpu;
+	blockif_start(nbc, ident, bc->ring != NULL);
+
+	return nbc;
+}
+
 static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
@@ -787,7 +2685,9 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 * Enqueue and inform the block i/o thread
 		 * that there is work available
 		 */
-		if (blockif_enqueue(bc, breq, op))
+		if (bc->ring)
+			blockif_uring_queue(bc, breq, op);
+		else if (blockif_enqueue(bc, breq, op))
 			pthread_cond_signal(&bc->cond);
 	} else {
 		/*
@@ -827,12 +2727,84 @@ blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DISCARD);
 }
 
+/*
+ * With the io_uring engine, the requests made between blockif_plug() and
+ * blockif_unplug() are submitted at once by the latter. No effect with
+ * the I/O threads.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->mtx);
+	bc->plugged++;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->mtx);
+	if (--bc->plugged == 0 && bc->ring)
+		blockif_uring_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+static int
+blockif_uring_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	struct blockif_elem *be;
+	struct io_uring_sqe *sqe;
+
+	/* still throttled, never issued */
+	TAILQ_FOREACH(be, &bc->pendq, link) {
+		if (be->req == breq) {
+			blockif_complete(bc, be);
+			return 0;
+		}
+	}
+
+	TAILQ_FOREACH(be, &bc->busyq, link) {
+		if (be->req == breq)
+			break;
+	}
+	if (be == NULL || be->status != BST_BUSY)
+		return -1;
+
+	/* left to an I/O thread: drop it if none took it yet */
+	if (be->sync) {
+		if (be->tid)
+			return -EBUSY;
+		TAILQ_REMOVE(&bc->procq, be, plink);
+		blockif_complete(bc, be);
+		return 0;
+	}
+
+	/* the request completes through its callback, with ECANCELED */
+	if (blockif_uring_space(bc->ring) < 1)
+		blockif_uring_submit(bc);
+	sqe = blockif_uring_sqe(bc->ring);
+	if (sqe == NULL)
+		return -EBUSY;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = be - bc->reqs;
+	sqe->user_data = BLOCKIF_URING_CANCEL;
+	blockif_uring_submit(bc);
+	return -EBUSY;
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
 	struct blockif_elem *be;
+	int err;
 
 	pthread_mutex_lock(&bc->mtx);
+	if (bc->ring) {
+		err = blockif_uring_cancel(bc, breq);
+		pthread_mutex_unlock(&bc->mtx);
+		return err;
+	}
+
 	/*
 	 * Check pending requests.
 	 */
@@ -902,6 +2874,55 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return -EBUSY;
 }
 
+/*
+ * Wait for the requests in flight, reaping their completions here as the
+ * mevent thread may not be dispatching any more.
+ */
+static void
+blockif_uring_close(struct blockif_ctxt *bc)
+{
+	struct pollfd pfd;
+	uint64_t val;
+	int i;
+
+	pfd.fd = bc->ring->efd;
+	pfd.events = POLLIN;
+	pthread_mutex_lock(&bc->mtx);
+	__atomic_store_n(&bc->closing, 1, __ATOMIC_RELEASE);
+	if (bc->ctid) {
+		pthread_mutex_unlock(&bc->mtx);
+		val = 1;
+		if (write(pfd.fd, &val, sizeof(val)) < 0)
+			WPRINTF(("blockif: eventfd write failed %d\n", errno));
+		pthread_join(bc->ctid, NULL);
+		pthread_mutex_lock(&bc->mtx);
+	}
+	/* the throttled requests are let through when closing */
+	blockif_uring_release(bc);
+	while (!TAILQ_EMPTY(&bc->busyq)) {
+		blockif_uring_submit(bc);
+		pthread_mutex_unlock(&bc->mtx);
+		if (poll(&pfd, 1, 10) > 0 &&
+		    read(pfd.fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			WPRINTF(("blockif: eventfd read failed %d\n", errno));
+		blockif_uring_reap(bc);
+		pthread_mutex_lock(&bc->mtx);
+	}
+	pthread_cond_broadcast(&bc->cond);
+	pthread_mutex_unlock(&bc->mtx);
+
+	for (i = 0; i < BLOCKIF_NUMTHR && bc->btid[i]; i++)
+		pthread_join(bc->btid[i], NULL);
+
+	close(bc->fd);
+
+	/* the ring and bc are freed by the teardown */
+	if (bc->ring->mevp)
+		mevent_delete(bc->ring->mevp);
+	else
+		blockif_uring_teardown(bc);
+}
+
 int
 blockif_close(struct blockif_ctxt *bc)
 {
@@ -909,6 +2930,25 @@ blockif_close(struct blockif_ctxt *bc)
 	int i;
 
 	sub_file_unlock(bc);
+	/* no longer woken on a change of the limits */
+	blockif_throttle_detach(bc);
+
+	if (bc->nocache)
+		pr_info("blockif: nocache %lu requests, %lu bounced, "
+			"%lu bounce buffers allocated, %lu partial blocks\n",
+			bc->stats.reqs, bc->stats.bounced,
+			bc->stats.bounce_allocs, bc->stats.rmw);
+	if (bc->merge_max && !bc->ring)
+		pr_info("blockif: %lu requests merged into %lu\n",
+			bc->stats.merged, bc->stats.merges);
+	if (bc->stats.throttled)
+		pr_info("blockif: %lu requests throttled for %lu ms\n",
+			bc->stats.throttled, bc->stats.throttle_ns / 1000000);
+
+	if (bc->ring) {
+		blockif_uring_close(bc);
+		return 0;
+	}
 
 	/*
 	 * Stop the block i/o thread
@@ -927,6 +2967,12 @@ blockif_close(struct blockif_ctxt *bc)
 	 * Release resources
 	 */
 	close(bc->fd);
+	blockif_bounce_free(bc);
+	if (bc->cow)
+		blockif_cow_put(bc->cow);
+	if (bc->cache)
+		blockif_cache_close(bc->cache);
+	blockif_throttle_put(bc->throttle);
 	free(bc);
 
 	return 0;
@@ -1049,6 +3095,78 @@ blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce)
 	bc->wce = wce;
 }
 
+void
+blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *stats)
+{
+	stats->reqs = __atomic_load_n(&bc->stats.reqs, __ATOMIC_RELAXED);
+	stats->bounced = __atomic_load_n(&bc->stats.bounced,
+		__ATOMIC_RELAXED);
+	stats->bounce_allocs = __atomic_load_n(&bc->stats.bounce_allocs,
+		__ATOMIC_RELAXED);
+	stats->rmw = __atomic_load_n(&bc->stats.rmw, __ATOMIC_RELAXED);
+	stats->merged = __atomic_load_n(&bc->stats.merged, __ATOMIC_RELAXED);
+	stats->merges = __atomic_load_n(&bc->stats.merges, __ATOMIC_RELAXED);
+	stats->throttled = __atomic_load_n(&bc->stats.throttled,
+		__ATOMIC_RELAXED);
+	stats->throttle_ns = __atomic_load_n(&bc->stats.throttle_ns,
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * Change the limits of the drive of bc, and of its clones, at runtime:
+ * opts is a list of <name>=<rate>[:<burst>], the limits not in it are
+ * left as they are, and a rate of 0 removes one.
+ */
+int
+blockif_set_throttle(struct blockif_ctxt *bc, const char *opts)
+{
+	struct blockif_throttle *t = bc->throttle;
+	struct blockif_bucket buckets[BLOCKIF_LIMITS];
+	char *nopt, *xopts, *cp;
+	int i, err = 0;
+
+	nopt = xopts = strdup(opts);
+	if (!nopt)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&t->mtx);
+	memcpy(buckets, t->buckets, sizeof(buckets));
+	while ((cp = strsep(&xopts, ",")) != NULL) {
+		if (blockif_limit_parse(buckets, cp) != 1) {
+			pr_err("blockif: invalid limit \"%s\"\n", cp);
+			err = -EINVAL;
+			break;
+		}
+	}
+	if (!err) {
+		memcpy(t->buckets, buckets, sizeof(buckets));
+		t->last = blockif_now();
+		for (i = 0; i < BLOCKIF_LIMITS && !buckets[i].rate; i++)
+			;
+		__atomic_store_n(&t->limited, i < BLOCKIF_LIMITS,
+			__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&t->mtx);
+	free(nopt);
+	if (err)
+		return err;
+
+	/* the throttled requests of all the contexts are due again */
+	pthread_mutex_lock(&t->ctxs_mtx);
+	LIST_FOREACH(bc, &t->ctxs, tlink) {
+		pthread_mutex_lock(&bc->mtx);
+		if (bc->ring) {
+			blockif_uring_release(bc);
+			if (!bc->plugged)
+				blockif_uring_submit(bc);
+		} else
+			pthread_cond_broadcast(&bc->cond);
+		pthread_mutex_unlock(&bc->mtx);
+	}
+	pthread_mutex_unlock(&t->ctxs_mtx);
+	return 0;
+}
+
 int
 blockif_flush_all(struct blockif_ctxt *bc)
 {
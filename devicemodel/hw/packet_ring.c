@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "packet_ring.h"
+#include "log.h"
+
+/*
+ * The RX ring takes the packets of about 1ms at 10Gbps in a block, a
+ * 64KB GSO packet fits in one.
+ */
+#define PACKET_RX_BLOCK_SIZE	(1 << 17)
+#define PACKET_RX_BLOCK_NR	32
+#define PACKET_RX_FRAME_SIZE	2048
+/* retire a partly filled RX block after this many ms */
+#define PACKET_RX_BLOCK_TMO	1
+
+#define PACKET_TX_FRAME_SIZE	4096
+#define PACKET_TX_FRAME_NR	256
+#define PACKET_TX_BLOCK_SIZE	(1 << 16)
+/* the data of a TX frame follows its header, less the sockaddr_ll */
+#define PACKET_TX_DATA_OFF	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+struct packet_ring {
+	int		fd;
+	uint8_t		*map;
+	size_t		maplen;
+
+	uint8_t		*rx_ring;
+	unsigned int	rx_cur;		/* RX block being consumed */
+	unsigned int	rx_left;	/* packets left in it */
+	struct tpacket3_hdr *rx_pkt;	/* next packet in it */
+
+	uint8_t		*tx_ring;
+	unsigned int	tx_cur;		/* next TX frame to fill */
+	unsigned int	tx_queued;	/* frames filled since the last flush */
+
+	struct packet_ring_stats stats;
+};
+
+static int
+packet_ring_setup(struct packet_ring *r, const char *ifname, int headroom)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+	int ifindex, val;
+	size_t rxlen;
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		pr_err("packet_ring: no interface %s\n", ifname);
+		return -1;
+	}
+
+	val = TPACKET_V3;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val))) {
+		pr_err("packet_ring: TPACKET_V3 not supported: %d\n", errno);
+		return -1;
+	}
+
+	/*
+	 * Received packets come with a virtio-net header, for the checksum
+	 * and GSO offloads of the host stack, and sent ones take it.
+	 * It can't be changed once the rings are set up.
+	 */
+	val = 1;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VNET_HDR, &val, sizeof(val))) {
+		pr_err("packet_ring: PACKET_VNET_HDR failed: %d\n", errno);
+		return -1;
+	}
+
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RESERVE, &headroom,
+		       sizeof(headroom))) {
+		pr_err("packet_ring: PACKET_RESERVE failed: %d\n", errno);
+		return -1;
+	}
+
+	/* skip a malformed TX frame rather than stall the ring on it */
+	val = 1;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_LOSS, &val, sizeof(val)))
+		pr_err("packet_ring: PACKET_LOSS failed: %d\n", errno);
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PACKET_RX_BLOCK_SIZE;
+	req.tp_block_nr = PACKET_RX_BLOCK_NR;
+	req.tp_frame_size = PACKET_RX_FRAME_SIZE;
+	req.tp_frame_nr = PACKET_RX_BLOCK_SIZE / PACKET_RX_FRAME_SIZE *
+		PACKET_RX_BLOCK_NR;
+	req.tp_retire_blk_tov = PACKET_RX_BLOCK_TMO;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		pr_err("packet_ring: PACKET_RX_RING failed: %d\n", errno);
+		return -1;
+	}
+	rxlen = (size_t)req.tp_block_size * req.tp_block_nr;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PACKET_TX_BLOCK_SIZE;
+	req.tp_block_nr = PACKET_TX_FRAME_NR /
+		(PACKET_TX_BLOCK_SIZE / PACKET_TX_FRAME_SIZE);
+	req.tp_frame_size = PACKET_TX_FRAME_SIZE;
+	req.tp_frame_nr = PACKET_TX_FRAME_NR;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))) {
+		pr_err("packet_ring: PACKET_TX_RING failed: %d\n", errno);
+		return -1;
+	}
+
+	/* the RX ring is mapped first, the TX ring follows it */
+	r->maplen = rxlen + (size_t)req.tp_block_size * req.tp_block_nr;
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_LOCKED | MAP_POPULATE, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		pr_err("packet_ring: mmap failed: %d\n", errno);
+		r->map = NULL;
+		return -1;
+	}
+	r->rx_ring = r->map;
+	r->tx_ring = r->map + rxlen;
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(r->fd, (struct sockaddr *)&sll, sizeof(sll))) {
+		pr_err("packet_ring: bind to %s failed: %d\n", ifname, errno);
+		return -1;
+	}
+
+	/* the guest has its own MAC address */
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+		       sizeof(mreq))) {
+		pr_err("packet_ring: promiscuous mode failed: %d\n", errno);
+		return -1;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	/* older kernels don't have it, rx_peek skips them anyway */
+	val = 1;
+	(void)setsockopt(r->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &val,
+		sizeof(val));
+#endif
+
+	return 0;
+}
+
+struct packet_ring *
+packet_ring_open(const char *ifname, int headroom)
+{
+	struct packet_ring *r;
+
+	r = calloc(1, sizeof(struct packet_ring));
+	if (!r)
+		return NULL;
+
+	/* blocking, so that a flush of a full TX ring can wait for it */
+	r->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+	if (r->fd < 0) {
+		pr_err("packet_ring: socket failed: %d\n", errno);
+		free(r);
+		return NULL;
+	}
+
+	if (packet_ring_setup(r, ifname, headroom)) {
+		packet_ring_close(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void
+packet_ring_close(struct packet_ring *r)
+{
+	if (r->map)
+		munmap(r->map, r->maplen);
+	close(r->fd);
+	free(r);
+}
+
+int
+packet_ring_fd(struct packet_ring *r)
+{
+	return r->fd;
+}
+
+static inline struct tpacket_block_desc *
+rx_block(struct packet_ring *r, unsigned int i)
+{
+	return (struct tpacket_block_desc *)(r->rx_ring +
+		(size_t)i * PACKET_RX_BLOCK_SIZE);
+}
+
+static void
+rx_block_release(struct packet_ring *r)
+{
+	struct tpacket_block_desc *bd = rx_block(r, r->rx_cur);
+
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+		__ATOMIC_RELEASE);
+	r->rx_cur = (r->rx_cur + 1) % PACKET_RX_BLOCK_NR;
+	r->stats.rx_blocks++;
+}
+
+uint8_t *
+packet_ring_rx_peek(struct packet_ring *r, int *len)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *pkt;
+	struct sockaddr_ll *sll;
+
+	for (;;) {
+		if (r->rx_left == 0) {
+			bd = rx_block(r, r->rx_cur);
+			if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+					__ATOMIC_ACQUIRE) & TP_STATUS_USER))
+				return NULL;
+
+			r->rx_left = bd->hdr.bh1.num_pkts;
+			r->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)bd +
+				bd->hdr.bh1.offset_to_first_pkt);
+			if (r->rx_left == 0) {
+				rx_block_release(r);
+				continue;
+			}
+		}
+
+		pkt = r->rx_pkt;
+		sll = (struct sockaddr_ll *)((uint8_t *)pkt +
+			TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		if (sll->sll_pkttype != PACKET_OUTGOING) {
+			if (pkt->tp_snaplen == pkt->tp_len) {
+				*len = pkt->tp_snaplen;
+				return (uint8_t *)pkt + pkt->tp_mac;
+			}
+			r->stats.rx_truncated++;
+		}
+		packet_ring_rx_next(r);
+	}
+}
+
+void
+packet_ring_rx_next(struct packet_ring *r)
+{
+	if (r->rx_left == 0)
+		return;
+
+	r->stats.rx_packets++;
+	if (--r->rx_left > 0)
+		r->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)r->rx_pkt +
+			r->rx_pkt->tp_next_offset);
+	else
+		rx_block_release(r);
+}
+
+static inline struct tpacket3_hdr *
+tx_frame(struct packet_ring *r, unsigned int i)
+{
+	return (struct tpacket3_hdr *)(r->tx_ring +
+		(size_t)i * PACKET_TX_FRAME_SIZE);
+}
+
+static void
+tx_send(struct packet_ring *r, bool wait)
+{
+	ssize_t ret;
+
+	ret = sendto(r->fd, NULL, 0, wait ? 0 : MSG_DONTWAIT, NULL, 0);
+	if (ret < 0 && errno != EAGAIN && errno != ENOBUFS)
+		pr_err("packet_ring: send failed: %d\n", errno);
+	r->tx_queued = 0;
+	r->stats.tx_flushes++;
+}
+
+/* whether the frame is free, the ones skipped by the kernel are freed */
+static bool
+tx_frame_free(struct tpacket3_hdr *hdr)
+{
+	uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+	if (status & TP_STATUS_WRONG_FORMAT) {
+		__atomic_store_n(&hdr->tp_status, TP_STATUS_AVAILABLE,
+			__ATOMIC_RELAXED);
+		return true;
+	}
+	return status == TP_STATUS_AVAILABLE;
+}
+
+int
+packet_ring_tx(struct packet_ring *r, const void *vnet_hdr,
+	       const struct iovec *iov, int iovcnt, int len)
+{
+	struct tpacket3_hdr *hdr = tx_frame(r, r->tx_cur);
+	uint8_t *data;
+	int i;
+
+	if (len > (int)(PACKET_TX_FRAME_SIZE - PACKET_TX_DATA_OFF -
+			PACKET_RING_VNET_HDRLEN)) {
+		r->stats.tx_dropped++;
+		return -1;
+	}
+
+	if (!tx_frame_free(hdr)) {
+		/* the ring is full, wait for the kernel to send it */
+		tx_send(r, true);
+		if (!tx_frame_free(hdr)) {
+			r->stats.tx_dropped++;
+			return -1;
+		}
+	}
+
+	/* the packet follows its virtio-net header */
+	data = (uint8_t *)hdr + PACKET_TX_DATA_OFF;
+	memcpy(data, vnet_hdr, PACKET_RING_VNET_HDRLEN);
+	data += PACKET_RING_VNET_HDRLEN;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(data, iov[i].iov_base, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+	hdr->tp_len = len + PACKET_RING_VNET_HDRLEN;
+	hdr->tp_snaplen = hdr->tp_len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+		__ATOMIC_RELEASE);
+
+	r->tx_cur = (r->tx_cur + 1) % PACKET_TX_FRAME_NR;
+	r->tx_queued++;
+	r->stats.tx_packets++;
+	return 0;
+}
+
+void
+packet_ring_tx_flush(struct packet_ring *r)
+{
+	if (r->tx_queued > 0)
+		tx_send(r, false);
+}
+
+void
+packet_ring_get_stats(struct packet_ring *r, struct packet_ring_stats *stats)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	/* the kernel counters are reset on each read */
+	if (getsockopt(r->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+		r->stats.rx_dropped += st.tp_drops;
+
+	*stats = r->stats;
+}
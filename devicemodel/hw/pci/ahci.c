@@ -40,10 +40,15 @@
 #include "ahci.h"
 #include "block_if.h"
 #include "ata.h"
+#include "timer.h"
+#include "dm_string.h"
 
 #define	DEF_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
 #define	MAX_PORTS	32	/* AHCI supports 32 ports */
 
+#define	AHCI_COAL_DEF_US	50	/* NCQ completions held up to 50us */
+#define	AHCI_COAL_MAX_US	1000
+
 #define	PxSIG_ATA	0x00000101 /* ATA drive */
 #define	PxSIG_ATAPI	0xeb140101 /* ATAPI drive */
 
@@ -104,6 +109,7 @@ static FILE *dbg;
 
 struct ahci_ioreq {
 	struct blockif_req io_req;
+	struct iovec io_iov[BLOCKIF_IOV_MAX];	/* io_req.iov */
 	struct ahci_port *io_pr;
 
 	STAILQ_ENTRY(ahci_ioreq) io_flist;
@@ -132,6 +138,18 @@ struct ahci_port {
 	uint8_t asc;
 	u_int ccs;
 	uint32_t pending;
+	int ncq_ack;		/* NCQ commands accepted, no D2H FIS yet */
+
+	/*
+	 * NCQ completion coalescing, the completions are reported by one
+	 * SDB FIS, and one interrupt, for up to coal_max of them.
+	 */
+	uint32_t sdb_done;	/* completed, no SDB FIS yet */
+	int sdb_cnt;
+	int coal_max;		/* 1 if off */
+	int coal_us;		/* the longest a completion is held */
+	int coal_armed;
+	struct acrn_timer coal_timer;
 
 	uint32_t clb;
 	uint32_t clbu;
@@ -411,21 +429,101 @@ ahci_write_fis_d2h(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 	ahci_write_fis(p, FIS_TYPE_REGD2H, fis);
 }
 
+/*
+ * An NCQ command is accepted, the D2H FIS saying so is written once for
+ * all the commands accepted by a pass of ahci_handle_port().
+ */
 static void
-ahci_write_fis_d2h_ncq(struct ahci_port *p, int slot)
+ahci_accept_ncq(struct ahci_port *p, int slot)
+{
+	p->tfd = ATA_S_READY | ATA_S_DSC;
+	p->ci &= ~(1 << slot);
+	p->ncq_ack = 1;
+}
+
+static void
+ahci_write_fis_d2h_ncq(struct ahci_port *p)
 {
 	uint8_t fis[20];
 
-	p->tfd = ATA_S_READY | ATA_S_DSC;
+	if (!p->ncq_ack)
+		return;
+
+	p->ncq_ack = 0;
 	memset(fis, 0, sizeof(fis));
 	fis[0] = FIS_TYPE_REGD2H;
 	fis[1] = 0;			/* No interrupt */
-	fis[2] = p->tfd;		/* Status */
+	fis[2] = ATA_S_READY | ATA_S_DSC; /* Status */
 	fis[3] = 0;			/* No error */
-	p->ci &= ~(1 << slot);
 	ahci_write_fis(p, FIS_TYPE_REGD2H, fis);
 }
 
+/*
+ * Report the NCQ commands completed since the last SDB FIS, by one FIS.
+ */
+static void
+ahci_write_fis_sdb_done(struct ahci_port *p)
+{
+	struct itimerspec its;
+	uint8_t fis[8];
+
+	if (p->sdb_done == 0)
+		return;
+
+	if (p->coal_armed) {
+		memset(&its, 0, sizeof(its));
+		acrn_timer_settime(&p->coal_timer, &its);
+		p->coal_armed = 0;
+	}
+
+	memset(fis, 0, sizeof(fis));
+	fis[0] = FIS_TYPE_SETDEVBITS;
+	fis[1] = (1 << 6);
+	fis[2] = ATA_S_READY | ATA_S_DSC;
+	*(uint32_t *)(fis + 4) = p->sdb_done;
+	p->sact &= ~p->sdb_done;
+	p->sdb_done = 0;
+	p->sdb_cnt = 0;
+	p->tfd &= ~0x77;
+	p->tfd |= ATA_S_READY | ATA_S_DSC;
+	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
+}
+
+/*
+ * An NCQ command completed fine, it's reported with the others once
+ * coal_max of them did, nothing else is in flight, or it's been held for
+ * coal_us.
+ */
+static void
+ahci_sdb_complete(struct ahci_port *p, int slot)
+{
+	struct itimerspec its;
+
+	p->sdb_done |= (1 << slot);
+	p->sdb_cnt++;
+	if (p->sdb_cnt >= p->coal_max || (p->pending & ~p->sdb_done) == 0) {
+		ahci_write_fis_sdb_done(p);
+	} else if (!p->coal_armed) {
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_nsec = p->coal_us * 1000;
+		if (acrn_timer_settime(&p->coal_timer, &its) == 0)
+			p->coal_armed = 1;
+		else
+			ahci_write_fis_sdb_done(p);
+	}
+}
+
+static void
+ahci_coal_timer(void *arg, uint64_t nexp)
+{
+	struct ahci_port *p = arg;
+
+	pthread_mutex_lock(&p->ahci_dev->mtx);
+	p->coal_armed = 0;
+	ahci_write_fis_sdb_done(p);
+	pthread_mutex_unlock(&p->ahci_dev->mtx);
+}
+
 static void
 ahci_write_reset_fis_d2h(struct ahci_port *p)
 {
@@ -472,6 +570,8 @@ ahci_port_stop(struct ahci_port *p)
 
 	/*assert(pthread_mutex_isowned_np(&p->ahci_dev->mtx)); */
 
+	ahci_write_fis_sdb_done(p);
+
 	TAILQ_FOREACH(aior, &p->iobhd, io_blist) {
 		/*
 		 * Try to cancel the outstanding blockif request.
@@ -513,6 +613,9 @@ ahci_port_reset(struct ahci_port *pr)
 {
 	pr->serr = 0;
 	pr->sact = 0;
+	pr->sdb_done = 0;
+	pr->sdb_cnt = 0;
+	pr->ncq_ack = 0;
 	pr->xfermode = ATA_UDMA6;
 	pr->mult_sectors = 128;
 
@@ -721,7 +824,7 @@ ahci_handle_rw(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t done)
 	TAILQ_INSERT_HEAD(&p->iobhd, aior, io_blist);
 
 	if (ncq && first)
-		ahci_write_fis_d2h_ncq(p, slot);
+		ahci_accept_ncq(p, slot);
 
 	if (readop)
 		err = blockif_read(p->bctx, breq);
@@ -834,8 +937,10 @@ next:
 	if (elen == 0) {
 		if (done >= len) {
 			if (ncq) {
-				if (first)
-					ahci_write_fis_d2h_ncq(p, slot);
+				if (first) {
+					ahci_accept_ncq(p, slot);
+					ahci_write_fis_d2h_ncq(p);
+				}
 				ahci_write_fis_sdb(p, slot, cfis,
 				    ATA_S_READY | ATA_S_DSC);
 			} else {
@@ -881,7 +986,7 @@ next:
 	TAILQ_INSERT_HEAD(&p->iobhd, aior, io_blist);
 
 	if (ncq && first)
-		ahci_write_fis_d2h_ncq(p, slot);
+		ahci_accept_ncq(p, slot);
 
 	err = blockif_discard(p->bctx, breq);
 	if (err)
@@ -1837,6 +1942,17 @@ ahci_handle_slot(struct ahci_port *p, int slot)
 		return;
 	}
 
+	/* NCQ reads and writes, most of the I/O, go straight to the rw */
+	if ((cfis[1] & 0x80) && !p->atapi &&
+	    (cfis[2] == ATA_READ_FPDMA_QUEUED ||
+	     cfis[2] == ATA_WRITE_FPDMA_QUEUED)) {
+		ahci_handle_rw(p, slot, cfis, 0);
+		return;
+	}
+
+	/* the FISes are written in order */
+	ahci_write_fis_d2h_ncq(p);
+
 	if (cfis[1] & 0x80) {
 		ahci_handle_cmd(p, slot, cfis);
 	} else {
@@ -1853,24 +1969,44 @@ ahci_handle_slot(struct ahci_port *p, int slot)
 static void
 ahci_handle_port(struct ahci_port *p)
 {
+	struct blockif_ctxt *bctx = p->bctx;
+	uint32_t issued, seen = 0;
+	int slot;
+
 	if (!(p->cmd & AHCI_P_CMD_ST))
 		return;
 
+	/* the commands issued at once are submitted at once */
+	if (bctx)
+		blockif_plug(bctx);
+
 	/*
-	 * Search for any new commands to issue ignoring those that
-	 * are already in-flight.  Stop if device is busy or in error.
+	 * Issue the new commands, ignoring those that are already in-flight,
+	 * in one pass from the current command slot on.  Stop if device is
+	 * busy or in error, or out of requests till one completes.
 	 */
-	for (; (p->ci & ~p->pending) != 0; p->ccs = ((p->ccs + 1) & 31)) {
+	while ((issued = p->ci & ~p->pending & ~seen) != 0) {
 		if ((p->tfd & (ATA_S_BUSY | ATA_S_DRQ)) != 0)
 			break;
 		if (p->waitforclear)
 			break;
-		if ((p->ci & ~p->pending & (1 << p->ccs)) != 0) {
-			p->cmd &= ~AHCI_P_CMD_CCS_MASK;
-			p->cmd |= p->ccs << AHCI_P_CMD_CCS_SHIFT;
-			ahci_handle_slot(p, p->ccs);
-		}
+		if (STAILQ_EMPTY(&p->iofhd))
+			break;
+		slot = ffs(issued & (0xffffffffU << p->ccs)) - 1;
+		if (slot < 0)
+			slot = ffs(issued) - 1;
+		seen |= (1 << slot);
+		p->ccs = slot;
+		p->cmd &= ~AHCI_P_CMD_CCS_MASK;
+		p->cmd |= p->ccs << AHCI_P_CMD_CCS_SHIFT;
+		ahci_handle_slot(p, slot);
+		p->ccs = (slot + 1) & 31;
 	}
+
+	ahci_write_fis_d2h_ncq(p);
+
+	if (bctx)
+		blockif_unplug(bctx);
 }
 
 /*
@@ -1934,9 +2070,13 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 		tfd = ATA_S_READY | ATA_S_DSC;
 	else
 		tfd = (ATA_E_ABORT << 8) | ATA_S_READY | ATA_S_ERROR;
-	if (ncq)
+	if (ncq && !err && p->coal_max > 1)
+		ahci_sdb_complete(p, slot);
+	else if (ncq) {
+		/* those done before are reported first */
+		ahci_write_fis_sdb_done(p);
 		ahci_write_fis_sdb(p, slot, cfis, tfd);
-	else
+	} else
 		ahci_write_fis_d2h(p, slot, cfis, tfd);
 
 	/*
@@ -2040,6 +2180,7 @@ pci_ahci_ioreq_init(struct ahci_port *pr)
 		else
 			vr->io_req.callback = atapi_ioreq_cb;
 		vr->io_req.param = vr;
+		vr->io_req.iov = vr->io_iov;
 		STAILQ_INSERT_TAIL(&pr->iofhd, vr, io_flist);
 	}
 
@@ -2337,6 +2478,47 @@ pci_ahci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev, int baridx,
 	return value;
 }
 
+/*
+ * Take the port options, coalesce=<n>[:<us>], out of opts. The rest is
+ * left in opts, for blockif_open().
+ */
+static int
+ahci_port_parse_opts(struct ahci_port *pr, char *opts)
+{
+	char *cp, *next, *end, *out;
+	int len;
+
+	pr->coal_max = 1;
+	pr->coal_us = AHCI_COAL_DEF_US;
+	for (cp = out = opts; cp != NULL; cp = next) {
+		next = strchr(cp, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (cp != opts && !strncmp(cp, "coalesce=", 9)) {
+			if (dm_strtoi(cp + 9, &end, 10, &pr->coal_max) ||
+			    pr->coal_max < 1 || pr->coal_max > 32 ||
+			    (*end == ':' && (dm_strtoi(end + 1, &end, 10,
+					&pr->coal_us) || pr->coal_us < 1 ||
+					pr->coal_us > AHCI_COAL_MAX_US)) ||
+			    *end != '\0') {
+				WPRINTF("ahci: invalid %s, 1 to 32 completions, "
+					"held 1 to %dus\n", cp,
+					AHCI_COAL_MAX_US);
+				return -1;
+			}
+			continue;
+		}
+		if (out != opts)
+			*out++ = ',';
+		len = strlen(cp);
+		memmove(out, cp, len);
+		out += len;
+	}
+	*out = '\0';
+
+	return 0;
+}
+
 static int
 pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 {
@@ -2391,6 +2573,12 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 		if (opts[0] == 0)
 			continue;
 
+		if (ahci_port_parse_opts(&ahci_dev->port[p], opts)) {
+			ahci_dev->ports = p;
+			ret = 1;
+			goto open_fail;
+		}
+
 		/*
 		 * Attempt to open the backing image. Use the PCI slot/func
 		 * and the port number for the identifier string.
@@ -2431,6 +2619,16 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 			goto open_fail;
 		}
 
+		if (ahci_dev->port[p].coal_max > 1) {
+			ahci_dev->port[p].coal_timer.clockid = CLOCK_MONOTONIC;
+			if (acrn_timer_init(&ahci_dev->port[p].coal_timer,
+					ahci_coal_timer, &ahci_dev->port[p])) {
+				WPRINTF("%s: failed to create the coalescing "
+					"timer\n", __func__);
+				ahci_dev->port[p].coal_max = 1;
+			}
+		}
+
 		ahci_dev->pi |= (1 << p);
 		if (ahci_dev->port[p].ioqsz < slots)
 			slots = ahci_dev->port[p].ioqsz;
@@ -2468,6 +2666,7 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 open_fail:
 	if (ret) {
 		for (p = 0; p < ahci_dev->ports; p++) {
+			acrn_timer_deinit(&ahci_dev->port[p].coal_timer);
 			if (ahci_dev->port[p].bctx != NULL)
 				blockif_close(ahci_dev->port[p].bctx);
 		}
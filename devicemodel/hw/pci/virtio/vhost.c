@@ -24,6 +24,7 @@
 #include "irq.h"
 #include "vmmapi.h"
 #include "vhost.h"
+#include "page_merge.h"
 
 static int vhost_debug;
 #define LOG_TAG "vhost: "
@@ -161,6 +162,36 @@ vhost_kernel_net_set_backend(struct vhost_dev *vdev,
 	return vhost_kernel_ioctl(vdev, VHOST_NET_SET_BACKEND, file);
 }
 
+static int
+vhost_kernel_vsock_set_guest_cid(struct vhost_dev *vdev, uint64_t *cid)
+{
+	return vhost_kernel_ioctl(vdev, VHOST_VSOCK_SET_GUEST_CID, cid);
+}
+
+static int
+vhost_kernel_vsock_set_running(struct vhost_dev *vdev, int *running)
+{
+	return vhost_kernel_ioctl(vdev, VHOST_VSOCK_SET_RUNNING, running);
+}
+
+const struct vhost_ops vhost_kernel_ops = {
+	.set_mem_table = vhost_kernel_set_mem_table,
+	.set_vring_addr = vhost_kernel_set_vring_addr,
+	.set_vring_num = vhost_kernel_set_vring_num,
+	.set_vring_base = vhost_kernel_set_vring_base,
+	.get_vring_base = vhost_kernel_get_vring_base,
+	.set_vring_kick = vhost_kernel_set_vring_kick,
+	.set_vring_call = vhost_kernel_set_vring_call,
+	.set_vring_busyloop_timeout = vhost_kernel_set_vring_busyloop_timeout,
+	.set_features = vhost_kernel_set_features,
+	.get_features = vhost_kernel_get_features,
+	.set_owner = vhost_kernel_set_owner,
+	.reset_device = vhost_kernel_reset_device,
+	.net_set_backend = vhost_kernel_net_set_backend,
+	.vsock_set_guest_cid = vhost_kernel_vsock_set_guest_cid,
+	.vsock_set_running = vhost_kernel_vsock_set_running,
+};
+
 static int
 vhost_eventfd_test_and_clear(int fd)
 {
@@ -378,7 +409,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_NUM */
 	ring.index = idx;
 	ring.num = vqi->qsize;
-	rc = vhost_kernel_set_vring_num(vdev, &ring);
+	rc = vdev->ops->set_vring_num(vdev, &ring);
 	if (rc < 0) {
 		WPRINTF("set_vring_num failed: idx = %d\n", idx);
 		goto fail_vring;
@@ -386,7 +417,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 
 	/* VHOST_SET_VRING_BASE */
 	ring.num = vqi->last_avail;
-	rc = vhost_kernel_set_vring_base(vdev, &ring);
+	rc = vdev->ops->set_vring_base(vdev, &ring);
 	if (rc < 0) {
 		WPRINTF("set_vring_base failed: idx = %d, last_avail = %d\n",
 			idx, vqi->last_avail);
@@ -400,7 +431,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	addr.used_user_addr = (uintptr_t)vqi->used;
 	addr.log_guest_addr = (uintptr_t)NULL;
 	addr.flags = 0;
-	rc = vhost_kernel_set_vring_addr(vdev, &addr);
+	rc = vdev->ops->set_vring_addr(vdev, &addr);
 	if (rc < 0) {
 		WPRINTF("set_vring_addr failed: idx = %d\n", idx);
 		goto fail_vring;
@@ -409,7 +440,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_CALL */
 	file.index = idx;
 	file.fd = vq->call_fd;
-	rc = vhost_kernel_set_vring_call(vdev, &file);
+	rc = vdev->ops->set_vring_call(vdev, &file);
 	if (rc < 0) {
 		WPRINTF("set_vring_call failed\n");
 		goto fail_vring;
@@ -418,7 +449,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_KICK */
 	file.index = idx;
 	file.fd = vq->kick_fd;
-	rc = vhost_kernel_set_vring_kick(vdev, &file);
+	rc = vdev->ops->set_vring_kick(vdev, &file);
 	if (rc < 0) {
 		WPRINTF("set_vring_kick failed: idx = %d", idx);
 		goto fail_vring_kick;
@@ -429,7 +460,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 fail_vring_kick:
 	file.index = idx;
 	file.fd = -1;
-	vhost_kernel_set_vring_call(vdev, &file);
+	vdev->ops->set_vring_call(vdev, &file);
 fail_vring:
 	vhost_vq_register_eventfd(vdev, idx, false);
 fail:
@@ -463,14 +494,14 @@ vhost_vq_stop(struct vhost_dev *vdev, int idx)
 	file.fd = -1;
 
 	/* VHOST_SET_VRING_KICK */
-	vhost_kernel_set_vring_kick(vdev, &file);
+	vdev->ops->set_vring_kick(vdev, &file);
 
 	/* VHOST_SET_VRING_CALL */
-	vhost_kernel_set_vring_call(vdev, &file);
+	vdev->ops->set_vring_call(vdev, &file);
 
 	/* VHOST_GET_VRING_BASE */
 	ring.index = idx;
-	rc = vhost_kernel_get_vring_base(vdev, &ring);
+	rc = vdev->ops->get_vring_base(vdev, &ring);
 	if (rc < 0)
 		WPRINTF("get_vring_base failed: idx = %d", idx);
 	else
@@ -537,7 +568,7 @@ vhost_set_mem_table(struct vhost_dev *vdev)
 
 	mem->nregions = nregions;
 	mem->padding = 0;
-	rc = vhost_kernel_set_mem_table(vdev, mem);
+	rc = vdev->ops->set_mem_table(vdev, mem);
 	free(mem);
 	if (rc < 0) {
 		WPRINTF("set_mem_table failed\n");
@@ -591,9 +622,14 @@ vhost_dev_init(struct vhost_dev *vdev,
 		goto fail;
 	}
 
+	/* the vhost backend maps guest memory on its own */
+	page_merge_disable("vhost");
+
+	if (!vdev->ops)
+		vdev->ops = &vhost_kernel_ops;
 	vhost_kernel_init(vdev, base, fd, vq_idx, busyloop_timeout);
 
-	rc = vhost_kernel_get_features(vdev, &features);
+	rc = vdev->ops->get_features(vdev, &features);
 	if (rc < 0) {
 		WPRINTF("vhost_get_features failed\n");
 		goto fail;
@@ -688,7 +724,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 		goto fail;
 	}
 
-	rc = vhost_kernel_set_owner(vdev);
+	rc = vdev->ops->set_owner(vdev);
 	if (rc < 0) {
 		WPRINTF("vhost_set_owner failed\n");
 		goto fail;
@@ -697,7 +733,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 	/* set vhost internal features */
 	features = (vdev->base->negotiated_caps & vdev->vhost_features) |
 		vdev->vhost_ext_features;
-	rc = vhost_kernel_set_features(vdev, features);
+	rc = vdev->ops->set_features(vdev, features);
 	if (rc < 0) {
 		WPRINTF("set_features failed\n");
 		goto fail;
@@ -716,7 +752,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 		state.num = vdev->busyloop_timeout;
 		for (i = 0; i < vdev->nvqs; i++) {
 			state.index = i;
-			rc = vhost_kernel_set_vring_busyloop_timeout(vdev,
+			rc = vdev->ops->set_vring_busyloop_timeout(vdev,
 				&state);
 			if (rc < 0) {
 				WPRINTF("set_busyloop_timeout failed\n");
@@ -763,7 +799,7 @@ vhost_dev_stop(struct vhost_dev *vdev)
 	 * 1) resources of the vhost dev are freed
 	 * 2) vhost virtqueues are reset
 	 */
-	rc = vhost_kernel_reset_device(vdev);
+	rc = vdev->ops->reset_device(vdev);
 	if (rc < 0) {
 		WPRINTF("vhost_reset_device failed\n");
 		rc = -1;
@@ -793,7 +829,7 @@ vhost_net_set_backend(struct vhost_dev *vdev, int backend_fd)
 	file.fd = backend_fd;
 	for (i = 0; i < vdev->nvqs; i++) {
 		file.index = i;
-		rc = vhost_kernel_net_set_backend(vdev, &file);
+		rc = vdev->ops->net_set_backend(vdev, &file);
 		if (rc < 0)
 			goto fail;
 	}
@@ -803,8 +839,22 @@ fail:
 	file.fd = -1;
 	while (--i >= 0) {
 		file.index = i;
-		vhost_kernel_net_set_backend(vdev, &file);
+		vdev->ops->net_set_backend(vdev, &file);
 	}
 
 	return -1;
 }
+
+int
+vhost_vsock_set_guest_cid(struct vhost_dev *vdev, uint64_t cid)
+{
+	return vdev->ops->vsock_set_guest_cid(vdev, &cid);
+}
+
+int
+vhost_vsock_set_running(struct vhost_dev *vdev, bool running)
+{
+	int start = running ? 1 : 0;
+
+	return vdev->ops->vsock_set_running(vdev, &start);
+}
@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * vhost-user transport of vhost_dev: the vhost requests are sent as
+ * vhost-user messages to a backend process over a unix socket, so that
+ * a data plane running outside of the device model, on its own cores,
+ * can serve the virtqueues. The backend maps guest memory from the
+ * hugetlbfs files passed along with SET_MEM_TABLE.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "vmmapi.h"
+#include "vhost.h"
+#include "vhost_user.h"
+
+static int vhost_user_debug;
+#define LOG_TAG "vhost-user: "
+#define DPRINTF(fmt, args...) \
+	do { if (vhost_user_debug) printf(LOG_TAG fmt, ##args); } while (0)
+#define WPRINTF(fmt, args...) printf(LOG_TAG fmt, ##args)
+
+static int
+vhost_user_send(struct vhost_dev *vdev, struct vhost_user_msg *msg,
+		int *fds, int nfds)
+{
+	char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+	struct msghdr msgh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t rc;
+
+	msg->flags = VHOST_USER_VERSION;
+	iov.iov_base = msg;
+	iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	if (nfds > 0) {
+		msgh.msg_control = control;
+		msgh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	do {
+		rc = sendmsg(vdev->fd, &msgh, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc != (ssize_t)iov.iov_len) {
+		WPRINTF("failed to send request %u, errno = %d\n",
+			msg->request, errno);
+		return -1;
+	}
+
+	DPRINTF("request %u, size %u, %d fds\n", msg->request, msg->size, nfds);
+	return 0;
+}
+
+static int
+vhost_user_read(int fd, void *buf, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = read(fd, buf, len);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		buf = (char *)buf + rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+/* wait for the reply of the request in msg, it's written over msg */
+static int
+vhost_user_recv(struct vhost_dev *vdev, struct vhost_user_msg *msg,
+		uint32_t size)
+{
+	uint32_t request = msg->request;
+
+	if (vhost_user_read(vdev->fd, msg, VHOST_USER_HDR_SIZE) < 0) {
+		WPRINTF("failed to receive the reply of request %u\n",
+			request);
+		return -1;
+	}
+
+	if (msg->request != request ||
+	    (msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION ||
+	    !(msg->flags & VHOST_USER_REPLY_MASK) || msg->size != size) {
+		WPRINTF("bad reply to request %u: request %u, flags 0x%x, "
+			"size %u\n", request, msg->request, msg->flags,
+			msg->size);
+		return -1;
+	}
+
+	if (vhost_user_read(vdev->fd, &msg->payload, size) < 0) {
+		WPRINTF("failed to receive the reply of request %u\n",
+			request);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+vhost_user_request(struct vhost_dev *vdev, uint32_t request)
+{
+	struct vhost_user_msg msg = {
+		.request = request,
+		.size = 0,
+	};
+
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_set_u64(struct vhost_dev *vdev, uint32_t request, uint64_t val,
+		   int fd)
+{
+	struct vhost_user_msg msg = {
+		.request = request,
+		.size = sizeof(msg.payload.u64),
+		.payload.u64 = val,
+	};
+
+	return vhost_user_send(vdev, &msg, &fd, fd >= 0 ? 1 : 0);
+}
+
+static int
+vhost_user_set_vring_state(struct vhost_dev *vdev, uint32_t request,
+			   struct vhost_vring_state *ring)
+{
+	struct vhost_user_msg msg = {
+		.request = request,
+		.size = sizeof(msg.payload.state),
+	};
+
+	/* the backend sees all the vqs of the device */
+	msg.payload.state.index = ring->index + vdev->vq_idx;
+	msg.payload.state.num = ring->num;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+/*
+ * Describe the guest memory regions by the hugetlbfs file ranges backing
+ * them, a region may span several files with two levels of hugepages.
+ */
+static int
+vhost_user_set_mem_table(struct vhost_dev *vdev, struct vhost_memory *mem)
+{
+	struct hugetlb_mem_region hr[HUGETLB_MEM_REGIONS_MAX];
+	struct vhost_user_msg msg = {
+		.request = VHOST_USER_SET_MEM_TABLE,
+	};
+	struct vhost_user_memory_region ur;
+	struct vhost_memory_region *r;
+	int fds[VHOST_USER_MAX_REGIONS];
+	uint64_t start, end;
+	uint32_t i;
+	int j, n, nr = 0;
+
+	n = hugetlb_get_mem_regions(vdev->base->dev->vmctx, hr,
+		ARRAY_SIZE(hr));
+	for (i = 0; i < mem->nregions; i++) {
+		r = &mem->regions[i];
+		for (j = 0; j < n; j++) {
+			start = MAX(r->guest_phys_addr, hr[j].gpa);
+			end = MIN(r->guest_phys_addr + r->memory_size,
+				hr[j].gpa + hr[j].size);
+			if (start >= end)
+				continue;
+			if (nr == VHOST_USER_MAX_REGIONS) {
+				WPRINTF("too many memory regions\n");
+				return -1;
+			}
+
+			ur.guest_phys_addr = start;
+			ur.memory_size = end - start;
+			ur.userspace_addr = r->userspace_addr +
+				(start - r->guest_phys_addr);
+			ur.mmap_offset = hr[j].offset + (start - hr[j].gpa);
+			msg.payload.memory.regions[nr] = ur;
+			fds[nr++] = hr[j].fd;
+		}
+	}
+
+	if (nr == 0) {
+		WPRINTF("guest memory is not backed by hugetlbfs files\n");
+		return -1;
+	}
+
+	msg.payload.memory.nregions = nr;
+	msg.size = sizeof(msg.payload.memory);
+	return vhost_user_send(vdev, &msg, fds, nr);
+}
+
+static int
+vhost_user_set_vring_addr(struct vhost_dev *vdev,
+			  struct vhost_vring_addr *addr)
+{
+	struct vhost_user_msg msg = {
+		.request = VHOST_USER_SET_VRING_ADDR,
+		.size = sizeof(msg.payload.addr),
+	};
+
+	msg.payload.addr = *addr;
+	msg.payload.addr.index += vdev->vq_idx;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_set_vring_num(struct vhost_dev *vdev,
+			 struct vhost_vring_state *ring)
+{
+	return vhost_user_set_vring_state(vdev, VHOST_USER_SET_VRING_NUM, ring);
+}
+
+static int
+vhost_user_set_vring_base(struct vhost_dev *vdev,
+			  struct vhost_vring_state *ring)
+{
+	return vhost_user_set_vring_state(vdev, VHOST_USER_SET_VRING_BASE,
+		ring);
+}
+
+/* this stops the ring, the backend replies once it's done with it */
+static int
+vhost_user_get_vring_base(struct vhost_dev *vdev,
+			  struct vhost_vring_state *ring)
+{
+	struct vhost_user_msg msg;
+
+	if (vhost_user_set_vring_state(vdev, VHOST_USER_GET_VRING_BASE, ring))
+		return -1;
+
+	msg.request = VHOST_USER_GET_VRING_BASE;
+	if (vhost_user_recv(vdev, &msg, sizeof(msg.payload.state)))
+		return -1;
+
+	ring->num = msg.payload.state.num;
+	return 0;
+}
+
+static int
+vhost_user_set_vring_file(struct vhost_dev *vdev, uint32_t request,
+			  struct vhost_vring_file *file)
+{
+	uint64_t val = (file->index + vdev->vq_idx) & VHOST_USER_VRING_IDX_MASK;
+
+	if (file->fd < 0)
+		val |= VHOST_USER_VRING_NOFD_MASK;
+	return vhost_user_set_u64(vdev, request, val, file->fd);
+}
+
+static int
+vhost_user_set_vring_kick(struct vhost_dev *vdev,
+			  struct vhost_vring_file *file)
+{
+	/*
+	 * No kick fd means the backend has to poll the ring, the ring is
+	 * stopped by GET_VRING_BASE instead.
+	 */
+	if (file->fd < 0)
+		return 0;
+
+	return vhost_user_set_vring_file(vdev, VHOST_USER_SET_VRING_KICK, file);
+}
+
+static int
+vhost_user_set_vring_call(struct vhost_dev *vdev,
+			  struct vhost_vring_file *file)
+{
+	return vhost_user_set_vring_file(vdev, VHOST_USER_SET_VRING_CALL, file);
+}
+
+static int
+vhost_user_set_vring_busyloop_timeout(struct vhost_dev *vdev,
+				      struct vhost_vring_state *s)
+{
+	/* polling is up to the backend */
+	return 0;
+}
+
+static int
+vhost_user_set_features(struct vhost_dev *vdev, uint64_t features)
+{
+	return vhost_user_set_u64(vdev, VHOST_USER_SET_FEATURES, features, -1);
+}
+
+static int
+vhost_user_get_features(struct vhost_dev *vdev, uint64_t *features)
+{
+	struct vhost_user_msg msg = {
+		.request = VHOST_USER_GET_FEATURES,
+		.size = 0,
+	};
+
+	if (vhost_user_send(vdev, &msg, NULL, 0) ||
+	    vhost_user_recv(vdev, &msg, sizeof(msg.payload.u64)))
+		return -1;
+
+	*features = msg.payload.u64;
+	return 0;
+}
+
+static int
+vhost_user_set_owner(struct vhost_dev *vdev)
+{
+	return vhost_user_request(vdev, VHOST_USER_SET_OWNER);
+}
+
+static int
+vhost_user_reset_device(struct vhost_dev *vdev)
+{
+	/*
+	 * RESET_OWNER is deprecated, the rings are already stopped by
+	 * GET_VRING_BASE and are set up again from scratch on start.
+	 */
+	return 0;
+}
+
+static int
+vhost_user_net_set_backend(struct vhost_dev *vdev,
+			   struct vhost_vring_file *file)
+{
+	WPRINTF("no backend fd with vhost-user\n");
+	return -1;
+}
+
+static int
+vhost_user_vsock_set_guest_cid(struct vhost_dev *vdev, uint64_t *cid)
+{
+	WPRINTF("no vsock with vhost-user\n");
+	return -1;
+}
+
+static int
+vhost_user_vsock_set_running(struct vhost_dev *vdev, int *running)
+{
+	WPRINTF("no vsock with vhost-user\n");
+	return -1;
+}
+
+const struct vhost_ops vhost_user_ops = {
+	.set_mem_table = vhost_user_set_mem_table,
+	.set_vring_addr = vhost_user_set_vring_addr,
+	.set_vring_num = vhost_user_set_vring_num,
+	.set_vring_base = vhost_user_set_vring_base,
+	.get_vring_base = vhost_user_get_vring_base,
+	.set_vring_kick = vhost_user_set_vring_kick,
+	.set_vring_call = vhost_user_set_vring_call,
+	.set_vring_busyloop_timeout = vhost_user_set_vring_busyloop_timeout,
+	.set_features = vhost_user_set_features,
+	.get_features = vhost_user_get_features,
+	.set_owner = vhost_user_set_owner,
+	.reset_device = vhost_user_reset_device,
+	.net_set_backend = vhost_user_net_set_backend,
+	.vsock_set_guest_cid = vhost_user_vsock_set_guest_cid,
+	.vsock_set_running = vhost_user_vsock_set_running,
+};
+
+/**
+ * @brief connect to a vhost-user backend.
+ *
+ * This interface is called to get the socket of a vhost-user backend
+ * listening on a unix socket, to be passed to vhost_dev_init with
+ * vdev->ops set to &vhost_user_ops.
+ *
+ * @param path Path of the unix socket.
+ *
+ * @return the socket on success and -1 on failure.
+ */
+int
+vhost_user_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strnlen(path, sizeof(addr.sun_path)) == sizeof(addr.sun_path)) {
+		WPRINTF("socket path %s is too long\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		WPRINTF("socket failed, errno = %d\n", errno);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		WPRINTF("failed to connect to %s, errno = %d\n", path, errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
@@ -82,16 +82,16 @@ virtio_poll_timer(void *arg, uint64_t nexp)
 	vops = base->vops;
 	name = vops->name;
 
-	if (base->mtx)
-		pthread_mutex_lock(base->mtx);
-
 	base->polling_in_progress = 1;
 
 	for (i = 0; i < base->vops->nvq; i++) {
 		vq = &base->queues[i];
-		if(!vq_ring_ready(vq))
+		VQ_LOCK(vq);
+		if(!vq_ring_ready(vq)) {
+			VQ_UNLOCK(vq);
 			continue;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		}
+		vq_set_used_ring_flags(vq);
 		/* TODO: call notify when necessary */
 		if (vq->notify)
 			(*vq->notify)(DEV_STRUCT(base), vq);
@@ -100,11 +100,9 @@ virtio_poll_timer(void *arg, uint64_t nexp)
 		else
 			pr_err("%s: qnotify queue %d: missing vq/vops notify\r\n",
 				name, i);
+		VQ_UNLOCK(vq);
 	}
 
-	if (base->mtx)
-		pthread_mutex_unlock(base->mtx);
-
 	virtio_start_timer(&base->polling_timer, 0, virtio_poll_interval);
 }
 
@@ -176,6 +174,11 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->flags = 0;
 		vq->last_avail = 0;
 		vq->save_used = 0;
+		vq->used_idx = 0;
+		vq->prev_avail = 0;
+		vq->poll_seen = 0;
+		free(vq->chain_ndesc);
+		vq->chain_ndesc = NULL;
 		vq->pfn = 0;
 		vq->msix_idx = VIRTIO_MSI_NO_VECTOR;
 		vq->gpa_desc[0] = 0;
@@ -320,6 +323,62 @@ virtio_vq_init(struct virtio_base *base, uint32_t pfn)
 	vq->flags = VQ_ALLOC;
 }
 
+/*
+ * Initialize a packed virtqueue.  The gpa of desc array, avail ring
+ * and used ring registers hold the descriptor ring, the driver event
+ * suppression and the device event suppression structures then.
+ */
+static void
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint16_t qsz;
+	uint64_t phys;
+	size_t size;
+	uint16_t *ndesc;
+
+	qsz = vq->qsize;
+	if (qsz == 0 || (qsz & (qsz - 1)) != 0) {
+		pr_err("%s: packed queue %d size %u is not a power of 2\r\n",
+			base->vops->name, base->curq, qsz);
+		return;
+	}
+
+	ndesc = realloc(vq->chain_ndesc, qsz * sizeof(uint16_t));
+	if (ndesc == NULL) {
+		pr_err("%s: failed to allocate packed queue %d\r\n",
+			base->vops->name, base->curq);
+		return;
+	}
+	vq->chain_ndesc = ndesc;
+
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	size = qsz * sizeof(struct vring_packed_desc);
+	vq->packed_desc = paddr_guest2host(base->dev->vmctx, phys, size);
+
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	size = sizeof(struct vring_packed_desc_event);
+	vq->driver_event = paddr_guest2host(base->dev->vmctx, phys, size);
+
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vq->device_event = paddr_guest2host(base->dev->vmctx, phys, size);
+
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+
+	/* Start at 0 with the wrap counters set when we use it. */
+	vq->last_avail = 0;
+	vq->save_used = 0;
+	vq->used_idx = 0;
+
+	/* Mark queue as enabled. */
+	vq->enabled = true;
+
+	/* Mark queue as allocated after initialization is complete. */
+	mb();
+	vq->flags = VQ_ALLOC | VQ_PACKED;
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -338,6 +397,11 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (base->negotiated_caps & (1UL << VIRTIO_F_RING_PACKED)) {
+		virtio_vq_enable_packed(base, vq);
+		return;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct vring_desc);
@@ -386,53 +450,42 @@ _vq_record(int i, volatile struct vring_desc *vd, struct vmctx *ctx,
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
 /*
- * Examine the chain of descriptors starting at the "next one" to
- * make sure that they describe a sensible request.  If so, return
- * the number of "real" descriptors that would be needed/used in
- * acting on this request.  This may be smaller than the number of
- * available descriptors, e.g., if there are two available but
- * they are two separate requests, this just returns 1.  Or, it
- * may be larger: if there are indirect descriptors involved,
- * there may only be one descriptor available but it may be an
- * indirect pointing to eight more.  We return 8 in this case,
- * i.e., we do not count the indirect descriptors, only the "real"
- * ones.
- *
- * Basically, this vets the flags and vd_next field of each
- * descriptor and tells you how many are involved.  Since some may
- * be indirect, this also needs the vmctx (in the pci_vdev
- * at base->dev) so that it can find indirect descriptors.
- *
- * As we process each descriptor, we copy and adjust it (guest to
- * host address wise, also using the vmtctx) into the given iov[]
- * array (of the given size).  If the array overflows, we stop
- * placing values into the array but keep processing descriptors,
- * up to VQ_MAX_DESCRIPTORS, before giving up and returning -1.
- * So you, the caller, must not assume that iov[] is as big as the
- * return value (you can process the same thing twice to allocate
- * a larger iov array if needed, or supply a zero length to find
- * out how much space is needed).
- *
- * If you want to verify the WRITE flag on each descriptor, pass a
- * non-NULL "flags" pointer to an array of "uint16_t" of the same size
- * as n_iov and we'll copy each flags field after unwinding any
- * indirects.
- *
- * If some descriptor(s) are invalid, this prints a diagnostic message
- * and returns -1.  If no descriptors are ready now it simply returns 0.
+ * Helper inline for vq_getchain_packed(): record the i'th "real"
+ * descriptor.
+ */
+static inline void
+_vq_record_packed(int i, volatile struct vring_packed_desc *vd,
+		  struct vmctx *ctx, struct iovec *iov, int n_iov,
+		  uint16_t *flags) {
+
+	if (i >= n_iov)
+		return;
+	iov[i].iov_base = paddr_guest2host(ctx, vd->addr, vd->len);
+	iov[i].iov_len = vd->len;
+	if (flags != NULL)
+		flags[i] = vd->flags;
+}
+
+/*
+ * vq_getchain() for packed virtqueues.
  *
- * You are assumed to have done a vq_ring_ready() if needed (note
- * that vq_has_descs() does one).
+ * The chain takes the descriptors following each other in the ring
+ * from last_avail, until one without the NEXT flag, and the buffer
+ * id is in that last descriptor.  An indirect descriptor points to a
+ * table of descriptors which are all part of the chain, there is no
+ * NEXT flag or next field in it.  The buffer id is returned in *pidx,
+ * and the number of ring descriptors it takes is kept for
+ * vq_relchain().
  */
-int
-vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
-	    struct iovec *iov, int n_iov, uint16_t *flags)
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
 {
 	int i;
-	u_int ndesc, n_indir;
-	u_int idx, next;
+	u_int ndesc, n_indir, j;
+	uint16_t idx, mask, id;
 
-	volatile struct vring_desc *vdir, *vindir, *vp;
+	volatile struct vring_packed_desc *vdir, *vindir;
 	struct vmctx *ctx;
 	struct virtio_base *base;
 	const char *name;
@@ -440,6 +493,98 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	base = vq->base;
 	name = base->vops->name;
 
+	idx = vq->last_avail;
+	if (!vq_packed_desc_avail(vq, idx))
+		return 0;
+
+	/*
+	 * The guest makes the head descriptor available last, read the
+	 * rest of the chain only after its flags.
+	 */
+	atomic_signal_fence();
+
+	ctx = base->dev->vmctx;
+	mask = vq->qsize - 1;
+	i = 0;
+	for (ndesc = 1; ; ndesc++, idx++) {
+		if (ndesc > vq->qsize) {
+			pr_err("%s: packed chain longer than the ring, "
+			    "driver confused?\r\n",
+			    name);
+			goto bad;
+		}
+		vdir = &vq->packed_desc[idx & mask];
+		if ((vdir->flags & VRING_DESC_F_INDIRECT) == 0) {
+			_vq_record_packed(i, vdir, ctx, iov, n_iov, flags);
+			i++;
+		} else if ((base->device_caps &
+		    (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0) {
+			pr_err("%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			goto bad;
+		} else {
+			n_indir = vdir->len / sizeof(struct vring_packed_desc);
+			if ((vdir->len & 0xf) || n_indir == 0) {
+				pr_err("%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vdir->len);
+				goto bad;
+			}
+			vindir = paddr_guest2host(ctx,
+			    vdir->addr, vdir->len);
+			for (j = 0; j < n_indir; j++) {
+				if (vindir[j].flags & VRING_DESC_F_INDIRECT) {
+					pr_err("%s: indirect desc has INDIR flag,"
+					    " driver confused?\r\n",
+					    name);
+					goto bad;
+				}
+				_vq_record_packed(i, &vindir[j], ctx, iov,
+				    n_iov, flags);
+				if (++i > VQ_MAX_DESCRIPTORS)
+					goto loopy;
+			}
+		}
+		if (i > VQ_MAX_DESCRIPTORS)
+			goto loopy;
+		if ((vdir->flags & VRING_DESC_F_NEXT) == 0)
+			break;
+	}
+
+	id = vdir->id;
+	if (id >= vq->qsize) {
+		pr_err("%s: buffer id %u out of range, "
+		    "driver confused?\r\n",
+		    name, id);
+		goto bad;
+	}
+	vq->chain_ndesc[id] = ndesc;
+	vq->prev_avail = vq->last_avail;
+	vq->last_avail = idx + 1;
+	*pidx = id;
+	return i;
+
+loopy:
+	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+bad:
+	/* skip what has been walked, as the split ring skips the entry */
+	vq->prev_avail = vq->last_avail;
+	vq->last_avail = idx + 1;
+	return -1;
+}
+
+/*
+ * Number of chains the guest has made available in a split ring since
+ * the last time we updated vq->last_avail, or -1 if avail->idx makes
+ * no sense.
+ */
+static int
+vq_avail_chains(struct virtio_vq_info *vq)
+{
+	u_int ndesc;
+
 	/*
 	 * Note: it's the responsibility of the guest not to
 	 * update vq->avail->idx until all of the descriptors
@@ -453,17 +598,38 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	 * We just need to do the subtraction as an unsigned int,
 	 * then trim off excess bits.
 	 */
-	idx = vq->last_avail;
-	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
-	if (ndesc == 0)
-		return 0;
+	ndesc = (uint16_t)((u_int)vq->avail->idx - vq->last_avail);
 	if (ndesc > vq->qsize) {
 		/* XXX need better way to diagnose issues */
 		pr_err("%s: ndesc (%u) out of range, driver confused?\r\n",
-		    name, (u_int)ndesc);
+		    vq->base->vops->name, (u_int)ndesc);
 		return -1;
 	}
 
+	return ndesc;
+}
+
+/*
+ * vq_getchain() for split rings, once vq_avail_chains() says there is
+ * a chain to take.
+ */
+static int
+_vq_getchain_split(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int i;
+	u_int n_indir;
+	u_int idx, next;
+
+	volatile struct vring_desc *vdir, *vindir, *vp;
+	struct vmctx *ctx;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
+	idx = vq->last_avail;
+
 	/*
 	 * Now count/parse "involved" descriptors starting from
 	 * the head of the chain.
@@ -541,6 +707,122 @@ loopy:
 	return -1;
 }
 
+/*
+ * Examine the chain of descriptors starting at the "next one" to
+ * make sure that they describe a sensible request.  If so, return
+ * the number of "real" descriptors that would be needed/used in
+ * acting on this request.  This may be smaller than the number of
+ * available descriptors, e.g., if there are two available but
+ * they are two separate requests, this just returns 1.  Or, it
+ * may be larger: if there are indirect descriptors involved,
+ * there may only be one descriptor available but it may be an
+ * indirect pointing to eight more.  We return 8 in this case,
+ * i.e., we do not count the indirect descriptors, only the "real"
+ * ones.
+ *
+ * Basically, this vets the flags and vd_next field of each
+ * descriptor and tells you how many are involved.  Since some may
+ * be indirect, this also needs the vmctx (in the pci_vdev
+ * at base->dev) so that it can find indirect descriptors.
+ *
+ * As we process each descriptor, we copy and adjust it (guest to
+ * host address wise, also using the vmtctx) into the given iov[]
+ * array (of the given size).  If the array overflows, we stop
+ * placing values into the array but keep processing descriptors,
+ * up to VQ_MAX_DESCRIPTORS, before giving up and returning -1.
+ * So you, the caller, must not assume that iov[] is as big as the
+ * return value (you can process the same thing twice to allocate
+ * a larger iov array if needed, or supply a zero length to find
+ * out how much space is needed).
+ *
+ * If you want to verify the WRITE flag on each descriptor, pass a
+ * non-NULL "flags" pointer to an array of "uint16_t" of the same size
+ * as n_iov and we'll copy each flags field after unwinding any
+ * indirects.
+ *
+ * If some descriptor(s) are invalid, this prints a diagnostic message
+ * and returns -1.  If no descriptors are ready now it simply returns 0.
+ *
+ * You are assumed to have done a vq_ring_ready() if needed (note
+ * that vq_has_descs() does one).
+ */
+int
+vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
+	    struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int navail;
+
+	if (vq->flags & VQ_PACKED)
+		return vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
+	navail = vq_avail_chains(vq);
+	if (navail <= 0)
+		return navail;
+
+	return _vq_getchain_split(vq, pidx, iov, n_iov, flags);
+}
+
+/*
+ * Take up to nchains available chains at once, as if calling
+ * vq_getchain() for each of them.
+ *
+ * For a split ring, avail->idx is read once for the whole batch, and
+ * the head descriptors of all the chains are prefetched before walking
+ * the first one, so that the cache misses on the guest-owned
+ * descriptor table overlap instead of being taken one chain at a
+ * time.  A packed ring has no index to read, the descriptors to come
+ * are prefetched as each chain is taken.
+ *
+ * Each chain gets its head (or buffer id) in idx and the number of
+ * descriptors in n, which is -1 for an invalid chain.  As with
+ * vq_getchain(), idx of an invalid chain is left to vq->qsize unless
+ * the chain has to be released.
+ *
+ * Returns the number of chains taken, 0 if there is none, or -1 if
+ * avail->idx makes no sense.
+ */
+int
+vq_getchains_bulk(struct virtio_vq_info *vq, struct vq_chain *chains,
+		  int nchains)
+{
+	uint16_t mask, head;
+	int i, navail;
+
+	mask = vq->qsize - 1;
+	if (vq->flags & VQ_PACKED) {
+		for (i = 0; i < nchains; i++) {
+			chains[i].idx = vq->qsize;
+			chains[i].n = vq_getchain_packed(vq, &chains[i].idx,
+				chains[i].iov, chains[i].n_iov, chains[i].flags);
+			if (chains[i].n == 0)
+				break;
+			__builtin_prefetch((const void *)
+				&vq->packed_desc[vq->last_avail & mask]);
+		}
+		return i;
+	}
+
+	navail = vq_avail_chains(vq);
+	if (navail <= 0)
+		return navail;
+	if (navail > nchains)
+		navail = nchains;
+
+	for (i = 0; i < navail; i++) {
+		head = vq->avail->ring[(uint16_t)(vq->last_avail + i) & mask];
+		if (head < vq->qsize)
+			__builtin_prefetch((const void *)&vq->desc[head]);
+	}
+
+	for (i = 0; i < navail; i++) {
+		chains[i].idx = vq->qsize;
+		chains[i].n = _vq_getchain_split(vq, &chains[i].idx,
+			chains[i].iov, chains[i].n_iov, chains[i].flags);
+	}
+
+	return navail;
+}
+
 /*
  * Return the currently-first request chain back to the available queue.
  *
@@ -550,7 +832,10 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
-	vq->last_avail--;
+	if (vq->flags & VQ_PACKED)
+		vq->last_avail = vq->prev_avail;
+	else
+		vq->last_avail--;
 }
 
 /*
@@ -566,6 +851,24 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	uint16_t uidx, mask;
 	volatile struct vring_used *vuh;
 	volatile struct vring_used_elem *vue;
+	volatile struct vring_packed_desc *vd;
+
+	if (vq->flags & VQ_PACKED) {
+		/*
+		 * Write the used descriptor in the next free slot, its
+		 * flags last, and skip the descriptors the buffer took.
+		 */
+		uidx = vq->used_idx;
+		vd = &vq->packed_desc[uidx & (vq->qsize - 1)];
+		vd->id = idx;
+		vd->len = iolen;
+		atomic_signal_fence();
+		vd->flags = ((uidx & vq->qsize) == 0) ?
+			((1 << VRING_PACKED_DESC_F_AVAIL) |
+			 (1 << VRING_PACKED_DESC_F_USED)) : 0;
+		vq->used_idx = uidx + vq->chain_ndesc[idx];
+		return;
+	}
 
 	/*
 	 * Notes:
@@ -587,6 +890,110 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vuh->idx = uidx;
 }
 
+/*
+ * Return nchains chains taken by vq_getchains_bulk() (or vq_getchain())
+ * to the guest at once, each with its own iolen.
+ *
+ * The used elements are all written before a single update of used->idx,
+ * and for a packed ring the first used descriptor is made visible last,
+ * so the guest sees the whole batch at once.  Chains with a negative n
+ * are skipped unless their idx is valid, as for an aborted request.
+ */
+void
+vq_relchains_bulk(struct virtio_vq_info *vq, struct vq_chain *chains,
+		  int nchains)
+{
+	uint16_t uidx, mask, used_flags, first_flags = 0;
+	volatile struct vring_used *vuh;
+	volatile struct vring_used_elem *vue;
+	volatile struct vring_packed_desc *vd, *first = NULL;
+	int i;
+
+	mask = vq->qsize - 1;
+	if (vq->flags & VQ_PACKED) {
+		uidx = vq->used_idx;
+		for (i = 0; i < nchains; i++) {
+			if (chains[i].idx >= vq->qsize)
+				continue;
+			vd = &vq->packed_desc[uidx & mask];
+			vd->id = chains[i].idx;
+			vd->len = chains[i].iolen;
+			used_flags = ((uidx & vq->qsize) == 0) ?
+				((1 << VRING_PACKED_DESC_F_AVAIL) |
+				 (1 << VRING_PACKED_DESC_F_USED)) : 0;
+			if (first == NULL) {
+				first = vd;
+				first_flags = used_flags;
+			} else {
+				vd->flags = used_flags;
+			}
+			uidx += vq->chain_ndesc[chains[i].idx];
+		}
+		if (first != NULL) {
+			atomic_signal_fence();
+			first->flags = first_flags;
+		}
+		vq->used_idx = uidx;
+		return;
+	}
+
+	vuh = vq->used;
+	uidx = vuh->idx;
+	for (i = 0; i < nchains; i++) {
+		if (chains[i].idx >= vq->qsize)
+			continue;
+		vue = &vuh->ring[uidx++ & mask];
+		vue->id = chains[i].idx;
+		vue->len = chains[i].iolen;
+	}
+	/* x86 keeps the stores in order, only the compiler needs a fence */
+	atomic_signal_fence();
+	vuh->idx = uidx;
+}
+
+/*
+ * vq_endchains() for packed virtqueues: the driver event suppression
+ * structure replaces the avail flags and used_event.
+ */
+static void
+vq_endchains_packed(struct virtio_vq_info *vq, int used_all_avail)
+{
+	struct virtio_base *base;
+	uint16_t event_idx, new_idx, old_idx, off_wrap, flags, wrap_mask;
+	int intr;
+
+	base = vq->base;
+	old_idx = vq->save_used;
+	vq->save_used = new_idx = vq->used_idx;
+	flags = vq->driver_event->flags;
+	if (used_all_avail &&
+	    (base->negotiated_caps & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)))
+		intr = 1;
+	else if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		intr = 0;
+	else if (flags == VRING_PACKED_EVENT_FLAG_DESC &&
+	    (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+		/*
+		 * Turn the ring position and wrap counter the guest
+		 * asks an interrupt for into the latest descriptor count
+		 * not after new_idx matching them, then compare as for
+		 * the split ring.
+		 */
+		off_wrap = vq->driver_event->off_wrap;
+		event_idx = off_wrap & (vq->qsize - 1);
+		if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) == 0)
+			event_idx |= vq->qsize;
+		wrap_mask = 2 * vq->qsize - 1;
+		event_idx = new_idx - ((uint16_t)(new_idx - event_idx) & wrap_mask);
+		intr = (uint16_t)(new_idx - event_idx - 1) <
+			(uint16_t)(new_idx - old_idx);
+	} else {
+		intr = new_idx != old_idx;
+	}
+	if (intr)
+		vq_interrupt(base, vq);
+}
+
 /*
  * Driver has finished processing "available" chains and calling
  * vq_relchain on each one.  If driver used all the available
@@ -622,6 +1029,11 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	atomic_thread_fence();
 
 	base = vq->base;
+	if (vq->flags & VQ_PACKED) {
+		vq_endchains_packed(vq, used_all_avail);
+		return;
+	}
+
 	old_idx = vq->save_used;
 	vq->save_used = new_idx = vq->used->idx;
 	if (used_all_avail &&
@@ -663,8 +1075,67 @@ void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *v
 	/* we should never unmask notification in polling mode */
 	if (virtio_poll_enabled && backend_type == BACKEND_VBSU && polling_in_progress == 1)
 		return;
+	/* nor while the poller checks the queue */
+	if (vq->flags & VQ_POLLING)
+		return;
 
-	vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vq->flags & VQ_PACKED) {
+		if (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+			/* notify on the next descriptor we'll look at */
+			vq->device_event->off_wrap =
+				(vq->last_avail & (vq->qsize - 1)) |
+				(((vq->last_avail & vq->qsize) == 0) <<
+				 VRING_PACKED_EVENT_F_WRAP_CTR);
+			atomic_signal_fence();
+			vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+		} else
+			vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	} else {
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+		if (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))
+			VQ_AVAIL_EVENT_IDX(vq) = vq->last_avail;
+	}
+}
+
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * Ask the guest not to notify the device on this virtqueue.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return None
+ */
+void vq_set_used_ring_flags(struct virtio_vq_info *vq)
+{
+	if (vq->flags & VQ_PACKED)
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	else
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+void
+virtio_print_vq_stats(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		pr_info("%s: vq %d: %lu kicks, %lu interrupts\n",
+			base->vops->name, i, vq->nr_kicks, vq->nr_intrs);
+		if (vq->nr_kicked + vq->nr_polled)
+			pr_info("%s: vq %d: %lu requests kicked, %lu polled "
+				"(%lu%%)\n", base->vops->name, i,
+				vq->nr_kicked, vq->nr_polled,
+				vq->nr_polled * 100 /
+				(vq->nr_kicked + vq->nr_polled));
+	}
+	if (base->poll_ns)
+		pr_info("%s: %lu.%03lums of CPU polling, budget exhausted "
+			"%lu times\n", base->vops->name,
+			base->poll_ns / 1000000, base->poll_ns / 1000 % 1000,
+			base->nr_poll_exhausted);
 }
 
 struct config_reg {
@@ -746,6 +1217,26 @@ virtio_find_modern_cr(int offset) {
 		offset);
 }
 
+/*
+ * A read clears the ISR flags. The queues with a mutex of their own set
+ * them without the device mutex: the line is dropped even if none was
+ * set, and raised again if one was set meanwhile.
+ */
+static uint8_t
+virtio_isr_read(struct virtio_base *base)
+{
+	uint8_t value;
+
+	value = __atomic_exchange_n(&base->isr, 0, __ATOMIC_SEQ_CST);
+	if (base->dev->lintr.pin > 0) {
+		pci_lintr_deassert(base->dev);
+		if (__atomic_load_n(&base->isr, __ATOMIC_SEQ_CST))
+			pci_lintr_assert(base->dev);
+	}
+
+	return value;
+}
+
 /*
  * Handle pci config space reads.
  * If it's to the MSI-X info, do that.
@@ -836,10 +1327,7 @@ bad:
 		value = base->status;
 		break;
 	case VIRTIO_PCI_ISR:
-		value = base->isr;
-		base->isr = 0;		/* a read clears this flag */
-		if (value)
-			pci_lintr_deassert(dev);
+		value = virtio_isr_read(base);
 		break;
 	case VIRTIO_MSI_CONFIG_VECTOR:
 		value = base->msix_cfg_idx;
@@ -856,6 +1344,39 @@ done:
 	return value;
 }
 
+/*
+ * Notify a queue kicked by the guest, under the mutex of the queue if it
+ * has one, or else the mutex of the device.
+ */
+static void
+virtio_queue_notify(struct virtio_base *base, uint64_t idx)
+{
+	struct virtio_vq_info *vq;
+	struct virtio_ops *vops;
+	const char *name;
+
+	vops = base->vops;
+	name = vops->name;
+
+	if (idx >= vops->nvq) {
+		pr_err("%s: queue %lu notify out of range\r\n", name, idx);
+		return;
+	}
+
+	vq = &base->queues[idx];
+	VQ_LOCK(vq);
+	vq->nr_kicks++;
+	virtio_poll_kick(base, vq);
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (vops->qnotify)
+		(*vops->qnotify)(DEV_STRUCT(base), vq);
+	else
+		pr_err("%s: qnotify queue %lu: missing vq/vops notify\r\n",
+			name, idx);
+	VQ_UNLOCK(vq);
+}
+
 /*
  * Handle pci config space writes.
  * If it's to the MSI-X info, do that.
@@ -876,6 +1397,12 @@ virtio_pci_legacy_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 	int error;
 
 
+	/* the queue notifies take the mutex of the queue, if it has one */
+	if (offset == VIRTIO_PCI_QUEUE_NOTIFY && size == 2) {
+		virtio_queue_notify(base, value);
+		return;
+	}
+
 	if (base->mtx)
 		pthread_mutex_lock(base->mtx);
 
@@ -943,21 +1470,6 @@ bad:
 		 */
 		base->curq = value;
 		break;
-	case VIRTIO_PCI_QUEUE_NOTIFY:
-		if (value >= vops->nvq) {
-			pr_err("%s: queue %d notify out of range\r\n",
-				name, (int)value);
-			goto done;
-		}
-		vq = &base->queues[value];
-		if (vq->notify)
-			(*vq->notify)(DEV_STRUCT(base), vq);
-		else if (vops->qnotify)
-			(*vops->qnotify)(DEV_STRUCT(base), vq);
-		else
-			pr_err("%s: qnotify queue %d: missing vq/vops notify\r\n",
-				name, (int)value);
-		break;
 	case VIRTIO_PCI_STATUS:
 		base->status = value;
 		if (vops->set_status)
@@ -1375,7 +1887,10 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 			break;
 		if (base->driver_feature_select < 2) {
 			value &= 0xffffffff;
-			base->negotiated_caps =
+			/* the two halves are written separately, keep the other */
+			base->negotiated_caps &= ~(0xffffffffUL <<
+				(base->driver_feature_select * 32));
+			base->negotiated_caps |=
 				(value << (base->driver_feature_select * 32))
 				& base->device_caps;
 			if (vops->apply_features)
@@ -1468,15 +1983,7 @@ bad_qindex:
 static uint32_t
 virtio_isr_cfg_read(struct pci_vdev *dev, uint64_t offset, int size)
 {
-	struct virtio_base *base = dev->arg;
-	uint32_t value = 0;
-
-	value = base->isr;
-	base->isr = 0;		/* a read clears this flag */
-	if (value)
-		pci_lintr_deassert(dev);
-
-	return value;
+	return virtio_isr_read(dev->arg);
 }
 
 static uint32_t
@@ -1544,29 +2051,7 @@ static void
 virtio_notify_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 			uint64_t value)
 {
-	struct virtio_base *base = dev->arg;
-	struct virtio_vq_info *vq;
-	struct virtio_ops *vops;
-	const char *name;
-	uint64_t idx;
-
-	idx = offset / VIRTIO_MODERN_NOTIFY_OFF_MULT;
-	vops = base->vops;
-	name = vops->name;
-
-	if (idx >= vops->nvq) {
-		pr_err("%s: queue %lu notify out of range\r\n", name, idx);
-		return;
-	}
-
-	vq = &base->queues[idx];
-	if (vq->notify)
-		(*vq->notify)(DEV_STRUCT(base), vq);
-	else if (vops->qnotify)
-		(*vops->qnotify)(DEV_STRUCT(base), vq);
-	else
-		pr_err("%s: qnotify queue %lu: missing vq/vops notify\r\n",
-			name, idx);
+	virtio_queue_notify(dev->arg, offset / VIRTIO_MODERN_NOTIFY_OFF_MULT);
 }
 
 static uint32_t
@@ -1650,6 +2135,13 @@ virtio_pci_modern_mmio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		return;
 	}
 
+	/* the queue notifies take the mutex of the queue, if it has one */
+	if (capid == VIRTIO_PCI_CAP_NOTIFY_CFG) {
+		offset -= VIRTIO_CAP_NOTIFY_OFFSET;
+		virtio_notify_cfg_write(dev, offset, size, value);
+		return;
+	}
+
 	if (base->mtx)
 		pthread_mutex_lock(base->mtx);
 
@@ -1662,10 +2154,6 @@ virtio_pci_modern_mmio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		offset -= VIRTIO_CAP_DEVICE_OFFSET;
 		virtio_device_cfg_write(dev, offset, size, value);
 		break;
-	case VIRTIO_PCI_CAP_NOTIFY_CFG:
-		offset -= VIRTIO_CAP_NOTIFY_OFFSET;
-		virtio_notify_cfg_write(dev, offset, size, value);
-		break;
 	default: /* guest driver should not write to ISR region */
 		pr_err("%s: write to [%d:0x%lx] size %d not supported\r\n",
 			name, baridx, offset, size);
@@ -1689,41 +2177,14 @@ virtio_pci_modern_pio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 			    uint64_t value)
 {
 	struct virtio_base *base = dev->arg;
-	struct virtio_vq_info *vq;
-	struct virtio_ops *vops;
-	const char *name;
-	uint64_t idx;
-
-
-	vops = base->vops;
-	name = vops->name;
-	idx = value;
 
 	if (size != 1 && size != 2 && size != 4) {
 		pr_err("%s: write to [%d:0x%lx] bad size %d\r\n",
-			name, baridx, offset, size);
+			base->vops->name, baridx, offset, size);
 		return;
 	}
 
-	if (idx >= vops->nvq) {
-		pr_err("%s: queue %lu notify out of range\r\n", name, idx);
-		return;
-	}
-
-	if (base->mtx)
-		pthread_mutex_lock(base->mtx);
-
-	vq = &base->queues[idx];
-	if (vq->notify)
-		(*vq->notify)(DEV_STRUCT(base), vq);
-	else if (vops->qnotify)
-		(*vops->qnotify)(DEV_STRUCT(base), vq);
-	else
-		pr_err("%s: qnotify queue %lu: missing vq/vops notify\r\n",
-			name, idx);
-
-	if (base->mtx)
-		pthread_mutex_unlock(base->mtx);
+	virtio_queue_notify(base, value);
 }
 
 /**
@@ -1835,6 +2296,10 @@ acrn_parse_virtio_poll_interval(const char *optarg)
 {
 	char *ptr;
 
+	/* "adaptive[:budget]", polled by the devices which support it */
+	if (!strncmp(optarg, "adaptive", 8))
+		return virtio_poll_parse_default(optarg + 8);
+
 	virtio_poll_interval = strtoul(optarg, &ptr, 0);
 
 	/* poll interval is limited from 1us to 10ms */
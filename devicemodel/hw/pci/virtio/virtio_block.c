@@ -39,8 +39,12 @@
 #include "virtio.h"
 #include "block_if.h"
 #include "monitor.h"
+#include "metrics.h"
 
-#define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_RINGSZ	64	/* default size of a queue */
+#define VIRTIO_BLK_MAX_RINGSZ	256
+#define VIRTIO_BLK_MAXQ		16
+#define VIRTIO_BLK_BATCH	8	/* chains taken at once */
 #define VIRTIO_BLK_MAX_OPTS_LEN	256
 
 #define VIRTIO_BLK_S_OK	0
@@ -59,6 +63,8 @@
 /* Device can toggle its cache between writeback and writethrough modes */
 #define	VIRTIO_BLK_F_CONFIG_WCE	(1 << 11)
 
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple queues */
+
 #define	VIRTIO_BLK_F_DISCARD	(1 << 13)
 
 /*
@@ -68,7 +74,8 @@
 	(VIRTIO_BLK_F_SEG_MAX |						    \
 	VIRTIO_BLK_F_BLK_SIZE |						    \
 	VIRTIO_BLK_F_TOPOLOGY |						    \
-	(1 << VIRTIO_RING_F_INDIRECT_DESC))	/* indirect descriptors */
+	(1 << VIRTIO_RING_F_INDIRECT_DESC) |	/* indirect descriptors */	    \
+	(1 << VIRTIO_RING_F_EVENT_IDX))	/* notification suppression */
 
 /*
  * Writeback cache bits
@@ -98,8 +105,8 @@ struct virtio_blk_config {
 	} topology;
 	uint8_t	writeback;
 	uint8_t unused;
-	/* Reserve for num_queues when VIRTIO_BLK_F_MQ is support*/
-	uint16_t reserve;
+	/* The number of queues, valid with VIRTIO_BLK_F_MQ */
+	uint16_t num_queues;
 	/* The maximum discard sectors (in 512-byte sectors) for one segment */
 	uint32_t max_discard_sectors;
 	/* The maximum number of discard segments */
@@ -138,13 +145,41 @@ static bool register_vm_monitor_blkrescan = false;
 
 static struct monitor_vm_ops virtio_blk_rescan_ops = {
 	.rescan	= vm_monitor_blkrescan,
+	.throttle = vm_monitor_blkthrottle,
 };
 
+/*
+ * A request, and the descriptors of its chain: the header, the data which
+ * is req.iov, and the status. The chain is walked right into them, and
+ * the data handed to block_if as it is.
+ */
 struct virtio_blk_ioreq {
+	struct iovec iov[BLOCKIF_IOV_MAX + 2];
+	uint16_t flags[BLOCKIF_IOV_MAX + 2];
 	struct blockif_req req;
 	struct virtio_blk *blk;
+	struct virtio_vq_info *vq;
 	uint8_t *status;
 	uint16_t idx;
+	uint64_t t;	/* ns, when the stage it's in started */
+} __attribute__((aligned(64)));
+
+/*
+ * Each queue has a block context of its own, its requests are submitted
+ * and completed by it, on the Service VM CPU of the queue if one is set.
+ * Its requests are taken from a pool of one per descriptor. The queue is
+ * notified, and its requests completed, under a mutex of its own, which
+ * also protects the pool and the chains being taken off the ring.
+ */
+struct virtio_blk_queue {
+	pthread_mutex_t mtx;
+	struct blockif_ctxt *bc;
+	struct virtio_blk_ioreq *ios;
+	struct virtio_blk_ioreq **free_ios;
+	int nfree;
+	int cpu;
+	struct vq_chain chains[VIRTIO_BLK_BATCH];
+	struct virtio_blk_ioreq *chain_ios[VIRTIO_BLK_BATCH];
 };
 
 /*
@@ -153,13 +188,19 @@ struct virtio_blk_ioreq {
 struct virtio_blk {
 	struct virtio_base base;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	struct virtio_ops ops;		/* virtio_blk_ops with our nvq */
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAXQ];
+	struct virtio_blk_queue queues[VIRTIO_BLK_MAXQ];
+	int nq;
+	int qsize;
 	struct virtio_blk_config cfg;
 	bool dummy_bctxt; /* Used in blockrescan. Indicate if the bctxt can be used */
-	struct blockif_ctxt *bc;
+	struct blockif_ctxt *bc;	/* the context of queue 0 */
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 	uint8_t original_wce;
+	struct metrics_dev *metrics;
+	int poll;			/* CPU budget of the polling, in % */
+	bool packed;			/* offer packed virtqueues, virtio 1.0 */
 };
 
 static void virtio_blk_reset(void *);
@@ -169,7 +210,7 @@ static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* 1 virtqueue, unless mq is set */
 	sizeof(struct virtio_blk_config), /* config reg size */
 	virtio_blk_reset,	/* reset */
 	virtio_blk_notify,	/* device-wide qnotify */
@@ -179,16 +220,60 @@ static struct virtio_ops virtio_blk_ops = {
 	NULL,			/* called on guest set status */
 };
 
+static void
+virtio_blk_set_wce(struct virtio_blk *blk, uint8_t wce)
+{
+	int i;
+
+	for (i = 0; i < blk->nq; i++)
+		blockif_set_wce(blk->queues[i].bc, wce);
+}
+
 static void
 virtio_blk_reset(void *vdev)
 {
 	struct virtio_blk *blk = vdev;
+	int i;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	/* no queue is notified, nor completes a request, meanwhile */
+	for (i = 0; i < blk->nq; i++)
+		pthread_mutex_lock(&blk->queues[i].mtx);
 	virtio_reset_dev(&blk->base);
+	for (i = blk->nq - 1; i >= 0; i--)
+		pthread_mutex_unlock(&blk->queues[i].mtx);
 	/* Reset virtio-blk device only on valid bctxt*/
 	if (!blk->dummy_bctxt)
-		blockif_set_wce(blk->bc, blk->original_wce);
+		virtio_blk_set_wce(blk, blk->original_wce);
+}
+
+/*
+ * Take up to VIRTIO_BLK_BATCH requests from the pool, and have the chains
+ * walked into them.
+ */
+static int
+virtio_blk_get_ios(struct virtio_blk_queue *q)
+{
+	struct virtio_blk_ioreq *io;
+	int i;
+
+	for (i = 0; i < VIRTIO_BLK_BATCH && q->nfree > 0; i++) {
+		io = q->free_ios[--q->nfree];
+		q->chain_ios[i] = io;
+		q->chains[i].iov = io->iov;
+		q->chains[i].flags = io->flags;
+		q->chains[i].n_iov = BLOCKIF_IOV_MAX + 2;
+	}
+
+	return i;
+}
+
+static inline void
+virtio_blk_put_io(struct virtio_blk *blk, struct virtio_blk_ioreq *io)
+{
+	struct virtio_blk_queue *q = &blk->queues[io->vq - blk->vqs];
+
+	q->free_ios[q->nfree++] = io;
 }
 
 static void
@@ -196,7 +281,11 @@ virtio_blk_done(struct blockif_req *br, int err)
 {
 	struct virtio_blk_ioreq *io = br->param;
 	struct virtio_blk *blk = io->blk;
+	int qi = io->vq - blk->vqs;
+	struct virtio_blk_queue *q = &blk->queues[qi];
+	uint64_t t;
 
+	t = metrics_stamp(blk->metrics, qi, METRICS_BACKEND, io->t);
 	if (err)
 		DPRINTF(("virtio_blk: done with error = %d\n\r", err));
 
@@ -212,35 +301,40 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, !vq_has_descs(&blk->vq));
-	pthread_mutex_unlock(&blk->mtx);
+	pthread_mutex_lock(&q->mtx);
+	vq_relchain(io->vq, io->idx, 1);
+	vq_endchains(io->vq, !vq_has_descs(io->vq));
+	virtio_blk_put_io(blk, io);
+	pthread_mutex_unlock(&q->mtx);
+	metrics_stamp(blk->metrics, qi, METRICS_COMPLETE, t);
 }
 
 static void
-virtio_blk_abort(struct virtio_vq_info *vq, uint16_t idx)
+virtio_blk_abort(struct virtio_blk *blk, struct virtio_blk_ioreq *io)
 {
-	if (idx < vq->qsize) {
-		vq_relchain(vq, idx, 1);
-		vq_endchains(vq, 0);
+	if (io->idx < io->vq->qsize) {
+		vq_relchain(io->vq, io->idx, 1);
+		vq_endchains(io->vq, 0);
 	}
+	virtio_blk_put_io(blk, io);
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_blk_queue *q,
+		struct virtio_vq_info *vq, struct vq_chain *chain,
+		struct virtio_blk_ioreq *io, uint64_t t)
 {
 	struct virtio_blk_hdr *vbh;
-	struct virtio_blk_ioreq *io;
 	int i, n;
 	int err;
 	ssize_t iolen;
 	int writeop, type;
-	struct iovec iov[BLOCKIF_IOV_MAX + 2];
-	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
+	struct iovec *iov = chain->iov;
+	uint16_t idx = chain->idx, *flags = chain->flags;
 
-	idx = vq->qsize;
-	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
+	n = chain->n;
+	io->idx = idx;
+	io->t = t;
 
 	/*
 	 * The first descriptor will be the read-only fixed header,
@@ -252,14 +346,13 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 */
 	if (n < 2 || n > BLOCKIF_IOV_MAX + 2) {
 		WPRINTF(("%s: vq_getchain failed\n", __func__));
-		virtio_blk_abort(vq, idx);
+		virtio_blk_abort(blk, io);
 		return;
 	}
 
-	io = &blk->ios[idx];
 	if ((flags[0] & VRING_DESC_F_WRITE) != 0) {
 		WPRINTF(("%s: the type for hdr should not be VRING_DESC_F_WRITE\n", __func__));
-		virtio_blk_abort(vq, idx);
+		virtio_blk_abort(blk, io);
 		return;
 	}
 	if (iov[0].iov_len != sizeof(struct virtio_blk_hdr)) {
@@ -267,17 +360,17 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 						__func__,
 						iov[0].iov_len,
 						sizeof(struct virtio_blk_hdr)));
-		virtio_blk_abort(vq, idx);
+		virtio_blk_abort(blk, io);
 		return;
 	}
 	vbh = iov[0].iov_base;
-	memcpy(&io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
+	/* the data is in io->req.iov already */
 	io->req.iovcnt = n - 2;
 	io->req.offset = vbh->sector * DEV_BSIZE;
 	io->status = iov[--n].iov_base;
 	if (iov[n].iov_len != 1 || ((flags[n] & VRING_DESC_F_WRITE) == 0)) {
 		WPRINTF(("%s: status iov is invalid!\n", __func__));
-		virtio_blk_abort(vq, idx);
+		virtio_blk_abort(blk, io);
 		return;
 	}
 
@@ -296,7 +389,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		return;
 	}
 
-	if (writeop && blockif_is_ro(blk->bc)) {
+	if (writeop && blockif_is_ro(q->bc)) {
 		WPRINTF(("Cannot write to a read-only storage!\n"));
 		virtio_blk_done(&io->req, EROFS);
 		return;
@@ -323,6 +416,8 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		 writeop ? "write/discard" : "read/ident", iolen, i - 1,
 		 io->req.offset));
 
+	io->t = metrics_stamp(blk->metrics, vq - blk->vqs, METRICS_SUBMIT,
+		io->t);
 	switch (type) {
 	case VBH_OP_READ:
 	case VBH_OP_WRITE:
@@ -347,14 +442,14 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		}
 
 		err = ((type == VBH_OP_READ) ? blockif_read : blockif_write)
-				(blk->bc, &io->req);
+				(q->bc, &io->req);
 		break;
 	case VBH_OP_DISCARD:
-		err = blockif_discard(blk->bc, &io->req);
+		err = blockif_discard(q->bc, &io->req);
 		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
-		err = blockif_flush(blk->bc, &io->req);
+		err = blockif_flush(q->bc, &io->req);
 		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
@@ -376,9 +471,42 @@ static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	struct virtio_blk_queue *q = &blk->queues[vq - blk->vqs];
+	struct blockif_ctxt *bc = blk->dummy_bctxt ? NULL : q->bc;
+	uint64_t t;
+	int i, n, nio;
+
+	/* the requests of a batch are submitted at once */
+	if (bc)
+		blockif_plug(bc);
 
-	while (vq_has_descs(vq))
-		virtio_blk_proc(blk, vq);
+	/*
+	 * No more kicks are needed while the queue is drained, ask for
+	 * them again once it's empty, and check for the requests which
+	 * came in before the guest saw that.
+	 */
+	do {
+		vq_set_used_ring_flags(vq);
+		do {
+			/* there are as many requests as descriptors */
+			nio = virtio_blk_get_ios(q);
+			n = vq_getchains_bulk(vq, q->chains, nio);
+			t = metrics_now();
+			for (i = 0; i < n; i++)
+				virtio_blk_proc(blk, q, vq, &q->chains[i],
+					q->chain_ios[i], t);
+			for (i = MAX(n, 0); i < nio; i++)
+				virtio_blk_put_io(blk, q->chain_ios[i]);
+		} while (n > 0 && vq_has_descs(vq));
+		if (n < 0)
+			break;
+		vq_clear_used_ring_flags(&blk->base, vq);
+		/* memory barrier */
+		mb();
+	} while (vq_has_descs(vq));
+
+	if (bc)
+		blockif_unplug(bc);
 }
 
 static uint64_t
@@ -396,6 +524,12 @@ virtio_blk_get_caps(struct virtio_blk *blk, bool wb)
 	if (blockif_is_ro(blk->bc))
 		caps |= VIRTIO_BLK_F_RO;
 
+	if (blk->nq > 1)
+		caps |= VIRTIO_BLK_F_MQ;
+
+	if (blk->packed)
+		caps |= VIRTIO_PACKED_HOSTCAPS;
+
 	return caps;
 }
 
@@ -423,6 +557,7 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	    (sto != 0) ? ((sts - sto) / sectsz) : 0;
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.writeback = blockif_get_wce(blk->bc);
+	blk->cfg.num_queues = blk->nq;
 	blk->original_wce = blk->cfg.writeback; /* save for reset */
 	if (blockif_candiscard(blk->bc)) {
 		blk->cfg.max_discard_sectors = blockif_max_discard_sectors(blk->bc);
@@ -432,34 +567,194 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	blk->base.device_caps =
 		virtio_blk_get_caps(blk, !!blk->cfg.writeback);
 }
+/*
+ * Parse the Service VM CPUs the queues run on, queue i runs on the
+ * (i % n)th of the n CPUs in the list.
+ */
 static int
-virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+virtio_blk_parse_cpus(struct virtio_blk *blk, char *cpus)
+{
+	char *cpu, *end;
+	int i, n = 0;
+	int list[VIRTIO_BLK_MAXQ];
+
+	while ((cpu = strsep(&cpus, ":")) != NULL) {
+		if (n == VIRTIO_BLK_MAXQ || dm_strtoi(cpu, &end, 10, &list[n]) ||
+		    *end != '\0' || list[n] < 0 || list[n] >= CPU_SETSIZE) {
+			pr_err("virtio_blk: invalid cpus option %s\n", cpu);
+			return -1;
+		}
+		n++;
+	}
+
+	for (i = 0; i < VIRTIO_BLK_MAXQ; i++)
+		blk->queues[i].cpu = list[i % n];
+	return 0;
+}
+
+/*
+ * Take the virtio-blk options, mq, qsize, cpus, poll and packed, out of
+ * opts. The rest is returned in bopts, for blockif_open().
+ */
+static int
+virtio_blk_parse_opts(struct virtio_blk *blk, const char *opts, char **bopts)
+{
+	char *nopt, *xopts, *cp, *end;
+	int len = 0, err = 0;
+
+	nopt = xopts = strdup(opts);
+	*bopts = calloc(1, strlen(opts) + 1);
+	if (!nopt || !*bopts) {
+		free(nopt);
+		free(*bopts);
+		return -1;
+	}
+
+	while (!err && (cp = strsep(&xopts, ",")) != NULL) {
+		if (cp != nopt && !strncmp(cp, "mq=", 3)) {
+			if (dm_strtoi(cp + 3, &end, 10, &blk->nq) ||
+			    *end != '\0' || blk->nq < 1 ||
+			    blk->nq > VIRTIO_BLK_MAXQ) {
+				pr_err("virtio_blk: invalid %s, 1 to %d "
+					"queues\n", cp, VIRTIO_BLK_MAXQ);
+				err = -1;
+			}
+		} else if (cp != nopt && !strncmp(cp, "qsize=", 6)) {
+			if (dm_strtoi(cp + 6, &end, 10, &blk->qsize) ||
+			    *end != '\0' || blk->qsize < 2 ||
+			    blk->qsize > VIRTIO_BLK_MAX_RINGSZ ||
+			    !powerof2(blk->qsize)) {
+				pr_err("virtio_blk: invalid %s, a power of 2 "
+					"up to %d\n", cp, VIRTIO_BLK_MAX_RINGSZ);
+				err = -1;
+			}
+		} else if (cp != nopt && !strncmp(cp, "cpus=", 5))
+			err = virtio_blk_parse_cpus(blk, cp + 5);
+		else if (cp != nopt && !strncmp(cp, "poll=", 5)) {
+			if (dm_strtoi(cp + 5, &end, 10, &blk->poll) ||
+			    *end != '\0' || blk->poll < 0 || blk->poll > 100) {
+				pr_err("virtio_blk: invalid %s, 0 to 100 "
+					"percent of a CPU\n", cp);
+				err = -1;
+			}
+		} else if (cp != nopt && !strcmp(cp, "packed"))
+			blk->packed = true;
+		else
+			len += sprintf(*bopts + len, "%s%s",
+				(cp == nopt) ? "" : ",", cp);
+	}
+
+	free(nopt);
+	if (err) {
+		free(*bopts);
+		*bopts = NULL;
+	}
+	return err;
+}
+
+static void
+virtio_blk_close(struct virtio_blk *blk)
+{
+	int i;
+
+	/* the clones first, queue 0 holds the sub file lock */
+	for (i = blk->nq - 1; i >= 0; i--) {
+		if (blk->queues[i].bc)
+			blockif_close(blk->queues[i].bc);
+		blk->queues[i].bc = NULL;
+	}
+	blk->bc = NULL;
+}
+
+/*
+ * Open the backing file for queue 0, and clone its context for the other
+ * queues, each on its CPU.
+ */
+static int
+virtio_blk_open(struct virtio_blk *blk, const char *opts,
+		struct pci_vdev *dev)
 {
-	bool dummy_bctxt;
 	char bident[16];
+	char *bopts;
 	struct blockif_ctxt *bctxt;
+	int i, rc;
+
+	if (snprintf(bident, sizeof(bident), "%d:%d",
+				dev->slot, dev->func) >= sizeof(bident)) {
+		WPRINTF(("bident error, please check slot and func\n"));
+	}
+
+	if (blk->queues[0].cpu >= 0)
+		rc = asprintf(&bopts, "%s,cpu=%d", opts, blk->queues[0].cpu);
+	else
+		rc = asprintf(&bopts, "%s", opts);
+	if (rc < 0)
+		return -1;
+	bctxt = blockif_open(bopts, bident);
+	free(bopts);
+	if (bctxt == NULL)
+		return -1;
+	blk->queues[0].bc = bctxt;
+
+	for (i = 1; i < blk->nq; i++) {
+		snprintf(bident, sizeof(bident), "%d:%d.%d",
+			 dev->slot, dev->func, i);
+		blk->queues[i].bc = blockif_clone(bctxt, bident,
+			blk->queues[i].cpu);
+		if (blk->queues[i].bc == NULL) {
+			virtio_blk_close(blk);
+			return -1;
+		}
+	}
+
+	blk->bc = bctxt;
+	return 0;
+}
+
+static void
+virtio_blk_free(struct virtio_blk *blk)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_BLK_MAXQ; i++) {
+		free(blk->queues[i].ios);
+		free(blk->queues[i].free_ios);
+	}
+	metrics_unregister(blk->metrics);
+	free(blk);
+}
+
+static int
+virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	char *bopts, name[32];
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct virtio_blk *blk;
-	int i;
+	struct virtio_blk_queue *q;
+	int i, j;
 	pthread_mutexattr_t attr;
 	int rc;
 
-	bctxt = NULL;
-	/* Assume the bctxt is valid, until identified otherwise */
-	dummy_bctxt = false;
-
 	if (opts == NULL) {
 		pr_err("virtio_blk: backing device required\n");
 		return -1;
 	}
 
-	/*
-	 * The supplied backing file has to exist
-	 */
-	if (snprintf(bident, sizeof(bident), "%d:%d",
-				dev->slot, dev->func) >= sizeof(bident)) {
-		WPRINTF(("bident error, please check slot and func\n"));
+	blk = calloc(1, sizeof(struct virtio_blk));
+	if (!blk) {
+		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		return -1;
+	}
+
+	blk->nq = 1;
+	blk->qsize = VIRTIO_BLK_RINGSZ;
+	blk->poll = -1;
+	for (i = 0; i < VIRTIO_BLK_MAXQ; i++)
+		blk->queues[i].cpu = -1;
+	if (virtio_blk_parse_opts(blk, opts, &bopts)) {
+		free(blk);
+		return -1;
 	}
 
 	/*
@@ -467,34 +762,47 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	 * file. Skip blockif_open and set dummy bctxt in virtio_blk struct
 	 */
 	if (strstr(opts, "nodisk") != NULL) {
-		dummy_bctxt = true;
-	} else {
-		bctxt = blockif_open(opts, bident);
-		if (bctxt == NULL) {
-			pr_err("Could not open backing file");
+		/* Update virtio-blk device struct of dummy ctxt*/
+		blk->dummy_bctxt = true;
+	} else if (virtio_blk_open(blk, bopts, dev)) {
+		/* The supplied backing file has to exist */
+		pr_err("Could not open backing file");
+		free(bopts);
+		free(blk);
+		return -1;
+	}
+	free(bopts);
+
+	for (i = 0; i < blk->nq; i++) {
+		q = &blk->queues[i];
+		if (posix_memalign((void **)&q->ios, 64,
+				blk->qsize * sizeof(struct virtio_blk_ioreq)))
+			q->ios = NULL;
+		q->free_ios = calloc(blk->qsize,
+			sizeof(struct virtio_blk_ioreq *));
+		if (!q->ios || !q->free_ios) {
+			WPRINTF(("virtio_blk: calloc returns NULL\n"));
+			virtio_blk_close(blk);
+			virtio_blk_free(blk);
 			return -1;
 		}
-	}
+		memset(q->ios, 0, blk->qsize * sizeof(struct virtio_blk_ioreq));
 
+		for (j = 0; j < blk->qsize; j++) {
+			struct virtio_blk_ioreq *io = &q->ios[j];
 
-	blk = calloc(1, sizeof(struct virtio_blk));
-	if (!blk) {
-		WPRINTF(("virtio_blk: calloc returns NULL\n"));
-		return -1;
+			io->req.iov = &io->iov[1];
+			io->req.callback = virtio_blk_done;
+			io->req.param = io;
+			io->blk = blk;
+			io->vq = &blk->vqs[i];
+			q->free_ios[j] = io;
+		}
+		q->nfree = blk->qsize;
 	}
 
-	blk->bc = bctxt;
-	/* Update virtio-blk device struct of dummy ctxt*/
-	blk->dummy_bctxt = dummy_bctxt;
-
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
-		struct virtio_blk_ioreq *io = &blk->ios[i];
-
-		io->req.callback = virtio_blk_done;
-		io->req.param = io;
-		io->blk = blk;
-		io->idx = i;
-	}
+	snprintf(name, sizeof(name), "virtio-blk %d:%d", dev->slot, dev->func);
+	blk->metrics = metrics_register(name, blk->nq, NULL);
 
 	/* init mutex attribute properly to avoid deadlock */
 	rc = pthread_mutexattr_init(&attr);
@@ -509,13 +817,24 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (rc)
 		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
 					"error %d!\n", rc));
+	for (i = 0; i < blk->nq; i++) {
+		rc = pthread_mutex_init(&blk->queues[i].mtx, &attr);
+		if (rc)
+			DPRINTF(("virtio_blk: pthread_mutex_init failed with "
+						"error %d!\n", rc));
+	}
 
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq, BACKEND_VBSU);
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = blk->nq;
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs, BACKEND_VBSU);
 	blk->base.mtx = &blk->mtx;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	for (i = 0; i < blk->nq; i++) {
+		blk->vqs[i].qsize = blk->qsize;
+		blk->vqs[i].mtx = &blk->queues[i].mtx;
+	}
+	/* blk->vqs[i].notify = we have no per-queue notify */
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -551,12 +870,22 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (virtio_interrupt_init(&blk->base, virtio_uses_msix())) {
 		/* call close only for valid bctxt */
 		if (!blk->dummy_bctxt)
-			blockif_close(blk->bc);
-		free(blk);
+			virtio_blk_close(blk);
+		virtio_blk_free(blk);
 		return -1;
 	}
 	virtio_set_io_bar(&blk->base, 0);
 
+	/* add the modern bars for the virtio 1.0 drivers of packed rings */
+	if (blk->packed && virtio_set_modern_bar(&blk->base, true)) {
+		if (!blk->dummy_bctxt)
+			virtio_blk_close(blk);
+		virtio_blk_free(blk);
+		return -1;
+	}
+
+	virtio_poll_init(&blk->base, blk->poll);
+
 	/*
 	 * Register ops for virtio-blk Rescan
 	 */
@@ -574,20 +903,21 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 static void
 virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk;
 
 	if (dev->arg) {
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
+		virtio_poll_deinit(&blk->base);
+		virtio_print_vq_stats(&blk->base);
 		/* De-init virtio-blk device only on valid bctxt*/
 		if (!blk->dummy_bctxt) {
-			bctxt = blk->bc;
-			if (blockif_flush_all(bctxt))
+			/* the queues share the backing file */
+			if (blockif_flush_all(blk->bc))
 				WPRINTF(("vrito_blk: Failed to flush before close\n"));
-			blockif_close(bctxt);
+			virtio_blk_close(blk);
 		}
-		free(blk);
+		virtio_blk_free(blk);
 	}
 }
 
@@ -605,7 +935,7 @@ virtio_blk_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 		memcpy(ptr, &value, size);
 		/* Update write cache enable only on valid bctxt*/
 		if (!blk->dummy_bctxt)
-			blockif_set_wce(blk->bc, blkcfg->writeback);
+			virtio_blk_set_wce(blk, blkcfg->writeback);
 		if (blkcfg->writeback)
 			blk->base.device_caps |= VIRTIO_BLK_F_FLUSH;
 		else
@@ -649,8 +979,6 @@ int
 virtio_blk_rescan(struct vmctx *ctx, struct pci_vdev *dev, char *newpath)
 {
 	int error = -1;
-	char bident[16];
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk = (struct virtio_blk *) dev->arg;
 
 	if (!blk) {
@@ -669,12 +997,6 @@ virtio_blk_rescan(struct vmctx *ctx, struct pci_vdev *dev, char *newpath)
 		goto end;
 	}
 
-	if (snprintf(bident, sizeof(bident), "%d:%d",
-				dev->slot, dev->func) >= sizeof(bident)) {
-		pr_err("bident error, please check slot and func\n");
-		goto end;
-	}
-
 	/* If bctxt is valid, then return error. Current support is only when
 	 * user has passed empty file during VM launch and wants to update it.
 	 * If this is the case, blk->bc would be null.
@@ -684,15 +1006,14 @@ virtio_blk_rescan(struct vmctx *ctx, struct pci_vdev *dev, char *newpath)
 		goto end;
 	}
 
-	pr_err("name=%s, Path=%s, ident=%s\n", dev->name, newpath, bident);
-	/* update the bctxt for the virtio-blk device */
-	bctxt = blockif_open(newpath, bident);
-	if (bctxt == NULL) {
+	pr_err("name=%s, Path=%s, slot=%d:%d\n", dev->name, newpath,
+		dev->slot, dev->func);
+	/* update the bctxt of each queue of the virtio-blk device */
+	if (virtio_blk_open(blk, newpath, dev)) {
 		pr_err("Error opening backing file\n");
 		goto end;
 	}
 
-	blk->bc = bctxt;
 	blk->dummy_bctxt = false;
 
 	/* Update virtio-blk device configuration on valid file*/
@@ -757,6 +1078,50 @@ end:
 	return error;
 }
 
+/*
+ * Change the I/O limits of a device at runtime, devargs is
+ * <slot>,<limit>=<rate>[:<burst>][,...]. The limits are shared by the
+ * contexts of the queues, all woken by blockif to run their requests due.
+ */
+int
+vm_monitor_blkthrottle(void *arg, char *devargs)
+{
+	char *str, *str_slot, *str_limits;
+	struct virtio_blk *blk;
+	struct pci_vdev *dev;
+	int slot, error = -1;
+
+	str = strdup(devargs);
+	if (!str)
+		return -1;
+
+	str_limits = str;
+	str_slot = strsep(&str_limits, ",");
+	if (str_limits == NULL || dm_strtoi(str_slot, &str_slot, 10, &slot)) {
+		pr_err("Slot info or limits not available!\n");
+		goto end;
+	}
+
+	dev = pci_get_vdev_info(slot);
+	if (dev == NULL || strstr(dev->name, "virtio-blk") == NULL) {
+		pr_err("No virtio-blk device at slot %d\n", slot);
+		goto end;
+	}
+
+	blk = (struct virtio_blk *)dev->arg;
+	if (!blk || !blk->bc) {
+		pr_err("virtio-blk at slot %d has no backing file\n", slot);
+		goto end;
+	}
+
+	error = blockif_set_throttle(blk->bc, str_limits);
+	if (!error)
+		pr_info("virtio-blk at slot %d limits: %s\n", slot, str_limits);
+end:
+	free(str);
+	return error;
+}
+
 struct pci_vdev_ops pci_ops_virtio_blk = {
 	.class_name	= "virtio-blk",
 	.vdev_init	= virtio_blk_init,
@@ -412,7 +412,7 @@ virtio_console_notify_rx(void *vdev, struct virtio_vq_info *vq)
 
 	if (!port->rx_ready) {
 		port->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_used_ring_flags(vq);
 	}
 }
 
@@ -959,12 +959,32 @@ virtio_console_add_backends(struct virtio_console *console, char *opts)
 	 * [,[@]stdio|tty|pty|file:portname[=portpath][:socket_type]]
 	 */
 	while ((opt = strsep(&opts, ",")) != NULL) {
+		if (strcmp(opt, "packed") == 0)
+			continue;
 		if (virtio_console_add_backend(console, opt))
 			return -1;
 	}
 	return 0;
 }
 
+/*
+ * Look for the packed option among the backends, to offer packed
+ * virtqueues to virtio 1.0 drivers.
+ */
+static bool
+virtio_console_want_packed(const char *opts)
+{
+	const char *p;
+	size_t n;
+
+	for (p = opts; *p != '\0'; p += n + (p[n] == ',')) {
+		n = strcspn(p, ",");
+		if (n == strlen("packed") && !strncmp(p, "packed", n))
+			return true;
+	}
+	return false;
+}
+
 static void
 virtio_console_close_backend(struct virtio_console_backend *be)
 {
@@ -1124,6 +1144,8 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		console->queues, BACKEND_VBSU);
 	console->base.mtx = &console->mtx;
 	console->base.device_caps = VIRTIO_CONSOLE_S_HOSTCAPS;
+	if (virtio_console_want_packed(opts))
+		console->base.device_caps |= VIRTIO_PACKED_HOSTCAPS;
 
 	for (i = 0; i < VIRTIO_CONSOLE_MAXQ; i++) {
 		console->queues[i].qsize = VIRTIO_CONSOLE_RINGSZ;
@@ -1150,6 +1172,15 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 	virtio_set_io_bar(&console->base, 0);
 
+	/* add the modern bars for the virtio 1.0 drivers of packed rings */
+	if ((console->base.device_caps & VIRTIO_PACKED_HOSTCAPS) &&
+	    virtio_set_modern_bar(&console->base, true)) {
+		if (console->config)
+			free(console->config);
+		free(console);
+		return -1;
+	}
+
 	/* create control port */
 	console->control_port.console = console;
 	console->control_port.txq = 2;
@@ -1594,7 +1594,7 @@ vmei_notify_tx(void *data, struct virtio_vq_info *vq)
 
 	pthread_mutex_lock(&vmei->tx_mutex);
 	DPRINTF("TX: New OUT buffer available!\n");
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	vq_set_used_ring_flags(vq);
 	pthread_mutex_unlock(&vmei->tx_mutex);
 
 	do {
@@ -1915,7 +1915,7 @@ static void *vmei_rx_thread(void *param)
 				goto out;
 		}
 
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_used_ring_flags(vq);
 
 		do {
 			vmei->rx_need_sched = vmei_proc_rx(vmei, vq);
@@ -1943,7 +1943,7 @@ vmei_notify_rx(void *data, struct virtio_vq_info *vq)
 	/* Signal the rx thread for processing */
 	pthread_mutex_lock(&vmei->rx_mutex);
 	DPRINTF("RX: New IN buffer available!\n");
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	vq_set_used_ring_flags(vq);
 	pthread_cond_signal(&vmei->rx_cond);
 	pthread_mutex_unlock(&vmei->rx_mutex);
 }
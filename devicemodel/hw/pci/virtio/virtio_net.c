@@ -40,16 +40,26 @@
 #include <net/if.h>
 #include <linux/if_tun.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include "dm.h"
 #include "pci_core.h"
-#include "mevent.h"
 #include "virtio.h"
 #include "vhost.h"
+#include "packet_ring.h"
 #include "dm_string.h"
+#include "metrics.h"
 
 #define VIRTIO_NET_RINGSZ	1024
+#define VIRTIO_NET_CTLQ_RINGSZ	64
 #define VIRTIO_NET_MAXSEGS	256
+#define VIRTIO_NET_TX_BATCH	16	/* tx chains taken at once */
+#define VIRTIO_NET_TX_BUDGET	16	/* tx batches before checking rx */
+#define VIRTIO_NET_MAXQP	8	/* max rx/tx queue pairs */
+#define VIRTIO_NET_RX_SEGS	32	/* segments of one rx buffer */
+#define VIRTIO_NET_RX_MAXBUFS	64	/* rx buffers merged for a packet */
+#define VIRTIO_NET_RX_BACKLOG	32	/* packets held for lack of buffers */
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -73,12 +83,32 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple rx/tx queue pairs */
 #define	VHOST_NET_F_VIRTIO_NET_HDR \
 				(1 << 27) /* vhost provides virtio_net_hdr */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
-	(1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC))
+	(1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC) | \
+	(1 << VIRTIO_RING_F_EVENT_IDX))
+
+/*
+ * Offloads, offered when the tap device takes the virtio-net header
+ */
+#define VIRTIO_NET_S_OFFLOADCAPS	\
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4 |			\
+	VIRTIO_NET_F_HOST_TSO6 | VIRTIO_NET_F_HOST_ECN |		\
+	VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_GUEST_TSO4 |		\
+	VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_GUEST_ECN)
+
+/*
+ * Offloads, offered with the AF_PACKET ring. Its TX frames are too small
+ * for TSO packets, the guest segments them itself.
+ */
+#define VIRTIO_NET_S_PACKETCAPS		\
+	(VIRTIO_NET_F_CSUM |						\
+	VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_GUEST_TSO4 |		\
+	VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_GUEST_ECN)
 
 #define VIRTIO_NET_S_VHOSTCAPS      \
 	((1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC) | \
@@ -94,16 +124,34 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions. Queue pair i uses the queues 2 * i for RX and
+ * 2 * i + 1 for TX, the control queue follows the last pair and is
+ * only there with VIRTIO_NET_F_MQ.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_MAXQ	(2 * VIRTIO_NET_MAXQP + 1)
+
+/*
+ * Control queue commands: a virtio_net_ctrl_hdr and the command data
+ * readable by the device, then one byte of ack written back.
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
+
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+#define VIRTIO_NET_CTRL_MAXSEGS			4
 
 /*
  * Fixed network header size
@@ -118,6 +166,16 @@ struct virtio_net_rxhdr {
 	uint16_t	vrh_bufs;
 } __attribute__((packed));
 
+/* virtio_net_rxhdr flags and gso_type */
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM	1	/* csum_start, csum_offset */
+#define VIRTIO_NET_HDR_GSO_NONE		0
+#define VIRTIO_NET_HDR_GSO_TCPV4	1
+#define VIRTIO_NET_HDR_GSO_TCPV6	4
+#define VIRTIO_NET_HDR_GSO_ECN		0x80
+
+/* the largest packet from the tap device, GSO ones included, and header */
+#define VIRTIO_NET_RX_BUFSZ	(sizeof(struct virtio_net_rxhdr) + 65550)
+
 /*
  * Debug printf
  */
@@ -130,50 +188,97 @@ static int virtio_net_debug;
  */
 struct vhost_net {
 	struct vhost_dev vdev;
-	struct vhost_vq vqs[VIRTIO_NET_MAXQ - 1];
+	struct vhost_vq vqs[2];		/* one rx/tx queue pair */
 	int tapfd;
 	bool vhost_started;
 };
 
+struct virtio_net;
+
+/*
+ * Per queue pair struct. Each pair has its own tap queue, or AF_PACKET
+ * ring, and its own worker thread, which receives from the backend and
+ * transmits what the TX queue is kicked for.
+ */
+struct virtio_net_queue {
+	struct virtio_net *net;
+	int		idx;		/* queue pair index */
+	int		tapfd;		/* tap queue, or the ring's socket */
+	bool		attached;	/* tap queue attached to the device */
+	struct packet_ring *ring;	/* AF_PACKET backend */
+	int		cpu;		/* Service VM CPU to run on, or -1 */
+
+	int		rx_ready;
+	/* rx buffers taken from the ring, not used yet */
+	struct vq_chain	rx_chains[VIRTIO_NET_RX_MAXBUFS];
+	struct iovec	rx_iov[VIRTIO_NET_RX_MAXBUFS][VIRTIO_NET_RX_SEGS];
+	int		rx_npending;
+	/*
+	 * Packets waiting for rx buffers, from rx_head on. The slot after
+	 * the last one stages the next packet read.
+	 */
+	uint8_t		*rx_backlog[VIRTIO_NET_RX_BACKLOG + 1];
+	int		rx_backlog_len[VIRTIO_NET_RX_BACKLOG + 1];
+	int		rx_head;
+	int		rx_count;
+	uint64_t	rx_dropped;	/* packets dropped */
+	uint64_t	rx_held;	/* packets held in the backlog */
+	bool		rx_stalled;	/* ring packets wait for rx buffers */
+
+	pthread_t	tid;
+	int		kickfd;		/* eventfd to wake up the worker */
+	pthread_mutex_t	mtx;
+	int		in_progress;	/* worker is processing the rings */
+	struct vq_chain	tx_chains[VIRTIO_NET_TX_BATCH];
+	struct iovec	tx_iov[VIRTIO_NET_TX_BATCH][VIRTIO_NET_MAXSEGS + 1];
+
+	struct vhost_net *vhost_net;
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_ops ops;		/* virtio_net_ops with our nvq */
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
-
-	int		rx_ready;
+	struct virtio_net_queue qps[VIRTIO_NET_MAXQP];
+	int		max_pairs;	/* queue pairs of the device */
+	int		curr_pairs;	/* queue pairs used by the guest */
 
 	volatile int	resetting;	/* set and checked outside lock */
-	volatile int	closing;	/* stop the tx i/o thread */
+	volatile int	closing;	/* stop the worker threads */
 
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
+	bool		tap_vnet_hdr;	/* tap reads/writes the header */
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	void (*virtio_net_rx)(struct virtio_net_queue *q);
+	void (*virtio_net_rx_drop)(struct virtio_net_queue *q);
+	void (*virtio_net_tx)(struct virtio_net_queue *q, struct iovec *iov,
 			     int iovcnt, int len);
+	void (*virtio_net_tx_flush)(struct virtio_net_queue *q);
 
-	struct vhost_net *vhost_net;
 	bool		use_vhost;
+	bool		vhost_started;
+	struct metrics_dev *metrics;	/* the RX and TX of each pair */
+	int		poll;		/* CPU budget of the polling, in % */
+};
+
+/* the metrics queues, RX and TX of each pair as the virtqueues */
+static const char *const virtio_net_metrics_names[2 * VIRTIO_NET_MAXQP] = {
+	"rx0", "tx0", "rx1", "tx1", "rx2", "tx2", "rx3", "tx3",
+	"rx4", "tx4", "rx5", "tx5", "rx6", "tx6", "rx7", "tx7",
 };
 
 static void virtio_net_reset(void *vdev);
-static void virtio_net_tx_stop(struct virtio_net *net);
+static void virtio_net_stop_queues(struct virtio_net *net);
 static int virtio_net_cfgread(void *vdev, int offset, int size,
 	uint32_t *retval);
 static int virtio_net_cfgwrite(void *vdev, int offset, int size,
@@ -181,15 +286,16 @@ static int virtio_net_cfgwrite(void *vdev, int offset, int size,
 static void virtio_net_neg_features(void *vdev, uint64_t negotiated_features);
 static void virtio_net_set_status(void *vdev, uint64_t status);
 static void virtio_net_teardown(void *param);
+static void virtio_net_tap_set_offload(struct virtio_net *net);
 static struct vhost_net *vhost_net_init(struct virtio_base *base, int vhostfd,
-	int tapfd, int vq_idx);
+	int tapfd, int vq_idx, const struct vhost_ops *ops);
 static int vhost_net_deinit(struct vhost_net *vhost_net);
 static int vhost_net_start(struct vhost_net *vhost_net);
 static int vhost_net_stop(struct vhost_net *vhost_net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	2,				/* 2 virtqueues per pair, see init */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -231,54 +337,102 @@ ether_aton(const char *a, struct ether_addr *e)
 }
 
 /*
- * If the transmit thread is active then stall until it is done.
+ * If the worker thread of a queue pair is active then stall until it
+ * is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_queue_wait(struct virtio_net_queue *q)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&q->mtx);
+	while (q->in_progress) {
+		pthread_mutex_unlock(&q->mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&q->mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&q->mtx);
 }
 
 /*
- * If the receive thread is active then stall until it is done.
+ * Wake up the worker thread of a queue pair
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_queue_kick(struct virtio_net_queue *q)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+	uint64_t val = 1;
+	ssize_t ret;
+
+	ret = write(q->kickfd, &val, sizeof(val));
+	(void)ret; /*avoid compiler warning*/
+}
+
+/*
+ * Attach the tap queues of the first pairs queue pairs, and detach the
+ * others so that the kernel doesn't steer packets to RX queues the guest
+ * doesn't use.
+ */
+static void
+virtio_net_set_pairs(struct virtio_net *net, int pairs)
+{
+	struct virtio_net_queue *q;
+	struct ifreq ifr;
+	bool attach;
+	int i;
+
+	net->curr_pairs = pairs;
+	if (net->max_pairs == 1)
+		return;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
+		attach = (i < pairs);
+		if (q->tapfd < 0 || q->attached == attach)
+			continue;
+
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(q->tapfd, TUNSETQUEUE, (void *)&ifr) < 0)
+			WPRINTF(("vtnet: failed to %s tap queue %d: %d\n",
+				attach ? "attach" : "detach", i, errno));
+		else {
+			q->attached = attach;
+			/* let the worker poll the tap queue or stop it */
+			if (q->tid)
+				virtio_net_queue_kick(q);
+		}
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_queue *q;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
 	net->resetting = 1;
 
 	/*
-	 * Wait for the transmit and receive threads to finish their
-	 * processing.
+	 * Wait for the worker threads to finish their processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
+		virtio_net_queue_wait(q);
+		q->rx_ready = 0;
+		/* the rings are gone with whatever was held for them */
+		q->rx_npending = 0;
+		q->rx_dropped += q->rx_count;
+		q->rx_head = 0;
+		q->rx_count = 0;
+		q->rx_stalled = false;
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->features = 0;
+	virtio_net_tap_set_offload(net);
+	virtio_net_set_pairs(net, 1);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
@@ -288,32 +442,36 @@ virtio_net_reset(void *vdev)
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Signal the worker threads to exit and wait till they do
  */
 static void
-virtio_net_tx_stop(struct virtio_net *net)
+virtio_net_stop_queues(struct virtio_net *net)
 {
-	void *jval;
+	struct virtio_net_queue *q;
+	int i;
 
-	pthread_mutex_lock(&net->tx_mtx);
 	net->closing = 1;
-	pthread_cond_broadcast(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
-
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
+		if (q->tid) {
+			virtio_net_queue_kick(q);
+			pthread_join(q->tid, NULL);
+			q->tid = 0;
+		}
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_queue *q, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (q->tapfd == -1)
 		return;
 
 	/*
@@ -326,14 +484,14 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(q->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
 /*
  *  Called when there is read activity on the tap file descriptor.
- * Each buffer posted by the guest is assumed to be able to contain
- * an entire ethernet frame + rx header.
+ * A packet takes several rx buffers with merged rx bufs, or one buffer
+ * big enough for it otherwise.
  *  MP note: the dummybuf is only used for discarding frames, so there
  * is no need for it to be per-vtnet or locked.
  */
@@ -366,20 +524,244 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
+/*
+ * Copy len bytes of buf into the iovecs, from offset off of them.
+ */
+static void
+iov_from_buf(const struct iovec *iov, int n, size_t off, const void *buf,
+	     size_t len)
+{
+	size_t chunk;
+	int i;
+
+	for (i = 0; i < n && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		chunk = iov[i].iov_len - off;
+		if (chunk > len)
+			chunk = len;
+		memcpy((char *)iov[i].iov_base + off, buf, chunk);
+		buf = (const char *)buf + chunk;
+		len -= chunk;
+		off = 0;
+	}
+}
+
+/*
+ * Copy the first len bytes of the iovecs into buf.
+ */
+static void
+iov_to_buf(const struct iovec *iov, int n, void *buf, size_t len)
+{
+	size_t chunk;
+	int i;
+
+	for (i = 0; i < n && len > 0; i++) {
+		chunk = iov[i].iov_len;
+		if (chunk > len)
+			chunk = len;
+		memcpy(buf, iov[i].iov_base, chunk);
+		buf = (char *)buf + chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Take one more rx buffer from the ring, it stays pending until a packet
+ * is placed in it. Returns 1 on success, 0 if the ring is empty and -1 if
+ * it's broken.
+ */
+static int
+virtio_net_rx_getbuf(struct virtio_net_queue *q, struct virtio_vq_info *vq)
+{
+	struct vq_chain *c = &q->rx_chains[q->rx_npending];
+	int i;
+
+	while (vq_has_descs(vq)) {
+		c->n = vq_getchain(vq, &c->idx, c->iov, VIRTIO_NET_RX_SEGS,
+			NULL);
+		if (c->n < 1) {
+			WPRINTF(("vtnet: virtio_net_rx_getbuf: vq_getchain = %d\n",
+				c->n));
+			return -1;
+		}
+
+		/* the capacity of the buffer, until it's used */
+		c->iolen = 0;
+		for (i = 0; i < c->n && i < VIRTIO_NET_RX_SEGS; i++)
+			c->iolen += c->iov[i].iov_len;
+		if (c->n > VIRTIO_NET_RX_SEGS || c->iolen < q->net->rx_vhdrlen) {
+			WPRINTF(("vtnet: unusable rx buffer, %d segs %u bytes\n",
+				c->n, c->iolen));
+			vq_relchain(vq, c->idx, 0);
+			continue;
+		}
+
+		q->rx_npending++;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Place a packet, from its virtio-net header on, in the pending rx buffers
+ * and the ones after them in the ring, and hand them to the guest at once.
+ * The first skip bytes of the packet are already in the first buffer, buf
+ * holds the rest. Returns the number of buffers used, 0 if the ring ran
+ * out of them, they stay pending then, or -1 if the packet doesn't fit.
+ */
+static int
+virtio_net_rx_fill(struct virtio_net_queue *q, struct virtio_vq_info *vq,
+		   const uint8_t *buf, int len, int skip)
+{
+	struct virtio_net *net = q->net;
+	struct vq_chain *c, tmp;
+	int i, ret, nbufs, maxbufs, base, end, from, cap;
+	uint16_t vrh_bufs;
+
+	/* without merged rx buffers, each packet has a buffer of its own */
+	maxbufs = net->rx_merge ? VIRTIO_NET_RX_MAXBUFS : 1;
+	for (nbufs = 0, cap = 0; cap < len; nbufs++) {
+		if (nbufs == maxbufs)
+			return -1;
+		if (nbufs == q->rx_npending) {
+			ret = virtio_net_rx_getbuf(q, vq);
+			if (ret <= 0)
+				return ret;
+		}
+		cap += q->rx_chains[nbufs].iolen;
+	}
+
+	for (i = 0, base = 0; i < nbufs; i++, base += cap) {
+		c = &q->rx_chains[i];
+		cap = c->iolen;
+		end = (base + cap < len) ? base + cap : len;
+		from = (base > skip) ? base : skip;
+		if (end > from)
+			iov_from_buf(c->iov, c->n, from - base,
+				buf + from - skip, end - from);
+		c->iolen = end - base;
+	}
+
+	if (net->rx_vhdrlen == sizeof(struct virtio_net_rxhdr)) {
+		vrh_bufs = nbufs;
+		iov_from_buf(q->rx_chains[0].iov, q->rx_chains[0].n,
+			offsetof(struct virtio_net_rxhdr, vrh_bufs),
+			&vrh_bufs, sizeof(vrh_bufs));
+	}
+
+	/* the guest looks for all the buffers once it sees the first one */
+	vq_relchains_bulk(vq, q->rx_chains, nbufs);
+
+	/* move the buffers left to the front, each keeps its iovecs */
+	q->rx_npending -= nbufs;
+	for (i = 0; i < q->rx_npending; i++) {
+		tmp = q->rx_chains[i];
+		q->rx_chains[i] = q->rx_chains[nbufs + i];
+		q->rx_chains[nbufs + i] = tmp;
+	}
+
+	return nbufs;
+}
+
+/*
+ * Receive one packet from the tap device. With nothing held back, it's
+ * read straight into the first rx buffer, with the staging buffer after
+ * it for what doesn't fit there. Otherwise, or if the ring runs out of
+ * buffers, it goes through the staging buffer, which is then added to the
+ * backlog. Returns -1 when there's no packet to read.
+ */
+static int
+virtio_net_rx_one(struct virtio_net_queue *q, struct virtio_vq_info *vq)
+{
+	struct iovec riov[VIRTIO_NET_RX_SEGS + 1];
+	struct virtio_net *net = q->net;
+	struct vq_chain *c;
+	uint8_t *stage;
+	int slot, len, n = 0, cap = 0, ret;
+
+	slot = (q->rx_head + q->rx_count) % (VIRTIO_NET_RX_BACKLOG + 1);
+	if (!q->rx_backlog[slot]) {
+		q->rx_backlog[slot] = malloc(VIRTIO_NET_RX_BUFSZ);
+		if (!q->rx_backlog[slot]) {
+			if (read(q->tapfd, dummybuf, sizeof(dummybuf)) < 0)
+				return -1;
+			q->rx_dropped++;
+			return 0;
+		}
+	}
+	stage = q->rx_backlog[slot];
+
+	if (net->tap_vnet_hdr) {
+		if (q->rx_count == 0 && (q->rx_npending > 0 ||
+		    virtio_net_rx_getbuf(q, vq) > 0)) {
+			c = &q->rx_chains[0];
+			n = c->n;
+			memcpy(riov, c->iov, n * sizeof(struct iovec));
+			cap = c->iolen;
+		}
+		riov[n].iov_base = stage;
+		riov[n].iov_len = VIRTIO_NET_RX_BUFSZ;
+		len = readv(q->tapfd, riov, n + 1);
+	} else {
+		/* the header is ours to fill, it's all zero but num_buffers */
+		memset(stage, 0, net->rx_vhdrlen);
+		len = read(q->tapfd, stage + net->rx_vhdrlen,
+			VIRTIO_NET_RX_BUFSZ - net->rx_vhdrlen);
+		if (len >= 0)
+			len += net->rx_vhdrlen;
+	}
+	if (len < 0)
+		return -1;
+
+	if (len > VIRTIO_NET_RX_BUFSZ) {
+		q->rx_dropped++;
+		return 0;
+	}
+
+	ret = virtio_net_rx_fill(q, vq, stage, len, (len < cap) ? len : cap);
+	if (ret < 0)
+		q->rx_dropped++;
+	if (ret != 0)
+		return 0;
+
+	/* out of rx buffers, hold the whole packet in the staging buffer */
+	if (cap > 0) {
+		memmove(stage + cap, stage, len - cap);
+		iov_to_buf(q->rx_chains[0].iov, q->rx_chains[0].n, stage, cap);
+	}
+	q->rx_backlog_len[slot] = len;
+	q->rx_count++;
+	q->rx_held++;
+	return 0;
+}
+
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx_drop(struct virtio_net_queue *q)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	ssize_t ret;
+
+	ret = read(q->tapfd, dummybuf, sizeof(dummybuf));
+	if (ret >= 0)
+		q->rx_dropped++;
+}
+
+static void
+virtio_net_tap_rx(struct virtio_net_queue *q)
+{
+	struct virtio_net *net = q->net;
 	struct virtio_vq_info *vq;
-	void *vrx;
-	int len, n;
-	uint16_t idx;
 	ssize_t ret;
+	int head, mq = 2 * q->idx + VIRTIO_NET_RXQ;
+	uint64_t t;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	if (net->tapfd == -1) {
+	if (q->tapfd == -1) {
 		WPRINTF(("vtnet: tapfd == -1\n"));
 		return;
 	}
@@ -388,142 +770,299 @@ virtio_net_tap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!q->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
-
+		virtio_net_tap_rx_drop(q);
 		return;
 	}
 
+	vq = &net->queues[2 * q->idx + VIRTIO_NET_RXQ];
+	/* each packet waits for the ones before it in the batch */
+	t = metrics_now();
+again:
 	/*
-	 * Check for available rx buffers
+	 * The packets held back go first.
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
-	if (!vq_has_descs(vq)) {
-		/*
-		 * Drop the packet and try later.  Interrupt on
-		 * empty, if that's negotiated.
-		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
+	while (q->rx_count > 0) {
+		head = q->rx_head;
+		ret = virtio_net_rx_fill(q, vq, q->rx_backlog[head],
+			q->rx_backlog_len[head], 0);
+		if (ret == 0)
+			break;
+		if (ret < 0)
+			q->rx_dropped++;
+		q->rx_head = (head + 1) % (VIRTIO_NET_RX_BACKLOG + 1);
+		q->rx_count--;
+		t = metrics_stamp(net->metrics, mq, METRICS_BACKEND, t);
+	}
 
-		vq_endchains(vq, 1);
-		return;
+	/*
+	 * Then the tap device, till it's drained or the backlog is full.
+	 */
+	while (q->rx_count < VIRTIO_NET_RX_BACKLOG) {
+		if (virtio_net_rx_one(q, vq) < 0)
+			break;
+		t = metrics_stamp(net->metrics, mq, METRICS_BACKEND, t);
 	}
 
-	do {
+	if (q->rx_count > 0) {
 		/*
-		 * Get descriptor chain.
+		 * Out of rx buffers: ask the guest to notify us when it
+		 * adds some, and check for the ones added before it could
+		 * see that.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-			WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
-			return;
+		vq_clear_used_ring_flags(&net->base, vq);
+		/* memory barrier */
+		mb();
+		if (vq_has_descs(vq)) {
+			vq_set_used_ring_flags(vq);
+			goto again;
 		}
-		/*
-		 * Get a pointer to the rx header, and use the
-		 * data immediately following it for the packet buffer.
-		 */
-		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
-		if (riov == NULL)
-			return;
+	}
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+	metrics_stamp(net->metrics, mq, METRICS_COMPLETE, t);
+}
 
-		len = readv(net->tapfd, riov, n);
+static void
+virtio_net_packet_rx_drop(struct virtio_net_queue *q)
+{
+	int len;
 
-		if (len < 0 && errno == EWOULDBLOCK) {
-			/*
-			 * No more packets, but still some avail ring
-			 * entries.  Interrupt if needed/appropriate.
-			 */
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
-			return;
+	while (packet_ring_rx_peek(q->ring, &len) != NULL) {
+		packet_ring_rx_next(q->ring);
+		q->rx_dropped++;
+	}
+}
+
+/*
+ * Check the offloads of a packet from the AF_PACKET ring, whose header is
+ * vrh, against the ones the guest took. The checksum left to a guest
+ * which can't do it is done here, in place. Returns -1 if the packet must
+ * be dropped, a GSO one the guest can't take.
+ */
+static int
+virtio_net_packet_rx_offload(struct virtio_net *net,
+			     struct virtio_net_rxhdr *vrh, uint8_t *pkt, int len)
+{
+	uint64_t need;
+	uint32_t sum;
+	int i, start, off;
+
+	if (vrh->vrh_gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+		switch (vrh->vrh_gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+		case VIRTIO_NET_HDR_GSO_TCPV4:
+			need = VIRTIO_NET_F_GUEST_TSO4;
+			break;
+		case VIRTIO_NET_HDR_GSO_TCPV6:
+			need = VIRTIO_NET_F_GUEST_TSO6;
+			break;
+		default:
+			return -1;
 		}
+		if (vrh->vrh_gso_type & VIRTIO_NET_HDR_GSO_ECN)
+			need |= VIRTIO_NET_F_GUEST_ECN;
+		return ((net->features & need) == need) ? 0 : -1;
+	}
 
-		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
-		 */
-		memset(vrx, 0, net->rx_vhdrlen);
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM)
+		return 0;
+
+	if (vrh->vrh_flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		/* the checksum field holds the pseudo header sum */
+		start = vrh->vrh_csum_start;
+		off = start + vrh->vrh_csum_offset;
+		if (off + 2 > len)
+			return -1;
+		sum = 0;
+		for (i = start; i + 1 < len; i += 2)
+			sum += (pkt[i] << 8) | pkt[i + 1];
+		if (i < len)
+			sum += pkt[i] << 8;
+		while (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		sum = ~sum & 0xffff;
+		if (sum == 0)
+			sum = 0xffff;
+		pkt[off] = sum >> 8;
+		pkt[off + 1] = sum & 0xff;
+	}
+	/* nothing left to do, should the packet be taken again */
+	vrh->vrh_flags = 0;
+	return 0;
+}
+
+/*
+ * Called when an RX block of the AF_PACKET ring is ready. The packets are
+ * copied from the ring to the rx buffers, with the virtio-net header the
+ * kernel put before them, moved into the headroom reserved before it if
+ * num_buffers follows it. When the buffers run out, the packets wait in
+ * the ring, which is left alone till the guest adds some.
+ */
+static void
+virtio_net_packet_rx(struct virtio_net_queue *q)
+{
+	struct virtio_net *net = q->net;
+	struct virtio_vq_info *vq;
+	struct virtio_net_rxhdr *vrh;
+	uint8_t *pkt, *hdr;
+	int len, ret, mq = 2 * q->idx + VIRTIO_NET_RXQ;
+	uint64_t t;
 
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
+	if (!q->rx_ready || net->resetting) {
+		virtio_net_packet_rx_drop(q);
+		return;
+	}
 
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+	vq = &net->queues[2 * q->idx + VIRTIO_NET_RXQ];
+	q->rx_stalled = false;
+	t = metrics_now();
+again:
+	while ((pkt = packet_ring_rx_peek(q->ring, &len)) != NULL) {
+		vrh = (struct virtio_net_rxhdr *)(pkt - PACKET_RING_VNET_HDRLEN);
+		if (virtio_net_packet_rx_offload(net, vrh, pkt, len)) {
+			q->rx_dropped++;
+			packet_ring_rx_next(q->ring);
+			continue;
 		}
 
-		/*
-		 * Release this chain and handle more chains.
-		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
-	} while (vq_has_descs(vq));
+		hdr = pkt - net->rx_vhdrlen;
+		memmove(hdr, vrh, PACKET_RING_VNET_HDRLEN);
+		ret = virtio_net_rx_fill(q, vq, hdr, len + net->rx_vhdrlen, 0);
+		if (ret == 0) {
+			/* it's taken again from the ring, with its header */
+			memmove(vrh, hdr, PACKET_RING_VNET_HDRLEN);
+			q->rx_stalled = true;
+			q->rx_held++;
+			break;
+		}
+		if (ret < 0)
+			q->rx_dropped++;
+		packet_ring_rx_next(q->ring);
+		t = metrics_stamp(net->metrics, mq, METRICS_BACKEND, t);
+	}
+
+	if (q->rx_stalled) {
+		vq_clear_used_ring_flags(&net->base, vq);
+		/* memory barrier */
+		mb();
+		if (vq_has_descs(vq)) {
+			vq_set_used_ring_flags(vq);
+			q->rx_stalled = false;
+			goto again;
+		}
+	}
 
-	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
+	metrics_stamp(net->metrics, mq, METRICS_COMPLETE, t);
 }
 
+/*
+ * The ring takes the header, as the guest wrote it but without
+ * num_buffers, apart from the packet.
+ */
 static void
-virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+virtio_net_packet_tx(struct virtio_net_queue *q, struct iovec *iov,
+		     int iovcnt, int len)
 {
-	struct virtio_net *net = param;
+	uint8_t hdr[PACKET_RING_VNET_HDRLEN];
+	struct iovec *tiov;
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	iov_to_buf(iov, iovcnt, hdr, sizeof(hdr));
+	tiov = rx_iov_trim(iov, &iovcnt, q->net->rx_vhdrlen);
+	if (tiov != NULL)
+		(void)packet_ring_tx(q->ring, hdr, tiov, iovcnt, len);
+}
 
+static void
+virtio_net_packet_tx_flush(struct virtio_net_queue *q)
+{
+	packet_ring_tx_flush(q->ring);
 }
 
 static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_queue *q = &net->qps[vq->num / 2];
 
 	/*
-	 * A qnotify means that the rx process can now begin
+	 * A qnotify means that the rx process can now begin, or go on
+	 * with the packets held back for lack of rx buffers.
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	}
+	q->rx_ready = 1;
+	vq_set_used_ring_flags(vq);
+	if (q->rx_count > 0 || q->rx_stalled)
+		virtio_net_queue_kick(q);
 }
 
-static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+static int
+virtio_net_proctx(struct virtio_net_queue *q, struct virtio_vq_info *vq)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
+	struct virtio_net *net = q->net;
+	struct vq_chain *chain;
+	struct iovec *tiov;
+	int i, j, n, nchains;
 	int plen, tlen;
-	uint16_t idx;
+	int mq = 2 * q->idx + VIRTIO_NET_TXQ;
+	uint64_t t, s, e;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * Obtain a batch of descriptor chains.  The packet follows
+	 * the header, which is the first descriptor for legacy
+	 * drivers but may share it with the packet for virtio 1.0
+	 * ones, so we need to sum up two lengths: packet length and
+	 * transfer length.
 	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-		WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n", n));
-		return;
-	}
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
+	nchains = vq_getchains_bulk(vq, q->tx_chains, VIRTIO_NET_TX_BATCH);
+	/* each packet waits for the ones before it in the batch */
+	t = e = metrics_now();
+	for (j = 0; j < nchains; j++) {
+		chain = &q->tx_chains[j];
+		n = chain->n;
+		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n",
+				n));
+			/* don't hand a broken chain back */
+			chain->idx = vq->qsize;
+			continue;
+		}
+		tlen = 0;
+		for (i = 0; i < n; i++)
+			tlen += chain->iov[i].iov_len;
+		plen = tlen - net->rx_vhdrlen;
+		chain->iolen = tlen;
+
+		/*
+		 * the tap device, or the AF_PACKET ring, takes the header
+		 * as the guest wrote it
+		 */
+		if (net->tap_vnet_hdr || q->ring)
+			tiov = chain->iov;
+		else
+			tiov = rx_iov_trim(chain->iov, &n, net->rx_vhdrlen);
+		if (tiov == NULL)
+			continue;
+
+		DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r",
+			plen, n));
+		s = metrics_stamp(net->metrics, mq, METRICS_SUBMIT, t);
+		net->virtio_net_tx(q, tiov, n, plen);
+		e = metrics_stamp(net->metrics, mq, METRICS_BACKEND, s);
 	}
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	/* chains are processed, release them with their tlen */
+	if (nchains > 0) {
+		if (net->virtio_net_tx_flush)
+			net->virtio_net_tx_flush(q);
+		vq_relchains_bulk(vq, q->tx_chains, nchains);
+		metrics_stamp(net->metrics, mq, METRICS_COMPLETE, e);
+	}
 
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	return nchains;
 }
 
 static void
@@ -537,92 +1076,202 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 	if (!vq_has_descs(vq))
 		return;
 
-	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	/* Signal the worker thread for processing */
+	vq_set_used_ring_flags(vq);
+	virtio_net_queue_kick(&net->qps[vq->num / 2]);
 }
 
 /*
- * Thread which will handle processing of TX desc
+ * Transmit up to VIRTIO_NET_TX_BUDGET batches from the TX queue of a
+ * pair with the guest notifications disabled. If there's more, the
+ * worker kicks itself to come back after the RX has had its turn,
+ * otherwise the notifications are enabled again.
  */
-static void *
-virtio_net_tx_thread(void *param)
+static void
+virtio_net_queue_tx(struct virtio_net_queue *q)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq = &net->queues[VIRTIO_NET_TXQ];
+	struct virtio_net *net = q->net;
+	struct virtio_vq_info *vq;
+	int budget;
 
-	/*
-	 * Let us wait till the tx queue pointers get initialised &
-	 * first tx signaled
-	 */
-	pthread_mutex_lock(&net->tx_mtx);
+	vq = &net->queues[2 * q->idx + VIRTIO_NET_TXQ];
+	if (!vq_ring_ready(vq))
+		return;
+
+	if (vq_has_descs(vq)) {
+		vq_set_used_ring_flags(vq);
+		for (budget = VIRTIO_NET_TX_BUDGET; budget > 0; budget--) {
+			/*
+			 * Run through entries, placing them into
+			 * iovecs and sending when an end-of-packet
+			 * is found
+			 */
+			if (virtio_net_proctx(q, vq) < 0)
+				return;
+			if (net->resetting || !vq_has_descs(vq))
+				break;
+		}
 
-	while (!net->closing && !vq_ring_ready(vq))
-		pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+		/*
+		 * Generate an interrupt if needed.
+		 */
+		vq_endchains(vq, 1);
+		if (net->resetting)
+			return;
+		if (vq_has_descs(vq)) {
+			virtio_net_queue_kick(q);
+			return;
+		}
+	}
 
-	if (net->closing) {
-		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
-		return NULL;
+	/*
+	 * Checking the avail ring after enabling the notifications
+	 * catches the chains made available before the guest could see it.
+	 */
+	vq_clear_used_ring_flags(&net->base, vq);
+	/* memory barrier */
+	mb();
+	if (vq_has_descs(vq)) {
+		vq_set_used_ring_flags(vq);
+		virtio_net_queue_kick(q);
 	}
+}
 
-	for (;;) {
-		/* note - tx mutex is locked here */
-		net->tx_in_progress = 0;
+/*
+ * Thread which handles the RX and TX of a queue pair
+ */
+static void *
+virtio_net_queue_thread(void *param)
+{
+	struct virtio_net_queue *q = param;
+	struct virtio_net *net = q->net;
+	struct pollfd pfd[2];
+	uint64_t val;
+	ssize_t ret;
+
+	pfd[0].fd = q->kickfd;
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
 
+	while (!net->closing) {
 		/*
-		 * Checking the avail ring here serves two purposes:
-		 *  - avoid vring processing due to spurious wakeups
-		 *  - catch missing notifications before acquiring tx_mtx
+		 * A detached tap queue polls as an error, leave it out, as
+		 * well as while the backlog is full or the ring stalled.
 		 */
-		while (net->resetting || !vq_has_descs(vq)) {
-			vq_clear_used_ring_flags(&net->base, vq);
-			/* memory barrier */
-			mb();
-			if (!net->resetting && vq_has_descs(vq))
-				break;
+		pfd[1].fd = (q->attached && !q->rx_stalled &&
+			     q->rx_count < VIRTIO_NET_RX_BACKLOG) ? q->tapfd : -1;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			WPRINTF(("vtnet: queue %d poll failed: %d\n",
+				q->idx, errno));
+			break;
+		}
+		if (net->closing)
+			break;
 
-			pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+		if (pfd[0].revents & POLLIN) {
+			ret = read(q->kickfd, &val, sizeof(val));
+			(void)ret; /*avoid compiler warning*/
+		}
 
-			if (net->closing) {
-				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
-				return NULL;
-			}
+		pthread_mutex_lock(&q->mtx);
+		if (net->resetting) {
+			pthread_mutex_unlock(&q->mtx);
+			/* drop the packets so that poll doesn't spin */
+			if (pfd[1].revents & POLLIN)
+				net->virtio_net_rx_drop(q);
+			continue;
 		}
+		q->in_progress = 1;
+		pthread_mutex_unlock(&q->mtx);
 
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		virtio_net_queue_tx(q);
+		if ((pfd[1].revents & POLLIN) || q->rx_count > 0 ||
+		    q->rx_stalled)
+			net->virtio_net_rx(q);
 
-		do {
-			/*
-			 * Run through entries, placing them into
-			 * iovecs and sending when an end-of-packet
-			 * is found
-			 */
-			virtio_net_proctx(net, vq);
-		} while (vq_has_descs(vq));
+		pthread_mutex_lock(&q->mtx);
+		q->in_progress = 0;
+		pthread_mutex_unlock(&q->mtx);
+	}
 
-		/*
-		 * Generate an interrupt if needed.
-		 */
-		vq_endchains(vq, 1);
+	WPRINTF(("vtnet queue %d thread closing...\n", q->idx));
+	return NULL;
+}
+
+/*
+ * Handle VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, the other commands are only
+ * sent for features we don't offer.
+ */
+static uint8_t
+virtio_net_ctrl(struct virtio_net *net, uint8_t *buf, int len)
+{
+	struct virtio_net_ctrl_hdr *hdr = (struct virtio_net_ctrl_hdr *)buf;
+	uint16_t pairs;
+
+	if (len < sizeof(*hdr) + sizeof(pairs) ||
+	    hdr->class != VIRTIO_NET_CTRL_MQ ||
+	    hdr->cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+	    !(net->features & VIRTIO_NET_F_MQ)) {
+		WPRINTF(("vtnet: unsupported control command %d:%d\n",
+			hdr->class, hdr->cmd));
+		return VIRTIO_NET_ERR;
+	}
 
-		pthread_mutex_lock(&net->tx_mtx);
+	memcpy(&pairs, buf + sizeof(*hdr), sizeof(pairs));
+	if (pairs < 1 || pairs > net->max_pairs) {
+		WPRINTF(("vtnet: invalid queue pairs %d\n", pairs));
+		return VIRTIO_NET_ERR;
 	}
+
+	DPRINTF(("vtnet: %d queue pairs in use\n\r", pairs));
+	virtio_net_set_pairs(net, pairs);
+	return VIRTIO_NET_OK;
 }
 
-#ifdef notyet
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = vdev;
+	struct iovec iov[VIRTIO_NET_CTRL_MAXSEGS];
+	uint16_t flags[VIRTIO_NET_CTRL_MAXSEGS];
+	uint8_t buf[64], *ack;
+	uint16_t idx;
+	int i, n, len, seg;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_CTRL_MAXSEGS, flags);
+		if (n < 1 || n > VIRTIO_NET_CTRL_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_ping_ctlq: vq_getchain = %d\n",
+				n));
+			return;
+		}
+
+		/* gather the command, the ack is the first writable byte */
+		len = 0;
+		ack = NULL;
+		for (i = 0; i < n; i++) {
+			if (flags[i] & VRING_DESC_F_WRITE) {
+				if (iov[i].iov_len > 0)
+					ack = iov[i].iov_base;
+				break;
+			}
+			seg = iov[i].iov_len;
+			if (seg > sizeof(buf) - len)
+				seg = sizeof(buf) - len;
+			memcpy(buf + len, iov[i].iov_base, seg);
+			len += seg;
+		}
+
+		if (ack)
+			*ack = virtio_net_ctrl(net, buf, len);
+		else
+			WPRINTF(("vtnet: control command without ack\n"));
+		vq_relchain(vq, idx, ack ? 1 : 0);
+	}
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -702,7 +1351,7 @@ virtio_net_is_macvtap(char *devname, int *ifindex)
 }
 
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, bool multi_queue, bool vnet_hdr)
 {
 	char tbuf[IFNAMSIZ];
 	int tunfd, rc, macvtap_index;
@@ -728,6 +1377,12 @@ virtio_net_tap_open(char *devname)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	/* each open of a multi queue tap device adds one queue to it */
+	if (multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	/* packets are read and written with a virtio-net header */
+	if (vnet_hdr)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 
 	if (*devname) {
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -746,65 +1401,251 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+static void
+virtio_net_tap_close(struct virtio_net *net)
+{
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		if (net->qps[i].ring) {
+			packet_ring_close(net->qps[i].ring);
+			net->qps[i].ring = NULL;
+		} else if (net->qps[i].tapfd >= 0)
+			close(net->qps[i].tapfd);
+		net->qps[i].tapfd = -1;
+	}
+}
+
+static void
+virtio_net_vhost_close(struct virtio_net *net)
+{
+	struct virtio_net_queue *q;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
+		if (q->vhost_net) {
+			vhost_net_deinit(q->vhost_net);
+			free(q->vhost_net);
+			q->vhost_net = NULL;
+		}
+	}
+}
+
+/*
+ * Set the header size and the offloads the guest can receive on the tap
+ * queues, per the negotiated features.
+ */
+static void
+virtio_net_tap_set_offload(struct virtio_net *net)
+{
+	struct virtio_net_queue *q;
+	unsigned int offload = 0;
+	int i;
+
+	if (!net->tap_vnet_hdr)
+		return;
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offload |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offload |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offload |= TUN_F_TSO6;
+		if ((offload & (TUN_F_TSO4 | TUN_F_TSO6)) &&
+		    (net->features & VIRTIO_NET_F_GUEST_ECN))
+			offload |= TUN_F_TSO_ECN;
+	}
+
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
+		if (q->tapfd < 0)
+			continue;
+		if (ioctl(q->tapfd, TUNSETVNETHDRSZ, &net->rx_vhdrlen) < 0)
+			WPRINTF(("vtnet: TUNSETVNETHDRSZ failed: %d\n", errno));
+		if (ioctl(q->tapfd, TUNSETOFFLOAD, offload) < 0)
+			WPRINTF(("vtnet: TUNSETOFFLOAD failed: %d\n", errno));
+	}
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
+	struct virtio_net_queue *q;
 	char tbuf[IFNAMSIZ];
-	int vhost_fd = -1;
-	int rc;
+	int vhost_fd;
+	int i, rc;
 
 	rc = snprintf(tbuf, IFNAMSIZ, "%s", devname);
 	if (rc < 0 || rc >= IFNAMSIZ) /* give warning if error or truncation happens */
 		WPRINTF(("Failed to set tap device name %s\n", tbuf));
 
 	net->virtio_net_rx = virtio_net_tap_rx;
+	net->virtio_net_rx_drop = virtio_net_tap_rx_drop;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
+	/* one tap queue for each queue pair */
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
+		q->tapfd = virtio_net_tap_open(tbuf, net->max_pairs > 1,
+			!net->use_vhost);
+		if (q->tapfd == -1) {
+			WPRINTF(("open of tap device %s queue %d failed\n",
+				tbuf, i));
+			virtio_net_tap_close(net);
+			return;
+		}
+		q->attached = true;
+
+		/*
+		 * Set non-blocking, the worker thread polls it
+		 */
+		int opt = 1;
+
+		if (ioctl(q->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			virtio_net_tap_close(net);
+			return;
+		}
 	}
 	DPRINTF(("open of tap device %s success!\n", tbuf));
 
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * vhost-net adds the header itself, otherwise offer the offloads
+	 * if the tap device can do them.
 	 */
-	int opt = 1;
-
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (!net->use_vhost) {
+		net->tap_vnet_hdr = true;
+		if (ioctl(net->qps[0].tapfd, TUNSETOFFLOAD, TUN_F_CSUM |
+			  TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN) == 0)
+			net->base.device_caps |= VIRTIO_NET_S_OFFLOADCAPS;
+		virtio_net_tap_set_offload(net);
+		return;
 	}
 
-	if (net->use_vhost) {
+	/* one vhost-net device for each queue pair */
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
 		vhost_fd = open("/dev/vhost-net", O_RDWR);
-		if (vhost_fd < 0)
+		if (vhost_fd < 0) {
 			WPRINTF(("open of vhost-net failed\n"));
-		else {
-			net->vhost_net = vhost_net_init(&net->base, vhost_fd,
-				net->tapfd, 0);
-			if (!net->vhost_net) {
-				WPRINTF(("vhost_net_init failed, fallback "
-					"to userspace virtio\n"));
-				close(vhost_fd);
-				vhost_fd = -1;
-			}
+			break;
 		}
+		q->vhost_net = vhost_net_init(&net->base, vhost_fd,
+			q->tapfd, 2 * i, &vhost_kernel_ops);
+		if (!q->vhost_net) {
+			WPRINTF(("vhost_net_init failed\n"));
+			close(vhost_fd);
+			break;
+		}
+	}
+
+	if (i < net->max_pairs) {
+		WPRINTF(("fallback to userspace virtio\n"));
+		virtio_net_vhost_close(net);
+	}
+}
+
+/*
+ * Attach to the host interface ifname through an AF_PACKET ring. The
+ * packets go through it with their virtio-net header, so the checksum and
+ * GSO offloads of the host stack are passed to the guest.
+ */
+static void
+virtio_net_packet_setup(struct virtio_net *net, char *ifname)
+{
+	struct virtio_net_queue *q = &net->qps[0];
+
+	/* room for num_buffers after the header of each received packet */
+	q->ring = packet_ring_open(ifname, sizeof(struct virtio_net_rxhdr) -
+		PACKET_RING_VNET_HDRLEN);
+	if (!q->ring) {
+		WPRINTF(("open of AF_PACKET ring on %s failed\n", ifname));
+		return;
+	}
+
+	net->virtio_net_rx = virtio_net_packet_rx;
+	net->virtio_net_rx_drop = virtio_net_packet_rx_drop;
+	net->virtio_net_tx = virtio_net_packet_tx;
+	net->virtio_net_tx_flush = virtio_net_packet_tx_flush;
+	q->tapfd = packet_ring_fd(q->ring);
+	q->attached = true;
+	net->base.device_caps |= VIRTIO_NET_S_PACKETCAPS;
+	DPRINTF(("open of AF_PACKET ring on %s success!\n", ifname));
+}
+
+/*
+ * Hand the queue pair over to the vhost-user backend listening on path,
+ * it owns the host side of the NIC.
+ */
+static void
+virtio_net_vhost_user_setup(struct virtio_net *net, char *path)
+{
+	struct virtio_net_queue *q = &net->qps[0];
+	int fd;
+
+	fd = vhost_user_connect(path);
+	if (fd < 0) {
+		WPRINTF(("connect to vhost-user backend %s failed\n", path));
+		return;
 	}
 
-	if (vhost_fd < 0) {
-		net->mevp = mevent_add(net->tapfd, EVF_READ,
-				       virtio_net_rx_callback, net,
-				       virtio_net_teardown, net);
-		if (net->mevp == NULL) {
-			WPRINTF(("Could not register event\n"));
-			close(net->tapfd);
-			net->tapfd = -1;
+	q->vhost_net = vhost_net_init(&net->base, fd, -1, 0, &vhost_user_ops);
+	if (!q->vhost_net) {
+		WPRINTF(("vhost_net_init failed\n"));
+		close(fd);
+	}
+}
+
+/*
+ * Parse the Service VM CPUs the queue pair threads run on, pair i runs
+ * on the (i % n)th of the n CPUs in the list.
+ */
+static int
+virtio_net_parse_cpus(struct virtio_net *net, char *cpus)
+{
+	char *cpu, *end;
+	int i, n = 0;
+	int list[VIRTIO_NET_MAXQP];
+
+	while ((cpu = strsep(&cpus, ":")) != NULL) {
+		if (n == VIRTIO_NET_MAXQP || dm_strtoi(cpu, &end, 10, &list[n]) ||
+		    *end != '\0' || list[n] < 0 || list[n] >= CPU_SETSIZE) {
+			pr_err("vtnet: invalid cpus option %s\n", cpu);
+			return -1;
 		}
+		n++;
 	}
+
+	for (i = 0; i < VIRTIO_NET_MAXQP; i++)
+		net->qps[i].cpu = list[i % n];
+	return 0;
+}
+
+static int
+virtio_net_start_queue(struct virtio_net *net, struct virtio_net_queue *q)
+{
+	char tname[MAXCOMLEN + 1];
+	cpu_set_t cpuset;
+
+	if (pthread_create(&q->tid, NULL, virtio_net_queue_thread, q) != 0) {
+		q->tid = 0;
+		return -1;
+	}
+
+	snprintf(tname, sizeof(tname), "vtnet-%d:%d q%d",
+		 net->base.dev->slot, net->base.dev->func, q->idx);
+	pthread_setname_np(q->tid, tname);
+
+	if (q->cpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(q->cpu, &cpuset);
+		if (pthread_setaffinity_np(q->tid, sizeof(cpuset), &cpuset))
+			WPRINTF(("vtnet: failed to pin queue %d to cpu %d\n",
+				q->idx, q->cpu));
+	}
+
+	return 0;
 }
 
 static int
@@ -813,14 +1654,15 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	MD5_CTX mdctx;
 	unsigned char digest[16];
 	char nstr[80];
-	char tname[MAXCOMLEN + 1];
 	struct virtio_net *net;
+	struct virtio_net_queue *q;
 	char *devname = NULL;
-	char *vtopts;
+	char *vtopts, *vtopts_end;
 	char *opt;
 	int mac_provided;
+	bool packed = false;
 	pthread_mutexattr_t attr;
-	int rc;
+	int i, j, rc, nvq;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -828,6 +1670,26 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 
+	net->max_pairs = 1;
+	net->poll = -1;
+	for (i = 0; i < VIRTIO_NET_MAXQP; i++) {
+		q = &net->qps[i];
+		q->net = net;
+		q->idx = i;
+		q->tapfd = -1;
+		q->kickfd = -1;
+		q->cpu = -1;
+		pthread_mutex_init(&q->mtx, NULL);
+		for (j = 0; j < VIRTIO_NET_TX_BATCH; j++) {
+			q->tx_chains[j].iov = q->tx_iov[j];
+			q->tx_chains[j].n_iov = VIRTIO_NET_MAXSEGS;
+		}
+		for (j = 0; j < VIRTIO_NET_RX_MAXBUFS; j++) {
+			q->rx_chains[j].iov = q->rx_iov[j];
+			q->rx_chains[j].n_iov = VIRTIO_NET_RX_SEGS;
+		}
+	}
+
 	/* init mutex attribute properly to avoid deadlock */
 	rc = pthread_mutexattr_init(&attr);
 	if (rc)
@@ -846,7 +1708,6 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	 * Read the MAC address if specified
 	 */
 	mac_provided = 0;
-	net->vhost_net = NULL;
 	if (opts != NULL) {
 		int err;
 
@@ -862,7 +1723,37 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		while ((opt = strsep(&vtopts, ",")) != NULL) {
 			if (strcmp("vhost", opt) == 0)
 				net->use_vhost = true;
-			else {
+			else if (strcmp("packed", opt) == 0)
+				packed = true;
+			else if (strncmp("mq=", opt, 3) == 0) {
+				if (dm_strtoi(opt + 3, &vtopts_end, 10,
+					&net->max_pairs) || *vtopts_end != '\0' ||
+				    net->max_pairs < 1 ||
+				    net->max_pairs > VIRTIO_NET_MAXQP) {
+					pr_err("vtnet: invalid %s, 1 to %d "
+						"queue pairs\n", opt,
+						VIRTIO_NET_MAXQP);
+					free(devname);
+					free(net);
+					return -1;
+				}
+			} else if (strncmp("cpus=", opt, 5) == 0) {
+				if (virtio_net_parse_cpus(net, opt + 5)) {
+					free(devname);
+					free(net);
+					return -1;
+				}
+			} else if (strncmp("poll=", opt, 5) == 0) {
+				if (dm_strtoi(opt + 5, &vtopts_end, 10,
+					&net->poll) || *vtopts_end != '\0' ||
+				    net->poll < 0 || net->poll > 100) {
+					pr_err("vtnet: invalid %s, 0 to 100 "
+						"percent of a CPU\n", opt);
+					free(devname);
+					free(net);
+					return -1;
+				}
+			} else {
 				err = virtio_net_parsemac(opt,
 					net->config.mac);
 				if (err != 0) {
@@ -875,32 +1766,81 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		}
 	}
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues,
+	/*
+	 * The AF_PACKET backend has one ring, with the header left to the
+	 * device model. A vhost-user backend serves one queue pair.
+	 */
+	if (devname && strncmp(devname, "packet=", 7) == 0) {
+		if (net->max_pairs > 1 || net->use_vhost)
+			WPRINTF(("vtnet: mq and vhost ignored for %s\n",
+				devname));
+		net->max_pairs = 1;
+		net->use_vhost = false;
+	} else if (devname && strncmp(devname, "vhost-user=", 11) == 0) {
+		if (net->max_pairs > 1)
+			WPRINTF(("vtnet: mq ignored for %s\n", devname));
+		net->max_pairs = 1;
+		net->use_vhost = true;
+	}
+
+	/* the pairs, plus the control queue if there are several */
+	nvq = 2 * net->max_pairs;
+	if (net->max_pairs > 1)
+		nvq++;
+	net->ops = virtio_net_ops;
+	net->ops.nvq = nvq;
+
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues,
 		      net->use_vhost ? BACKEND_VHOST : BACKEND_VBSU);
 	net->base.mtx = &net->mtx;
 	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
+	/* packed virtqueues are not supported by vhost */
+	if (packed && net->use_vhost) {
+		WPRINTF(("vtnet: packed ignored with vhost\n"));
+		packed = false;
+	}
+	if (packed)
+		net->base.device_caps |= VIRTIO_PACKED_HOSTCAPS;
+	if (net->max_pairs > 1)
+		net->base.device_caps |= VIRTIO_NET_F_CTRL_VQ |
+			VIRTIO_NET_F_MQ;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		net->queues[2 * i + VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[2 * i + VIRTIO_NET_RXQ].notify =
+			virtio_net_ping_rxq;
+		net->queues[2 * i + VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[2 * i + VIRTIO_NET_TXQ].notify =
+			virtio_net_ping_txq;
+	}
+	if (net->max_pairs > 1) {
+		net->queues[nvq - 1].qsize = VIRTIO_NET_CTLQ_RINGSZ;
+		net->queues[nvq - 1].notify = virtio_net_ping_ctlq;
+	}
+	net->config.max_virtqueue_pairs = net->max_pairs;
 
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
+	net->rx_merge = 1;
+	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
 
 	/*
 	 * Attempt to open the tap device
 	 */
-	net->tapfd = -1;
-
 	if (!devname) {
 		WPRINTF(("virtio_net: devname NULL\n"));
 		free(net);
 		return -1;
 	}
 
-	if ((strstr(devname, "tap") != NULL) ||
+	/* the tap functions cope with no backend, if it can't be opened */
+	net->virtio_net_rx = virtio_net_tap_rx;
+	net->virtio_net_rx_drop = virtio_net_tap_rx_drop;
+	net->virtio_net_tx = virtio_net_tap_tx;
+
+	if (strncmp(devname, "packet=", 7) == 0)
+		virtio_net_packet_setup(net, devname + 7);
+	else if (strncmp(devname, "vhost-user=", 11) == 0)
+		virtio_net_vhost_user_setup(net, devname + 11);
+	else if ((strstr(devname, "tap") != NULL) ||
 	    (strncmp(devname, "vmnet", 5) == 0))
 		virtio_net_tap_setup(net, devname);
 
@@ -936,42 +1876,56 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	else
 		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
-	/* Link is up if we managed to open tap device */
-	net->config.status = (opts == NULL || net->tapfd >= 0);
+	/* Link is up if we managed to open tap device, or vhost-user */
+	net->config.status = (opts == NULL || net->qps[0].tapfd >= 0 ||
+		net->qps[0].vhost_net != NULL);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
-	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
-		if (net)
-			free(net);
-		return -1;
-	}
+	if (virtio_interrupt_init(&net->base, virtio_uses_msix()))
+		goto fail;
 
 	/* use BAR 0 to map config regs in IO space */
 	virtio_set_io_bar(&net->base, 0);
 
+	/* add the modern bars for the virtio 1.0 drivers of packed rings */
+	if (packed && virtio_set_modern_bar(&net->base, true))
+		goto fail;
+
 	net->resetting = 0;
 	net->closing = 0;
 
-	net->rx_merge = 1;
-	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
+	/* the guest starts with one queue pair */
+	virtio_net_set_pairs(net, 1);
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Spawn a worker thread for each queue pair, unless vhost does
+	 * the data path.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	if (net->qps[0].vhost_net)
+		return 0;
+
+	snprintf(nstr, sizeof(nstr), "virtio-net %d:%d", dev->slot, dev->func);
+	net->metrics = metrics_register(nstr, 2 * net->max_pairs,
+		virtio_net_metrics_names);
+
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qps[i];
+		q->kickfd = eventfd(0, EFD_NONBLOCK);
+		if (q->kickfd < 0 || virtio_net_start_queue(net, q)) {
+			WPRINTF(("vtnet: failed to start queue %d\n", i));
+			goto fail;
+		}
+	}
+
+	virtio_poll_init(&net->base, net->poll);
 
 	return 0;
+
+fail:
+	virtio_net_stop_queues(net);
+	virtio_net_vhost_close(net);
+	virtio_net_teardown(net);
+	return -1;
 }
 
 static int
@@ -1016,37 +1970,51 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 
 	net->features = negotiated_features;
 
+	/* called for each half of the features with the modern bars */
+	net->rx_merge = 1;
+	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
 	if (!(net->features & VIRTIO_NET_F_MRG_RXBUF)) {
 		net->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		net->rx_vhdrlen -= 2;
+		/*
+		 * non-merge rx header is 2 bytes shorter, but virtio 1.0
+		 * always has the num_buffers field
+		 */
+		if (!(net->features & (1UL << VIRTIO_F_VERSION_1)))
+			net->rx_vhdrlen -= 2;
 	}
+
+	virtio_net_tap_set_offload(net);
 }
 
 static void
 virtio_net_set_status(void *vdev, uint64_t status)
 {
 	struct virtio_net *net = vdev;
-	int rc;
+	int i, rc;
 
-	if (!net->vhost_net)
+	if (!net->qps[0].vhost_net)
 		return;
 
-	if (!net->vhost_net->vhost_started &&
+	if (!net->vhost_started &&
 		(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-		if (net->mevp)
-			mevent_disable(net->mevp);
-
-		rc = vhost_net_start(net->vhost_net);
-		if (rc < 0) {
-			WPRINTF(("vhost_net_start failed\n"));
-			return;
+		for (i = 0; i < net->max_pairs; i++) {
+			rc = vhost_net_start(net->qps[i].vhost_net);
+			if (rc < 0) {
+				WPRINTF(("vhost_net_start failed\n"));
+				while (--i >= 0)
+					vhost_net_stop(net->qps[i].vhost_net);
+				return;
+			}
 		}
-	} else if (net->vhost_net->vhost_started &&
+		net->vhost_started = true;
+	} else if (net->vhost_started &&
 		((status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)) {
-		rc = vhost_net_stop(net->vhost_net);
-		if (rc < 0)
-			WPRINTF(("vhost_net_stop failed\n"));
+		for (i = 0; i < net->max_pairs; i++) {
+			rc = vhost_net_stop(net->qps[i].vhost_net);
+			if (rc < 0)
+				WPRINTF(("vhost_net_stop failed\n"));
+		}
+		net->vhost_started = false;
 	}
 }
 
@@ -1054,17 +2022,24 @@ static void
 virtio_net_teardown(void *param)
 {
 	struct virtio_net *net;
+	struct virtio_net_queue *q;
+	int i, j;
 
 	net = (struct virtio_net *)param;
 	if (!net)
 		return;
 
-	if (net->tapfd >= 0) {
-		close(net->tapfd);
-		net->tapfd = -1;
-	} else
-		pr_err("net->tapfd is -1!\n");
+	virtio_net_tap_close(net);
+	for (i = 0; i < VIRTIO_NET_MAXQP; i++) {
+		q = &net->qps[i];
+		if (q->kickfd >= 0)
+			close(q->kickfd);
+		pthread_mutex_destroy(&q->mtx);
+		for (j = 0; j <= VIRTIO_NET_RX_BACKLOG; j++)
+			free(q->rx_backlog[j]);
+	}
 
+	metrics_unregister(net->metrics);
 	free(net);
 }
 
@@ -1072,23 +2047,40 @@ static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	struct packet_ring_stats st;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
-		virtio_net_tx_stop(net);
-
-		if (net->vhost_net) {
-			vhost_net_stop(net->vhost_net);
-			vhost_net_deinit(net->vhost_net);
-			free(net->vhost_net);
-			net->vhost_net = NULL;
+		virtio_poll_deinit(&net->base);
+		virtio_net_stop_queues(net);
+
+		if (net->qps[0].vhost_net) {
+			for (i = 0; i < net->max_pairs; i++)
+				vhost_net_stop(net->qps[i].vhost_net);
+			virtio_net_vhost_close(net);
+		} else {
+			virtio_print_vq_stats(&net->base);
+			for (i = 0; i < net->max_pairs; i++)
+				pr_info("vtnet: queue pair %d: %lu rx packets "
+					"dropped, %lu held back\n", i,
+					net->qps[i].rx_dropped,
+					net->qps[i].rx_held);
+			if (net->qps[0].ring) {
+				packet_ring_get_stats(net->qps[0].ring, &st);
+				pr_info("vtnet: AF_PACKET ring: rx %lu packets "
+					"in %lu blocks, %lu dropped, %lu "
+					"truncated; tx %lu packets in %lu "
+					"flushes, %lu dropped\n",
+					st.rx_packets, st.rx_blocks,
+					st.rx_dropped, st.rx_truncated,
+					st.tx_packets, st.tx_flushes,
+					st.tx_dropped);
+			}
 		}
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-		else
-			virtio_net_teardown(net);
+		virtio_net_teardown(net);
 
 		DPRINTF(("%s: done\n", __func__));
 	} else
@@ -1096,7 +2088,8 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 }
 
 static struct vhost_net *
-vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
+vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx,
+	       const struct vhost_ops *ops)
 {
 	struct vhost_net *vhost_net = NULL;
 	uint64_t vhost_features = VIRTIO_NET_S_VHOSTCAPS;
@@ -1113,6 +2106,7 @@ vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
 	/* pre-init before calling vhost_dev_init */
 	vhost_net->vdev.nvqs = ARRAY_SIZE(vhost_net->vqs);
 	vhost_net->vdev.vqs = vhost_net->vqs;
+	vhost_net->vdev.ops = ops;
 	vhost_net->tapfd = tapfd;
 
 	rc = vhost_dev_init(&vhost_net->vdev, base, vhostfd, vq_idx,
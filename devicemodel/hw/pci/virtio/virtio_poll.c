@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Adaptive polling of the virtqueues.
+ *
+ * A kick puts the virtqueue in polling mode: the guest is asked not to
+ * notify it any more, and a poller thread checks it in its place. While
+ * requests keep coming the virtqueue is checked in a busy loop. Once it's
+ * been idle for VIRTIO_POLL_BUSY_NS the checks are spaced out, twice as
+ * much each time, and past VIRTIO_POLL_MAX_NS it's back to the kicks.
+ *
+ * All the CPU time of the poller, its spinning included, is charged to
+ * the devices it polls, shared evenly. Each has a budget in percent of a
+ * CPU over VIRTIO_POLL_PERIOD_NS. A device out of budget gets its
+ * virtqueues back to the kicks till the period ends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "dm_string.h"
+#include "log.h"
+
+#define VIRTIO_POLL_BUSY_NS	50000UL		/* busy after a request */
+#define VIRTIO_POLL_MIN_NS	1000UL		/* then checked every 1us */
+#define VIRTIO_POLL_MAX_NS	512000UL	/* up to 512us, then kicked */
+#define VIRTIO_POLL_PERIOD_NS	10000000UL	/* the budget is over 10ms */
+#define VIRTIO_POLL_DEF_BUDGET	50
+
+static LIST_HEAD(virtio_poll_list, virtio_base) poll_head =
+	LIST_HEAD_INITIALIZER(poll_head);
+/* taken before the mutexes of a device and its queues, never after them */
+static pthread_mutex_t poll_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t poll_tid;
+static int poll_evfd = -1;
+static int poll_def_budget;
+
+static uint64_t
+virtio_poll_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* The requests made available since the last call */
+static uint16_t
+virtio_poll_seen(struct virtio_vq_info *vq)
+{
+	uint16_t idx, n;
+
+	if (!vq_ring_ready(vq))
+		return 0;
+
+	if (vq->flags & VQ_PACKED) {
+		/*
+		 * There's no avail index: the descriptors past those seen,
+		 * or those the device took, are new while their flags match
+		 * the wrap counter of their position. A chain ends with a
+		 * descriptor without NEXT.
+		 */
+		idx = vq->poll_seen;
+		if ((int16_t)(vq->last_avail - idx) > 0)
+			idx = vq->last_avail;
+		for (n = 0; (uint16_t)(idx - vq->last_avail) < vq->qsize &&
+		     vq_packed_desc_avail(vq, idx); idx++) {
+			if (!(vq->packed_desc[idx & (vq->qsize - 1)].flags &
+			      VRING_DESC_F_NEXT))
+				n++;
+		}
+		vq->poll_seen = idx;
+		return n;
+	}
+
+	idx = vq->avail->idx;
+	n = idx - vq->poll_seen;
+	vq->poll_seen = idx;
+	return n;
+}
+
+/* the budget is updated by the poller only, and read on the kicks */
+static bool
+virtio_poll_exhausted(struct virtio_base *base, uint64_t now)
+{
+	return now < __atomic_load_n(&base->poll_period, __ATOMIC_RELAXED) &&
+		__atomic_load_n(&base->poll_used, __ATOMIC_RELAXED) * 100 >
+		base->poll_budget * VIRTIO_POLL_PERIOD_NS;
+}
+
+static void
+virtio_poll_notify(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq->notify)
+		(*vq->notify)(base, vq);
+	else if (base->vops->qnotify)
+		(*base->vops->qnotify)(base, vq);
+}
+
+/* Back to the kicks, and take the requests the guest didn't kick for */
+static void
+virtio_poll_stop(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint16_t n;
+
+	vq->flags &= ~VQ_POLLING;
+	vq_clear_used_ring_flags(base, vq);
+	mb();
+	n = virtio_poll_seen(vq);
+	if (n) {
+		vq->nr_polled += n;
+		virtio_poll_notify(base, vq);
+	}
+}
+
+static void
+virtio_poll_vq(struct virtio_base *base, struct virtio_vq_info *vq,
+	       uint64_t now)
+{
+	uint16_t n;
+
+	/*
+	 * Only the requests which are new are notified, as a kick would,
+	 * those already notified may still be in the device's hands.
+	 */
+	n = virtio_poll_seen(vq);
+	if (n) {
+		vq->nr_polled += n;
+		virtio_poll_notify(base, vq);
+		vq->poll_last = now;
+		vq->poll_wait = 0;
+		vq->poll_next = now;
+	} else if (now - vq->poll_last < VIRTIO_POLL_BUSY_NS) {
+		vq->poll_next = now;
+	} else {
+		vq->poll_wait = vq->poll_wait ? 2 * vq->poll_wait :
+			VIRTIO_POLL_MIN_NS;
+		if (vq->poll_wait > VIRTIO_POLL_MAX_NS)
+			virtio_poll_stop(base, vq);
+		else
+			vq->poll_next = now + vq->poll_wait;
+	}
+}
+
+/*
+ * Charge a device with cpu, its share of the last pass of the poller if
+ * it was polled in it, and check its virtqueues, each under its mutex.
+ * Returns when it wants the next check.
+ */
+static uint64_t
+virtio_poll_dev(struct virtio_base *base, uint64_t cpu)
+{
+	struct virtio_vq_info *vq;
+	uint64_t now, next = UINT64_MAX;
+	int i, n = 0;
+
+	now = virtio_poll_clock(CLOCK_MONOTONIC);
+	if (now >= base->poll_period) {
+		__atomic_store_n(&base->poll_used, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&base->poll_period,
+			now + VIRTIO_POLL_PERIOD_NS, __ATOMIC_RELAXED);
+	}
+	if (base->poll_active) {
+		__atomic_add_fetch(&base->poll_used, cpu, __ATOMIC_RELAXED);
+		base->poll_ns += cpu;
+	}
+
+	for (i = 0; i < base->vops->nvq; i++)
+		if (__atomic_load_n(&base->queues[i].flags, __ATOMIC_RELAXED) &
+		    VQ_POLLING)
+			n++;
+	base->poll_active = (n > 0);
+	if (n == 0)
+		return next;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		VQ_LOCK(vq);
+		if (vq->flags & VQ_POLLING) {
+			if (now >= vq->poll_next)
+				virtio_poll_vq(base, vq, now);
+			if (vq->flags & VQ_POLLING)
+				next = MIN(next, vq->poll_next);
+		}
+		VQ_UNLOCK(vq);
+	}
+
+	if (virtio_poll_exhausted(base, now)) {
+		for (i = 0; i < base->vops->nvq; i++) {
+			vq = &base->queues[i];
+			VQ_LOCK(vq);
+			if (vq->flags & VQ_POLLING)
+				virtio_poll_stop(base, vq);
+			VQ_UNLOCK(vq);
+		}
+		base->nr_poll_exhausted++;
+		next = UINT64_MAX;
+	}
+
+	return next;
+}
+
+static void *
+virtio_poll_thread(void *param)
+{
+	struct virtio_base *base;
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t now, next, cnt, cpu, last, share;
+	int polled = 0, n;
+
+	pfd.fd = poll_evfd;
+	pfd.events = POLLIN;
+	last = virtio_poll_clock(CLOCK_THREAD_CPUTIME_ID);
+	for (;;) {
+		next = UINT64_MAX;
+		n = 0;
+		pthread_mutex_lock(&poll_mtx);
+		/* the CPU time since the last pass goes to the devices in it */
+		cpu = virtio_poll_clock(CLOCK_THREAD_CPUTIME_ID);
+		share = polled ? (cpu - last) / polled : 0;
+		last = cpu;
+		LIST_FOREACH(base, &poll_head, poll_list) {
+			next = MIN(next, virtio_poll_dev(base, share));
+			if (base->poll_active)
+				n++;
+		}
+		polled = n;
+		pthread_mutex_unlock(&poll_mtx);
+
+		now = virtio_poll_clock(CLOCK_MONOTONIC);
+		if (next <= now)
+			continue;
+
+		/* nothing is due, sleep till something is, or is kicked */
+		ts.tv_sec = (next - now) / 1000000000UL;
+		ts.tv_nsec = (next - now) % 1000000000UL;
+		if (ppoll(&pfd, 1, next == UINT64_MAX ? NULL : &ts, NULL) > 0 &&
+		    read(poll_evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+			pr_err("%s: read failed, errno %d\n", __func__, errno);
+	}
+
+	return NULL;
+}
+
+void
+virtio_poll_kick(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint64_t now, cnt = 1;
+
+	if (base->poll_budget == 0)
+		return;
+
+	vq->nr_kicked += virtio_poll_seen(vq);
+	if (vq->flags & VQ_POLLING)
+		return;
+
+	now = virtio_poll_clock(CLOCK_MONOTONIC);
+	if (virtio_poll_exhausted(base, now))
+		return;
+
+	vq->flags |= VQ_POLLING;
+	vq->poll_last = now;
+	vq->poll_wait = 0;
+	vq->poll_next = now;
+	vq_set_used_ring_flags(vq);
+	if (write(poll_evfd, &cnt, sizeof(cnt)) < 0)
+		pr_err("%s: failed to wake the poller\n", __func__);
+}
+
+void
+virtio_poll_init(struct virtio_base *base, int budget)
+{
+	if (budget < 0)
+		budget = poll_def_budget;
+	if (budget == 0 || base->mtx == NULL)
+		return;
+
+	pthread_mutex_lock(&poll_mtx);
+	if (poll_evfd < 0) {
+		poll_evfd = eventfd(0, EFD_NONBLOCK);
+		if (poll_evfd < 0 || pthread_create(&poll_tid, NULL,
+				virtio_poll_thread, NULL)) {
+			pr_err("%s: failed to start the poller\n", __func__);
+			if (poll_evfd >= 0)
+				close(poll_evfd);
+			poll_evfd = -1;
+			pthread_mutex_unlock(&poll_mtx);
+			return;
+		}
+		pthread_setname_np(poll_tid, "virtio_poll");
+	}
+	base->poll_budget = budget;
+	base->poll_active = 0;
+	LIST_INSERT_HEAD(&poll_head, base, poll_list);
+	pthread_mutex_unlock(&poll_mtx);
+
+	pr_info("%s: polled with %d%% of a CPU\n", base->vops->name, budget);
+}
+
+void
+virtio_poll_deinit(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	if (base->poll_budget == 0)
+		return;
+
+	/* the poller doesn't hold the device once it's off the list */
+	pthread_mutex_lock(&poll_mtx);
+	LIST_REMOVE(base, poll_list);
+	pthread_mutex_unlock(&poll_mtx);
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		VQ_LOCK(vq);
+		if (vq->flags & VQ_POLLING) {
+			vq->flags &= ~VQ_POLLING;
+			vq_clear_used_ring_flags(base, vq);
+		}
+		VQ_UNLOCK(vq);
+	}
+	base->poll_budget = 0;
+}
+
+int
+virtio_poll_parse_default(const char *optarg)
+{
+	char *end;
+
+	poll_def_budget = VIRTIO_POLL_DEF_BUDGET;
+	if (*optarg == '\0')
+		return 0;
+	if (*optarg != ':' || dm_strtoi(optarg + 1, &end, 10,
+			&poll_def_budget) || *end != '\0' ||
+	    poll_def_budget < 1 || poll_def_budget > 100)
+		return -1;
+
+	return 0;
+}
@@ -370,8 +370,13 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *vbs_k_opt = NULL;
 	enum VBS_K_STATUS kstat = VIRTIO_DEV_INITIAL;
 	char tname[MAXCOMLEN + 1];
+	bool packed = false;
 
 	while ((opt = strsep(&opts, ",")) != NULL) {
+		if (strcmp(opt, "packed") == 0) {
+			packed = true;
+			continue;
+		}
 		/* vbs_k_opt should be kernel=on */
 		vbs_k_opt = strsep(&opt, "=");
 		DPRINTF(("vbs_k_opt is %s\n", vbs_k_opt));
@@ -435,7 +440,11 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	    rnd->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS) {
 		DPRINTF(("%s: fallback to VBS-U...\n", __func__));
 		virtio_linkup(&rnd->base, &virtio_rnd_ops, rnd, dev, &rnd->vq, BACKEND_VBSU);
-	}
+		/* only the VBS-U backend handles packed virtqueues */
+		if (packed)
+			rnd->base.device_caps = VIRTIO_PACKED_HOSTCAPS;
+	} else if (packed)
+		WPRINTF(("virtio_rnd: packed ignored with VBS-K\n"));
 
 	rnd->base.mtx = &rnd->mtx;
 
@@ -457,6 +466,11 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	virtio_set_io_bar(&rnd->base, 0);
 
+	/* add the modern bars for the virtio 1.0 drivers of packed rings */
+	if ((rnd->base.device_caps & VIRTIO_PACKED_HOSTCAPS) &&
+	    virtio_set_modern_bar(&rnd->base, true))
+		goto fail;
+
 	rnd->in_progress = 0;
 	pthread_mutex_init(&rnd->rx_mtx, NULL);
 	pthread_cond_init(&rnd->rx_cond, NULL);
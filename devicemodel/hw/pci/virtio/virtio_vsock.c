@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * virtio vsock device, backed by the vhost-vsock kernel driver.
+ *
+ * The guest gets an AF_VSOCK address, its context id (cid), the Service
+ * VM reaches it with as a socket address. vhost-vsock moves the packets
+ * of the rx and tx virtqueues between the guest and the host sockets,
+ * the device model only sets it up. The event virtqueue is left to the
+ * device model, which has no event to send on it.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vhost.h"
+#include "dm_string.h"
+#include "log.h"
+
+#define VIRTIO_VSOCK_RINGSZ	128
+
+#define VIRTIO_VSOCK_RXQ	0
+#define VIRTIO_VSOCK_TXQ	1
+#define VIRTIO_VSOCK_EVTQ	2
+#define VIRTIO_VSOCK_MAXQ	3
+
+/* cids 0 to 2 are the hypervisor, reserved and the host */
+#define VIRTIO_VSOCK_MIN_CID	3
+
+#define VIRTIO_VSOCK_F_SEQPACKET	(1UL << 1) /* SOCK_SEQPACKET */
+
+/*
+ * Offered if vhost-vsock has them, split virtqueues only, vhost doesn't
+ * handle the packed ones.
+ */
+#define VIRTIO_VSOCK_S_HOSTCAPS	\
+	((1UL << VIRTIO_F_NOTIFY_ON_EMPTY) |			\
+	(1UL << VIRTIO_RING_F_INDIRECT_DESC) |			\
+	(1UL << VIRTIO_RING_F_EVENT_IDX) |			\
+	(1UL << VIRTIO_F_VERSION_1) | VIRTIO_VSOCK_F_SEQPACKET)
+
+struct virtio_vsock_config {
+	uint64_t guest_cid;
+} __attribute__((packed));
+
+/*
+ * Per-device struct
+ */
+struct virtio_vsock {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_VSOCK_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_vsock_config config;
+
+	/* rx and tx, handed to vhost-vsock */
+	struct vhost_dev vdev;
+	struct vhost_vq vqs[2];
+	bool vhost_started;
+};
+
+static int virtio_vsock_debug;
+#define DPRINTF(params) do { if (virtio_vsock_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_vsock_reset(void *vdev);
+static int virtio_vsock_cfgread(void *vdev, int offset, int size,
+	uint32_t *retval);
+static int virtio_vsock_cfgwrite(void *vdev, int offset, int size,
+	uint32_t value);
+static void virtio_vsock_set_status(void *vdev, uint64_t status);
+
+static struct virtio_ops virtio_vsock_ops = {
+	"vtvsock",			/* our name */
+	VIRTIO_VSOCK_MAXQ,		/* we support 3 virtqueues */
+	sizeof(struct virtio_vsock_config), /* config reg size */
+	virtio_vsock_reset,		/* reset */
+	NULL,				/* device-wide qnotify -- not used */
+	virtio_vsock_cfgread,		/* read virtio config */
+	virtio_vsock_cfgwrite,		/* write virtio config */
+	NULL,				/* apply negotiated features */
+	virtio_vsock_set_status,	/* called on guest set status */
+};
+
+static void
+virtio_vsock_reset(void *vdev)
+{
+	struct virtio_vsock *vsock = vdev;
+
+	DPRINTF(("vtvsock: device reset requested !\n"));
+	virtio_reset_dev(&vsock->base);
+}
+
+/*
+ * The kicks of rx and tx go to vhost-vsock once it's started, and it
+ * looks at the rings when it starts for those which came before. The
+ * event virtqueue only holds the buffers of the guest.
+ */
+static void
+virtio_vsock_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	DPRINTF(("vtvsock: kick of vq %ld ignored\n",
+		vq - ((struct virtio_vsock *)vdev)->queues));
+}
+
+static int
+virtio_vsock_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_vsock *vsock = vdev;
+	void *ptr;
+
+	ptr = (uint8_t *)&vsock->config + offset;
+	memcpy(retval, ptr, size);
+	return 0;
+}
+
+static int
+virtio_vsock_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	DPRINTF(("vtvsock: write to readonly reg %d\n", offset));
+	return 0;
+}
+
+static int
+virtio_vsock_vhost_start(struct virtio_vsock *vsock)
+{
+	if (vhost_dev_start(&vsock->vdev) < 0) {
+		WPRINTF(("vtvsock: vhost_dev_start failed\n"));
+		return -1;
+	}
+
+	if (vhost_vsock_set_running(&vsock->vdev, true) < 0) {
+		WPRINTF(("vtvsock: vhost_vsock_set_running failed\n"));
+		vhost_dev_stop(&vsock->vdev);
+		return -1;
+	}
+
+	vsock->vhost_started = true;
+	return 0;
+}
+
+static void
+virtio_vsock_vhost_stop(struct virtio_vsock *vsock)
+{
+	if (vhost_vsock_set_running(&vsock->vdev, false) < 0)
+		WPRINTF(("vtvsock: vhost_vsock_set_running failed\n"));
+	if (vhost_dev_stop(&vsock->vdev) < 0)
+		WPRINTF(("vtvsock: vhost_dev_stop failed\n"));
+
+	vsock->vhost_started = false;
+}
+
+static void
+virtio_vsock_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_vsock *vsock = vdev;
+
+	if (!vsock->vhost_started && (status & VIRTIO_CONFIG_S_DRIVER_OK))
+		virtio_vsock_vhost_start(vsock);
+	else if (vsock->vhost_started &&
+		 (status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)
+		virtio_vsock_vhost_stop(vsock);
+}
+
+static int
+virtio_vsock_parse_opts(char *opts, uint64_t *cid)
+{
+	char *cp, *xopts, *tmp;
+	int err = 0;
+
+	*cid = 0;
+	if (opts == NULL) {
+		WPRINTF(("vtvsock: the cid=<n> option is needed\n"));
+		return -1;
+	}
+
+	xopts = tmp = strdup(opts);
+	if (xopts == NULL)
+		return -1;
+
+	while (!err && (cp = strsep(&tmp, ",")) != NULL) {
+		if (strncmp(cp, "cid=", 4) == 0) {
+			if (dm_strtoul(cp + 4, &cp, 10, cid) || *cp != '\0')
+				err = -1;
+		} else {
+			WPRINTF(("vtvsock: unknown option %s\n", cp));
+			err = -1;
+		}
+	}
+	free(xopts);
+
+	/* the guest's end of a socket, it's 32 bits in AF_VSOCK addresses */
+	if (!err && (*cid < VIRTIO_VSOCK_MIN_CID || *cid >= UINT32_MAX)) {
+		WPRINTF(("vtvsock: cid must be from %d to %u\n",
+			VIRTIO_VSOCK_MIN_CID, UINT32_MAX - 1));
+		err = -1;
+	}
+
+	return err;
+}
+
+static int
+virtio_vsock_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vsock;
+	pthread_mutexattr_t attr;
+	uint64_t cid;
+	int i, fd, rc;
+
+	if (virtio_vsock_parse_opts(opts, &cid))
+		return -1;
+
+	/* vhost signals the guest through irqfds, which are MSI-X only */
+	if (!virtio_uses_msix()) {
+		WPRINTF(("vtvsock: vhost-vsock needs MSI-X\n"));
+		return -1;
+	}
+
+	vsock = calloc(1, sizeof(struct virtio_vsock));
+	if (!vsock) {
+		WPRINTF(("vtvsock: calloc returns NULL\n"));
+		return -1;
+	}
+
+	/* init mutex attribute properly to avoid deadlock */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (rc)
+		DPRINTF(("vtvsock: mutexattr_settype failed with "
+			"error %d!\n", rc));
+	rc = pthread_mutex_init(&vsock->mtx, &attr);
+	if (rc)
+		DPRINTF(("vtvsock: pthread_mutex_init failed with "
+			"error %d!\n", rc));
+
+	virtio_linkup(&vsock->base, &virtio_vsock_ops, vsock, dev,
+		      vsock->queues, BACKEND_VHOST);
+	vsock->base.mtx = &vsock->mtx;
+	vsock->base.device_caps = VIRTIO_VSOCK_S_HOSTCAPS;
+
+	for (i = 0; i < VIRTIO_VSOCK_MAXQ; i++) {
+		vsock->queues[i].qsize = VIRTIO_VSOCK_RINGSZ;
+		vsock->queues[i].notify = virtio_vsock_notify;
+	}
+	vsock->config.guest_cid = cid;
+
+	fd = open("/dev/vhost-vsock", O_RDWR);
+	if (fd < 0) {
+		WPRINTF(("vtvsock: open of vhost-vsock failed\n"));
+		goto fail;
+	}
+
+	/* rx and tx are the first two, vhost_dev_init closes fd on failure */
+	vsock->vdev.nvqs = ARRAY_SIZE(vsock->vqs);
+	vsock->vdev.vqs = vsock->vqs;
+	if (vhost_dev_init(&vsock->vdev, &vsock->base, fd, VIRTIO_VSOCK_RXQ,
+			VIRTIO_VSOCK_S_HOSTCAPS, 0, 0) < 0) {
+		WPRINTF(("vtvsock: vhost_dev_init failed\n"));
+		goto fail;
+	}
+
+	/* fails if another VM has the cid already */
+	if (vhost_vsock_set_guest_cid(&vsock->vdev, cid) < 0) {
+		WPRINTF(("vtvsock: cid %lu can't be used\n", cid));
+		goto vhost_fail;
+	}
+
+	/* a virtio 1.0 device only, there's no transitional one for vsock */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, 0x1040 + VIRTIO_TYPE_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_SIMPLECOMM);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_SIMPLECOMM_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, 0x1100);
+	if (is_winvm == true)
+		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, ORACLE_VENDOR_ID);
+	else
+		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+	pci_set_cfgdata16(dev, PCIR_REVID, 1);
+
+	if (virtio_interrupt_init(&vsock->base, true))
+		goto vhost_fail;
+
+	if (virtio_set_modern_bar(&vsock->base, true))
+		goto vhost_fail;
+
+	pr_info("vtvsock: guest cid %lu\n", cid);
+	return 0;
+
+vhost_fail:
+	vhost_dev_deinit(&vsock->vdev);
+fail:
+	pthread_mutex_destroy(&vsock->mtx);
+	free(vsock);
+	dev->arg = NULL;
+	return -1;
+}
+
+static void
+virtio_vsock_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vsock;
+
+	vsock = dev->arg;
+	if (vsock == NULL) {
+		DPRINTF(("%s: vsock is NULL\n", __func__));
+		return;
+	}
+
+	if (vsock->vhost_started)
+		virtio_vsock_vhost_stop(vsock);
+	vhost_dev_deinit(&vsock->vdev);
+
+	pthread_mutex_destroy(&vsock->mtx);
+	free(vsock);
+	dev->arg = NULL;
+	DPRINTF(("%s: done\n", __func__));
+}
+
+struct pci_vdev_ops pci_ops_virtio_vsock = {
+	.class_name	= "vhost-vsock",
+	.vdev_init	= virtio_vsock_init,
+	.vdev_deinit	= virtio_vsock_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_vsock);
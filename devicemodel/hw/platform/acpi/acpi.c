@@ -68,6 +68,7 @@
 #include "tpm.h"
 #include "vmmapi.h"
 #include "hpet.h"
+#include "sw_load.h"
 #include "log.h"
 
 /*
@@ -828,11 +829,14 @@ basl_fwrite_dsdt(FILE *fp, struct vmctx *ctx)
 	dsdt_line("DefinitionBlock (\"dm_dsdt.aml\", \"DSDT\", 2,"
 			"\"DM \", \"DMDSDT  \", 0x00000001)");
 	dsdt_line("{");
-	dsdt_line("  Name (_S3, Package ()");
-	dsdt_line("  {");
-	dsdt_line("      0x03,");
-	dsdt_line("      Zero,");
-	dsdt_line("  })");
+	/* a kernel booted directly has no firmware to resume it from S3 */
+	if (!acrn_sw_direct_boot()) {
+		dsdt_line("  Name (_S3, Package ()");
+		dsdt_line("  {");
+		dsdt_line("      0x03,");
+		dsdt_line("      Zero,");
+		dsdt_line("  })");
+	}
 	dsdt_line("  Name (_S5, Package ()");
 	dsdt_line("  {");
 	dsdt_line("      0x05,");
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * A cache of the blocks read from read-only files, such as the golden
+ * images many User VMs boot from, in a shared memory segment per file
+ * mapped by every device model. The blocks one of them read are then
+ * copied out of the segment by the others, without a syscall.
+ *
+ * The segment, BLOCK_CACHE_SHM-<dev>-<inode>, is created by the first
+ * device model running as the owner of the file, with the size it asks
+ * for, and lives till it's removed from /dev/shm. Only the device models
+ * running as the owner of the file, which could write the file anyway,
+ * fill the segment; the others map it read-only. The segment records the
+ * size and the times of the file, and is replaced once they change. Only
+ * the regular files without write permission are cached.
+ */
+
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define BLOCK_CACHE_SHM		"/acrn-blkcache"
+#define BLOCK_CACHE_DEF_MB	256
+
+struct block_cache_stats {
+	uint64_t hits;		/* blocks copied out of the cache */
+	uint64_t misses;	/* blocks read from the file */
+	uint64_t fills;		/* blocks put in the cache */
+};
+
+struct block_cache_file;
+
+/*
+ * Cache the blocks of fd, which stays open, in the shared segment of the
+ * file; it's created of size_mb MiB if it doesn't exist. Returns NULL if
+ * the file can't be cached or the segment mapped, the reads then have to
+ * go to the file.
+ */
+struct block_cache_file *block_cache_open(int fd, size_t size_mb);
+void	block_cache_close(struct block_cache_file *f);
+
+/* preadv() of the file, through the cache */
+ssize_t	block_cache_preadv(struct block_cache_file *f, const struct iovec *iov,
+			   int iovcnt, off_t offset);
+
+void	block_cache_get_stats(struct block_cache_file *f,
+			      struct block_cache_stats *stats);
+
+#endif /* _BLOCK_CACHE_H_ */
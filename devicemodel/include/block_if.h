@@ -41,8 +41,13 @@
 
 #define BLOCKIF_IOV_MAX		256	/* not practical to be IOV_MAX */
 
+/*
+ * The iovecs of a request are the caller's, up to BLOCKIF_IOV_MAX of them,
+ * and must stay as they are till its callback. They're passed as they
+ * are down to the engine, not copied.
+ */
 struct blockif_req {
-	struct iovec	iov[BLOCKIF_IOV_MAX];
+	struct iovec	*iov;
 	int		iovcnt;
 	off_t		offset;
 	ssize_t		resid;
@@ -50,8 +55,24 @@ struct blockif_req {
 	void		*param;
 };
 
+struct blockif_stats {
+	/* nocache */
+	uint64_t	reqs;		/* reads and writes */
+	uint64_t	bounced;	/* not aligned for O_DIRECT */
+	uint64_t	bounce_allocs;	/* bounce buffers allocated, pool empty */
+	uint64_t	rmw;		/* partial blocks read and written back */
+	/* merge */
+	uint64_t	merged;		/* requests merged into a previous one */
+	uint64_t	merges;		/* requests others were merged into */
+	/* throttle */
+	uint64_t	throttled;	/* requests held back by the limits */
+	uint64_t	throttle_ns;	/* total time they were held back */
+};
+
 struct blockif_ctxt;
 struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
+struct blockif_ctxt *blockif_clone(struct blockif_ctxt *bc, const char *ident,
+				   int cpu);
 off_t	blockif_size(struct blockif_ctxt *bc);
 void	blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h,
 		    uint8_t *s);
@@ -65,6 +86,8 @@ int	blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
+void	blockif_plug(struct blockif_ctxt *bc);
+void	blockif_unplug(struct blockif_ctxt *bc);
 int	blockif_close(struct blockif_ctxt *bc);
 uint8_t	blockif_get_wce(struct blockif_ctxt *bc);
 void	blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce);
@@ -72,5 +95,7 @@ int	blockif_flush_all(struct blockif_ctxt *bc);
 int	blockif_max_discard_sectors(struct blockif_ctxt *bc);
 int	blockif_max_discard_seg(struct blockif_ctxt *bc);
 int	blockif_discard_sector_alignment(struct blockif_ctxt *bc);
+void	blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *stats);
+int	blockif_set_throttle(struct blockif_ctxt *bc, const char *opts);
 
 #endif /* _BLOCK_IF_H_ */
@@ -43,6 +43,7 @@ extern char *vsbl_file_name;
 extern char *ovmf_file_name;
 extern char *kernel_file_name;
 extern char *elf_file_name;
+extern char *restore_file_name;
 extern char *vmname;
 extern bool stdio_in_use;
 extern char *mac_seed;
@@ -50,6 +51,7 @@ extern bool lapic_pt;
 extern bool is_rtvm;
 extern bool pt_tpm2;
 extern bool is_winvm;
+extern bool numa_affinity;
 
 int vmexit_task_switch(struct vmctx *ctx, struct vhm_request *vhm_req,
 		       int *vcpu);
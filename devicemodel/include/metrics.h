@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Latency metrics of the emulated I/O. A device registers the queues it
+ * handles requests on, and records the time each request spends in each
+ * stage: taken from the guest and handed to the backend (submit), in the
+ * backend (backend), and given back to the guest (complete). Each stage
+ * of a queue has a count, a sum, a max and a log2 histogram, updated
+ * with atomics, so the recording threads never take a lock. A queue
+ * recorded by several threads, such as the exits of the vCPUs, has a
+ * slot per thread, summed when the metrics are dumped.
+ *
+ * They're only recorded with --metrics, and dumped as text through the
+ * monitor, with "acrnctl metrics".
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* bucket i counts [2^i, 2^(i+1)) ns, the last one anything longer */
+#define METRICS_BUCKETS		32
+
+enum metrics_stage {
+	METRICS_SUBMIT,
+	METRICS_BACKEND,
+	METRICS_COMPLETE,
+	METRICS_STAGES
+};
+
+struct metrics_dev;
+
+/* set by --metrics, nothing is recorded otherwise */
+extern bool metrics_enabled;
+
+/*
+ * Register a device with nq queues, named qnames[i], or "q<i>" if qnames
+ * is NULL. Returns NULL if the metrics are disabled or can't be
+ * allocated, the recording is then a no-op.
+ */
+struct metrics_dev *metrics_register(const char *name, int nq,
+				     const char *const *qnames);
+/* Same, with nslots slots of each queue, for as many recording threads */
+struct metrics_dev *metrics_register_slots(const char *name, int nq,
+					   int nslots,
+					   const char *const *qnames);
+void	metrics_unregister(struct metrics_dev *d);
+
+/* CLOCK_MONOTONIC, in ns, 0 if the metrics are disabled */
+uint64_t metrics_now(void);
+
+/*
+ * Record a stage of queue q which started at start and ended now, and
+ * return now, the start of the next stage.
+ */
+uint64_t metrics_stamp(struct metrics_dev *d, int q, enum metrics_stage s,
+		       uint64_t start);
+/* Same, in slot slot of the queue */
+uint64_t metrics_stamp_slot(struct metrics_dev *d, int slot, int q,
+			    enum metrics_stage s, uint64_t start);
+
+/* Write the metrics of the devices registered, the slots summed */
+void	metrics_dump(FILE *fp);
+
+#endif /* _METRICS_H_ */
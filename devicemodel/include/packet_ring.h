@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Packet I/O on a host network interface through the mmap'ed RX and TX
+ * rings of an AF_PACKET socket (TPACKET_V3). The kernel fills the RX ring
+ * a block of packets at a time and sends the TX ring on one syscall, so
+ * the per packet syscalls of a tap device are gone.
+ *
+ * A ring is not thread safe, it's meant to be used by one thread.
+ */
+
+#ifndef _PACKET_RING_H_
+#define _PACKET_RING_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Each packet comes, or goes, with a struct virtio_net_hdr, the legacy
+ * virtio-net header without num_buffers, for the checksum and GSO
+ * offloads.
+ */
+#define PACKET_RING_VNET_HDRLEN	10
+
+struct packet_ring_stats {
+	uint64_t rx_packets;	/* packets taken from the RX ring */
+	uint64_t rx_blocks;	/* RX blocks given back to the kernel */
+	uint64_t rx_dropped;	/* dropped by the kernel, RX ring full */
+	uint64_t rx_truncated;	/* too big for a block, skipped */
+	uint64_t tx_packets;	/* packets put in the TX ring */
+	uint64_t tx_flushes;	/* syscalls to send the TX ring */
+	uint64_t tx_dropped;	/* too big, or the TX ring stayed full */
+};
+
+struct packet_ring;
+
+/*
+ * Open a ring on the interface ifname, in promiscuous mode. Received
+ * packets have headroom writable bytes before their virtio-net header.
+ */
+struct packet_ring *packet_ring_open(const char *ifname, int headroom);
+void	packet_ring_close(struct packet_ring *r);
+
+/* The socket to poll for POLLIN, set when an RX block is ready */
+int	packet_ring_fd(struct packet_ring *r);
+
+/*
+ * Return the next received packet and its length, or NULL if there is
+ * none. Its virtio-net header is the PACKET_RING_VNET_HDRLEN bytes before
+ * it. It stays in the ring, and is returned again, till
+ * packet_ring_rx_next() is called.
+ */
+uint8_t	*packet_ring_rx_peek(struct packet_ring *r, int *len);
+void	packet_ring_rx_next(struct packet_ring *r);
+
+/*
+ * Copy a packet, of len bytes, and its virtio-net header into the TX
+ * ring. It's sent by packet_ring_tx_flush(), or when the ring is full.
+ * Returns -1 if the packet is dropped.
+ */
+int	packet_ring_tx(struct packet_ring *r, const void *vnet_hdr,
+		       const struct iovec *iov, int iovcnt, int len);
+void	packet_ring_tx_flush(struct packet_ring *r);
+
+void	packet_ring_get_stats(struct packet_ring *r,
+			      struct packet_ring_stats *stats);
+
+#endif /* _PACKET_RING_H_ */
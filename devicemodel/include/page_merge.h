@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Page merging, with --page_merge. A thread scans guest memory by 2M
+ * chunk and nominates the chunks whose content hasn't changed between
+ * two passes to the hypervisor, which merges the identical pages and
+ * maps the zero pages to a zero page (HC_VM_MERGE_PAGES).
+ *
+ * A chunk of the 2M hugepages whose pages are all zero pages is freed:
+ * it's made inaccessible to the DM, the hypervisor gives its host memory
+ * back to the Service VM, and the hole is punched in the hugetlbfs file,
+ * so that the hugepage returns to the pool. It's backed again on the
+ * first access from the DM, through vm_map_gpa(), or from the guest,
+ * through a REQ_RESTORE_PAGE request.
+ *
+ * Guest memory mapped outside the DM, or used for DMA by the devices of
+ * the Service VM, can't be merged: vhost and O_DIRECT backends disable
+ * page merging, and the io_uring backends don't register guest memory.
+ */
+
+#ifndef _PAGE_MERGE_H_
+#define _PAGE_MERGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct vmctx;
+
+/* set by --page_merge */
+extern bool page_merge_enabled;
+
+/* Start the scan of the guest memory, if enabled. Returns 0 on success. */
+int page_merge_init(struct vmctx *ctx);
+void page_merge_deinit(struct vmctx *ctx);
+
+/*
+ * Disable page merging for good, a device is about to map guest memory
+ * outside the DM or to DMA to it. The freed chunks are backed again.
+ */
+void page_merge_disable(const char *why);
+
+/*
+ * Back the freed chunks again and don't free any until
+ * page_merge_unhold(), for the DM to access all guest memory directly.
+ */
+void page_merge_hold(void);
+void page_merge_unhold(void);
+
+/*
+ * Back the chunks of [gpa, gpa + len) again if freed, before the DM
+ * accesses them. Returns 0 on success.
+ */
+int page_merge_access(uint64_t gpa, size_t len);
+
+#endif /* _PAGE_MERGE_H_ */
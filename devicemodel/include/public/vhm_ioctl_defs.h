@@ -97,6 +97,7 @@
 #define IC_ALLOC_MEMSEG                 _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x00)
 #define IC_SET_MEMSEG                   _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x01)
 #define IC_UNSET_MEMSEG                 _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x02)
+#define IC_VM_MERGE_PAGES               _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x04)
 
 /* PCI assignment*/
 #define IC_ID_PCI_BASE                  0x50UL
@@ -151,6 +152,48 @@ struct vm_memmap {
 	uint32_t prot;	/* RWX */
 };
 
+/* the ops of IC_VM_MERGE_PAGES */
+#define PAGE_MERGE_NOMINATE		0U
+#define PAGE_MERGE_FREE_BACKING		1U
+#define PAGE_MERGE_RESTORE_BACKING	2U
+
+/**
+ * @brief Info to merge the identical pages of a guest memory range
+ *
+ * the parameter for IC_VM_MERGE_PAGES, passed to HC_VM_MERGE_PAGES
+ */
+struct page_merge_data {
+	/** PAGE_MERGE_NOMINATE, PAGE_MERGE_FREE_BACKING or PAGE_MERGE_RESTORE_BACKING */
+	uint32_t op;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** the guest physical address of the range, 4K aligned, 2M aligned to free or restore */
+	uint64_t gpa;
+
+	/** the size of the range, 4K aligned, 2M at most, 0 to only query the counters */
+	uint64_t size;
+
+	/** the host memory of the Service VM to restore the backing with, 2M aligned */
+	uint64_t hpa;
+
+	/** output of PAGE_MERGE_NOMINATE: pages of the range mapped to the zero page */
+	uint64_t zero_pages;
+
+	/** output: guest pages currently merged, system wide */
+	uint64_t merged_pages;
+
+	/** output: host pages currently shared by merged pages, system wide */
+	uint64_t shared_pages;
+
+	/** output: times the sharing has been broken by a write, system wide */
+	uint64_t unshared_pages;
+
+	/** output: zero pages whose backing has been freed, system wide */
+	uint64_t released_pages;
+} __attribute__((aligned(8)));
+
 /**
  * @brief Info to assign or deassign PCI for a VM
  *
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "vmmapi.h"
+
+#define SNAPSHOT_MAGIC		0x53504e534e524341UL	/* "ACRNSNPS" */
+#define SNAPSHOT_VERSION	1U
+
+/* guest memory starts at this file offset, each byte at offset + gpa */
+#define SNAPSHOT_MEM_OFFSET	4096UL
+
+/*
+ * Snapshot file layout:
+ * - struct snapshot_header, padded to SNAPSHOT_MEM_OFFSET
+ * - guest memory, laid out by gpa from SNAPSHOT_MEM_OFFSET. Only the
+ *   non-zero pages of lowmem, highmem and biosmem are written, zero pages
+ *   and the gaps between segments are holes, so the file is sparse and can
+ *   be mmap'ed as a flat guest memory image.
+ */
+struct snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t lowmem;
+	uint64_t highmem;
+	uint64_t highmem_gpa_base;
+	uint64_t biosmem;
+	/* BSP state to resume from, as set by the guest loader at launch */
+	struct acrn_set_vcpu_regs bsp_regs;
+};
+
+int vm_snapshot_save(struct vmctx *ctx, const char *path);
+int vm_snapshot_restore(struct vmctx *ctx, const char *path);
+int vm_monitor_snapshot(void *arg, char *path);
+
+#endif
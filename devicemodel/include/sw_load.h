@@ -28,6 +28,8 @@
 #ifndef	_CORE_SW_LOAD_
 #define _CORE_SW_LOAD_
 
+#include <stdbool.h>
+
 #define STR_LEN 1024
 #define BOOT_ARG_LEN 2048
 
@@ -79,7 +81,11 @@ int acrn_sw_load_bzimage(struct vmctx *ctx);
 int acrn_sw_load_elf(struct vmctx *ctx);
 int acrn_sw_load_vsbl(struct vmctx *ctx);
 int acrn_sw_load_ovmf(struct vmctx *ctx);
+int acrn_sw_restore_vsbl(struct vmctx *ctx);
+int acrn_sw_restore_ovmf(struct vmctx *ctx);
 int acrn_writeback_ovmf_nvstorage(struct vmctx *ctx);
 int acrn_sw_load(struct vmctx *ctx);
+int acrn_sw_restore(struct vmctx *ctx);
+bool acrn_sw_direct_boot(void);
 #endif
 
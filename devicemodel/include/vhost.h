@@ -30,12 +30,63 @@ struct vhost_vq {
 	struct vhost_dev *dev;	/**< pointer to vhost_dev */
 };
 
+struct vhost_dev;
+struct vhost_memory;
+struct vhost_vring_addr;
+struct vhost_vring_state;
+struct vhost_vring_file;
+
+/**
+ * @brief vhost transport operations
+ *
+ * The requests of the vhost protocol, handled by the vhost kernel driver
+ * through ioctls on its chardev, or by a vhost-user backend through
+ * messages on a unix socket. The vring indexes are relative to the first
+ * vq of the vhost_dev.
+ */
+struct vhost_ops {
+	int (*set_mem_table)(struct vhost_dev *vdev, struct vhost_memory *mem);
+	int (*set_vring_addr)(struct vhost_dev *vdev,
+			      struct vhost_vring_addr *addr);
+	int (*set_vring_num)(struct vhost_dev *vdev,
+			     struct vhost_vring_state *ring);
+	int (*set_vring_base)(struct vhost_dev *vdev,
+			      struct vhost_vring_state *ring);
+	int (*get_vring_base)(struct vhost_dev *vdev,
+			      struct vhost_vring_state *ring);
+	int (*set_vring_kick)(struct vhost_dev *vdev,
+			      struct vhost_vring_file *file);
+	int (*set_vring_call)(struct vhost_dev *vdev,
+			      struct vhost_vring_file *file);
+	int (*set_vring_busyloop_timeout)(struct vhost_dev *vdev,
+					  struct vhost_vring_state *s);
+	int (*set_features)(struct vhost_dev *vdev, uint64_t features);
+	int (*get_features)(struct vhost_dev *vdev, uint64_t *features);
+	int (*set_owner)(struct vhost_dev *vdev);
+	int (*reset_device)(struct vhost_dev *vdev);
+	int (*net_set_backend)(struct vhost_dev *vdev,
+			       struct vhost_vring_file *file);
+	int (*vsock_set_guest_cid)(struct vhost_dev *vdev, uint64_t *cid);
+	int (*vsock_set_running)(struct vhost_dev *vdev, int *running);
+};
+
+/** vhost kernel driver transport, the default one */
+extern const struct vhost_ops vhost_kernel_ops;
+/** vhost-user transport, see vhost_user_connect() */
+extern const struct vhost_ops vhost_user_ops;
+
 struct vhost_dev {
 	/**
 	 * backpointer to virtio_base
 	 */
 	struct virtio_base *base;
 
+	/**
+	 * transport operations, vhost_kernel_ops if not set before
+	 * vhost_dev_init()
+	 */
+	const struct vhost_ops *ops;
+
 	/**
 	 * pointer to vhost_vq array
 	 */
@@ -47,7 +98,7 @@ struct vhost_dev {
 	int nvqs;
 
 	/**
-	 * vhost chardev fd
+	 * vhost chardev fd, or vhost-user socket
 	 */
 	int fd;
 
@@ -86,7 +137,8 @@ struct vhost_dev {
  *
  * @param vdev Pointer to struct vhost_dev.
  * @param base Pointer to struct virtio_base.
- * @param fd fd of the vhost chardev.
+ * @param fd fd of the vhost chardev, or the vhost-user socket if
+ *        vdev->ops is &vhost_user_ops. It's closed by vhost_dev_deinit.
  * @param vq_idx The first virtqueue which would be used by this vhost dev.
  * @param vhost_features Subset of vhost features which would be enabled.
  * @param vhost_ext_features Specific vhost internal features to be enabled.
@@ -144,6 +196,45 @@ int vhost_dev_stop(struct vhost_dev *vdev);
  */
 int vhost_net_set_backend(struct vhost_dev *vdev, int backend_fd);
 
+/**
+ * @brief set the context id of the guest to vhost vsock.
+ *
+ * This interface is called to tell vhost the address of the guest, the
+ * host side reaches it with it. It must be set before the device runs.
+ *
+ * @param vdev Pointer to struct vhost_dev.
+ * @param cid Context id of the guest, 3 or above.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int vhost_vsock_set_guest_cid(struct vhost_dev *vdev, uint64_t cid);
+
+/**
+ * @brief start or stop vhost vsock.
+ *
+ * This interface is called once the data plane is started, to have vhost
+ * process the virtqueues, and before it's stopped.
+ *
+ * @param vdev Pointer to struct vhost_dev.
+ * @param running Whether vhost vsock processes the virtqueues.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+int vhost_vsock_set_running(struct vhost_dev *vdev, bool running);
+
+/**
+ * @brief connect to a vhost-user backend.
+ *
+ * This interface is called to get the socket of a vhost-user backend
+ * listening on a unix socket, to be passed to vhost_dev_init with
+ * vdev->ops set to &vhost_user_ops.
+ *
+ * @param path Path of the unix socket.
+ *
+ * @return the socket on success and -1 on failure.
+ */
+int vhost_user_connect(const char *path);
+
 /**
  * @}
  */
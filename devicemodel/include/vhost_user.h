@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/**
+ * @file vhost_user.h
+ *
+ * @brief vhost-user protocol messages
+ *
+ * The subset of the vhost-user protocol used by the device model, the
+ * frontend, to hand virtqueues over to a backend process: the guest
+ * memory files are passed with SET_MEM_TABLE, the kick and call eventfds
+ * with SET_VRING_KICK and SET_VRING_CALL, all as SCM_RIGHTS ancillary
+ * data of the message. The protocol features are not negotiated, so the
+ * rings are enabled as soon as their kick fd is set, and stopped by
+ * GET_VRING_BASE.
+ */
+
+#ifndef __VHOST_USER_H__
+#define __VHOST_USER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/vhost.h>
+
+enum vhost_user_request {
+	VHOST_USER_NONE = 0,
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_LOG_BASE = 6,
+	VHOST_USER_SET_LOG_FD = 7,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+	VHOST_USER_SET_VRING_ERR = 14,
+	VHOST_USER_MAX
+};
+
+#define VHOST_USER_VERSION		0x1U
+#define VHOST_USER_VERSION_MASK		0x3U
+#define VHOST_USER_REPLY_MASK		(0x1U << 2)
+
+/* in the u64 payload of SET_VRING_KICK/CALL, along with the vring index */
+#define VHOST_USER_VRING_IDX_MASK	0xffU
+#define VHOST_USER_VRING_NOFD_MASK	(0x1U << 8)
+
+/* the memory table and the fds of a message are limited to this */
+#define VHOST_USER_MAX_REGIONS		8
+
+/* in the features, the backend speaks the protocol features messages */
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+
+struct vhost_user_memory_region {
+	uint64_t guest_phys_addr;
+	uint64_t memory_size;
+	uint64_t userspace_addr;	/* in the frontend */
+	uint64_t mmap_offset;		/* of the region in the fd */
+};
+
+struct vhost_user_memory {
+	uint32_t nregions;
+	uint32_t padding;
+	struct vhost_user_memory_region regions[VHOST_USER_MAX_REGIONS];
+};
+
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;		/* of the payload */
+	union {
+		uint64_t u64;
+		struct vhost_vring_state state;
+		struct vhost_vring_addr addr;
+		struct vhost_user_memory memory;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE	offsetof(struct vhost_user_msg, payload)
+
+#endif
@@ -130,6 +130,7 @@
 #include <linux/virtio_config.h>
 #include <linux/virtio_pci.h>
 
+#include <sys/queue.h>
 #include "types.h"
 #include "timer.h"
 
@@ -193,6 +194,7 @@ enum {
 #define	VIRTIO_TYPE_SCSI	8
 #define	VIRTIO_TYPE_9P		9
 #define	VIRTIO_TYPE_INPUT	18
+#define	VIRTIO_TYPE_VSOCK	19
 
 /*
  * ACRN virtio device types
@@ -242,6 +244,44 @@ enum {
 #define VIRTIO_CONFIG_S_NEEDS_RESET	0x40
 #endif
 
+/*
+ * Packed virtqueue definitions, not available in the virtio_ring.h
+ * and virtio_config.h of older kernels.
+ */
+#ifndef VIRTIO_F_RING_PACKED
+#define VIRTIO_F_RING_PACKED		34
+#endif
+
+#ifndef VRING_PACKED_DESC_F_AVAIL
+#define VRING_PACKED_DESC_F_AVAIL	7
+#define VRING_PACKED_DESC_F_USED	15
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	0x1
+#define VRING_PACKED_EVENT_FLAG_DESC	0x2
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
+
+struct vring_packed_desc_event {
+	uint16_t off_wrap;
+	uint16_t flags;
+};
+
+struct vring_packed_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t id;
+	uint16_t flags;
+};
+#endif
+
+/*
+ * Capabilities a VBS-U device gets from the generic virtqueue code when
+ * it also exposes the modern (virtio 1.0) bars: packed virtqueues can
+ * only be negotiated through the 64-bit feature registers there.
+ */
+#define VIRTIO_PACKED_HOSTCAPS		\
+	((1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_PACKED))
+
 /*
  * Bits in VIRTIO_PCI_ISR.  These apply only if not using MSI-X.
  *
@@ -361,6 +401,14 @@ struct virtio_base {
 	int backend_type;               /**< VBSU, VBSK or VHOST */
 	struct acrn_timer polling_timer; /**< timer for polling mode */
 	int polling_in_progress;        /**< The polling status */
+
+	int poll_budget;		/**< % of a CPU adaptive polling takes */
+	LIST_ENTRY(virtio_base) poll_list; /**< in the adaptive poller */
+	uint64_t poll_period;		/**< end of the budget period, in ns */
+	uint64_t poll_used;		/**< CPU ns polled in the period */
+	int poll_active;		/**< in the last pass of the poller */
+	uint64_t poll_ns;		/**< CPU ns polled in total */
+	uint64_t nr_poll_exhausted;	/**< periods the budget ran out */
 };
 
 #define	VIRTIO_BASE_LOCK(vb)					\
@@ -398,6 +446,8 @@ struct virtio_ops {
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+#define	VQ_PACKED	0x04	/* packed virtqueue layout */
+#define	VQ_POLLING	0x08	/* checked by the adaptive poller */
 /**
  * @brief Virtqueue data structure
  *
@@ -416,11 +466,20 @@ struct virtio_ops {
  * keep a pointer to each one.  The event indices are similarly
  * (but more easily) computable, and this time we'll compute them:
  * they're just XX_ring[N].
+ *
+ * For a packed virtqueue (VQ_PACKED), desc, avail and used are NULL
+ * and the descriptor ring and the two event suppression structures
+ * are used instead.  last_avail, save_used and used_idx then count
+ * descriptors modulo 2^16: as qsize is a power of 2, the ring
+ * position is the count modulo qsize and the wrap counter is set
+ * while (count & qsize) is 0.
  */
 struct virtio_vq_info {
 	uint16_t qsize;		/**< size of this queue (a power of 2) */
 	void	(*notify)(void *, struct virtio_vq_info *);
 				/**< called instead of notify, if not NULL */
+	pthread_mutex_t *mtx;	/**< taken instead of the device mutex
+				     around notify, if not NULL */
 
 	struct virtio_base *base;
 				/**< backpointer to virtio_base */
@@ -440,12 +499,53 @@ struct virtio_vq_info {
 	volatile struct vring_used *used;
 				/**< the "used" ring */
 
+	volatile struct vring_packed_desc *packed_desc;
+				/**< the packed descriptor ring */
+	volatile struct vring_packed_desc_event *driver_event;
+				/**< driver event suppression, packed only */
+	volatile struct vring_packed_desc_event *device_event;
+				/**< device event suppression, packed only */
+	uint16_t used_idx;	/**< next used descriptor, packed only */
+	uint16_t prev_avail;	/**< last_avail before vq_getchain */
+	uint16_t *chain_ndesc;	/**< descriptors in each buffer id */
+
+	uint64_t nr_kicks;	/**< notifications from the guest */
+	uint64_t nr_intrs;	/**< interrupts delivered to the guest */
+	uint64_t nr_kicked;	/**< requests found on a kick, if polled */
+	uint64_t nr_polled;	/**< requests found by the poller */
+
+	uint16_t poll_seen;	/**< avail->idx the requests are counted to,
+				     or descriptor count if packed */
+	uint64_t poll_last;	/**< when the poller last found requests */
+	uint64_t poll_wait;	/**< ns between the checks of the poller */
+	uint64_t poll_next;	/**< when the poller checks next */
+
 	uint32_t gpa_desc[2];	/**< gpa of descriptors */
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
 };
 
+/*
+ * The mutex of a queue, or the device's: held when notified, and taken
+ * after the device's, never before it.
+ */
+#define	VQ_LOCK(vq)						\
+do {								\
+	if ((vq)->mtx)						\
+		pthread_mutex_lock((vq)->mtx);			\
+	else							\
+		VIRTIO_BASE_LOCK((vq)->base);			\
+} while (0)
+
+#define	VQ_UNLOCK(vq)						\
+do {								\
+	if ((vq)->mtx)						\
+		pthread_mutex_unlock((vq)->mtx);		\
+	else							\
+		VIRTIO_BASE_UNLOCK((vq)->base);			\
+} while (0)
+
 /* as noted above, these are sort of backwards, name-wise */
 #define VQ_AVAIL_EVENT_IDX(vq) \
 	(*(volatile uint16_t *)&(vq)->used->ring[(vq)->qsize])
@@ -465,6 +565,24 @@ vq_ring_ready(struct virtio_vq_info *vq)
 	return ((vq->flags & VQ_ALLOC) == VQ_ALLOC);
 }
 
+/**
+ * @brief Is the packed descriptor at the given count made available?
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Descriptor count, as kept in last_avail.
+ *
+ * @return false on not available and true on available.
+ */
+static inline bool
+vq_packed_desc_avail(struct virtio_vq_info *vq, uint16_t idx)
+{
+	uint16_t flags = vq->packed_desc[idx & (vq->qsize - 1)].flags;
+	int wrap = (idx & vq->qsize) == 0;
+
+	return ((flags >> VRING_PACKED_DESC_F_AVAIL) & 1) == wrap &&
+	    ((flags >> VRING_PACKED_DESC_F_USED) & 1) != wrap;
+}
+
 /**
  * @brief Are there "available" descriptors?
  *
@@ -477,8 +595,11 @@ vq_ring_ready(struct virtio_vq_info *vq)
 static inline bool
 vq_has_descs(struct virtio_vq_info *vq)
 {
-	return (vq_ring_ready(vq) && vq->last_avail !=
-	    vq->avail->idx);
+	if (!vq_ring_ready(vq))
+		return false;
+	if (vq->flags & VQ_PACKED)
+		return vq_packed_desc_avail(vq, vq->last_avail);
+	return vq->last_avail != vq->avail->idx;
 }
 
 /**
@@ -494,11 +615,19 @@ vq_has_descs(struct virtio_vq_info *vq)
 static inline void
 vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
 {
+	vq->nr_intrs++;
 	if (pci_msix_enabled(vb->dev))
 		pci_generate_msix(vb->dev, vq->msix_idx);
-	else {
+	else if (vq->mtx) {
+		/* the device mutex can't be taken under the queue's */
+		__atomic_or_fetch(&vb->isr, VIRTIO_PCI_ISR_QUEUES,
+			__ATOMIC_SEQ_CST);
+		pci_generate_msi(vb->dev, 0);
+		pci_lintr_assert(vb->dev);
+	} else {
 		VIRTIO_BASE_LOCK(vb);
-		vb->isr |= VIRTIO_PCI_ISR_QUEUES;
+		__atomic_or_fetch(&vb->isr, VIRTIO_PCI_ISR_QUEUES,
+			__ATOMIC_SEQ_CST);
 		pci_generate_msi(vb->dev, 0);
 		pci_lintr_assert(vb->dev);
 		VIRTIO_BASE_UNLOCK(vb);
@@ -526,7 +655,8 @@ virtio_config_changed(struct virtio_base *vb)
 		pci_generate_msix(vb->dev, vb->msix_cfg_idx);
 	else {
 		VIRTIO_BASE_LOCK(vb);
-		vb->isr |= VIRTIO_PCI_ISR_CONFIG;
+		__atomic_or_fetch(&vb->isr, VIRTIO_PCI_ISR_CONFIG,
+			__ATOMIC_SEQ_CST);
 		pci_generate_msi(vb->dev, 0);
 		pci_lintr_assert(vb->dev);
 		VIRTIO_BASE_UNLOCK(vb);
@@ -562,6 +692,57 @@ void virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
  */
 int acrn_parse_virtio_poll_interval(const char *optarg);
 
+/**
+ * @brief Set the default CPU budget of adaptive polling.
+ *
+ * @param optarg Pointer to the budget, "" or ":<percent of a CPU>".
+ *
+ * @return fail -1 success 0
+ */
+int virtio_poll_parse_default(const char *optarg);
+
+/**
+ * @brief Poll the virtqueues of a device adaptively.
+ *
+ * A virtqueue kicked by the guest is then checked by the poller thread,
+ * with the notifications disabled, as long as requests keep coming. It
+ * goes back to the notifications when it's been idle for a while, or
+ * when the polling of the device has taken more than its budget of CPU
+ * time. The device must have a mutex, which the notify callbacks are
+ * called with by the poller.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param budget Percent of a CPU the device is polled with, 0 not to poll
+ *               it, or -1 for the default of --virtio_poll adaptive.
+ *
+ * @return None
+ */
+void virtio_poll_init(struct virtio_base *base, int budget);
+
+/**
+ * @brief Stop polling the virtqueues of a device.
+ *
+ * The notify callbacks are no longer called by the poller once this
+ * returns. It must not be called with the device mutex held.
+ *
+ * @param base Pointer to struct virtio_base.
+ *
+ * @return None
+ */
+void virtio_poll_deinit(struct virtio_base *base);
+
+/**
+ * @brief Account a kick, and poll the virtqueue if its device is polled.
+ *
+ * Called with the device mutex held, before the notify callback.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return None
+ */
+void virtio_poll_kick(struct virtio_base *base, struct virtio_vq_info *vq);
+
 /**
  * @brief Initialize MSI-X vector capabilities if we're to use MSI-X,
  * or MSI capabilities if not.
@@ -622,7 +803,8 @@ void virtio_set_io_bar(struct virtio_base *base, int barnum);
  * and put them into a given iov[] array.
  *
  * @param vq Pointer to struct virtio_vq_info.
- * @param pidx Pointer to available ring position.
+ * @param pidx Pointer to available ring position, or buffer id for a
+ * packed virtqueue.
  * @param iov Pointer to iov[] array prepared by caller.
  * @param n_iov Size of iov[] array.
  * @param flags Pointer to a uint16_t array which will contain flag of
@@ -633,6 +815,35 @@ void virtio_set_io_bar(struct virtio_base *base, int barnum);
 int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		struct iovec *iov, int n_iov, uint16_t *flags);
 
+/**
+ * @brief A descriptor chain for vq_getchains_bulk() and vq_relchains_bulk()
+ */
+struct vq_chain {
+	struct iovec *iov;	/**< iov[] array prepared by caller */
+	uint16_t *flags;	/**< flags[] array prepared by caller, or NULL */
+	int n_iov;		/**< size of iov[] and flags[] arrays */
+	int n;			/**< number of descriptors, -1 if invalid */
+	uint16_t idx;		/**< available ring position or buffer id */
+	uint32_t iolen;		/**< bytes returned to frontend, set by caller */
+};
+
+/**
+ * @brief Walk through the chains of descriptors of up to nchains
+ * requests, as vq_getchain() does for one.
+ *
+ * The available index is read once for the batch and the descriptors
+ * are prefetched ahead of the walks.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to chains[] array with iov, flags and n_iov
+ * prepared by caller, idx and n of each chain taken are set.
+ * @param nchains Size of chains[] array.
+ *
+ * @return number of chains taken, or -1 on invalid available index.
+ */
+int vq_getchains_bulk(struct virtio_vq_info *vq, struct vq_chain *chains,
+		      int nchains);
+
 /**
  * @brief Return the currently-first request chain back to the
  * available ring.
@@ -655,6 +866,21 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Return request chains to the guest at once, setting the I/O
+ * length of each chain to its iolen.
+ *
+ * The used index is updated once for the whole batch.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to chains[] array, returned by vq_getchains_bulk().
+ * @param nchains Number of chains to return.
+ *
+ * @return None
+ */
+void vq_relchains_bulk(struct virtio_vq_info *vq, struct vq_chain *chains,
+		       int nchains);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -675,6 +901,12 @@ void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
  * For virtio poll mode, in order to avoid trap, we should never really
  * clear used ring flags.
  *
+ * With VIRTIO_RING_F_EVENT_IDX the guest ignores the flags and notifies
+ * once its avail index passes avail_event, so avail_event is set to the
+ * next chain the device will look at.  Either way the caller must issue
+ * a full barrier and check vq_has_descs() again after this, for chains
+ * made available before the guest saw the update.
+ *
  * @param base Pointer to struct virtio_base.
  * @param vq Pointer to struct virtio_vq_info.
  *
@@ -682,6 +914,31 @@ void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
  */
 void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq);
 
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * Ask the guest not to notify the device on this virtqueue, i.e. set
+ * VRING_USED_F_NO_NOTIFY, or disable the device event of a packed
+ * virtqueue.  Driver should always use this helper function rather
+ * than touching the used ring.  With VIRTIO_RING_F_EVENT_IDX on a split
+ * virtqueue this leaves avail_event behind, which the guest passes at
+ * most once before the next vq_clear_used_ring_flags().
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return None
+ */
+void vq_set_used_ring_flags(struct virtio_vq_info *vq);
+
+/**
+ * @brief Log the notification counters of all the virtqueues.
+ *
+ * @param base Pointer to struct virtio_base.
+ *
+ * @return None
+ */
+void virtio_print_vq_stats(struct virtio_base *base);
+
 /**
  * @brief Handle PCI configuration space reads.
  *
@@ -237,6 +237,8 @@ enum vm_exitcode {
 	VM_EXITCODE_INOUT = 0,
 	VM_EXITCODE_MMIO_EMUL,
 	VM_EXITCODE_PCI_CFG,
+	VM_EXITCODE_WP,			/* emulated by the hypervisor */
+	VM_EXITCODE_RESTORE_PAGE,
 	VM_EXITCODE_MAX
 };
 
@@ -74,6 +74,20 @@ struct vmctx {
 	void (*update_gvt_bar)(struct vmctx *ctx);
 };
 
+/*
+ * A guest memory range and the hugetlbfs file it's mmap'ed from, there
+ * are up to 3 memory segments with up to 2 levels of hugepages each.
+ */
+#define HUGETLB_MEM_REGIONS_MAX	6
+struct hugetlb_mem_region {
+	uint64_t gpa;
+	uint64_t size;
+	void	*hva;
+	int	fd;
+	uint64_t offset;	/* of the range in the file */
+	uint64_t pg_size;	/* of the hugepages of the file */
+};
+
 #define	PROT_RW		(PROT_READ | PROT_WRITE)
 #define	PROT_ALL	(PROT_READ | PROT_WRITE | PROT_EXEC)
 
@@ -116,6 +130,9 @@ bool	init_hugetlb(void);
 void	uninit_hugetlb(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
+void	hugetlb_zero_memory(struct vmctx *ctx);
+int	hugetlb_get_mem_regions(struct vmctx *ctx,
+	struct hugetlb_mem_region *regions, int max);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 size_t	vm_get_lowmem_size(struct vmctx *ctx);
@@ -138,11 +155,13 @@ int	vm_reset_ptdev_intx_info(struct vmctx *ctx, uint16_t virt_bdf,
 	uint16_t phys_bdf, int virt_pin, bool pic_pin);
 
 int	acrn_parse_cpu_affinity(char *arg);
+uint64_t	acrn_get_cpu_affinity(void);
 int	vm_create_vcpu(struct vmctx *ctx, uint16_t vcpu_id);
 int	vm_set_vcpu_regs(struct vmctx *ctx, struct acrn_set_vcpu_regs *cpu_regs);
 
 int	vm_get_cpu_state(struct vmctx *ctx, void *state_buf);
 int	vm_intr_monitor(struct vmctx *ctx, void *intr_buf);
+int	vm_merge_pages(struct vmctx *ctx, struct page_merge_data *data);
 void	vm_stop_watchdog(struct vmctx *ctx);
 void	vm_reset_watchdog(struct vmctx *ctx);
 
@@ -26,6 +26,7 @@
 #include <rdt.h>
 #include <vboot.h>
 #include <sgx.h>
+#include <page_merge.h>
 #include <uart16550.h>
 
 #define CPU_UP_TIMEOUT		100U /* millisecond */
@@ -256,10 +257,11 @@ void init_pcpu_post(uint16_t pcpu_id)
 		}
 
 		/*
-		 * Reserve memory from platform E820 for EPT 4K pages for all VMs
+		 * Set up the EPT page-table page pool shared by all VMs
 		 */
-#ifdef CONFIG_LAST_LEVEL_EPT_AT_BOOT
 		reserve_buffer_for_ept_pages();
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+		reserve_buffer_for_page_merge();
 #endif
 		/* Start all secondary cores */
 		startup_paddr = prepare_trampoline();
@@ -30,6 +30,40 @@ bool ept_is_mr_valid(const struct acrn_vm *vm, uint64_t base, uint64_t size)
 	return valid;
 }
 
+/*
+ * Give all the page-table pages of the normal world EPT back to the page pool,
+ * leaf mappings are left untouched.
+ */
+static void free_ept_pgtable_pages(struct acrn_vm *vm)
+{
+	struct memory_ops *mem_ops = &vm->arch_vm.ept_mem_ops;
+	uint64_t *pml4_page = (uint64_t *)vm->arch_vm.nworld_eptp;
+	uint64_t *pml4e, *pdpte, *pde;
+	uint64_t i, j, k;
+
+	for (i = 0UL; i < PTRS_PER_PML4E; i++) {
+		pml4e = pml4_page + i;
+		if (mem_ops->pgentry_present(*pml4e) == 0UL) {
+			continue;
+		}
+		for (j = 0UL; j < PTRS_PER_PDPTE; j++) {
+			pdpte = pml4e_page_vaddr(*pml4e) + j;
+			if ((mem_ops->pgentry_present(*pdpte) == 0UL) || (pdpte_large(*pdpte) != 0UL)) {
+				continue;
+			}
+			for (k = 0UL; k < PTRS_PER_PDE; k++) {
+				pde = pdpte_page_vaddr(*pdpte) + k;
+				if ((mem_ops->pgentry_present(*pde) != 0UL) && (pde_large(*pde) == 0UL)) {
+					mem_ops->free_pgtable_page(mem_ops->info, (struct page *)pde_page_vaddr(*pde));
+				}
+			}
+			mem_ops->free_pgtable_page(mem_ops->info, (struct page *)pdpte_page_vaddr(*pdpte));
+		}
+		mem_ops->free_pgtable_page(mem_ops->info, (struct page *)pml4e_page_vaddr(*pml4e));
+	}
+	mem_ops->free_pgtable_page(mem_ops->info, (struct page *)pml4_page);
+}
+
 void destroy_ept(struct acrn_vm *vm)
 {
 	/* Destroy secure world */
@@ -38,7 +72,8 @@ void destroy_ept(struct acrn_vm *vm)
 	}
 
 	if (vm->arch_vm.nworld_eptp != NULL) {
-		(void)memset(vm->arch_vm.nworld_eptp, 0U, PAGE_SIZE);
+		free_ept_pgtable_pages(vm);
+		vm->arch_vm.nworld_eptp = NULL;
 	}
 }
 
@@ -116,53 +151,75 @@ static inline void ept_flush_guest(struct acrn_vm *vm)
 	}
 }
 
-void ept_add_mr(struct acrn_vm *vm, uint64_t *pml4_page,
+int32_t ept_add_mr(struct acrn_vm *vm, uint64_t *pml4_page,
 	uint64_t hpa, uint64_t gpa, uint64_t size, uint64_t prot_orig)
 {
 	uint64_t prot = prot_orig;
+	int32_t ret;
 
 	dev_dbg(DBG_LEVEL_EPT, "%s, vm[%d] hpa: 0x%016lx gpa: 0x%016lx size: 0x%016lx prot: 0x%016x\n",
 			__func__, vm->vm_id, hpa, gpa, size, prot);
 
 	spinlock_obtain(&vm->ept_lock);
 
-	mmu_add(pml4_page, hpa, gpa, size, prot, &vm->arch_vm.ept_mem_ops);
+	ret = mmu_add(pml4_page, hpa, gpa, size, prot, &vm->arch_vm.ept_mem_ops);
 
 	spinlock_release(&vm->ept_lock);
 
 	ept_flush_guest(vm);
+
+	if (ret != 0) {
+		pr_err("%s, vm[%d] failed to map gpa 0x%lx size 0x%lx", __func__, vm->vm_id, gpa, size);
+	}
+
+	return ret;
 }
 
-void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page,
+int32_t ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page,
 		uint64_t gpa, uint64_t size,
 		uint64_t prot_set, uint64_t prot_clr)
 {
 	uint64_t local_prot = prot_set;
+	int32_t ret;
 
 	dev_dbg(DBG_LEVEL_EPT, "%s,vm[%d] gpa 0x%lx size 0x%lx\n", __func__, vm->vm_id, gpa, size);
 
 	spinlock_obtain(&vm->ept_lock);
 
-	mmu_modify_or_del(pml4_page, gpa, size, local_prot, prot_clr, &(vm->arch_vm.ept_mem_ops), MR_MODIFY);
+	ret = mmu_modify_or_del(pml4_page, gpa, size, local_prot, prot_clr, &(vm->arch_vm.ept_mem_ops), MR_MODIFY);
 
 	spinlock_release(&vm->ept_lock);
 
 	ept_flush_guest(vm);
+
+	if (ret != 0) {
+		pr_err("%s, vm[%d] failed to modify gpa 0x%lx size 0x%lx", __func__, vm->vm_id, gpa, size);
+	}
+
+	return ret;
 }
 /**
  * @pre [gpa,gpa+size) has been mapped into host physical memory region
  */
-void ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa, uint64_t size)
+int32_t ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa, uint64_t size)
 {
+	int32_t ret;
+
 	dev_dbg(DBG_LEVEL_EPT, "%s,vm[%d] gpa 0x%lx size 0x%lx\n", __func__, vm->vm_id, gpa, size);
 
 	spinlock_obtain(&vm->ept_lock);
 
-	mmu_modify_or_del(pml4_page, gpa, size, 0UL, 0UL, &vm->arch_vm.ept_mem_ops, MR_DEL);
+	ret = mmu_modify_or_del(pml4_page, gpa, size, 0UL, 0UL, &vm->arch_vm.ept_mem_ops, MR_DEL);
 
 	spinlock_release(&vm->ept_lock);
 
 	ept_flush_guest(vm);
+
+	if (ret != 0) {
+		pr_err("%s, vm[%d] failed to unmap gpa 0x%lx size 0x%lx", __func__, vm->vm_id, gpa, size);
+	}
+
+	return ret;
 }
 
 /**
@@ -0,0 +1,1156 @@
+/*
+ * Copyright (C) 2020 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <vm.h>
+#include <vm_config.h>
+#include <pgtable.h>
+#include <mmu.h>
+#include <ept.h>
+#include <e820.h>
+#include <irq.h>
+#include <page_merge.h>
+#include <logmsg.h>
+
+/*
+ * Same-page merging for post-launched VMs.
+ *
+ * The Service VM nominates guest memory ranges, every 4K page of a range is hashed and looked
+ * up among the pages seen before. When an identical page is found, the first page becomes the
+ * owner of a group: its mapping is made read-only in place and the new page is remapped,
+ * read-only, to the owner's host page. A write to any page of a group gives the writer its
+ * original host page back; a write to the owner dissolves the whole group.
+ *
+ * Zero pages are not grouped but remapped, read-only, to a zero page of the hypervisor. They
+ * are tracked by 2M chunk of guest memory: once all the pages of a chunk are zero pages, the
+ * Service VM may free the host memory backing the chunk. A write to such a page is then sent
+ * to the device model, which gives the chunk new backing memory before the write is retried.
+ *
+ * Otherwise the original host pages of merged pages stay allocated to their VM, so sharing can
+ * be broken without any allocation in the hypervisor. They are write-protected in the Service
+ * VM EPT too, a device model write to one of them breaks the sharing first, so that I/O
+ * to guest memory is never lost nor seen by another VM.
+ *
+ * Two pages are only compared once both are write-protected and the EPT mappings of the VMs
+ * owning them, and of the Service VM, are invalidated on every pCPU, so that no vCPU can
+ * still write to them through a stale TLB entry. The invalidation waits for the other pCPUs,
+ * which only answer with interrupts enabled, so it's done with page_merge_lock released: the
+ * pages of a nomination are write-protected by batch under the lock, the lock is dropped for
+ * the invalidation, then the pages still write-protected are compared and merged.
+ */
+
+#define DBG_LEVEL_PAGE_MERGE	6U
+
+#define MERGE_HASH_BITS		12U
+#define MERGE_HASH_SIZE		(1U << MERGE_HASH_BITS)
+#define INVALID_MERGE_IDX	0xFFFFFFFFU
+/* the match of a batched page which is compared with the zero page */
+#define MERGE_MATCH_ZERO	0xFFFFFFFEU
+
+/* the tracked pages and zero chunks of each post-launched VM */
+#define MERGE_PAGES_PER_VM	((uint32_t)(((CONFIG_UOS_RAM_SIZE >> PAGE_SHIFT) * \
+				CONFIG_PAGE_MERGE_PAGES_PERCENT) / 100UL))
+#define MERGE_PAGES_NUM		(MAX_POST_VM_NUM * MERGE_PAGES_PER_VM)
+#define ZERO_CHUNKS_PER_VM	((uint32_t)(CONFIG_UOS_RAM_SIZE >> PDE_SHIFT))
+#define ZERO_CHUNKS_NUM		(MAX_POST_VM_NUM * ZERO_CHUNKS_PER_VM)
+#define ZERO_CHUNK_PAGES	(PDE_SIZE >> PAGE_SHIFT)
+#define ZERO_CHUNK_BITMAP_NUM	(ZERO_CHUNK_PAGES / 64UL)
+
+/* the range of one nomination, and the pages write-protected under the lock at once */
+#define MERGE_NOMINATE_MAX_SIZE	PDE_SIZE
+#define MERGE_BATCH_PAGES	64U
+
+/* each tracked page is chained by content hash, by (vm, gpa) and by original host page */
+enum merge_chain {
+	CHAIN_CONTENT = 0,
+	CHAIN_GPA,
+	CHAIN_HPA,
+	CHAIN_NUM,
+};
+
+enum merge_state {
+	/* hashed only, neither write-protected nor shared */
+	MERGE_CANDIDATE = 0,
+	/* a candidate write-protected to become the owner of a group */
+	MERGE_PENDING,
+	/* write-protected to join a group */
+	MERGE_JOINING,
+	/* the owner or a member of a group */
+	MERGE_SHARED,
+};
+
+struct merge_page {
+	uint64_t hash;
+	uint64_t gpa;
+	/* the host page originally backing gpa */
+	uint64_t hpa;
+	/* the host page gpa is mapped to while merged, equal to hpa for the owner of a group */
+	uint64_t shared_hpa;
+	/* EPT memory type and access rights of the original mapping */
+	uint64_t prot;
+	uint32_t next[CHAIN_NUM];
+	uint16_t vm_id;
+	/* for the owner: number of other pages mapped to its host page */
+	uint16_t refcnt;
+	bool in_use;
+	uint8_t state;
+};
+
+/* The zero pages of a 2M chunk of guest memory backed by contiguous host memory */
+struct zero_chunk {
+	/* INVALID_GPA for a free chunk */
+	uint64_t gpa;
+	/* the host memory backing the chunk, INVALID_HPA if not known */
+	uint64_t hpa;
+	uint64_t prot;
+	/* the pages mapped to the zero page */
+	uint64_t merged[ZERO_CHUNK_BITMAP_NUM];
+	/* the pages write-protected to be compared with the zero page */
+	uint64_t pending[ZERO_CHUNK_BITMAP_NUM];
+	/* chained by backing host memory, while it's known */
+	uint32_t next_hpa;
+	uint16_t vm_id;
+	uint16_t merged_num;
+	/* the backing has been given back to the Service VM */
+	bool released;
+};
+
+struct merge_batch {
+	uint32_t num;
+	/* the VMs whose EPT has been changed */
+	uint64_t vm_mask;
+	struct {
+		uint64_t gpa;
+		/* the new page or the zero chunk */
+		uint32_t idx;
+		/* the page it's compared with, or MERGE_MATCH_ZERO */
+		uint32_t match;
+	} pages[MERGE_BATCH_PAGES];
+};
+
+static struct merge_page *merge_pages;
+static struct zero_chunk *zero_chunks;
+#ifndef CONFIG_LAST_LEVEL_EPT_AT_BOOT
+static struct merge_page merge_page_buf[MERGE_PAGES_NUM];
+static struct zero_chunk zero_chunk_buf[ZERO_CHUNKS_NUM];
+#endif
+static uint32_t merge_heads[CHAIN_NUM][MERGE_HASH_SIZE];
+static uint32_t zero_hpa_heads[MERGE_HASH_SIZE];
+static uint32_t merge_page_num[MAX_POST_VM_NUM];
+static struct page merge_zero_page;
+static uint64_t zero_hash;
+static struct page_merge_stats merge_stats;
+static spinlock_t page_merge_lock = { .head = 0U, .tail = 0U, };
+/* one nomination at a time, the others fail with -EBUSY */
+static bool nominate_busy;
+
+static uint64_t hash_page(const void *page)
+{
+	const uint64_t *p = (const uint64_t *)page;
+	uint64_t hash = 0xcbf29ce484222325UL;
+	uint32_t i;
+
+	for (i = 0U; i < (PAGE_SIZE / sizeof(uint64_t)); i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3UL;
+	}
+
+	return hash;
+}
+
+static bool same_page(uint64_t hpa1, uint64_t hpa2)
+{
+	const uint64_t *p1 = (const uint64_t *)hpa2hva(hpa1);
+	const uint64_t *p2 = (const uint64_t *)hpa2hva(hpa2);
+	bool same = true;
+	uint32_t i;
+
+	stac();
+	for (i = 0U; i < (PAGE_SIZE / sizeof(uint64_t)); i++) {
+		if (p1[i] != p2[i]) {
+			same = false;
+			break;
+		}
+	}
+	clac();
+
+	return same;
+}
+
+static uint32_t hash_key(uint64_t key)
+{
+	return (uint32_t)((key ^ (key >> MERGE_HASH_BITS) ^ (key >> (2U * MERGE_HASH_BITS))) &
+		(MERGE_HASH_SIZE - 1U));
+}
+
+static uint32_t chain_key(enum merge_chain chain, const struct merge_page *mp)
+{
+	uint64_t key;
+
+	switch (chain) {
+	case CHAIN_CONTENT:
+		key = mp->hash;
+		break;
+	case CHAIN_GPA:
+		key = (mp->gpa >> PAGE_SHIFT) ^ ((uint64_t)mp->vm_id << 40U);
+		break;
+	default:	/* CHAIN_HPA */
+		key = mp->hpa >> PAGE_SHIFT;
+		break;
+	}
+
+	return hash_key(key);
+}
+
+static void chain_insert(enum merge_chain chain, uint32_t idx)
+{
+	uint32_t key = chain_key(chain, &merge_pages[idx]);
+
+	merge_pages[idx].next[chain] = merge_heads[chain][key];
+	merge_heads[chain][key] = idx;
+}
+
+static void chain_remove(enum merge_chain chain, uint32_t idx)
+{
+	uint32_t key = chain_key(chain, &merge_pages[idx]);
+	uint32_t *pidx = &merge_heads[chain][key];
+
+	while (*pidx != INVALID_MERGE_IDX) {
+		if (*pidx == idx) {
+			*pidx = merge_pages[idx].next[chain];
+			break;
+		}
+		pidx = &merge_pages[*pidx].next[chain];
+	}
+}
+
+/* The post-launched VMs get the slices of the buffers in the order of their configuration */
+static uint16_t post_vm_slot(uint16_t vm_id)
+{
+	uint16_t i, slot = 0U;
+
+	for (i = 0U; i < vm_id; i++) {
+		if (get_vm_config(i)->load_order == POST_LAUNCHED_VM) {
+			slot++;
+		}
+	}
+
+	return slot;
+}
+
+void reserve_buffer_for_page_merge(void)
+{
+	uint32_t i;
+
+#ifdef CONFIG_LAST_LEVEL_EPT_AT_BOOT
+	uint64_t base;
+
+	base = e820_alloc_memory(MERGE_PAGES_NUM * sizeof(struct merge_page), ~0UL);
+	hv_access_memory_region_update(base, MERGE_PAGES_NUM * sizeof(struct merge_page));
+	merge_pages = (struct merge_page *)hpa2hva(base);
+	base = e820_alloc_memory(ZERO_CHUNKS_NUM * sizeof(struct zero_chunk), ~0UL);
+	hv_access_memory_region_update(base, ZERO_CHUNKS_NUM * sizeof(struct zero_chunk));
+	zero_chunks = (struct zero_chunk *)hpa2hva(base);
+#else
+	merge_pages = merge_page_buf;
+	zero_chunks = zero_chunk_buf;
+#endif
+
+	(void)memset(merge_heads, 0xFFU, sizeof(merge_heads));
+	(void)memset(zero_hpa_heads, 0xFFU, sizeof(zero_hpa_heads));
+	for (i = 0U; i < MERGE_PAGES_NUM; i++) {
+		merge_pages[i].in_use = false;
+	}
+	for (i = 0U; i < ZERO_CHUNKS_NUM; i++) {
+		zero_chunks[i].gpa = INVALID_GPA;
+	}
+	zero_hash = hash_page(&merge_zero_page);
+}
+
+static uint32_t alloc_merge_page(uint16_t slot)
+{
+	uint32_t idx = INVALID_MERGE_IDX;
+	uint32_t i;
+
+	if (merge_page_num[slot] < MERGE_PAGES_PER_VM) {
+		for (i = slot * MERGE_PAGES_PER_VM; i < ((slot + 1U) * MERGE_PAGES_PER_VM); i++) {
+			if (!merge_pages[i].in_use) {
+				merge_pages[i].in_use = true;
+				merge_pages[i].state = MERGE_CANDIDATE;
+				merge_pages[i].refcnt = 0U;
+				merge_page_num[slot]++;
+				idx = i;
+				break;
+			}
+		}
+	}
+
+	return idx;
+}
+
+static void free_merge_page(uint32_t idx)
+{
+	chain_remove(CHAIN_CONTENT, idx);
+	chain_remove(CHAIN_GPA, idx);
+	chain_remove(CHAIN_HPA, idx);
+	merge_pages[idx].in_use = false;
+	merge_page_num[idx / MERGE_PAGES_PER_VM]--;
+}
+
+/* Drop the candidate pages of a VM but keep to make room for new ones */
+static void flush_candidates(uint16_t slot, uint32_t keep)
+{
+	uint32_t idx;
+
+	for (idx = slot * MERGE_PAGES_PER_VM; idx < ((slot + 1U) * MERGE_PAGES_PER_VM); idx++) {
+		if (merge_pages[idx].in_use && (merge_pages[idx].state == MERGE_CANDIDATE) && (idx != keep)) {
+			free_merge_page(idx);
+		}
+	}
+}
+
+static uint32_t find_by_gpa(uint16_t vm_id, uint64_t gpa)
+{
+	struct merge_page key_page = { .vm_id = vm_id, .gpa = gpa };
+	uint32_t idx = merge_heads[CHAIN_GPA][chain_key(CHAIN_GPA, &key_page)];
+
+	while (idx != INVALID_MERGE_IDX) {
+		if ((merge_pages[idx].vm_id == vm_id) && (merge_pages[idx].gpa == gpa)) {
+			break;
+		}
+		idx = merge_pages[idx].next[CHAIN_GPA];
+	}
+
+	return idx;
+}
+
+/* Find the write-protected page originally backed by hpa */
+static uint32_t find_protected_by_hpa(uint64_t hpa)
+{
+	struct merge_page key_page = { .hpa = hpa };
+	uint32_t idx = merge_heads[CHAIN_HPA][chain_key(CHAIN_HPA, &key_page)];
+
+	while (idx != INVALID_MERGE_IDX) {
+		if ((merge_pages[idx].hpa == hpa) && (merge_pages[idx].state != MERGE_CANDIDATE)) {
+			break;
+		}
+		idx = merge_pages[idx].next[CHAIN_HPA];
+	}
+
+	return idx;
+}
+
+static uint32_t find_zero_chunk(uint16_t vm_id, uint64_t gpa)
+{
+	uint32_t base = post_vm_slot(vm_id) * ZERO_CHUNKS_PER_VM;
+	uint32_t start = (uint32_t)((gpa >> PDE_SHIFT) % ZERO_CHUNKS_PER_VM);
+	uint32_t i, idx = INVALID_MERGE_IDX;
+
+	/* open addressing, the chunks of a VM are only freed all together */
+	for (i = 0U; i < ZERO_CHUNKS_PER_VM; i++) {
+		struct zero_chunk *zc = &zero_chunks[base + ((start + i) % ZERO_CHUNKS_PER_VM)];
+
+		if (zc->gpa == INVALID_GPA) {
+			break;
+		}
+		if (zc->gpa == (gpa & PDE_MASK)) {
+			idx = base + ((start + i) % ZERO_CHUNKS_PER_VM);
+			break;
+		}
+	}
+
+	return idx;
+}
+
+static uint32_t find_zero_chunk_by_hpa(uint64_t hpa)
+{
+	uint32_t idx = zero_hpa_heads[hash_key(hpa >> PDE_SHIFT)];
+
+	while (idx != INVALID_MERGE_IDX) {
+		if (zero_chunks[idx].hpa == (hpa & PDE_MASK)) {
+			break;
+		}
+		idx = zero_chunks[idx].next_hpa;
+	}
+
+	return idx;
+}
+
+static void zero_chunk_insert_hpa(uint32_t idx)
+{
+	uint32_t key = hash_key(zero_chunks[idx].hpa >> PDE_SHIFT);
+
+	zero_chunks[idx].next_hpa = zero_hpa_heads[key];
+	zero_hpa_heads[key] = idx;
+}
+
+static void zero_chunk_remove_hpa(uint32_t idx)
+{
+	uint32_t *pidx = &zero_hpa_heads[hash_key(zero_chunks[idx].hpa >> PDE_SHIFT)];
+
+	while (*pidx != INVALID_MERGE_IDX) {
+		if (*pidx == idx) {
+			*pidx = zero_chunks[idx].next_hpa;
+			break;
+		}
+		pidx = &zero_chunks[*pidx].next_hpa;
+	}
+}
+
+static bool zero_chunk_test(const uint64_t *bitmap, uint64_t gpa)
+{
+	uint64_t nr = (gpa & (PDE_SIZE - 1UL)) >> PAGE_SHIFT;
+
+	return bitmap_test((uint16_t)(nr & 0x3FUL), &bitmap[nr >> 6U]);
+}
+
+static void zero_chunk_set(uint64_t *bitmap, uint64_t gpa, bool set)
+{
+	uint64_t nr = (gpa & (PDE_SIZE - 1UL)) >> PAGE_SHIFT;
+
+	if (set) {
+		bitmap_set_nolock((uint16_t)(nr & 0x3FUL), &bitmap[nr >> 6U]);
+	} else {
+		bitmap_clear_nolock((uint16_t)(nr & 0x3FUL), &bitmap[nr >> 6U]);
+	}
+}
+
+/* No page of the chunk is merged nor write-protected to be compared */
+static bool zero_chunk_idle(const struct zero_chunk *zc)
+{
+	uint32_t i;
+	bool idle = (zc->merged_num == 0U) && !zc->released;
+
+	for (i = 0U; idle && (i < ZERO_CHUNK_BITMAP_NUM); i++) {
+		idle = (zc->pending[i] == 0UL);
+	}
+
+	return idle;
+}
+
+/*
+ * Find, or set up, the zero chunk of a zero page at gpa backed by hpa
+ *
+ * @retval INVALID_MERGE_IDX if the page doesn't fit the host memory or the access rights of
+ *         the chunk, which then can't be freed
+ */
+static uint32_t get_zero_chunk(uint16_t vm_id, uint64_t gpa, uint64_t hpa, uint64_t prot)
+{
+	uint64_t chunk_hpa = hpa - (gpa & (PDE_SIZE - 1UL));
+	uint32_t base = post_vm_slot(vm_id) * ZERO_CHUNKS_PER_VM;
+	uint32_t start = (uint32_t)((gpa >> PDE_SHIFT) % ZERO_CHUNKS_PER_VM);
+	uint32_t i, idx = find_zero_chunk(vm_id, gpa);
+	struct zero_chunk *zc;
+
+	if (idx == INVALID_MERGE_IDX) {
+		for (i = 0U; i < ZERO_CHUNKS_PER_VM; i++) {
+			zc = &zero_chunks[base + ((start + i) % ZERO_CHUNKS_PER_VM)];
+			if (zc->gpa == INVALID_GPA) {
+				(void)memset(zc, 0U, sizeof(*zc));
+				zc->gpa = gpa & PDE_MASK;
+				zc->hpa = INVALID_HPA;
+				zc->vm_id = vm_id;
+				idx = base + ((start + i) % ZERO_CHUNKS_PER_VM);
+				break;
+			}
+		}
+	}
+
+	if (idx != INVALID_MERGE_IDX) {
+		zc = &zero_chunks[idx];
+		if (zero_chunk_idle(zc) && (zc->hpa != chunk_hpa) && mem_aligned_check(chunk_hpa, PDE_SIZE)) {
+			/* an idle chunk follows the current backing of the guest memory */
+			if (zc->hpa != INVALID_HPA) {
+				zero_chunk_remove_hpa(idx);
+			}
+			zc->hpa = chunk_hpa;
+			zc->prot = prot;
+			zero_chunk_insert_hpa(idx);
+		}
+		if (zc->released || (zc->hpa != chunk_hpa) || (zc->prot != prot)) {
+			idx = INVALID_MERGE_IDX;
+		}
+	}
+
+	return idx;
+}
+
+static void sos_write_protect(uint64_t hpa, uint64_t size, bool set)
+{
+	struct acrn_vm *sos_vm = get_sos_vm();
+
+	if (ept_is_mr_valid(sos_vm, hpa, size)) {
+		(void)ept_modify_mr(sos_vm, (uint64_t *)sos_vm->arch_vm.nworld_eptp, hpa, size,
+			set ? 0UL : EPT_WR, set ? EPT_WR : 0UL);
+	}
+}
+
+static void merge_invept(void *data)
+{
+	struct acrn_vm *vm = (struct acrn_vm *)data;
+
+	invept(vm->arch_vm.nworld_eptp);
+	if (vm->sworld_control.flag.active != 0UL) {
+		invept(vm->arch_vm.sworld_eptp);
+	}
+}
+
+/*
+ * Invalidate the EPT mappings of vm on the pCPUs its vCPUs run on and wait for it, unlike
+ * the EPT_FLUSH request, which is only handled before the next VM entry.
+ *
+ * @pre page_merge_lock is not held, the other pCPUs may be spinning on it with interrupts
+ *      disabled
+ */
+static void flush_ept_sync(struct acrn_vm *vm)
+{
+	struct acrn_vcpu *vcpu;
+	uint64_t mask = 0UL;
+	uint16_t i, pcpu_id = get_pcpu_id();
+
+	foreach_vcpu(i, vm, vcpu) {
+		bitmap_set_nolock(pcpuid_from_vcpu(vcpu), &mask);
+	}
+
+	if (bitmap_test(pcpu_id, &mask)) {
+		bitmap_clear_nolock(pcpu_id, &mask);
+		merge_invept(vm);
+	}
+	if (mask != 0UL) {
+		smp_call_function(mask, merge_invept, vm);
+	}
+}
+
+/* Write-protect, or restore the write access of, a page in its VM and in the Service VM */
+static void protect_page(struct acrn_vm *vm, uint64_t gpa, uint64_t hpa, uint64_t prot, bool set)
+{
+	(void)ept_modify_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, gpa, PAGE_SIZE,
+		set ? 0UL : (prot & EPT_WR), set ? EPT_WR : 0UL);
+	sos_write_protect(hpa, PAGE_SIZE, set);
+}
+
+/*
+ * Map a guest page to another host page. The page has been write-protected before, so it's
+ * mapped by a 4K entry and no page-table page is needed.
+ */
+static void remap_page(struct acrn_vm *vm, uint64_t gpa, uint64_t hpa, uint64_t prot)
+{
+	uint64_t *eptp = (uint64_t *)vm->arch_vm.nworld_eptp;
+
+	if (eptp != NULL) {
+		(void)ept_del_mr(vm, eptp, gpa, PAGE_SIZE);
+		if (ept_add_mr(vm, eptp, hpa, gpa, PAGE_SIZE, prot) != 0) {
+			pr_err("%s, vm%hu failed to map gpa 0x%lx", __func__, vm->vm_id, gpa);
+		}
+	}
+}
+
+/* Map a merged page back to its original host page with its original access rights */
+static void unmerge_member(uint32_t idx)
+{
+	struct merge_page *mp = &merge_pages[idx];
+
+	/*
+	 * The original host page is write-protected for the Service VM and unmapped for the
+	 * guest while merged, so its content is still identical to the shared one.
+	 */
+	remap_page(get_vm_from_vmid(mp->vm_id), mp->gpa, mp->hpa, mp->prot);
+	sos_write_protect(mp->hpa, PAGE_SIZE, false);
+	merge_stats.merged_pages--;
+	free_merge_page(idx);
+}
+
+static void release_owner(uint32_t idx)
+{
+	struct merge_page *mp = &merge_pages[idx];
+	struct acrn_vm *vm = get_vm_from_vmid(mp->vm_id);
+
+	if (vm->arch_vm.nworld_eptp != NULL) {
+		(void)ept_modify_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, mp->gpa, PAGE_SIZE, mp->prot & EPT_WR, 0UL);
+	}
+	sos_write_protect(mp->hpa, PAGE_SIZE, false);
+	merge_stats.shared_pages--;
+	free_merge_page(idx);
+}
+
+static uint32_t find_owner(uint64_t hash, uint64_t shared_hpa)
+{
+	struct merge_page key_page = { .hash = hash };
+	uint32_t idx = merge_heads[CHAIN_CONTENT][chain_key(CHAIN_CONTENT, &key_page)];
+
+	while (idx != INVALID_MERGE_IDX) {
+		if ((merge_pages[idx].state == MERGE_SHARED) && (merge_pages[idx].hpa == shared_hpa)) {
+			break;
+		}
+		idx = merge_pages[idx].next[CHAIN_CONTENT];
+	}
+
+	return idx;
+}
+
+static void dissolve_group(uint32_t owner_idx)
+{
+	struct merge_page key_page = { .hash = merge_pages[owner_idx].hash };
+	uint64_t shared_hpa = merge_pages[owner_idx].hpa;
+	uint32_t idx, next;
+
+	idx = merge_heads[CHAIN_CONTENT][chain_key(CHAIN_CONTENT, &key_page)];
+	while (idx != INVALID_MERGE_IDX) {
+		next = merge_pages[idx].next[CHAIN_CONTENT];
+		if ((merge_pages[idx].state == MERGE_SHARED) && (idx != owner_idx) &&
+				(merge_pages[idx].shared_hpa == shared_hpa)) {
+			unmerge_member(idx);
+		}
+		idx = next;
+	}
+	release_owner(owner_idx);
+}
+
+/* Break the sharing of one page of a group, dissolve the group if the page is its owner */
+static void unshare_page(uint32_t idx)
+{
+	struct merge_page *mp = &merge_pages[idx];
+	uint64_t hash = mp->hash, shared_hpa = mp->shared_hpa;
+	uint32_t owner_idx;
+
+	if (mp->hpa == mp->shared_hpa) {
+		dissolve_group(idx);
+	} else {
+		unmerge_member(idx);
+		owner_idx = find_owner(hash, shared_hpa);
+		if (owner_idx != INVALID_MERGE_IDX) {
+			merge_pages[owner_idx].refcnt--;
+			if (merge_pages[owner_idx].refcnt == 0U) {
+				release_owner(owner_idx);
+			}
+		}
+	}
+	merge_stats.unshared_pages++;
+}
+
+/* Give a write-protected page its write access back, before it's compared */
+static void unprotect_pending(uint32_t idx)
+{
+	struct merge_page *mp = &merge_pages[idx];
+
+	protect_page(get_vm_from_vmid(mp->vm_id), mp->gpa, mp->hpa, mp->prot, false);
+	if (mp->state == MERGE_PENDING) {
+		mp->state = MERGE_CANDIDATE;
+	} else {
+		free_merge_page(idx);
+	}
+}
+
+/* Map a zero page of a chunk back to its backing host page */
+static void unmerge_zero_page(uint32_t chunk_idx, uint64_t gpa)
+{
+	struct zero_chunk *zc = &zero_chunks[chunk_idx];
+	uint64_t hpa = zc->hpa + (gpa & (PDE_SIZE - 1UL));
+
+	remap_page(get_vm_from_vmid(zc->vm_id), gpa, hpa, zc->prot);
+	sos_write_protect(hpa, PAGE_SIZE, false);
+	zero_chunk_set(zc->merged, gpa, false);
+	zc->merged_num--;
+	merge_stats.merged_pages--;
+	merge_stats.zero_pages--;
+	merge_stats.unshared_pages++;
+}
+
+/* Give a zero page write-protected to be compared its write access back */
+static void unprotect_zero_pending(uint32_t chunk_idx, uint64_t gpa)
+{
+	struct zero_chunk *zc = &zero_chunks[chunk_idx];
+
+	protect_page(get_vm_from_vmid(zc->vm_id), gpa, zc->hpa + (gpa & (PDE_SIZE - 1UL)), zc->prot, false);
+	zero_chunk_set(zc->pending, gpa, false);
+}
+
+static void batch_add(struct merge_batch *batch, uint64_t gpa, uint32_t idx, uint32_t match)
+{
+	batch->pages[batch->num].gpa = gpa;
+	batch->pages[batch->num].idx = idx;
+	batch->pages[batch->num].match = match;
+	batch->num++;
+}
+
+/* Look for a group owner, or a candidate, with the same content as a page backed by hpa */
+static uint32_t find_match(uint64_t hash, uint64_t hpa)
+{
+	struct merge_page key_page = { .hash = hash };
+	uint32_t idx = merge_heads[CHAIN_CONTENT][chain_key(CHAIN_CONTENT, &key_page)];
+
+	while (idx != INVALID_MERGE_IDX) {
+		const struct merge_page *mp = &merge_pages[idx];
+
+		if ((mp->hash == hash) && (mp->hpa == mp->shared_hpa) && (mp->hpa != hpa) &&
+				(mp->state != MERGE_JOINING)) {
+			break;
+		}
+		idx = mp->next[CHAIN_CONTENT];
+	}
+
+	return idx;
+}
+
+/*
+ * Hash the page at gpa of vm and track it. A zero page, or a page with a match, is
+ * write-protected, along with its match, and added to the batch to be compared once the EPT
+ * mappings are invalidated.
+ *
+ * @pre page_merge_lock is held
+ *
+ * @retval false if there is no room left to track the page
+ */
+static bool prepare_page(struct acrn_vm *vm, uint64_t gpa, struct merge_batch *batch)
+{
+	const struct memory_ops *mem_ops = &vm->arch_vm.ept_mem_ops;
+	const uint64_t *pgentry;
+	uint64_t pg_size = 0UL, hpa, prot, hash;
+	uint16_t slot = post_vm_slot(vm->vm_id);
+	uint32_t idx, match, chunk_idx;
+	bool ret = true;
+
+	/* a candidate is hashed again, its content may have changed since */
+	idx = find_by_gpa(vm->vm_id, gpa);
+	if ((idx != INVALID_MERGE_IDX) && (merge_pages[idx].state == MERGE_CANDIDATE)) {
+		free_merge_page(idx);
+		idx = INVALID_MERGE_IDX;
+	}
+
+	pgentry = lookup_address((uint64_t *)vm->arch_vm.nworld_eptp, gpa, &pg_size, mem_ops);
+	if ((pgentry != NULL) && ((*pgentry & EPT_WR) != 0UL) && ((*pgentry & EPT_MT_MASK) == EPT_WB) &&
+			(idx == INVALID_MERGE_IDX)) {
+		hpa = (((*pgentry & (~EPT_PFN_HIGH_MASK)) & (~(pg_size - 1UL))) | (gpa & (pg_size - 1UL)));
+		prot = *pgentry & (EPT_RWX | EPT_MT_MASK);
+		if (pg_size != PTE_SIZE) {
+			mem_ops->recover_exe_right(&prot);
+		}
+
+		stac();
+		hash = hash_page(hpa2hva(hpa));
+		clac();
+
+		chunk_idx = INVALID_MERGE_IDX;
+		if (hash == zero_hash) {
+			chunk_idx = get_zero_chunk(vm->vm_id, gpa, hpa, prot);
+		}
+
+		if (chunk_idx != INVALID_MERGE_IDX) {
+			/* a writable page of a chunk is neither merged nor pending */
+			zero_chunk_set(zero_chunks[chunk_idx].pending, gpa, true);
+			protect_page(vm, gpa, hpa, prot, true);
+			batch_add(batch, gpa, chunk_idx, MERGE_MATCH_ZERO);
+		} else {
+			match = find_match(hash, hpa);
+			idx = alloc_merge_page(slot);
+			if (idx == INVALID_MERGE_IDX) {
+				/* not the candidate about to become the owner */
+				flush_candidates(slot, match);
+				idx = alloc_merge_page(slot);
+			}
+
+			if (idx == INVALID_MERGE_IDX) {
+				ret = false;
+			} else {
+				struct merge_page *np = &merge_pages[idx];
+
+				np->hash = hash;
+				np->gpa = gpa;
+				np->hpa = hpa;
+				np->prot = prot;
+				np->vm_id = vm->vm_id;
+				np->shared_hpa = hpa;
+				chain_insert(CHAIN_CONTENT, idx);
+				chain_insert(CHAIN_GPA, idx);
+				chain_insert(CHAIN_HPA, idx);
+
+				if (match != INVALID_MERGE_IDX) {
+					struct merge_page *mp = &merge_pages[match];
+
+					/* both pages are write-protected, everywhere, before they are compared */
+					if (mp->state == MERGE_CANDIDATE) {
+						protect_page(get_vm_from_vmid(mp->vm_id), mp->gpa, mp->hpa, mp->prot, true);
+						mp->state = MERGE_PENDING;
+						bitmap_set_nolock(mp->vm_id, &batch->vm_mask);
+					}
+					protect_page(vm, gpa, hpa, prot, true);
+					np->state = MERGE_JOINING;
+					batch_add(batch, gpa, idx, match);
+				}
+			}
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Compare the pages of the batch which are still write-protected and merge them, or give them
+ * their write access back.
+ *
+ * @pre page_merge_lock is held
+ */
+static void merge_batch(struct acrn_vm *vm, const struct merge_batch *batch)
+{
+	uint64_t gpa, hpa;
+	uint32_t i, idx, match;
+
+	for (i = 0U; i < batch->num; i++) {
+		gpa = batch->pages[i].gpa;
+		idx = batch->pages[i].idx;
+		match = batch->pages[i].match;
+
+		if (match == MERGE_MATCH_ZERO) {
+			struct zero_chunk *zc = &zero_chunks[idx];
+
+			/* a write has given the page its write access back meanwhile */
+			if ((zc->vm_id == vm->vm_id) && (zc->gpa == (gpa & PDE_MASK)) && zero_chunk_test(zc->pending, gpa)) {
+				hpa = zc->hpa + (gpa & (PDE_SIZE - 1UL));
+				zero_chunk_set(zc->pending, gpa, false);
+				if (same_page(hpa, hva2hpa(&merge_zero_page))) {
+					remap_page(vm, gpa, hva2hpa(&merge_zero_page), zc->prot & ~EPT_WR);
+					zero_chunk_set(zc->merged, gpa, true);
+					zc->merged_num++;
+					merge_stats.merged_pages++;
+					merge_stats.zero_pages++;
+				} else {
+					protect_page(vm, gpa, hpa, zc->prot, false);
+				}
+			}
+		} else {
+			struct merge_page *np = &merge_pages[idx];
+			struct merge_page *mp = &merge_pages[match];
+
+			if (np->in_use && (np->state == MERGE_JOINING) && (np->gpa == gpa)) {
+				if (mp->in_use && ((mp->state == MERGE_PENDING) || (mp->state == MERGE_SHARED)) &&
+						same_page(mp->hpa, np->hpa)) {
+					if (mp->state == MERGE_PENDING) {
+						mp->state = MERGE_SHARED;
+						merge_stats.shared_pages++;
+					}
+					mp->refcnt++;
+
+					np->state = MERGE_SHARED;
+					np->shared_hpa = mp->hpa;
+					remap_page(vm, gpa, mp->hpa, np->prot & ~EPT_WR);
+					merge_stats.merged_pages++;
+
+					dev_dbg(DBG_LEVEL_PAGE_MERGE, "vm%hu gpa 0x%lx merged to hpa 0x%lx",
+						vm->vm_id, gpa, mp->hpa);
+				} else {
+					/* the page, or its match, has changed since it was hashed, forget it */
+					unprotect_pending(idx);
+				}
+			}
+		}
+	}
+
+	/* the candidates nothing has joined */
+	for (i = 0U; i < batch->num; i++) {
+		match = batch->pages[i].match;
+		if ((match != MERGE_MATCH_ZERO) && merge_pages[match].in_use &&
+				(merge_pages[match].state == MERGE_PENDING)) {
+			unprotect_pending(match);
+		}
+	}
+}
+
+/* pass-through devices DMA to the original host pages behind the EPT, skip such VMs */
+static bool has_ptdev(const struct acrn_vm *vm)
+{
+	const struct pci_vdev *vdev;
+	uint32_t i;
+	bool ret = false;
+
+	for (i = 0U; i < vm->vpci.pci_vdev_cnt; i++) {
+		vdev = &vm->vpci.pci_vdevs[i];
+		if ((vdev->pdev != NULL) && (vdev->user == vdev)) {
+			ret = true;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static uint64_t count_zero_pages(const struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	uint64_t offset, num = 0UL;
+	uint32_t chunk_idx;
+
+	for (offset = 0UL; offset < size; offset += PAGE_SIZE) {
+		chunk_idx = find_zero_chunk(vm->vm_id, gpa + offset);
+		if ((chunk_idx != INVALID_MERGE_IDX) && zero_chunk_test(zero_chunks[chunk_idx].merged, gpa + offset)) {
+			num++;
+		}
+	}
+
+	return num;
+}
+
+int32_t page_merge_nominate(struct acrn_vm *vm, uint64_t gpa, uint64_t size, uint64_t *zero_pages)
+{
+	struct merge_batch batch;
+	uint64_t offset = 0UL;
+	uint16_t vm_id;
+	bool full = false;
+	int32_t ret = -EINVAL;
+
+	if (!is_postlaunched_vm(vm) || is_rt_vm(vm) || is_lapic_pt_configured(vm) || has_ptdev(vm)) {
+		pr_err("%s, vm%hu can't take part in page merging", __func__, vm->vm_id);
+	} else if (!mem_aligned_check(gpa, PAGE_SIZE) || !mem_aligned_check(size, PAGE_SIZE) ||
+			(size > MERGE_NOMINATE_MAX_SIZE) || ((size != 0UL) && !ept_is_mr_valid(vm, gpa, size))) {
+		pr_err("%s, vm%hu invalid range gpa 0x%lx size 0x%lx", __func__, vm->vm_id, gpa, size);
+	} else {
+		spinlock_obtain(&page_merge_lock);
+		if (nominate_busy) {
+			ret = -EBUSY;
+		} else {
+			nominate_busy = true;
+			ret = 0;
+		}
+
+		while ((ret == 0) && (offset < size) && !full) {
+			batch.num = 0U;
+			batch.vm_mask = 0UL;
+			while ((offset < size) && (batch.num < MERGE_BATCH_PAGES) && !full) {
+				full = !prepare_page(vm, gpa + offset, &batch);
+				offset += PAGE_SIZE;
+			}
+			if (full) {
+				pr_warn("%s, no room to track more pages of vm%hu", __func__, vm->vm_id);
+			}
+
+			if (batch.num != 0U) {
+				spinlock_release(&page_merge_lock);
+				flush_ept_sync(vm);
+				for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+					if ((vm_id != vm->vm_id) && bitmap_test(vm_id, &batch.vm_mask)) {
+						flush_ept_sync(get_vm_from_vmid(vm_id));
+					}
+				}
+				flush_ept_sync(get_sos_vm());
+				spinlock_obtain(&page_merge_lock);
+
+				merge_batch(vm, &batch);
+			}
+		}
+
+		if (ret == 0) {
+			*zero_pages = count_zero_pages(vm, gpa, size);
+			nominate_busy = false;
+		}
+		spinlock_release(&page_merge_lock);
+	}
+
+	return ret;
+}
+
+int32_t page_merge_free_backing(struct acrn_vm *vm, uint64_t gpa)
+{
+	uint32_t chunk_idx, i;
+	struct zero_chunk *zc = NULL;
+	bool all_zero = false;
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(vm) && mem_aligned_check(gpa, PDE_SIZE)) {
+		spinlock_obtain(&page_merge_lock);
+		chunk_idx = find_zero_chunk(vm->vm_id, gpa);
+		if ((chunk_idx != INVALID_MERGE_IDX) && !zero_chunks[chunk_idx].released &&
+				(zero_chunks[chunk_idx].hpa != INVALID_HPA)) {
+			zc = &zero_chunks[chunk_idx];
+			all_zero = true;
+			for (i = 0U; i < ZERO_CHUNK_BITMAP_NUM; i++) {
+				if (zc->merged[i] != ~0UL) {
+					all_zero = false;
+					break;
+				}
+			}
+		}
+
+		if (all_zero && (zc != NULL)) {
+			/* the Service VM gets its host memory back, writable */
+			sos_write_protect(zc->hpa, PDE_SIZE, false);
+			zero_chunk_remove_hpa(chunk_idx);
+			zc->hpa = INVALID_HPA;
+			zc->released = true;
+			merge_stats.released_pages += ZERO_CHUNK_PAGES;
+			ret = 0;
+		}
+		spinlock_release(&page_merge_lock);
+
+		if (ret == 0) {
+			/* no vCPU may still reach the backing through a stale mapping once it's freed */
+			flush_ept_sync(vm);
+		} else {
+			pr_err("%s, vm%hu gpa 0x%lx is not a chunk of zero pages", __func__, vm->vm_id, gpa);
+		}
+	}
+
+	return ret;
+}
+
+int32_t page_merge_restore_backing(struct acrn_vm *vm, uint64_t gpa, uint64_t hpa)
+{
+	struct acrn_vm *sos_vm = get_sos_vm();
+	uint32_t chunk_idx;
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(vm) && mem_aligned_check(gpa, PDE_SIZE) && mem_aligned_check(hpa, PDE_SIZE) &&
+			ept_is_mr_valid(sos_vm, hpa, PDE_SIZE)) {
+		/* the zero pages of the chunk are given back from it, one by one */
+		stac();
+		(void)memset(hpa2hva(hpa), 0U, PDE_SIZE);
+		clac();
+
+		spinlock_obtain(&page_merge_lock);
+		chunk_idx = find_zero_chunk(vm->vm_id, gpa);
+		if ((chunk_idx != INVALID_MERGE_IDX) && zero_chunks[chunk_idx].released &&
+				(find_zero_chunk_by_hpa(hpa) == INVALID_MERGE_IDX)) {
+			zero_chunks[chunk_idx].hpa = hpa;
+			zero_chunks[chunk_idx].released = false;
+			zero_chunk_insert_hpa(chunk_idx);
+			sos_write_protect(hpa, PDE_SIZE, true);
+			merge_stats.released_pages -= ZERO_CHUNK_PAGES;
+			ret = 0;
+		}
+		spinlock_release(&page_merge_lock);
+
+		if (ret == 0) {
+			flush_ept_sync(sos_vm);
+		}
+	}
+
+	if (ret != 0) {
+		pr_err("%s, vm%hu can't back gpa 0x%lx with hpa 0x%lx", __func__, vm->vm_id, gpa, hpa);
+	}
+
+	return ret;
+}
+
+enum page_merge_write page_merge_handle_write(struct acrn_vm *vm, uint64_t gpa)
+{
+	const uint64_t *pgentry;
+	uint64_t page_gpa = gpa & PAGE_MASK, pg_size = 0UL;
+	uint32_t idx = INVALID_MERGE_IDX, chunk_idx = INVALID_MERGE_IDX;
+	enum page_merge_write ret = PAGE_MERGE_WRITE_NONE;
+
+	spinlock_obtain(&page_merge_lock);
+	if (is_sos_vm(vm)) {
+		/* the Service VM maps host memory 1:1 */
+		idx = find_protected_by_hpa(page_gpa);
+		if (idx == INVALID_MERGE_IDX) {
+			chunk_idx = find_zero_chunk_by_hpa(page_gpa);
+			if (chunk_idx != INVALID_MERGE_IDX) {
+				/* the guest page backed by page_gpa */
+				page_gpa = zero_chunks[chunk_idx].gpa + (page_gpa & (PDE_SIZE - 1UL));
+			}
+		}
+	} else if (is_postlaunched_vm(vm)) {
+		idx = find_by_gpa(vm->vm_id, page_gpa);
+		if ((idx != INVALID_MERGE_IDX) && (merge_pages[idx].state == MERGE_CANDIDATE)) {
+			idx = INVALID_MERGE_IDX;
+		}
+		chunk_idx = find_zero_chunk(vm->vm_id, page_gpa);
+	} else {
+		/* pre-launched VMs don't take part in page merging */
+	}
+
+	if (idx != INVALID_MERGE_IDX) {
+		if (merge_pages[idx].state == MERGE_SHARED) {
+			unshare_page(idx);
+		} else {
+			unprotect_pending(idx);
+		}
+		ret = PAGE_MERGE_WRITE_DONE;
+	} else if (chunk_idx != INVALID_MERGE_IDX) {
+		if (zero_chunk_test(zero_chunks[chunk_idx].pending, page_gpa)) {
+			unprotect_zero_pending(chunk_idx, page_gpa);
+			ret = PAGE_MERGE_WRITE_DONE;
+		} else if (zero_chunk_test(zero_chunks[chunk_idx].merged, page_gpa)) {
+			if (zero_chunks[chunk_idx].released) {
+				ret = PAGE_MERGE_WRITE_RELEASED;
+			} else {
+				unmerge_zero_page(chunk_idx, page_gpa);
+				ret = PAGE_MERGE_WRITE_DONE;
+			}
+		} else {
+			/* not a page of the chunk under merging */
+		}
+	} else {
+		/* not a tracked page */
+	}
+
+	if (ret == PAGE_MERGE_WRITE_NONE) {
+		/* the write access may have been given back after a vCPU cached the read-only mapping */
+		pgentry = lookup_address((uint64_t *)vm->arch_vm.nworld_eptp, gpa, &pg_size, &vm->arch_vm.ept_mem_ops);
+		if ((pgentry != NULL) && ((*pgentry & EPT_WR) != 0UL)) {
+			ret = PAGE_MERGE_WRITE_DONE;
+		}
+	}
+	spinlock_release(&page_merge_lock);
+
+	return ret;
+}
+
+void page_merge_release_vm(const struct acrn_vm *vm)
+{
+	uint16_t slot = post_vm_slot(vm->vm_id);
+	uint64_t offset;
+	uint32_t idx;
+
+	if (is_postlaunched_vm(vm)) {
+		spinlock_obtain(&page_merge_lock);
+		for (idx = slot * MERGE_PAGES_PER_VM; idx < ((slot + 1U) * MERGE_PAGES_PER_VM); idx++) {
+			struct merge_page *mp = &merge_pages[idx];
+
+			if (mp->in_use) {
+				if (mp->state == MERGE_SHARED) {
+					unshare_page(idx);
+				} else if (mp->state == MERGE_CANDIDATE) {
+					free_merge_page(idx);
+				} else {
+					unprotect_pending(idx);
+					if (mp->in_use) {
+						free_merge_page(idx);
+					}
+				}
+			}
+		}
+
+		for (idx = slot * ZERO_CHUNKS_PER_VM; idx < ((slot + 1U) * ZERO_CHUNKS_PER_VM); idx++) {
+			struct zero_chunk *zc = &zero_chunks[idx];
+
+			if (zc->gpa != INVALID_GPA) {
+				if (zc->released) {
+					merge_stats.released_pages -= ZERO_CHUNK_PAGES;
+				} else if (zc->hpa != INVALID_HPA) {
+					/* the Service VM gets the write access to the backing back */
+					for (offset = 0UL; offset < PDE_SIZE; offset += PAGE_SIZE) {
+						if (zero_chunk_test(zc->merged, offset) || zero_chunk_test(zc->pending, offset)) {
+							sos_write_protect(zc->hpa + offset, PAGE_SIZE, false);
+						}
+					}
+					zero_chunk_remove_hpa(idx);
+				}
+				merge_stats.merged_pages -= zc->merged_num;
+				merge_stats.zero_pages -= zc->merged_num;
+				zc->gpa = INVALID_GPA;
+			}
+		}
+		spinlock_release(&page_merge_lock);
+	}
+}
+
+void get_page_merge_stats(struct page_merge_stats *stats)
+{
+	spinlock_obtain(&page_merge_lock);
+	*stats = merge_stats;
+	spinlock_release(&page_merge_lock);
+}
@@ -2137,11 +2137,11 @@ void vlapic_create(struct acrn_vcpu *vcpu, uint16_t pcpu_id)
 			(uint64_t *)vcpu->vm->arch_vm.nworld_eptp;
 		/* only need unmap it from SOS as UOS never mapped it */
 		if (is_sos_vm(vcpu->vm)) {
-			ept_del_mr(vcpu->vm, pml4_page,
+			(void)ept_del_mr(vcpu->vm, pml4_page,
 				DEFAULT_APIC_BASE, PAGE_SIZE);
 		}
 
-		ept_add_mr(vcpu->vm, pml4_page,
+		(void)ept_add_mr(vcpu->vm, pml4_page,
 			vlapic_apicv_get_apic_access_addr(),
 			DEFAULT_APIC_BASE, PAGE_SIZE,
 			EPT_WR | EPT_RD | EPT_UNCACHED);
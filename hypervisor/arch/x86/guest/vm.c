@@ -33,6 +33,7 @@
 #include <vacpi.h>
 #include <platform_caps.h>
 #include <mmio_dev.h>
+#include <page_merge.h>
 
 vm_sw_loader_t vm_sw_loader;
 
@@ -218,16 +219,20 @@ static inline uint16_t get_configured_bsp_pcpu_id(const struct acrn_vm_config *v
 }
 
 /**
+ * @retval 0 on success
+ * @retval -ENOMEM if the EPT page-table pages run out
+ *
  * @pre vm != NULL && vm_config != NULL
  */
-static void prepare_prelaunched_vm_memmap(struct acrn_vm *vm, const struct acrn_vm_config *vm_config)
+static int32_t prepare_prelaunched_vm_memmap(struct acrn_vm *vm, const struct acrn_vm_config *vm_config)
 {
 	bool is_hpa1 = true;
 	uint64_t base_hpa = vm_config->memory.start_hpa;
 	uint64_t remaining_hpa_size = vm_config->memory.size;
 	uint32_t i;
+	int32_t ret = 0;
 
-	for (i = 0U; i < vm->e820_entry_num; i++) {
+	for (i = 0U; (i < vm->e820_entry_num) && (ret == 0); i++) {
 		const struct e820_entry *entry = &(vm->e820_entries[i]);
 
 		if (entry->length == 0UL) {
@@ -236,7 +241,7 @@ static void prepare_prelaunched_vm_memmap(struct acrn_vm *vm, const struct acrn_
 
 		/* Do EPT mapping for GPAs that are backed by physical memory */
 		if ((entry->type == E820_TYPE_RAM) && (remaining_hpa_size >= entry->length)) {
-			ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, base_hpa, entry->baseaddr,
+			ret = ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, base_hpa, entry->baseaddr,
 				entry->length, EPT_RWX | EPT_WB);
 
 			base_hpa += entry->length;
@@ -248,8 +253,8 @@ static void prepare_prelaunched_vm_memmap(struct acrn_vm *vm, const struct acrn_
 
 		/* GPAs under 1MB are always backed by physical memory */
 		if ((entry->type != E820_TYPE_RAM) && (entry->baseaddr < (uint64_t)MEM_1M) &&
-			(remaining_hpa_size >= entry->length)) {
-			ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, base_hpa, entry->baseaddr,
+			(remaining_hpa_size >= entry->length) && (ret == 0)) {
+			ret = ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, base_hpa, entry->baseaddr,
 				entry->length, EPT_RWX | EPT_UNCACHED);
 
 			base_hpa += entry->length;
@@ -263,20 +268,25 @@ static void prepare_prelaunched_vm_memmap(struct acrn_vm *vm, const struct acrn_
 		}
 	}
 
-	for (i = 0U; i < MAX_MMIO_DEV_NUM; i++) {
-		(void)assign_mmio_dev(vm, &vm_config->mmiodevs[i]);
+	if (ret == 0) {
+		for (i = 0U; i < MAX_MMIO_DEV_NUM; i++) {
+			(void)assign_mmio_dev(vm, &vm_config->mmiodevs[i]);
+		}
 	}
+
+	return ret;
 }
 
 /**
  * @param[inout] vm pointer to a vm descriptor
  *
  * @retval 0 on success
+ * @retval -ENOMEM if the EPT page-table pages run out
  *
  * @pre vm != NULL
  * @pre is_sos_vm(vm) == true
  */
-static void prepare_sos_vm_memmap(struct acrn_vm *vm)
+static int32_t prepare_sos_vm_memmap(struct acrn_vm *vm)
 {
 	uint16_t vm_id;
 	uint32_t i;
@@ -290,6 +300,7 @@ static void prepare_sos_vm_memmap(struct acrn_vm *vm)
 	uint32_t entries_count = vm->e820_entry_num;
 	const struct e820_entry *p_e820 = vm->e820_entries;
 	const struct mem_range *p_mem_range_info = get_mem_range_info();
+	int32_t ret;
 
 	pr_dbg("sos_vm: bottom memory - 0x%lx, top memory - 0x%lx\n",
 		p_mem_range_info->mem_bottom, p_mem_range_info->mem_top);
@@ -299,14 +310,14 @@ static void prepare_sos_vm_memmap(struct acrn_vm *vm)
 	}
 
 	/* create real ept map for all ranges with UC */
-	ept_add_mr(vm, pml4_page, p_mem_range_info->mem_bottom, p_mem_range_info->mem_bottom,
+	ret = ept_add_mr(vm, pml4_page, p_mem_range_info->mem_bottom, p_mem_range_info->mem_bottom,
 			(p_mem_range_info->mem_top - p_mem_range_info->mem_bottom), attr_uc);
 
 	/* update ram entries to WB attr */
-	for (i = 0U; i < entries_count; i++) {
+	for (i = 0U; (i < entries_count) && (ret == 0); i++) {
 		entry = p_e820 + i;
 		if (entry->type == E820_TYPE_RAM) {
-			ept_modify_mr(vm, pml4_page, entry->baseaddr, entry->length, EPT_WB, EPT_MT_MASK);
+			ret = ept_modify_mr(vm, pml4_page, entry->baseaddr, entry->length, EPT_WB, EPT_MT_MASK);
 		}
 	}
 
@@ -322,20 +333,22 @@ static void prepare_sos_vm_memmap(struct acrn_vm *vm)
 	 * will cause EPT violation if sos accesses EPC resource.
 	 */
 	epc_secs = get_phys_epc();
-	for (i = 0U; (i < MAX_EPC_SECTIONS) && (epc_secs[i].size != 0UL); i++) {
-		ept_del_mr(vm, pml4_page, epc_secs[i].base, epc_secs[i].size);
+	for (i = 0U; (i < MAX_EPC_SECTIONS) && (epc_secs[i].size != 0UL) && (ret == 0); i++) {
+		ret = ept_del_mr(vm, pml4_page, epc_secs[i].base, epc_secs[i].size);
 	}
 
 	/* unmap hypervisor itself for safety
 	 * will cause EPT violation if sos accesses hv memory
 	 */
-	hv_hpa = hva2hpa((void *)(get_hv_image_base()));
-	ept_del_mr(vm, pml4_page, hv_hpa, CONFIG_HV_RAM_SIZE);
+	if (ret == 0) {
+		hv_hpa = hva2hpa((void *)(get_hv_image_base()));
+		ret = ept_del_mr(vm, pml4_page, hv_hpa, CONFIG_HV_RAM_SIZE);
+	}
 	/* unmap prelaunch VM memory */
-	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+	for (vm_id = 0U; (vm_id < CONFIG_MAX_VM_NUM) && (ret == 0); vm_id++) {
 		vm_config = get_vm_config(vm_id);
 		if (vm_config->load_order == PRE_LAUNCHED_VM) {
-			ept_del_mr(vm, pml4_page, vm_config->memory.start_hpa, vm_config->memory.size);
+			ret = ept_del_mr(vm, pml4_page, vm_config->memory.start_hpa, vm_config->memory.size);
 		}
 
 		for (i = 0U; i < MAX_MMIO_DEV_NUM; i++) {
@@ -349,25 +362,34 @@ static void prepare_sos_vm_memmap(struct acrn_vm *vm)
 	 * mode will ensure the base address of tramploline
 	 * code be page-aligned.
 	 */
-	ept_del_mr(vm, pml4_page, get_ap_trampoline_buf(), CONFIG_LOW_RAM_SIZE);
+	if (ret == 0) {
+		ret = ept_del_mr(vm, pml4_page, get_ap_trampoline_buf(), CONFIG_LOW_RAM_SIZE);
+	}
 
 	/* unmap PCIe MMCONFIG region since it's owned by hypervisor */
-	ept_del_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, get_mmcfg_base(), PCI_MMCONFIG_SIZE);
+	if (ret == 0) {
+		ret = ept_del_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, get_mmcfg_base(), PCI_MMCONFIG_SIZE);
+	}
+
+	return ret;
 }
 
 /* Add EPT mapping of EPC reource for the VM */
-static void prepare_epc_vm_memmap(struct acrn_vm *vm)
+static int32_t prepare_epc_vm_memmap(struct acrn_vm *vm)
 {
 	struct epc_map* vm_epc_maps;
 	uint32_t i;
+	int32_t ret = 0;
 
 	if (is_vsgx_supported(vm->vm_id)) {
 		vm_epc_maps = get_epc_mapping(vm->vm_id);
-		for (i = 0U; (i < MAX_EPC_SECTIONS) && (vm_epc_maps[i].size != 0UL); i++) {
-			ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, vm_epc_maps[i].hpa,
+		for (i = 0U; (i < MAX_EPC_SECTIONS) && (vm_epc_maps[i].size != 0UL) && (ret == 0); i++) {
+			ret = ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, vm_epc_maps[i].hpa,
 				vm_epc_maps[i].gpa, vm_epc_maps[i].size, EPT_RWX | EPT_WB);
 		}
 	}
+
+	return ret;
 }
 
 /**
@@ -414,17 +436,25 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 
 	init_ept_mem_ops(&vm->arch_vm.ept_mem_ops, vm->vm_id);
 	vm->arch_vm.nworld_eptp = vm->arch_vm.ept_mem_ops.get_pml4_page(vm->arch_vm.ept_mem_ops.info);
-	sanitize_pte((uint64_t *)vm->arch_vm.nworld_eptp, &vm->arch_vm.ept_mem_ops);
+	if (vm->arch_vm.nworld_eptp == NULL) {
+		status = -ENOMEM;
+	} else {
+		sanitize_pte((uint64_t *)vm->arch_vm.nworld_eptp, &vm->arch_vm.ept_mem_ops);
+	}
 
 	(void)memcpy_s(&vm->uuid[0], sizeof(vm->uuid),
 		&vm_config->uuid[0], sizeof(vm_config->uuid));
 
-	if (is_sos_vm(vm)) {
+	if (status != 0) {
+		pr_err("%s, no EPT page available for VM%u", __func__, vm_id);
+	} else if (is_sos_vm(vm)) {
 		/* Only for SOS_VM */
 		create_sos_vm_e820(vm);
-		prepare_sos_vm_memmap(vm);
+		status = prepare_sos_vm_memmap(vm);
 
-		status = init_vm_boot_info(vm);
+		if (status == 0) {
+			status = init_vm_boot_info(vm);
+		}
 	} else {
 		/* For PRE_LAUNCHED_VM and POST_LAUNCHED_VM */
 		if ((vm_config->guest_flags & GUEST_FLAG_SECURE_WORLD_ENABLED) != 0U) {
@@ -433,7 +463,7 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 		if (vm->sworld_control.flag.supported != 0UL) {
 			struct memory_ops *ept_mem_ops = &vm->arch_vm.ept_mem_ops;
 
-			ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
+			status = ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
 				hva2hpa(ept_mem_ops->get_sworld_memory_base(ept_mem_ops->info)),
 				TRUSTY_EPT_REBASE_GPA, TRUSTY_RAM_SIZE, EPT_WB | EPT_RWX);
 		}
@@ -442,15 +472,20 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 			snprintf(vm_config->name, 16, "ACRN VM_%d", vm_id);
 		}
 
-		 if (vm_config->load_order == PRE_LAUNCHED_VM) {
+		 if ((vm_config->load_order == PRE_LAUNCHED_VM) && (status == 0)) {
 			create_prelaunched_vm_e820(vm);
-			prepare_prelaunched_vm_memmap(vm, vm_config);
-			status = init_vm_boot_info(vm);
+			status = prepare_prelaunched_vm_memmap(vm, vm_config);
+			if (status == 0) {
+				status = init_vm_boot_info(vm);
+			}
 		 }
 	}
 
 	if (status == 0) {
-		prepare_epc_vm_memmap(vm);
+		status = prepare_epc_vm_memmap(vm);
+	}
+
+	if (status == 0) {
 		spinlock_init(&vm->vlapic_mode_lock);
 		spinlock_init(&vm->ept_lock);
 		spinlock_init(&vm->emul_mmio_lock);
@@ -522,8 +557,8 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 		}
 	}
 
-	if ((status != 0) && (vm->arch_vm.nworld_eptp != NULL)) {
-		(void)memset(vm->arch_vm.nworld_eptp, 0U, PAGE_SIZE);
+	if (status != 0) {
+		destroy_ept(vm);
 	}
 
 	return status;
@@ -611,6 +646,11 @@ int32_t shutdown_vm(struct acrn_vm *vm)
 
 	deinit_vpci(vm);
 
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+	/* Give the merged pages back before the EPT goes away */
+	page_merge_release_vm(vm);
+#endif
+
 	/* Free EPT allocated resources assigned to VM */
 	destroy_ept(vm);
 
@@ -130,6 +130,13 @@ static int32_t dispatch_sos_hypercall(const struct acrn_vcpu *vcpu)
 		}
 		break;
 
+	case HC_VM_MERGE_PAGES:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_merge_pages(sos_vm, vm_id, param2);
+		}
+		break;
+
 	/*
 	 * Don't do MSI remapping and make the pmsi_data equal to vmsi_data
 	 * This is a temporary solution before this hypercall is removed from SOS
@@ -17,6 +17,7 @@
 #include <pgtable.h>
 #include <trace.h>
 #include <logmsg.h>
+#include <page_merge.h>
 
 void arch_fire_vhm_interrupt(void)
 {
@@ -103,6 +104,9 @@ int32_t ept_violation_vmexit_handler(struct acrn_vcpu *vcpu)
 	uint64_t gpa;
 	struct io_request *io_req = &vcpu->req;
 	struct mmio_request *mmio_req = &io_req->reqs.mmio;
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+	enum page_merge_write merge_write = PAGE_MERGE_WRITE_NONE;
+#endif
 
 	/* Handle page fault from guest */
 	exit_qual = vcpu->arch.exit_qualification;
@@ -111,17 +115,38 @@ int32_t ept_violation_vmexit_handler(struct acrn_vcpu *vcpu)
 
 	TRACE_2L(TRACE_VMEXIT_EPT_VIOLATION, exit_qual, gpa);
 
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+	if (((exit_qual & 0x2UL) != 0UL) && (vcpu->arch.cur_context == NORMAL_WORLD)) {
+		merge_write = page_merge_handle_write(vcpu->vm, gpa);
+	}
+#endif
+
 	/*caused by instruction fetch */
 	if ((exit_qual & 0x4UL) != 0UL) {
 		if (vcpu->arch.cur_context == NORMAL_WORLD) {
-			ept_modify_mr(vcpu->vm, (uint64_t *)vcpu->vm->arch_vm.nworld_eptp,
+			(void)ept_modify_mr(vcpu->vm, (uint64_t *)vcpu->vm->arch_vm.nworld_eptp,
 				gpa & PAGE_MASK, PAGE_SIZE, EPT_EXE, 0UL);
 		} else {
-			ept_modify_mr(vcpu->vm, (uint64_t *)vcpu->vm->arch_vm.sworld_eptp,
+			(void)ept_modify_mr(vcpu->vm, (uint64_t *)vcpu->vm->arch_vm.sworld_eptp,
 				gpa & PAGE_MASK, PAGE_SIZE, EPT_EXE, 0UL);
 		}
 		vcpu_retain_rip(vcpu);
 		status = 0;
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+	} else if (merge_write == PAGE_MERGE_WRITE_DONE) {
+		/* the merged page has been given back to the VM, restart the write */
+		vcpu_retain_rip(vcpu);
+		status = 0;
+	} else if (merge_write == PAGE_MERGE_WRITE_RELEASED) {
+		/* the DM backs the page with new memory first, then the write is restarted */
+		io_req->io_type = REQ_RESTORE_PAGE;
+		mmio_req->direction = REQUEST_WRITE;
+		mmio_req->address = gpa & PAGE_MASK;
+		mmio_req->size = 0UL;
+		mmio_req->value = 0UL;
+		vcpu_retain_rip(vcpu);
+		status = emulate_io(vcpu, io_req);
+#endif
 	} else {
 
 		io_req->io_type = REQ_MMIO;
@@ -13,6 +13,8 @@
 #include <vtd.h>
 #include <security.h>
 #include <vm.h>
+#include <bits.h>
+#include <logmsg.h>
 
 #define LINEAR_ADDRESS_SPACE_48_BIT	(1UL << 48U)
 
@@ -59,21 +61,21 @@ static inline uint64_t ppt_pgentry_present(uint64_t pte)
 	return pte & PAGE_PRESENT;
 }
 
-static inline struct page *ppt_get_pml4_page(const union pgtable_pages_info *info)
+static inline struct page *ppt_get_pml4_page(union pgtable_pages_info *info)
 {
 	struct page *pml4_page = info->ppt.pml4_base;
 	(void)memset(pml4_page, 0U, PAGE_SIZE);
 	return pml4_page;
 }
 
-static inline struct page *ppt_get_pdpt_page(const union pgtable_pages_info *info, uint64_t gpa)
+static inline struct page *ppt_get_pdpt_page(union pgtable_pages_info *info, uint64_t gpa)
 {
 	struct page *pdpt_page = info->ppt.pdpt_base + (gpa >> PML4E_SHIFT);
 	(void)memset(pdpt_page, 0U, PAGE_SIZE);
 	return pdpt_page;
 }
 
-static inline struct page *ppt_get_pd_page(const union pgtable_pages_info *info, uint64_t gpa)
+static inline struct page *ppt_get_pd_page(union pgtable_pages_info *info, uint64_t gpa)
 {
 	struct page *pd_page = info->ppt.pd_base + (gpa >> PDPTE_SHIFT);
 	(void)memset(pd_page, 0U, PAGE_SIZE);
@@ -96,19 +98,6 @@ const struct memory_ops ppt_mem_ops = {
 	.recover_exe_right = nop_recover_exe_right,
 };
 
-static struct page sos_vm_pml4_pages[SOS_VM_NUM][PML4_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE))];
-static struct page sos_vm_pdpt_pages[SOS_VM_NUM][PDPT_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE))];
-static struct page sos_vm_pd_pages[SOS_VM_NUM][PD_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE))];
-/* pre_uos_nworld_pml4_pages */
-static struct page pre_uos_nworld_pml4_pages[PRE_VM_NUM][PML4_PAGE_NUM(PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
-static struct page pre_uos_nworld_pdpt_pages[PRE_VM_NUM][PDPT_PAGE_NUM(PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
-static struct page pre_uos_nworld_pd_pages[PRE_VM_NUM][PD_PAGE_NUM(PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
-
-/* post_uos_nworld_pml4_pages */
-static struct page post_uos_nworld_pml4_pages[MAX_POST_VM_NUM][PML4_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
-static struct page post_uos_nworld_pdpt_pages[MAX_POST_VM_NUM][PDPT_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
-static struct page post_uos_nworld_pd_pages[MAX_POST_VM_NUM][PD_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
-
 static struct page post_uos_sworld_pgtable_pages[MAX_POST_VM_NUM][TRUSTY_PGTABLE_PAGE_NUM(TRUSTY_RAM_SIZE)];
 /* pre-assumption: TRUSTY_RAM_SIZE is 2M aligned */
 static struct page post_uos_sworld_memory[MAX_POST_VM_NUM][TRUSTY_RAM_SIZE >> PAGE_SHIFT] __aligned(MEM_2M);
@@ -116,38 +105,159 @@ static struct page post_uos_sworld_memory[MAX_POST_VM_NUM][TRUSTY_RAM_SIZE >> PA
 /* ept: extended page table*/
 static union pgtable_pages_info ept_pages_info[CONFIG_MAX_VM_NUM];
 
-
-#ifdef CONFIG_LAST_LEVEL_EPT_AT_BOOT
-/* Array with address space size for each type of load order of VM */
-static const uint64_t vm_address_space_size[MAX_LOAD_ORDER] = {
-	PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE), /* for Pre-Launched VM */
-	EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE), /* for SOS VM */
-	EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE), /* for Post-Launched VM */
+/*
+ * The normal world EPT page-table pages of all VMs are allocated on demand
+ * from one shared pool and given back when the VM is destroyed. Each VM is
+ * limited by a quota, which is the number of pages needed to map its whole
+ * address space with 4K pages. The pool is smaller than the sum of the quotas
+ * of the post-launched VMs, see POST_VM_EPT_PGTABLE_PAGE_NUM.
+ */
+#define EPT_PAGE_POOL_BITMAP_SIZE	((TOTAL_EPT_PGTABLE_PAGE_NUM + 63UL) >> 6U)
+static uint64_t ept_page_pool_bitmap[EPT_PAGE_POOL_BITMAP_SIZE];
+static uint16_t ept_page_pool_owner[TOTAL_EPT_PGTABLE_PAGE_NUM];
+static struct page_pool ept_page_pool = {
+	.page_num = TOTAL_EPT_PGTABLE_PAGE_NUM,
+	.bitmap_size = EPT_PAGE_POOL_BITMAP_SIZE,
+	.bitmap = ept_page_pool_bitmap,
+	.owner = ept_page_pool_owner,
 };
 
+#ifndef CONFIG_LAST_LEVEL_EPT_AT_BOOT
+static struct page ept_page_pool_pages[TOTAL_EPT_PGTABLE_PAGE_NUM];
+#endif
+
+static void init_page_pool(struct page_pool *pool, struct page *start_page)
+{
+	uint64_t bit;
+
+	spinlock_init(&pool->lock);
+	pool->start_page = start_page;
+	pool->used_num = 0UL;
+	pool->last_hint_id = 0UL;
+	(void)memset(pool->bitmap, 0U, pool->bitmap_size * sizeof(uint64_t));
+
+	/* mark the bits beyond the last page as used so they are never handed out */
+	for (bit = pool->page_num; bit < (pool->bitmap_size << 6U); bit++) {
+		bitmap_set_nolock((uint16_t)(bit & 0x3fUL), pool->bitmap + (bit >> 6U));
+	}
+}
+
 /*
- * @brief Reserve space for EPT 4K pages from platform E820 table
+ * @brief Reserve the backing memory of the EPT page-table page pool
+ *
+ * With CONFIG_LAST_LEVEL_EPT_AT_BOOT the pool is carved out of the platform E820 table,
+ * otherwise it is backed by a static array.
  */
 void reserve_buffer_for_ept_pages(void)
 {
+	struct page *start_page;
+
+#ifdef CONFIG_LAST_LEVEL_EPT_AT_BOOT
 	uint64_t pt_base;
-	uint16_t vm_id;
-	uint32_t offset = 0U;
-	struct acrn_vm_config *vm_config;
-
-	pt_base = e820_alloc_memory(TOTAL_EPT_4K_PAGES_SIZE, ~0UL);
-	hv_access_memory_region_update(pt_base, TOTAL_EPT_4K_PAGES_SIZE);
-	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
-		vm_config = get_vm_config(vm_id);
-		ept_pages_info[vm_id].ept.nworld_pt_base = (struct page *)(void *)(pt_base + offset);
-		offset += PT_PAGE_NUM(vm_address_space_size[vm_config->load_order])*MEM_4K;
-	}
-}
+
+	pt_base = e820_alloc_memory(TOTAL_EPT_PGTABLE_PAGES_SIZE, ~0UL);
+	hv_access_memory_region_update(pt_base, TOTAL_EPT_PGTABLE_PAGES_SIZE);
+	start_page = (struct page *)(void *)pt_base;
 #else
-static struct page sos_vm_pt_pages[SOS_VM_NUM][PT_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE))];
-static struct page pre_uos_nworld_pt_pages[PRE_VM_NUM][PT_PAGE_NUM(PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
-static struct page post_uos_nworld_pt_pages[MAX_POST_VM_NUM][PT_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))];
+	start_page = ept_page_pool_pages;
 #endif
+	init_page_pool(&ept_page_pool, start_page);
+}
+
+static struct page *alloc_page(struct page_pool *pool, uint16_t owner)
+{
+	struct page *page = NULL;
+	uint64_t loop_idx, idx;
+	uint16_t bit;
+
+	spinlock_obtain(&pool->lock);
+	for (loop_idx = pool->last_hint_id; loop_idx < (pool->last_hint_id + pool->bitmap_size); loop_idx++) {
+		idx = loop_idx % pool->bitmap_size;
+		if (pool->bitmap[idx] != ~0UL) {
+			bit = ffz64(pool->bitmap[idx]);
+			bitmap_set_nolock(bit, pool->bitmap + idx);
+			page = pool->start_page + ((idx << 6U) + bit);
+			pool->owner[(idx << 6U) + bit] = owner;
+			pool->last_hint_id = idx;
+			pool->used_num++;
+			break;
+		}
+	}
+	spinlock_release(&pool->lock);
+
+	return page;
+}
+
+static bool page_in_pool(const struct page_pool *pool, const struct page *page)
+{
+	return ((pool->start_page != NULL) && (page >= pool->start_page) &&
+		(page < (pool->start_page + pool->page_num)));
+}
+
+/*
+ * A page is only given back by the VM it was handed out to, any other
+ * free request is refused.
+ *
+ * @pre page_in_pool(pool, page)
+ */
+static bool free_page(struct page_pool *pool, const struct page *page, uint16_t owner)
+{
+	uint64_t offset = (uint64_t)(page - pool->start_page);
+	bool freed = false;
+
+	spinlock_obtain(&pool->lock);
+	if (bitmap_test((uint16_t)(offset & 0x3fUL), pool->bitmap + (offset >> 6U)) &&
+			(pool->owner[offset] == owner)) {
+		bitmap_clear_nolock((uint16_t)(offset & 0x3fUL), pool->bitmap + (offset >> 6U));
+		pool->used_num--;
+		freed = true;
+	}
+	spinlock_release(&pool->lock);
+
+	return freed;
+}
+
+void get_ept_page_pool_usage(uint64_t *total, uint64_t *used)
+{
+	*total = ept_page_pool.page_num;
+	*used = ept_page_pool.used_num;
+}
+
+/*
+ * @return NULL when the VM is over its quota or the pool is exhausted
+ */
+static struct page *ept_alloc_page(union pgtable_pages_info *info)
+{
+	struct page *page = NULL;
+
+	if (info->ept.pgtable_pages < info->ept.pgtable_quota) {
+		page = alloc_page(info->ept.pool, info->ept.vm_id);
+	}
+
+	if (page != NULL) {
+		info->ept.pgtable_pages++;
+		(void)memset(page, 0U, PAGE_SIZE);
+	} else {
+		pr_err("%s, VM%u: no EPT page available, used %lu pages of quota %lu", __func__,
+			info->ept.vm_id, info->ept.pgtable_pages, info->ept.pgtable_quota);
+	}
+
+	return page;
+}
+
+/*
+ * Pages that don't come from the pool (the secure world page tables) are silently ignored.
+ */
+static void ept_free_pgtable_page(union pgtable_pages_info *info, struct page *page)
+{
+	if (page_in_pool(info->ept.pool, page)) {
+		if (free_page(info->ept.pool, page, info->ept.vm_id)) {
+			info->ept.pgtable_pages--;
+		} else {
+			pr_err("%s, VM%u: EPT page %p not owned by this VM", __func__, info->ept.vm_id, page);
+		}
+	}
+}
 
 void *get_reserve_sworld_memory_base(void)
 {
@@ -174,44 +284,40 @@ static inline void ept_clflush_pagewalk(const void* etry)
 	iommu_flush_cache(etry, sizeof(uint64_t));
 }
 
-static inline struct page *ept_get_pml4_page(const union pgtable_pages_info *info)
+static inline struct page *ept_get_pml4_page(union pgtable_pages_info *info)
 {
-	struct page *pml4_page = info->ept.nworld_pml4_base;
-	(void)memset(pml4_page, 0U, PAGE_SIZE);
-	return pml4_page;
+	return ept_alloc_page(info);
 }
 
-static inline struct page *ept_get_pdpt_page(const union pgtable_pages_info *info, uint64_t gpa)
+static inline struct page *ept_get_pdpt_page(union pgtable_pages_info *info, __unused uint64_t gpa)
 {
-	struct page *pdpt_page = info->ept.nworld_pdpt_base + (gpa >> PML4E_SHIFT);
-	(void)memset(pdpt_page, 0U, PAGE_SIZE);
-	return pdpt_page;
+	return ept_alloc_page(info);
 }
 
-static inline struct page *ept_get_pd_page(const union pgtable_pages_info *info, uint64_t gpa)
+static inline struct page *ept_get_pd_page(union pgtable_pages_info *info, uint64_t gpa)
 {
 	struct page *pd_page;
 	if (gpa < TRUSTY_EPT_REBASE_GPA) {
-		pd_page = info->ept.nworld_pd_base + (gpa >> PDPTE_SHIFT);
+		pd_page = ept_alloc_page(info);
 	} else {
 		pd_page = info->ept.sworld_pgtable_base + TRUSTY_PML4_PAGE_NUM(TRUSTY_EPT_REBASE_GPA) +
 			TRUSTY_PDPT_PAGE_NUM(TRUSTY_EPT_REBASE_GPA) + ((gpa - TRUSTY_EPT_REBASE_GPA) >> PDPTE_SHIFT);
+		(void)memset(pd_page, 0U, PAGE_SIZE);
 	}
-	(void)memset(pd_page, 0U, PAGE_SIZE);
 	return pd_page;
 }
 
-static inline struct page *ept_get_pt_page(const union pgtable_pages_info *info, uint64_t gpa)
+static inline struct page *ept_get_pt_page(union pgtable_pages_info *info, uint64_t gpa)
 {
 	struct page *pt_page;
 	if (gpa < TRUSTY_EPT_REBASE_GPA) {
-		pt_page = info->ept.nworld_pt_base + (gpa >> PDE_SHIFT);
+		pt_page = ept_alloc_page(info);
 	} else {
 		pt_page = info->ept.sworld_pgtable_base + TRUSTY_PML4_PAGE_NUM(TRUSTY_EPT_REBASE_GPA) +
 			TRUSTY_PDPT_PAGE_NUM(TRUSTY_EPT_REBASE_GPA) + TRUSTY_PD_PAGE_NUM(TRUSTY_EPT_REBASE_GPA) +
 			((gpa - TRUSTY_EPT_REBASE_GPA) >> PDE_SHIFT);
+		(void)memset(pt_page, 0U, PAGE_SIZE);
 	}
-	(void)memset(pt_page, 0U, PAGE_SIZE);
 	return pt_page;
 }
 
@@ -240,35 +346,21 @@ void init_ept_mem_ops(struct memory_ops *mem_ops, uint16_t vm_id)
 
 	if (is_sos_vm(vm)) {
 		ept_pages_info[vm_id].ept.top_address_space = EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE);
-		ept_pages_info[vm_id].ept.nworld_pml4_base = sos_vm_pml4_pages[0U];
-		ept_pages_info[vm_id].ept.nworld_pdpt_base = sos_vm_pdpt_pages[0U];
-		ept_pages_info[vm_id].ept.nworld_pd_base = sos_vm_pd_pages[0U];
-#ifndef CONFIG_LAST_LEVEL_EPT_AT_BOOT
-		ept_pages_info[vm_id].ept.nworld_pt_base = sos_vm_pt_pages[0U];
-#endif
 	} else if (is_prelaunched_vm(vm)) {
 		ept_pages_info[vm_id].ept.top_address_space = PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE);
-		ept_pages_info[vm_id].ept.nworld_pml4_base = pre_uos_nworld_pml4_pages[vm_id];
-		ept_pages_info[vm_id].ept.nworld_pdpt_base = pre_uos_nworld_pdpt_pages[vm_id];
-		ept_pages_info[vm_id].ept.nworld_pd_base = pre_uos_nworld_pd_pages[vm_id];
-#ifndef CONFIG_LAST_LEVEL_EPT_AT_BOOT
-		ept_pages_info[vm_id].ept.nworld_pt_base = pre_uos_nworld_pt_pages[vm_id];
-#endif
 	} else {
 		uint16_t sos_vm_id = (get_sos_vm())->vm_id;
 		uint16_t page_idx = vmid_2_rel_vmid(sos_vm_id, vm_id) - 1U;
 
 		ept_pages_info[vm_id].ept.top_address_space = EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE);
-		ept_pages_info[vm_id].ept.nworld_pml4_base = post_uos_nworld_pml4_pages[page_idx];
-		ept_pages_info[vm_id].ept.nworld_pdpt_base = post_uos_nworld_pdpt_pages[page_idx];
-		ept_pages_info[vm_id].ept.nworld_pd_base = post_uos_nworld_pd_pages[page_idx];
-#ifndef CONFIG_LAST_LEVEL_EPT_AT_BOOT
-		ept_pages_info[vm_id].ept.nworld_pt_base = post_uos_nworld_pt_pages[page_idx];
-#endif
 		ept_pages_info[vm_id].ept.sworld_pgtable_base = post_uos_sworld_pgtable_pages[page_idx];
 		ept_pages_info[vm_id].ept.sworld_memory_base = post_uos_sworld_memory[page_idx];
 		mem_ops->get_sworld_memory_base = ept_get_sworld_memory_base;
 	}
+	ept_pages_info[vm_id].ept.pool = &ept_page_pool;
+	ept_pages_info[vm_id].ept.vm_id = vm_id;
+	ept_pages_info[vm_id].ept.pgtable_quota = EPT_PGTABLE_PAGE_NUM(ept_pages_info[vm_id].ept.top_address_space);
+	ept_pages_info[vm_id].ept.pgtable_pages = 0UL;
 	mem_ops->info = &ept_pages_info[vm_id];
 	mem_ops->get_default_access_right = ept_get_default_access_right;
 	mem_ops->pgentry_present = ept_pgentry_present;
@@ -276,6 +368,7 @@ void init_ept_mem_ops(struct memory_ops *mem_ops, uint16_t vm_id)
 	mem_ops->get_pdpt_page = ept_get_pdpt_page;
 	mem_ops->get_pd_page = ept_get_pd_page;
 	mem_ops->get_pt_page = ept_get_pt_page;
+	mem_ops->free_pgtable_page = ept_free_pgtable_page;
 	mem_ops->clflush_pagewalk = ept_clflush_pagewalk;
 	mem_ops->large_page_support = large_page_support;
 
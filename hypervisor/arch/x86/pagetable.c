@@ -10,20 +10,23 @@
 #include <page.h>
 #include <mmu.h>
 #include <logmsg.h>
+#include <errno.h>
 
 #define DBG_LEVEL_MMU	6U
 
 /*
  * Split a large page table into next level page table.
+ * Return -ENOMEM, with the large page left as is, if no page-table page is available.
  *
  * @pre: level could only IA32E_PDPT or IA32E_PD
  */
-static void split_large_page(uint64_t *pte, enum _page_table_level level,
+static int32_t split_large_page(uint64_t *pte, enum _page_table_level level,
 		uint64_t vaddr, const struct memory_ops *mem_ops)
 {
 	uint64_t *pbase;
 	uint64_t ref_paddr, paddr, paddrinc;
 	uint64_t i, ref_prot;
+	int32_t ret = 0;
 
 	switch (level) {
 	case IA32E_PDPT:
@@ -42,18 +45,24 @@ static void split_large_page(uint64_t *pte, enum _page_table_level level,
 		break;
 	}
 
-	dev_dbg(DBG_LEVEL_MMU, "%s, paddr: 0x%lx, pbase: 0x%lx\n", __func__, ref_paddr, pbase);
+	if (pbase == NULL) {
+		ret = -ENOMEM;
+	} else {
+		dev_dbg(DBG_LEVEL_MMU, "%s, paddr: 0x%lx, pbase: 0x%lx\n", __func__, ref_paddr, pbase);
 
-	paddr = ref_paddr;
-	for (i = 0UL; i < PTRS_PER_PTE; i++) {
-		set_pgentry(pbase + i, paddr | ref_prot, mem_ops);
-		paddr += paddrinc;
-	}
+		paddr = ref_paddr;
+		for (i = 0UL; i < PTRS_PER_PTE; i++) {
+			set_pgentry(pbase + i, paddr | ref_prot, mem_ops);
+			paddr += paddrinc;
+		}
 
-	ref_prot = mem_ops->get_default_access_right();
-	set_pgentry(pte, hva2hpa((void *)pbase) | ref_prot, mem_ops);
+		ref_prot = mem_ops->get_default_access_right();
+		set_pgentry(pte, hva2hpa((void *)pbase) | ref_prot, mem_ops);
 
-	/* TODO: flush the TLB */
+		/* TODO: flush the TLB */
+	}
+
+	return ret;
 }
 
 static inline void local_modify_or_del_pte(uint64_t *pte,
@@ -123,12 +132,13 @@ static void modify_or_del_pte(const uint64_t *pde, uint64_t vaddr_start, uint64_
  * type: MR_DEL
  * delete [vaddr_start, vaddr_end) MT PT mapping
  */
-static void modify_or_del_pde(const uint64_t *pdpte, uint64_t vaddr_start, uint64_t vaddr_end,
+static int32_t modify_or_del_pde(const uint64_t *pdpte, uint64_t vaddr_start, uint64_t vaddr_end,
 		uint64_t prot_set, uint64_t prot_clr, const struct memory_ops *mem_ops, uint32_t type)
 {
 	uint64_t *pd_page = pdpte_page_vaddr(*pdpte);
 	uint64_t vaddr = vaddr_start;
 	uint64_t index = pde_index(vaddr);
+	int32_t ret = 0;
 
 	dev_dbg(DBG_LEVEL_MMU, "%s, vaddr: [0x%lx - 0x%lx]\n", __func__, vaddr, vaddr_end);
 	for (; index < PTRS_PER_PDE; index++) {
@@ -142,7 +152,10 @@ static void modify_or_del_pde(const uint64_t *pdpte, uint64_t vaddr_start, uint6
 		} else {
 			if (pde_large(*pde) != 0UL) {
 				if ((vaddr_next > vaddr_end) || (!mem_aligned_check(vaddr, PDE_SIZE))) {
-					split_large_page(pde, IA32E_PD, vaddr, mem_ops);
+					ret = split_large_page(pde, IA32E_PD, vaddr, mem_ops);
+					if (ret != 0) {
+						break;
+					}
 				} else {
 					local_modify_or_del_pte(pde, prot_set, prot_clr, type, mem_ops);
 					if (vaddr_next < vaddr_end) {
@@ -159,6 +172,8 @@ static void modify_or_del_pde(const uint64_t *pdpte, uint64_t vaddr_start, uint6
 		}
 		vaddr = vaddr_next;
 	}
+
+	return ret;
 }
 
 /*
@@ -168,12 +183,13 @@ static void modify_or_del_pde(const uint64_t *pdpte, uint64_t vaddr_start, uint6
  * type: MR_DEL
  * delete [vaddr_start, vaddr_end) MT PT mapping
  */
-static void modify_or_del_pdpte(const uint64_t *pml4e, uint64_t vaddr_start, uint64_t vaddr_end,
+static int32_t modify_or_del_pdpte(const uint64_t *pml4e, uint64_t vaddr_start, uint64_t vaddr_end,
 		uint64_t prot_set, uint64_t prot_clr, const struct memory_ops *mem_ops, uint32_t type)
 {
 	uint64_t *pdpt_page = pml4e_page_vaddr(*pml4e);
 	uint64_t vaddr = vaddr_start;
 	uint64_t index = pdpte_index(vaddr);
+	int32_t ret = 0;
 
 	dev_dbg(DBG_LEVEL_MMU, "%s, vaddr: [0x%lx - 0x%lx]\n", __func__, vaddr, vaddr_end);
 	for (; index < PTRS_PER_PDPTE; index++) {
@@ -188,7 +204,10 @@ static void modify_or_del_pdpte(const uint64_t *pml4e, uint64_t vaddr_start, uin
 			if (pdpte_large(*pdpte) != 0UL) {
 				if ((vaddr_next > vaddr_end) ||
 						(!mem_aligned_check(vaddr, PDPTE_SIZE))) {
-					split_large_page(pdpte, IA32E_PDPT, vaddr, mem_ops);
+					ret = split_large_page(pdpte, IA32E_PDPT, vaddr, mem_ops);
+					if (ret != 0) {
+						break;
+					}
 				} else {
 					local_modify_or_del_pte(pdpte, prot_set, prot_clr, type, mem_ops);
 					if (vaddr_next < vaddr_end) {
@@ -198,13 +217,18 @@ static void modify_or_del_pdpte(const uint64_t *pml4e, uint64_t vaddr_start, uin
 					break;	/* done */
 				}
 			}
-			modify_or_del_pde(pdpte, vaddr, vaddr_end, prot_set, prot_clr, mem_ops, type);
+			ret = modify_or_del_pde(pdpte, vaddr, vaddr_end, prot_set, prot_clr, mem_ops, type);
+			if (ret != 0) {
+				break;
+			}
 		}
 		if (vaddr_next >= vaddr_end) {
 			break;	/* done */
 		}
 		vaddr = vaddr_next;
 	}
+
+	return ret;
 }
 
 /*
@@ -219,28 +243,33 @@ static void modify_or_del_pdpte(const uint64_t *pml4e, uint64_t vaddr_start, uin
  * to set, prot_clr to the MT mask.
  * type: MR_DEL
  * delete [vaddr_base, vaddr_base + size ) memory region page table mapping.
+ * Return -ENOMEM if a large page has to be split and no page-table page is available,
+ * the part of the region handled so far keeps its new mapping.
  */
-void mmu_modify_or_del(uint64_t *pml4_page, uint64_t vaddr_base, uint64_t size,
+int32_t mmu_modify_or_del(uint64_t *pml4_page, uint64_t vaddr_base, uint64_t size,
 		uint64_t prot_set, uint64_t prot_clr, const struct memory_ops *mem_ops, uint32_t type)
 {
 	uint64_t vaddr = round_page_up(vaddr_base);
 	uint64_t vaddr_next, vaddr_end;
 	uint64_t *pml4e;
+	int32_t ret = 0;
 
 	vaddr_end = vaddr + round_page_down(size);
 	dev_dbg(DBG_LEVEL_MMU, "%s, vaddr: 0x%lx, size: 0x%lx\n",
 		__func__, vaddr, size);
 
-	while (vaddr < vaddr_end) {
+	while ((vaddr < vaddr_end) && (ret == 0)) {
 		vaddr_next = (vaddr & PML4E_MASK) + PML4E_SIZE;
 		pml4e = pml4e_offset(pml4_page, vaddr);
 		if ((mem_ops->pgentry_present(*pml4e) == 0UL) && (type == MR_MODIFY)) {
 			ASSERT(false, "invalid op, pml4e not present");
 		} else {
-			modify_or_del_pdpte(pml4e, vaddr, vaddr_end, prot_set, prot_clr, mem_ops, type);
+			ret = modify_or_del_pdpte(pml4e, vaddr, vaddr_end, prot_set, prot_clr, mem_ops, type);
 			vaddr = vaddr_next;
 		}
 	}
+
+	return ret;
 }
 
 /*
@@ -278,13 +307,14 @@ static void add_pte(const uint64_t *pde, uint64_t paddr_start, uint64_t vaddr_st
  * In PD level,
  * add [vaddr_start, vaddr_end) to [paddr_base, ...) MT PT mapping
  */
-static void add_pde(const uint64_t *pdpte, uint64_t paddr_start, uint64_t vaddr_start, uint64_t vaddr_end,
+static int32_t add_pde(const uint64_t *pdpte, uint64_t paddr_start, uint64_t vaddr_start, uint64_t vaddr_end,
 		uint64_t prot, const struct memory_ops *mem_ops)
 {
 	uint64_t *pd_page = pdpte_page_vaddr(*pdpte);
 	uint64_t vaddr = vaddr_start;
 	uint64_t paddr = paddr_start;
 	uint64_t index = pde_index(vaddr);
+	int32_t ret = 0;
 
 	dev_dbg(DBG_LEVEL_MMU, "%s, paddr: 0x%lx, vaddr: [0x%lx - 0x%lx]\n",
 		__func__, paddr, vaddr, vaddr_end);
@@ -310,6 +340,11 @@ static void add_pde(const uint64_t *pdpte, uint64_t paddr_start, uint64_t vaddr_
 					break;	/* done */
 				} else {
 					void *pt_page = mem_ops->get_pt_page(mem_ops->info, vaddr);
+
+					if (pt_page == NULL) {
+						ret = -ENOMEM;
+						break;
+					}
 					construct_pgentry(pde, pt_page, mem_ops->get_default_access_right(), mem_ops);
 				}
 			}
@@ -321,19 +356,22 @@ static void add_pde(const uint64_t *pdpte, uint64_t paddr_start, uint64_t vaddr_
 		paddr += (vaddr_next - vaddr);
 		vaddr = vaddr_next;
 	}
+
+	return ret;
 }
 
 /*
  * In PDPT level,
  * add [vaddr_start, vaddr_end) to [paddr_base, ...) MT PT mapping
  */
-static void add_pdpte(const uint64_t *pml4e, uint64_t paddr_start, uint64_t vaddr_start, uint64_t vaddr_end,
+static int32_t add_pdpte(const uint64_t *pml4e, uint64_t paddr_start, uint64_t vaddr_start, uint64_t vaddr_end,
 		uint64_t prot, const struct memory_ops *mem_ops)
 {
 	uint64_t *pdpt_page = pml4e_page_vaddr(*pml4e);
 	uint64_t vaddr = vaddr_start;
 	uint64_t paddr = paddr_start;
 	uint64_t index = pdpte_index(vaddr);
+	int32_t ret = 0;
 
 	dev_dbg(DBG_LEVEL_MMU, "%s, paddr: 0x%lx, vaddr: [0x%lx - 0x%lx]\n", __func__, paddr, vaddr, vaddr_end);
 	for (; index < PTRS_PER_PDPTE; index++) {
@@ -358,10 +396,18 @@ static void add_pdpte(const uint64_t *pml4e, uint64_t paddr_start, uint64_t vadd
 					break;	/* done */
 				} else {
 					void *pd_page = mem_ops->get_pd_page(mem_ops->info, vaddr);
+
+					if (pd_page == NULL) {
+						ret = -ENOMEM;
+						break;
+					}
 					construct_pgentry(pdpte, pd_page, mem_ops->get_default_access_right(), mem_ops);
 				}
 			}
-			add_pde(pdpte, paddr, vaddr, vaddr_end, prot, mem_ops);
+			ret = add_pde(pdpte, paddr, vaddr, vaddr_end, prot, mem_ops);
+			if (ret != 0) {
+				break;
+			}
 		}
 		if (vaddr_next >= vaddr_end) {
 			break;	/* done */
@@ -369,19 +415,24 @@ static void add_pdpte(const uint64_t *pml4e, uint64_t paddr_start, uint64_t vadd
 		paddr += (vaddr_next - vaddr);
 		vaddr = vaddr_next;
 	}
+
+	return ret;
 }
 
 /*
  * action: MR_ADD
  * add [vaddr_base, vaddr_base + size ) memory region page table mapping.
+ * Return -ENOMEM if no page-table page is available, the part of the region
+ * mapped so far stays mapped.
  * @pre: the prot should set before call this function.
  */
-void mmu_add(uint64_t *pml4_page, uint64_t paddr_base, uint64_t vaddr_base, uint64_t size, uint64_t prot,
+int32_t mmu_add(uint64_t *pml4_page, uint64_t paddr_base, uint64_t vaddr_base, uint64_t size, uint64_t prot,
 		const struct memory_ops *mem_ops)
 {
 	uint64_t vaddr, vaddr_next, vaddr_end;
 	uint64_t paddr;
 	uint64_t *pml4e;
+	int32_t ret = 0;
 
 	dev_dbg(DBG_LEVEL_MMU, "%s, paddr 0x%lx, vaddr 0x%lx, size 0x%lx\n", __func__, paddr_base, vaddr_base, size);
 
@@ -390,18 +441,27 @@ void mmu_add(uint64_t *pml4_page, uint64_t paddr_base, uint64_t vaddr_base, uint
 	paddr = round_page_up(paddr_base);
 	vaddr_end = vaddr + round_page_down(size);
 
-	while (vaddr < vaddr_end) {
+	while ((vaddr < vaddr_end) && (ret == 0)) {
 		vaddr_next = (vaddr & PML4E_MASK) + PML4E_SIZE;
 		pml4e = pml4e_offset(pml4_page, vaddr);
 		if (mem_ops->pgentry_present(*pml4e) == 0UL) {
 			void *pdpt_page = mem_ops->get_pdpt_page(mem_ops->info, vaddr);
-			construct_pgentry(pml4e, pdpt_page, mem_ops->get_default_access_right(), mem_ops);
+
+			if (pdpt_page == NULL) {
+				ret = -ENOMEM;
+			} else {
+				construct_pgentry(pml4e, pdpt_page, mem_ops->get_default_access_right(), mem_ops);
+			}
+		}
+		if (ret == 0) {
+			ret = add_pdpte(pml4e, paddr, vaddr, vaddr_end, prot, mem_ops);
 		}
-		add_pdpte(pml4e, paddr, vaddr, vaddr_end, prot, mem_ops);
 
 		paddr += (vaddr_next - vaddr);
 		vaddr = vaddr_next;
 	}
+
+	return ret;
 }
 
 /**
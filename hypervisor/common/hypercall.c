@@ -20,6 +20,7 @@
 #include <logmsg.h>
 #include <ioapic.h>
 #include <mmio_dev.h>
+#include <page_merge.h>
 
 #define DBG_LEVEL_HYCALL	6U
 
@@ -633,9 +634,8 @@ static int32_t add_vm_memory_region(struct acrn_vm *vm, struct acrn_vm *target_v
 				prot |= EPT_UNCACHED;
 			}
 			/* create gpa to hpa EPT mapping */
-			ept_add_mr(target_vm, pml4_page, hpa,
+			ret = ept_add_mr(target_vm, pml4_page, hpa,
 					region->gpa, region->size, prot);
-			ret = 0;
 		}
 	}
 
@@ -671,9 +671,8 @@ static int32_t set_vm_memory_region(struct acrn_vm *vm,
 			if (region->type != MR_DEL) {
 				ret = add_vm_memory_region(vm, target_vm, region, pml4_page);
 			} else {
-				ept_del_mr(target_vm, pml4_page,
+				ret = ept_del_mr(target_vm, pml4_page,
 						region->gpa, region->size);
-				ret = 0;
 			}
 		}
 	}
@@ -760,9 +759,8 @@ static int32_t write_protect_page(struct acrn_vm *vm,const struct wp_data *wp)
 				prot_set = (wp->set != 0U) ? 0UL : EPT_WR;
 				prot_clr = (wp->set != 0U) ? EPT_WR : 0UL;
 
-				ept_modify_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
+				ret = ept_modify_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
 					wp->gpa, PAGE_SIZE, prot_set, prot_clr);
-				ret = 0;
 			}
 		}
 	}
@@ -799,6 +797,62 @@ int32_t hcall_write_protect_page(struct acrn_vm *vm, uint16_t vmid, uint64_t wp_
 	return ret;
 }
 
+/**
+ * @brief merge the identical pages of a guest memory range
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct page_merge_data
+ *
+ * @pre Pointer vm shall point to SOS_VM
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_merge_pages(struct acrn_vm *vm, uint16_t vmid, uint64_t param)
+{
+	struct acrn_vm *target_vm = get_vm_from_vmid(vmid);
+	int32_t ret = -1;
+
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+	struct page_merge_data data;
+	struct page_merge_stats stats;
+
+	if (!is_poweroff_vm(target_vm) && (copy_from_gpa(vm, &data, param, sizeof(data)) == 0)) {
+		switch (data.op) {
+		case PAGE_MERGE_NOMINATE:
+			ret = page_merge_nominate(target_vm, data.gpa, data.size, &data.zero_pages);
+			break;
+		case PAGE_MERGE_FREE_BACKING:
+			ret = page_merge_free_backing(target_vm, data.gpa);
+			break;
+		case PAGE_MERGE_RESTORE_BACKING:
+			ret = page_merge_restore_backing(target_vm, data.gpa, data.hpa);
+			break;
+		default:
+			pr_err("%s: invalid op %u", __func__, data.op);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (ret == 0) {
+			get_page_merge_stats(&stats);
+			data.merged_pages = stats.merged_pages;
+			data.shared_pages = stats.shared_pages;
+			data.unshared_pages = stats.unshared_pages;
+			data.released_pages = stats.released_pages;
+			ret = copy_to_gpa(vm, &data, param, sizeof(data));
+		}
+	} else {
+		pr_err("%p %s: target_vm is invalid or copy param failed", target_vm, __func__);
+	}
+#else
+	pr_err("%s: page merging is not enabled, vm%hu param 0x%lx", __func__, target_vm->vm_id, param);
+	(void)vm;
+#endif
+
+	return ret;
+}
+
 /**
  * @brief translate guest physical address to host physical address
  *
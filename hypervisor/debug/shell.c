@@ -22,6 +22,7 @@
 #include <shell.h>
 #include <vmcs.h>
 #include <host_pm.h>
+#include <page_merge.h>
 
 #define TEMP_STR_SIZE		60U
 #define MAX_STR_SIZE		256U
@@ -49,6 +50,10 @@ static int32_t shell_show_vioapic_info(int32_t argc, char **argv);
 static int32_t shell_show_ioapic_info(__unused int32_t argc, __unused char **argv);
 static int32_t shell_loglevel(int32_t argc, char **argv);
 static int32_t shell_cpuid(int32_t argc, char **argv);
+static int32_t shell_show_ept_pool(__unused int32_t argc, __unused char **argv);
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+static int32_t shell_show_page_merge(__unused int32_t argc, __unused char **argv);
+#endif
 static int32_t shell_reboot(int32_t argc, char **argv);
 static int32_t shell_rdmsr(int32_t argc, char **argv);
 static int32_t shell_wrmsr(int32_t argc, char **argv);
@@ -138,6 +143,20 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_CPUID_HELP,
 		.fcn		= shell_cpuid,
 	},
+	{
+		.str		= SHELL_CMD_EPT_POOL,
+		.cmd_param	= SHELL_CMD_EPT_POOL_PARAM,
+		.help_str	= SHELL_CMD_EPT_POOL_HELP,
+		.fcn		= shell_show_ept_pool,
+	},
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+	{
+		.str		= SHELL_CMD_PAGE_MERGE,
+		.cmd_param	= SHELL_CMD_PAGE_MERGE_PARAM,
+		.help_str	= SHELL_CMD_PAGE_MERGE_HELP,
+		.fcn		= shell_show_page_merge,
+	},
+#endif
 	{
 		.str		= SHELL_CMD_REBOOT,
 		.cmd_param	= SHELL_CMD_REBOOT_PARAM,
@@ -1368,6 +1387,50 @@ static int32_t shell_cpuid(int32_t argc, char **argv)
 	return 0;
 }
 
+static int32_t shell_show_ept_pool(__unused int32_t argc, __unused char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct acrn_vm *vm;
+	const union pgtable_pages_info *info;
+	uint64_t total, used;
+	uint16_t vm_id;
+
+	get_ept_page_pool_usage(&total, &used);
+	snprintf(temp_str, MAX_STR_SIZE, "\r\nEPT page pool: %lu pages, %lu used, %lu free\r\n",
+		total, used, total - used);
+	shell_puts(temp_str);
+
+	shell_puts("\r\nVM_ID PAGES      QUOTA"
+		   "\r\n===== ========== ==========\r\n");
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (!is_poweroff_vm(vm)) {
+			info = vm->arch_vm.ept_mem_ops.info;
+			snprintf(temp_str, MAX_STR_SIZE, "%-5d %-10lu %-10lu\r\n",
+				vm_id, info->ept.pgtable_pages, info->ept.pgtable_quota);
+			shell_puts(temp_str);
+		}
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_PAGE_MERGE_ENABLED
+static int32_t shell_show_page_merge(__unused int32_t argc, __unused char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct page_merge_stats stats;
+
+	get_page_merge_stats(&stats);
+	snprintf(temp_str, MAX_STR_SIZE, "\r\nmerged pages: %lu\r\nshared pages: %lu\r\nunshared pages: %lu\r\n"
+		"zero pages: %lu\r\nreleased pages: %lu\r\n", stats.merged_pages, stats.shared_pages,
+		stats.unshared_pages, stats.zero_pages, stats.released_pages);
+	shell_puts(temp_str);
+
+	return 0;
+}
+#endif
+
 static int32_t shell_reboot(int32_t argc, char **argv)
 {
 	(void)argc;
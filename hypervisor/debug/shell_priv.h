@@ -77,6 +77,14 @@ struct shell {
 #define SHELL_CMD_PTDEV_PARAM		NULL
 #define SHELL_CMD_PTDEV_HELP		"Show pass-through device information"
 
+#define SHELL_CMD_EPT_POOL		"ept_pool"
+#define SHELL_CMD_EPT_POOL_PARAM	NULL
+#define SHELL_CMD_EPT_POOL_HELP		"Show the usage of the EPT page-table page pool, in total and per VM"
+
+#define SHELL_CMD_PAGE_MERGE		"page_merge"
+#define SHELL_CMD_PAGE_MERGE_PARAM	NULL
+#define SHELL_CMD_PAGE_MERGE_HELP	"Show the counters of the merged pages of post-launched VMs"
+
 #define SHELL_CMD_REBOOT		"reboot"
 #define SHELL_CMD_REBOOT_PARAM		NULL
 #define SHELL_CMD_REBOOT_HELP		"Trigger a system reboot (immediately)"
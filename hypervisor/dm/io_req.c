@@ -312,8 +312,8 @@ static void dm_emulate_io_complete(struct acrn_vcpu *vcpu)
 
 			default:
 				/*
-				 * REQ_WP can only be triggered on writes which do not need
-				 * post-work. Just mark the ioreq done.
+				 * REQ_WP and REQ_RESTORE_PAGE can only be triggered on writes
+				 * which do not need post-work. Just mark the ioreq done.
 				 */
 				complete_ioreq(vcpu, NULL);
 				break;
@@ -555,6 +555,10 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 			emulate_mmio_complete(vcpu, io_req);
 		}
 		break;
+	case REQ_RESTORE_PAGE:
+		/* only the device model can allocate the backing */
+		status = -ENODEV;
+		break;
 	default:
 		/* Unknown I/O request io_type */
 		status = -EINVAL;
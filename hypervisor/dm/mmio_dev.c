@@ -18,10 +18,9 @@ int32_t assign_mmio_dev(struct acrn_vm *vm, const struct acrn_mmiodev *mmiodev)
 	if (mem_aligned_check(mmiodev->base_gpa, PAGE_SIZE) &&
 			mem_aligned_check(mmiodev->base_hpa, PAGE_SIZE) &&
 			mem_aligned_check(mmiodev->size, PAGE_SIZE)) {
-		ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, mmiodev->base_hpa,
+		ret = ept_add_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, mmiodev->base_hpa,
 				is_sos_vm(vm) ? mmiodev->base_hpa : mmiodev->base_gpa,
 				mmiodev->size, EPT_RWX | EPT_UNCACHED);
-		ret = 0;
 	}
 
 	return ret;
@@ -34,9 +33,8 @@ int32_t deassign_mmio_dev(struct acrn_vm *vm, const struct acrn_mmiodev *mmiodev
 	if (mem_aligned_check(mmiodev->base_gpa, PAGE_SIZE) &&
 			mem_aligned_check(mmiodev->base_hpa, PAGE_SIZE) &&
 			mem_aligned_check(mmiodev->size, PAGE_SIZE)) {
-		ept_del_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
+		ret = ept_del_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
 				is_sos_vm(vm) ? mmiodev->base_hpa : mmiodev->base_gpa, mmiodev->size);
-		ret = 0;
 	}
 
 	return ret;
@@ -79,7 +79,7 @@ void vdev_pt_map_msix(struct pci_vdev *vdev, bool hold_lock)
 		addr_hi = round_page_up(addr_hi);
 		register_mmio_emulation_handler(vm, vmsix_handle_table_mmio_access,
 				addr_lo, addr_hi, vdev, hold_lock);
-		ept_del_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, addr_lo, addr_hi - addr_lo);
+		(void)ept_del_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, addr_lo, addr_hi - addr_lo);
 		msix->mmio_gpa = vbar->base_gpa;
 	}
 }
@@ -95,7 +95,7 @@ static void vdev_pt_unmap_mem_vbar(struct pci_vdev *vdev, uint32_t idx)
 	if (vbar->base_gpa != 0UL) {
 		struct acrn_vm *vm = vpci2vm(vdev->vpci);
 
-		ept_del_mr(vm, (uint64_t *)(vm->arch_vm.nworld_eptp),
+		(void)ept_del_mr(vm, (uint64_t *)(vm->arch_vm.nworld_eptp),
 			vbar->base_gpa, /* GPA (old vbar) */
 			vbar->size);
 	}
@@ -116,7 +116,7 @@ static void vdev_pt_map_mem_vbar(struct pci_vdev *vdev, uint32_t idx)
 	if (vbar->base_gpa != 0UL) {
 		struct acrn_vm *vm = vpci2vm(vdev->vpci);
 
-		ept_add_mr(vm, (uint64_t *)(vm->arch_vm.nworld_eptp),
+		(void)ept_add_mr(vm, (uint64_t *)(vm->arch_vm.nworld_eptp),
 			vbar->base_hpa, /* HPA (pbar) */
 			vbar->base_gpa, /* GPA (new vbar) */
 			vbar->size,
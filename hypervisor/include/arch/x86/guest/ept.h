@@ -80,9 +80,10 @@ uint64_t sos_vm_hpa2gpa(uint64_t hpa);
  *                 to be mapped
  * @param[in] prot_orig The specified memory access right and memory type
  *
- * @return None
+ * @retval 0 on success
+ * @retval -ENOMEM if no EPT page-table page is available
  */
-void ept_add_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t hpa,
+int32_t ept_add_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t hpa,
 		uint64_t gpa, uint64_t size, uint64_t prot_orig);
 /**
  * @brief Guest-physical memory page access right or memory type updating
@@ -97,9 +98,10 @@ void ept_add_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t hpa,
  * @param[in] prot_clr The specified memory access right and memory type
  *                     that will be cleared
  *
- * @return None
+ * @retval 0 on success
+ * @retval -ENOMEM if a large page can't be split for lack of EPT page-table pages
  */
-void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
+int32_t ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
 		uint64_t size, uint64_t prot_set, uint64_t prot_clr);
 /**
  * @brief Guest-physical memory region unmapping
@@ -110,11 +112,12 @@ void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
  *                physical memory region whoes mapping needs to be deleted
  * @param[in] size The size of guest physical memory region
  *
- * @return None
+ * @retval 0 on success
+ * @retval -ENOMEM if a large page can't be split for lack of EPT page-table pages
  *
  * @pre [gpa,gpa+size) has been mapped into host physical memory region
  */
-void ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
+int32_t ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
 		uint64_t size);
 
 /**
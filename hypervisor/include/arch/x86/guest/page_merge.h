@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2020 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PAGE_MERGE_H
+#define PAGE_MERGE_H
+
+#include <types.h>
+
+struct acrn_vm;
+
+struct page_merge_stats {
+	/* guest pages currently mapped to a host page shared with other guest pages */
+	uint64_t merged_pages;
+	/* host pages currently shared by more than one guest page */
+	uint64_t shared_pages;
+	/* times the sharing has been broken by a write */
+	uint64_t unshared_pages;
+	/* guest pages currently mapped to the zero page, counted in merged_pages too */
+	uint64_t zero_pages;
+	/* zero pages whose backing host memory has been freed */
+	uint64_t released_pages;
+};
+
+enum page_merge_write {
+	/* not a page under merging */
+	PAGE_MERGE_WRITE_NONE = 0,
+	/* the page has been given its write access back, the write shall be restarted */
+	PAGE_MERGE_WRITE_DONE,
+	/* the backing of the page has been freed, the device model shall restore it first */
+	PAGE_MERGE_WRITE_RELEASED,
+};
+
+/**
+ * @brief Reserve the memory to track the merged pages of the post-launched VMs
+ *
+ * With CONFIG_LAST_LEVEL_EPT_AT_BOOT the memory is carved out of the platform E820 table,
+ * otherwise it is a static array.
+ */
+void reserve_buffer_for_page_merge(void);
+
+/**
+ * @brief Merge the identical pages of a guest memory range
+ *
+ * Hash every 4K page of [gpa, gpa + size) and map the zero pages to the zero page, and the
+ * pages whose content is identical to a page seen before to that page's host page, read-only.
+ * Pages without a match are kept as candidates for later nominations.
+ *
+ * @param[in] vm the VM owning the range
+ * @param[in] gpa the start guest physical address of the range, 4K aligned
+ * @param[in] size the size of the range, 4K aligned, 2M at most
+ * @param[out] zero_pages the number of pages of the range mapped to the zero page
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if the range is invalid or too large, or the VM can't take part in page merging
+ * @retval -EBUSY if another nomination is in progress
+ */
+int32_t page_merge_nominate(struct acrn_vm *vm, uint64_t gpa, uint64_t size, uint64_t *zero_pages);
+
+/**
+ * @brief Give the host memory backing a 2M chunk of zero pages back to the Service VM
+ *
+ * The memory is writable for the Service VM again, and no longer reachable from the VM, when
+ * this returns.
+ *
+ * @param[in] vm the VM owning the chunk
+ * @param[in] gpa the guest physical address of the chunk, 2M aligned
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if a page of the chunk isn't mapped to the zero page or its backing is freed
+ */
+int32_t page_merge_free_backing(struct acrn_vm *vm, uint64_t gpa);
+
+/**
+ * @brief Back a 2M chunk of zero pages freed before with new host memory
+ *
+ * The memory is zeroed and write-protected for the Service VM, the pages of the chunk are
+ * given their own host page on their first write.
+ *
+ * @param[in] vm the VM owning the chunk
+ * @param[in] gpa the guest physical address of the chunk, 2M aligned
+ * @param[in] hpa the host memory of the Service VM to back the chunk, 2M aligned
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if the chunk is not freed or hpa is not memory of the Service VM
+ */
+int32_t page_merge_restore_backing(struct acrn_vm *vm, uint64_t gpa, uint64_t hpa);
+
+/**
+ * @brief Give the write access to a page under merging back on EPT write violation
+ *
+ * @param[in] vm the VM which caused the EPT write violation
+ * @param[in] gpa the faulting guest physical address
+ *
+ * @return how the write violation has been handled
+ */
+enum page_merge_write page_merge_handle_write(struct acrn_vm *vm, uint64_t gpa);
+
+/**
+ * @brief Break the sharing of all the pages of a VM being destroyed
+ *
+ * @param[in] vm the VM being destroyed
+ */
+void page_merge_release_vm(const struct acrn_vm *vm);
+
+void get_page_merge_stats(struct page_merge_stats *stats);
+
+#endif /* PAGE_MERGE_H */
@@ -8,6 +8,7 @@
 #define PAGE_H
 
 #include <board_info.h>
+#include <spinlock.h>
 
 #define PAGE_SHIFT	12U
 #define PAGE_SIZE	(1U << PAGE_SHIFT)
@@ -40,9 +41,25 @@
 
 #define PRE_VM_EPT_ADDRESS_SPACE(size)	(PTDEV_HI_MMIO_START + HI_MMIO_SIZE)
 
-#define TOTAL_EPT_4K_PAGES_SIZE		(PRE_VM_NUM*(PT_PAGE_NUM(PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))*MEM_4K)) + \
-						(SOS_VM_NUM*(PT_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE))*MEM_4K)) + \
-						(MAX_POST_VM_NUM*(PT_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))*MEM_4K))
+/* The number of page-table pages needed to map an address space of the given size with 4K pages */
+#define EPT_PGTABLE_PAGE_NUM(size)	\
+(PML4_PAGE_NUM(size) + PDPT_PAGE_NUM(size) + PD_PAGE_NUM(size) + PT_PAGE_NUM(size))
+
+/* The pre-launched VMs and the SOS VM are created at boot and always get the pages they may need */
+#define BOOT_VM_EPT_PGTABLE_PAGE_NUM	((PRE_VM_NUM * EPT_PGTABLE_PAGE_NUM(PRE_VM_EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE))) + \
+					(SOS_VM_NUM * EPT_PGTABLE_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_SOS_RAM_SIZE))))
+
+/*
+ * Most guest memory is mapped with large pages, so the post-launched VMs share only
+ * CONFIG_EPT_POST_VM_PGTABLE_PERCENT percent of their worst case. Their quotas overcommit it.
+ */
+#define POST_VM_EPT_PGTABLE_PAGE_NUM	\
+	((MAX_POST_VM_NUM * EPT_PGTABLE_PAGE_NUM(EPT_ADDRESS_SPACE(CONFIG_UOS_RAM_SIZE)) * \
+	CONFIG_EPT_POST_VM_PGTABLE_PERCENT) / 100UL)
+
+#define TOTAL_EPT_PGTABLE_PAGE_NUM	(BOOT_VM_EPT_PGTABLE_PAGE_NUM + POST_VM_EPT_PGTABLE_PAGE_NUM)
+
+#define TOTAL_EPT_PGTABLE_PAGES_SIZE	(TOTAL_EPT_PGTABLE_PAGE_NUM * MEM_4K)
 
 #define TRUSTY_PML4_PAGE_NUM(size)	(1UL)
 #define TRUSTY_PDPT_PAGE_NUM(size)	(1UL)
@@ -79,6 +96,22 @@ struct page {
 	uint8_t contents[PAGE_SIZE];
 } __aligned(PAGE_SIZE);
 
+/*
+ * Bitmap-backed pool of page-table pages, one bit per page.
+ * A set bit means the page is in use.
+ */
+struct page_pool {
+	struct page *start_page;
+	spinlock_t lock;
+	uint64_t page_num;
+	uint64_t used_num;
+	uint64_t bitmap_size;
+	uint64_t *bitmap;
+	uint64_t last_hint_id;
+	/* id of the VM each page is handed out to, checked when the page is given back */
+	uint16_t *owner;
+};
+
 union pgtable_pages_info {
 	struct {
 		struct page *pml4_base;
@@ -88,10 +121,11 @@ union pgtable_pages_info {
 	} ppt;
 	struct {
 		uint64_t top_address_space;
-		struct page *nworld_pml4_base;
-		struct page *nworld_pdpt_base;
-		struct page *nworld_pd_base;
-		struct page *nworld_pt_base;
+		struct page_pool *pool;
+		uint16_t vm_id;
+		/* max and current number of pages this VM takes from the pool */
+		uint64_t pgtable_quota;
+		uint64_t pgtable_pages;
 		struct page *sworld_pgtable_base;
 		struct page *sworld_memory_base;
 	} ept;
@@ -102,10 +136,11 @@ struct memory_ops {
 	bool (*large_page_support)(enum _page_table_level level);
 	uint64_t (*get_default_access_right)(void);
 	uint64_t (*pgentry_present)(uint64_t pte);
-	struct page *(*get_pml4_page)(const union pgtable_pages_info *info);
-	struct page *(*get_pdpt_page)(const union pgtable_pages_info *info, uint64_t gpa);
-	struct page *(*get_pd_page)(const union pgtable_pages_info *info, uint64_t gpa);
-	struct page *(*get_pt_page)(const union pgtable_pages_info *info, uint64_t gpa);
+	struct page *(*get_pml4_page)(union pgtable_pages_info *info);
+	struct page *(*get_pdpt_page)(union pgtable_pages_info *info, uint64_t gpa);
+	struct page *(*get_pd_page)(union pgtable_pages_info *info, uint64_t gpa);
+	struct page *(*get_pt_page)(union pgtable_pages_info *info, uint64_t gpa);
+	void (*free_pgtable_page)(union pgtable_pages_info *info, struct page *page);
 	void *(*get_sworld_memory_base)(const union pgtable_pages_info *info);
 	void (*clflush_pagewalk)(const void *p);
 	void (*tweak_exe_right)(uint64_t *entry);
@@ -115,8 +150,6 @@ struct memory_ops {
 extern const struct memory_ops ppt_mem_ops;
 void init_ept_mem_ops(struct memory_ops *mem_ops, uint16_t vm_id);
 void *get_reserve_sworld_memory_base(void);
-
-#ifdef CONFIG_LAST_LEVEL_EPT_AT_BOOT
 void reserve_buffer_for_ept_pages(void);
-#endif
+void get_ept_page_pool_usage(uint64_t *total, uint64_t *used);
 #endif /* PAGE_H */
@@ -233,6 +233,22 @@ int32_t hcall_set_vm_memory_regions(struct acrn_vm *vm, uint64_t param);
  */
 int32_t hcall_write_protect_page(struct acrn_vm *vm, uint16_t vmid, uint64_t wp_gpa);
 
+/**
+ * @brief merge the identical pages of a guest memory range
+ *
+ * Identical pages are mapped read-only to a single host page, the sharing
+ * is broken on the first write to a merged page.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct page_merge_data
+ *
+ * @pre Pointer vm shall point to SOS_VM
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_merge_pages(struct acrn_vm *vm, uint16_t vmid, uint64_t param);
+
 /**
  * @brief translate guest physical address to host physical address
  *
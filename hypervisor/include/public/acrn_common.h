@@ -35,6 +35,8 @@
 #define REQ_MMIO	1U
 #define REQ_PCICFG	2U
 #define REQ_WP		3U
+/* a write to a merged page whose backing has been freed, see HC_VM_MERGE_PAGES */
+#define REQ_RESTORE_PAGE	4U
 
 #define REQUEST_READ	0U
 #define REQUEST_WRITE	1U
@@ -56,6 +56,7 @@
 #define HC_VM_GPA2HPA               BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x01UL)
 #define HC_VM_SET_MEMORY_REGIONS    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x02UL)
 #define HC_VM_WRITE_PROTECT_PAGE    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x03UL)
+#define HC_VM_MERGE_PAGES           BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x04UL)
 
 /* PCI assignment*/
 #define HC_ID_PCI_BASE              0x50UL
@@ -176,6 +177,50 @@ struct wp_data {
 	uint64_t gpa;
 } __aligned(8);
 
+/* merge the identical pages of [gpa, gpa + size) */
+#define PAGE_MERGE_NOMINATE		0U
+/* give the host memory backing the 2M chunk of zero pages at gpa back to the Service VM */
+#define PAGE_MERGE_FREE_BACKING		1U
+/* back the 2M chunk of zero pages at gpa, freed before, with the host memory at hpa */
+#define PAGE_MERGE_RESTORE_BACKING	2U
+
+/**
+ * @brief Info to merge the identical pages of a guest memory range
+ *
+ * the parameter for HC_VM_MERGE_PAGES hypercall
+ */
+struct page_merge_data {
+	/** PAGE_MERGE_NOMINATE, PAGE_MERGE_FREE_BACKING or PAGE_MERGE_RESTORE_BACKING */
+	uint32_t op;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** the guest physical address of the range, 4K aligned, 2M aligned to free or restore */
+	uint64_t gpa;
+
+	/** the size of the range, 4K aligned, 2M at most, 0 to only query the counters */
+	uint64_t size;
+
+	/** the host memory of the Service VM to restore the backing with, 2M aligned */
+	uint64_t hpa;
+
+	/** output of PAGE_MERGE_NOMINATE: pages of the range mapped to the zero page */
+	uint64_t zero_pages;
+
+	/** output: guest pages currently merged, system wide */
+	uint64_t merged_pages;
+
+	/** output: host pages currently shared by merged pages, system wide */
+	uint64_t shared_pages;
+
+	/** output: times the sharing has been broken by a write, system wide */
+	uint64_t unshared_pages;
+
+	/** output: zero pages whose backing has been freed, system wide */
+	uint64_t released_pages;
+} __aligned(8);
+
 /**
  * Setup parameter for share buffer, used for HC_SETUP_SBUF hypercall
  */
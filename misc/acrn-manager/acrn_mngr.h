@@ -26,6 +26,8 @@ header file.
 
 #define ACRN_DM_BASE_PATH	"/run/acrn"
 #define ACRN_DM_SOCK_PATH	"/run/acrn/mngr"
+/* written by acrn-dm on DM_METRICS, with the name of the VM */
+#define ACRN_DM_METRICS_FMT	ACRN_DM_BASE_PATH "/%s.metrics"
 
 /* TODO: Revisit PARAM_LEN and see if size can be reduced */
 #define PARAM_LEN	256
@@ -36,7 +38,7 @@ struct mngr_msg {
 	unsigned long timestamp;
 	union {
 
-		/* Arguments to rescan virtio-blk device */
+		/* Arguments to rescan virtio-blk device, or snapshot file path */
 		char devargs[PARAM_LEN];
 
 		/* ack of DM_STOP, DM_SUSPEND, DM_RESUME,
@@ -96,6 +98,9 @@ enum dm_msgid {
 	DM_RESUME,		/* Resume this UOS from suspend state */
 	DM_QUERY,		/* Ask power state of this UOS */
 	DM_BLKRESCAN,		/* Rescan virtio-blk device for any changes in UOS */
+	DM_SNAPSHOT,		/* Save the memory of this suspended UOS to a file */
+	DM_BLKTHROTTLE,		/* Change the I/O limits of a virtio-blk device */
+	DM_METRICS,		/* Write the I/O latency metrics to ACRN_DM_METRICS_FMT */
 	DM_MAX,
 };
 
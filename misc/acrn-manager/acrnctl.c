@@ -36,6 +36,9 @@
 #define RESUME_DESC    "Resume virtual machine from suspend state"
 #define RESET_DESC     "Stop and then start virtual machine VM_NAME"
 #define BLKRESCAN_DESC  "Rescan virtio-blk device attached to a virtual machine"
+#define SNAPSHOT_DESC  "Save the memory of a suspended virtual machine to a file"
+#define BLKTHROTTLE_DESC "Change the I/O limits of a virtio-blk device of a virtual machine"
+#define METRICS_DESC   "Show the I/O latency metrics of a virtual machine"
 
 #define VM_NAME (1)
 #define CMD_ARGS (2)
@@ -437,6 +440,79 @@ static int acrnctl_do_blkrescan(int argc, char *argv[])
 	return 0;
 }
 
+static int acrnctl_do_snapshot(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_SUSPENDED) {
+		printf("%s is in %s state but should be in %s state for snapshot\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_SUSPENDED]);
+		return -1;
+	}
+
+	return snapshot_vm(argv[VM_NAME], argv[CMD_ARGS]);
+}
+
+static int acrnctl_do_blkthrottle(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for blkthrottle\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+
+	return blkthrottle_vm(argv[VM_NAME], argv[CMD_ARGS]);
+}
+
+static int acrnctl_do_metrics(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+	char path[PATH_LEN];
+	char buf[4096];
+	ssize_t n;
+	int fd, ret;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED && s->state != VM_SUSPENDED) {
+		printf("%s is in %s state, it isn't running\n",
+			argv[VM_NAME], state_str[s->state]);
+		return -1;
+	}
+
+	ret = metrics_vm(argv[VM_NAME]);
+	if (ret)
+		return ret;
+
+	/* acrn-dm writes them to a file of its own, named after the VM */
+	snprintf(path, sizeof(path), ACRN_DM_METRICS_FMT, argv[VM_NAME]);
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		printf("failed to open %s\n", path);
+		return -1;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+	close(fd);
+
+	return 0;
+}
+
 static int acrnctl_do_stop(int argc, char *argv[])
 {
 	struct vmmngr_struct *s;
@@ -704,6 +780,43 @@ static int valid_blkrescan_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
+static int valid_snapshot_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME /absolute/path/of/snapshot";
+
+	/* the file is written by acrn-dm, so a relative path is meaningless */
+	if (argc != 3 || !strcmp(argv[1], "help") || argv[2][0] != '/') {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_blkthrottle_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME slot,limit=rate[:burst][,...]";
+
+	if (argc != 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_metrics_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME";
+
+	if (argc != 2 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int valid_add_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
 	char df_opt[32] = "launch_scripts options";
@@ -748,6 +861,9 @@ struct acrnctl_cmd acmds[] = {
 	ACMD("resume", acrnctl_do_resume, RESUME_DESC, df_valid_args),
 	ACMD("reset", acrnctl_do_reset, RESET_DESC, df_valid_args),
 	ACMD("blkrescan", acrnctl_do_blkrescan, BLKRESCAN_DESC, valid_blkrescan_args),
+	ACMD("snapshot", acrnctl_do_snapshot, SNAPSHOT_DESC, valid_snapshot_args),
+	ACMD("blkthrottle", acrnctl_do_blkthrottle, BLKTHROTTLE_DESC, valid_blkthrottle_args),
+	ACMD("metrics", acrnctl_do_metrics, METRICS_DESC, valid_metrics_args),
 };
 
 #define NCMD	(sizeof(acmds)/sizeof(struct acrnctl_cmd))
@@ -59,5 +59,8 @@ int continue_vm(const char *vmname);
 int suspend_vm(const char *vmname);
 int resume_vm(const char *vmname, unsigned reason);
 int blkrescan_vm(const char *vmname, char *devargs);
+int snapshot_vm(const char *vmname, const char *path);
+int blkthrottle_vm(const char *vmname, char *devargs);
+int metrics_vm(const char *vmname);
 
 #endif				/* _ACRNCTL_H_ */
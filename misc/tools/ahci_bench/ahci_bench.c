@@ -0,0 +1,669 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * AHCI NCQ micro-benchmark.
+ *
+ * Runs the device model AHCI emulation (devicemodel/hw/pci/ahci.c) against
+ * a minimal guest driver issuing a synthetic list of READ/WRITE FPDMA
+ * QUEUED commands on one port, with a block backend that completes the
+ * requests from its own thread without doing any I/O.  What's measured is
+ * the cost of the emulation itself: the time per command, and the MMIO
+ * accesses and interrupts it takes, each of them being a VM exit on a real
+ * guest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "ahci.h"
+#include "ata.h"
+#include "block_if.h"
+#include "timer.h"
+#include "log.h"
+
+#define GUEST_MEM_SIZE		(8UL << 20)
+#define CLB_GPA			0x0UL
+#define FB_GPA			0x1000UL
+#define CT_GPA			0x10000UL	/* a 4KiB table per slot */
+#define BUF_GPA			0x100000UL	/* a 128KiB buffer per slot */
+#define PRD_SIZE		4096U		/* bytes per PRDT entry */
+#define NSLOTS			32
+#define CMD_LIST_LEN		4096
+#define SECTOR_SIZE		512
+#define DISK_SECTORS		(1UL << 31)
+#define BAR			5
+
+extern struct pci_vdev_ops pci_ops_ahci_hd;
+
+static char *guest_mem;
+static volatile unsigned long nr_intr;
+
+/*
+ * The device model services ahci.c relies on, reduced to what the bench
+ * needs: guest memory is one flat buffer, interrupts are counted.
+ */
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t gaddr, size_t len)
+{
+	if (gaddr + len > GUEST_MEM_SIZE)
+		return NULL;
+	return guest_mem + gaddr;
+}
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > LOG_WARNING)
+		return;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+int pci_msi_maxmsgnum(struct pci_vdev *dev) { return 1; }
+void pci_generate_msi(struct pci_vdev *dev, int index)
+{
+	__atomic_add_fetch(&nr_intr, 1, __ATOMIC_RELEASE);
+}
+void pci_lintr_assert(struct pci_vdev *dev) {}
+void pci_lintr_deassert(struct pci_vdev *dev) {}
+void pci_lintr_request(struct pci_vdev *pi) {}
+int pci_emul_add_msicap(struct pci_vdev *pi, int msgnum) { return 0; }
+int pci_emul_alloc_bar(struct pci_vdev *pdi, int idx, enum pcibar_type type,
+		uint64_t size) { return 0; }
+
+/*
+ * The coalescing timer, run by its own thread. There's one port, so one
+ * timer.
+ */
+static struct acrn_timer *bench_timer;
+static pthread_mutex_t timer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static uint64_t timer_deadline;
+static bool timer_stop;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int32_t
+acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t),
+		void *param)
+{
+	timer->callback = cb;
+	timer->callback_param = param;
+	bench_timer = timer;
+	return 0;
+}
+
+void
+acrn_timer_deinit(struct acrn_timer *timer)
+{
+	bench_timer = NULL;
+}
+
+int32_t
+acrn_timer_settime(struct acrn_timer *timer,
+		const struct itimerspec *new_value)
+{
+	uint64_t ns;
+
+	ns = new_value->it_value.tv_sec * 1000000000UL +
+		new_value->it_value.tv_nsec;
+	pthread_mutex_lock(&timer_mtx);
+	timer_deadline = ns ? now_ns() + ns : 0;
+	pthread_cond_signal(&timer_cond);
+	pthread_mutex_unlock(&timer_mtx);
+	return 0;
+}
+
+static void *
+timer_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&timer_mtx);
+	while (!timer_stop) {
+		if (timer_deadline == 0) {
+			pthread_cond_wait(&timer_cond, &timer_mtx);
+			continue;
+		}
+		if (now_ns() < timer_deadline) {
+			ts.tv_sec = timer_deadline / 1000000000UL;
+			ts.tv_nsec = timer_deadline % 1000000000UL;
+			pthread_cond_timedwait(&timer_cond, &timer_mtx, &ts);
+			continue;
+		}
+		/* the callback takes the controller lock, this one's dropped */
+		timer_deadline = 0;
+		pthread_mutex_unlock(&timer_mtx);
+		if (bench_timer)
+			(*bench_timer->callback)(bench_timer->callback_param, 1);
+		pthread_mutex_lock(&timer_mtx);
+	}
+	pthread_mutex_unlock(&timer_mtx);
+
+	return NULL;
+}
+
+/*
+ * The block backend: the requests are queued to a thread which completes
+ * them in order, after -l us each, without touching the data.
+ */
+struct blockif_ctxt {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	struct blockif_req *q[NSLOTS];
+	int head, tail;
+	int plugged;
+	bool stop;
+	unsigned long nr_req;
+	unsigned long nr_wakeup;
+};
+
+static struct blockif_ctxt backend;
+static int backend_us;
+static int guest_cpu = 0;
+static int backend_cpu = 1;
+
+static void
+pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "failed to pin to cpu %d\n", cpu);
+}
+
+struct blockif_ctxt *
+blockif_open(const char *optstr, const char *ident)
+{
+	return &backend;
+}
+
+int blockif_close(struct blockif_ctxt *bc) { return 0; }
+off_t blockif_size(struct blockif_ctxt *bc)
+{
+	return DISK_SECTORS * SECTOR_SIZE;
+}
+void blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h,
+		uint8_t *s) { *c = 65535; *h = 16; *s = 63; }
+int blockif_sectsz(struct blockif_ctxt *bc) { return SECTOR_SIZE; }
+void blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off)
+{
+	*size = SECTOR_SIZE;
+	*off = 0;
+}
+int blockif_queuesz(struct blockif_ctxt *bc) { return NSLOTS; }
+int blockif_is_ro(struct blockif_ctxt *bc) { return 0; }
+int blockif_candiscard(struct blockif_ctxt *bc) { return 0; }
+int blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	return -1;
+}
+int blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	return -1;
+}
+int blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	return -1;
+}
+
+static int
+blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	pthread_mutex_lock(&bc->mtx);
+	bc->q[bc->tail++ % NSLOTS] = breq;
+	bc->nr_req++;
+	if (!bc->plugged) {
+		bc->nr_wakeup++;
+		pthread_cond_signal(&bc->cond);
+	}
+	pthread_mutex_unlock(&bc->mtx);
+	return 0;
+}
+
+int blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	return blockif_enqueue(bc, breq);
+}
+int blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	return blockif_enqueue(bc, breq);
+}
+
+void
+blockif_plug(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->mtx);
+	bc->plugged++;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->mtx);
+	if (--bc->plugged == 0 && bc->head != bc->tail) {
+		bc->nr_wakeup++;
+		pthread_cond_signal(&bc->cond);
+	}
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+static void *
+backend_thread(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_req *breq;
+	uint64_t end;
+
+	pin_to_cpu(backend_cpu);
+	pthread_mutex_lock(&bc->mtx);
+	for (;;) {
+		while (!bc->stop && (bc->head == bc->tail || bc->plugged))
+			pthread_cond_wait(&bc->cond, &bc->mtx);
+		if (bc->stop)
+			break;
+		breq = bc->q[bc->head++ % NSLOTS];
+		pthread_mutex_unlock(&bc->mtx);
+
+		if (backend_us) {
+			end = now_ns() + backend_us * 1000UL;
+			while (now_ns() < end)
+				;
+		}
+		breq->resid = 0;
+		(*breq->callback)(breq, 0);
+
+		pthread_mutex_lock(&bc->mtx);
+	}
+	pthread_mutex_unlock(&bc->mtx);
+
+	return NULL;
+}
+
+/* One command of the synthetic list */
+struct bench_cmd {
+	uint8_t write;
+	uint16_t sectors;
+	uint64_t lba;
+};
+
+struct bench {
+	struct pci_vdev dev;
+	struct pci_vdev_ops *ops;
+	char opts[64];
+
+	struct bench_cmd *cmds;
+	int depth;
+	int batch;
+	unsigned long ncmds;
+
+	/* guest driver state */
+	uint32_t outstanding;
+	unsigned long next;
+	unsigned long nr_mmio;
+};
+
+static void
+relax(int *spins)
+{
+	if (++(*spins) < 64) {
+		asm volatile("pause");
+	} else {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+static void
+bench_write(struct bench *b, uint64_t offset, uint32_t value)
+{
+	b->nr_mmio++;
+	(*b->ops->vdev_barwrite)(NULL, 0, &b->dev, BAR, offset, 4, value);
+}
+
+static uint32_t
+bench_read(struct bench *b, uint64_t offset)
+{
+	b->nr_mmio++;
+	return (*b->ops->vdev_barread)(NULL, 0, &b->dev, BAR, offset, 4);
+}
+
+#define PORT_REG(reg)	(AHCI_OFFSET + (reg))
+
+/*
+ * A random mix of reads and writes, of 4KiB mostly and up to 128KiB,
+ * cycled through by the guest.
+ */
+static void
+bench_gen_cmds(struct bench *b, int write_pct, int sectors)
+{
+	int i;
+
+	srand(1);
+	for (i = 0; i < CMD_LIST_LEN; i++) {
+		b->cmds[i].write = (rand() % 100) < write_pct;
+		b->cmds[i].sectors = sectors ? sectors :
+			((rand() % 8) ? 8 : 8 << (rand() % 5));
+		b->cmds[i].lba = ((uint64_t)rand() % (DISK_SECTORS / 8)) * 8;
+	}
+}
+
+/* Build the command header, the H2D FIS and the PRDT of a slot */
+static void
+bench_build_cmd(struct bench *b, int slot, struct bench_cmd *c)
+{
+	struct ahci_cmd_hdr {
+		uint16_t flags;
+		uint16_t prdtl;
+		uint32_t prdbc;
+		uint64_t ctba;
+		uint32_t reserved[4];
+	} *hdr;
+	struct ahci_prdt_entry {
+		uint64_t dba;
+		uint32_t reserved;
+		uint32_t dbc;
+	} *prdt;
+	uint8_t *cfis;
+	uint32_t len, i, n;
+
+	len = c->sectors * SECTOR_SIZE;
+	n = (len + PRD_SIZE - 1) / PRD_SIZE;
+	hdr = (struct ahci_cmd_hdr *)(guest_mem + CLB_GPA +
+		slot * AHCI_CL_SIZE);
+	cfis = (uint8_t *)(guest_mem + CT_GPA + slot * 4096UL);
+	prdt = (struct ahci_prdt_entry *)(cfis + 0x80);
+
+	memset(cfis, 0, 20);
+	cfis[0] = 0x27;				/* H2D register FIS */
+	cfis[1] = 0x80;				/* command */
+	cfis[2] = c->write ? ATA_WRITE_FPDMA_QUEUED : ATA_READ_FPDMA_QUEUED;
+	cfis[3] = c->sectors & 0xff;		/* count, in the features */
+	cfis[11] = c->sectors >> 8;
+	cfis[4] = c->lba;
+	cfis[5] = c->lba >> 8;
+	cfis[6] = c->lba >> 16;
+	cfis[7] = ATA_D_LBA;
+	cfis[8] = c->lba >> 24;
+	cfis[9] = c->lba >> 32;
+	cfis[10] = c->lba >> 40;
+	cfis[12] = slot << 3;			/* tag */
+
+	for (i = 0; i < n; i++) {
+		prdt[i].dba = BUF_GPA + slot * 0x20000UL + i * PRD_SIZE;
+		prdt[i].reserved = 0;
+		prdt[i].dbc = MIN(PRD_SIZE, len - i * PRD_SIZE) - 1;
+	}
+
+	hdr->flags = 5 | (c->write ? (1 << 6) : 0);	/* 5 dwords of CFIS */
+	hdr->prdtl = n;
+	hdr->prdbc = 0;
+	hdr->ctba = CT_GPA + slot * 4096UL;
+}
+
+/* start the controller and the port, the way a guest does */
+static void
+bench_setup(struct bench *b)
+{
+	memset(guest_mem, 0, GUEST_MEM_SIZE);
+	bench_write(b, AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_IE);
+	bench_write(b, PORT_REG(AHCI_P_CLB), CLB_GPA);
+	bench_write(b, PORT_REG(AHCI_P_CLBU), 0);
+	bench_write(b, PORT_REG(AHCI_P_FB), FB_GPA);
+	bench_write(b, PORT_REG(AHCI_P_FBU), 0);
+	bench_write(b, PORT_REG(AHCI_P_IS), 0xffffffff);
+	bench_write(b, PORT_REG(AHCI_P_IE), AHCI_P_IX_SDB | AHCI_P_IX_DHR |
+		AHCI_P_IX_TFE);
+	bench_write(b, PORT_REG(AHCI_P_CMD), AHCI_P_CMD_FRE | AHCI_P_CMD_ST |
+		AHCI_P_CMD_SUD | AHCI_P_CMD_POD);
+	b->outstanding = 0;
+	b->next = 0;
+	b->nr_mmio = 0;
+}
+
+/*
+ * Issue commands on the free slots, batch of them by PxSACT and PxCI
+ * write, as long as the queue isn't full.
+ */
+static void
+bench_issue(struct bench *b)
+{
+	uint32_t mask;
+	int slot, n;
+
+	while (b->next < b->ncmds &&
+	    __builtin_popcount(b->outstanding) < b->depth) {
+		mask = 0;
+		for (n = 0, slot = 0; slot < b->depth && n < b->batch &&
+		    b->next < b->ncmds; slot++) {
+			if ((b->outstanding | mask) & (1U << slot))
+				continue;
+			bench_build_cmd(b, slot,
+				&b->cmds[b->next++ % CMD_LIST_LEN]);
+			mask |= 1U << slot;
+			n++;
+		}
+		b->outstanding |= mask;
+		bench_write(b, PORT_REG(AHCI_P_SACT), mask);
+		bench_write(b, PORT_REG(AHCI_P_CI), mask);
+	}
+}
+
+/* The interrupt handler, returns the commands it completed */
+static int
+bench_intr(struct bench *b)
+{
+	uint32_t is, pis, sact, done;
+
+	is = bench_read(b, AHCI_IS);
+	pis = bench_read(b, PORT_REG(AHCI_P_IS));
+	bench_write(b, PORT_REG(AHCI_P_IS), pis);
+	bench_write(b, AHCI_IS, is);
+	if (pis & AHCI_P_IX_TFE) {
+		fprintf(stderr, "task file error, tfd %x\n",
+			bench_read(b, PORT_REG(AHCI_P_TFD)));
+		exit(1);
+	}
+	sact = bench_read(b, PORT_REG(AHCI_P_SACT));
+	done = b->outstanding & ~sact;
+	b->outstanding &= sact;
+
+	return __builtin_popcount(done);
+}
+
+static void
+run(struct bench *b)
+{
+	struct timespec start, end;
+	unsigned long done = 0, intr, seen = 0, nr_req, nr_wakeup;
+	pthread_t backend_tid, timer_tid;
+	uint64_t ns;
+	char opts[sizeof(b->opts)];
+	int spins = 0;
+
+	/* the options are cut by the device init */
+	snprintf(opts, sizeof(opts), "%s", b->opts);
+	memset(&b->dev, 0, sizeof(b->dev));
+	if ((*b->ops->vdev_init)(NULL, &b->dev, opts)) {
+		fprintf(stderr, "failed to init the controller with %s\n",
+			b->opts);
+		exit(1);
+	}
+	memset(&backend, 0, sizeof(backend));
+	pthread_mutex_init(&backend.mtx, NULL);
+	pthread_cond_init(&backend.cond, NULL);
+	pthread_create(&backend_tid, NULL, backend_thread, &backend);
+	timer_stop = false;
+	timer_deadline = 0;
+	pthread_create(&timer_tid, NULL, timer_thread, NULL);
+
+	pin_to_cpu(guest_cpu);
+	bench_setup(b);
+	nr_intr = 0;
+	b->nr_mmio = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (done < b->ncmds) {
+		bench_issue(b);
+		intr = __atomic_load_n(&nr_intr, __ATOMIC_ACQUIRE);
+		if (intr == seen) {
+			relax(&spins);
+			continue;
+		}
+		seen = intr;
+		done += bench_intr(b);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_mutex_lock(&backend.mtx);
+	backend.stop = true;
+	nr_req = backend.nr_req;
+	nr_wakeup = backend.nr_wakeup;
+	pthread_cond_signal(&backend.cond);
+	pthread_mutex_unlock(&backend.mtx);
+	pthread_join(backend_tid, NULL);
+	pthread_mutex_lock(&timer_mtx);
+	timer_stop = true;
+	pthread_cond_signal(&timer_cond);
+	pthread_mutex_unlock(&timer_mtx);
+	pthread_join(timer_tid, NULL);
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000UL +
+		end.tv_nsec - start.tv_nsec;
+	printf("%-28s depth %d batch %d: %lu commands in %lu ms, "
+		"%.1f ns/command, %.2f mmio/command, %.2f interrupts/command, "
+		"%.2f requests/backend wakeup\n",
+		b->opts, b->depth, b->batch, done, ns / 1000000,
+		(double)ns / done, (double)b->nr_mmio / done,
+		(double)nr_intr / done,
+		nr_wakeup ? (double)nr_req / nr_wakeup : 0.0);
+	free(b->dev.arg);
+}
+
+static void
+usage(const char *prog)
+{
+	printf("Usage: %s [-q depth] [-b batch] [-n commands] [-s sectors]"
+		" [-w write%%] [-l backend_us] [-c coalesce]"
+		" [-g guest_cpu] [-d backend_cpu]\n"
+		"  -q  commands in flight, up to %d (default %d)\n"
+		"  -b  commands issued by PxCI write (default 8)\n"
+		"  -n  number of commands (default 1000000)\n"
+		"  -s  sectors per command, up to 256 (default 8, or a mix of"
+		" 8 to 128 with 0)\n"
+		"  -w  percentage of writes (default 30)\n"
+		"  -l  backend latency per request in us (default 0)\n"
+		"  -c  the coalesce=<n>[:<us>] port option, 1 and 8 by"
+		" default\n"
+		"  -g  cpu of the guest driver thread (default 0)\n"
+		"  -d  cpu of the backend thread (default 1)\n",
+		prog, NSLOTS, NSLOTS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench b;
+	pthread_condattr_t attr;
+	const char *coalesce = NULL;
+	int c, write_pct = 30, sectors = 8;
+
+	memset(&b, 0, sizeof(b));
+	b.ops = &pci_ops_ahci_hd;
+	b.depth = NSLOTS;
+	b.batch = 8;
+	b.ncmds = 1000000UL;
+
+	while ((c = getopt(argc, argv, "q:b:n:s:w:l:c:g:d:h")) != -1) {
+		switch (c) {
+		case 'q':
+			b.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			b.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.ncmds = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sectors = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			write_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			backend_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			coalesce = optarg;
+			break;
+		case 'g':
+			guest_cpu = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			backend_cpu = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (b.depth < 1 || b.depth > NSLOTS || b.batch < 1 ||
+	    sectors < 0 || sectors > 256 || write_pct < 0 || write_pct > 100) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	guest_mem = aligned_alloc(4096, GUEST_MEM_SIZE);
+	b.cmds = calloc(CMD_LIST_LEN, sizeof(struct bench_cmd));
+	if (guest_mem == NULL || b.cmds == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	bench_gen_cmds(&b, write_pct, sectors);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timer_cond, &attr);
+
+	if (coalesce) {
+		snprintf(b.opts, sizeof(b.opts), "hd:bench,coalesce=%s",
+			coalesce);
+		run(&b);
+	} else {
+		snprintf(b.opts, sizeof(b.opts), "hd:bench");
+		run(&b);
+		snprintf(b.opts, sizeof(b.opts), "hd:bench,coalesce=8");
+		run(&b);
+	}
+
+	free(b.cmds);
+	free(guest_mem);
+	return 0;
+}
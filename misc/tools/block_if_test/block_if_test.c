@@ -0,0 +1,766 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Block interface test.
+ *
+ * Runs requests through the device model block interface
+ * (devicemodel/hw/block_if.c) on files in a temporary directory, and
+ * checks:
+ * - the copy-on-write overlay: the clusters not written are read from
+ *   the backing file, the ones written are allocated in the overlay, each
+ *   synced before a table points to it, and found again when the overlay
+ *   is reopened, with the backing file left as it was;
+ * - throttling: the reads over their limit are held back, the writes
+ *   aren't, and the held reads are let through as soon as the limit is
+ *   removed by blockif_set_throttle();
+ * - merging: the contiguous requests pending are run as one, and what was
+ *   done is split back to each of them, up to a short read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "vmmapi.h"
+#include "mevent.h"
+#include "block_if.h"
+#include "page_merge.h"
+#include "log.h"
+
+#define FILE_SIZE	(1024 * 1024)
+#define BLK		4096
+#define COW_CLUSTER_SZ	(64 * 1024)	/* of the overlays block_if.c creates */
+#define MAX_EVENTS	1024
+#define NS_PER_MS	1000000UL
+
+static const char *engine = "";
+static char dir[256];
+static bool verbose;
+
+/* the device model services block_if.c relies on */
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > LOG_WARNING && !verbose)
+		return;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* no mevent thread: io_uring is tested on a pinned context, cpu=0 */
+struct mevent *
+mevent_add(int fd, enum ev_type type,
+	   void (*run)(int, enum ev_type, void *), void *param,
+	   void (*teardown)(void *), void *teardown_param)
+{
+	return NULL;
+}
+
+int
+mevent_delete(struct mevent *evp)
+{
+	return 0;
+}
+
+/* no guest memory to register */
+int
+hugetlb_get_mem_regions(struct vmctx *ctx, struct hugetlb_mem_region *regions,
+			int max)
+{
+	return 0;
+}
+
+bool page_merge_enabled;
+void page_merge_disable(const char *why) {}
+
+/*
+ * The writes to the overlay and its syncs, in order, linked with
+ * --wrap=pwrite,--wrap=fdatasync. An 8 bytes write is a table entry, and
+ * its value the offset of the cluster it points to.
+ */
+struct sync_event {
+	int	fd;
+	bool	sync;
+	off_t	off;
+	size_t	len;
+	uint64_t val;
+};
+
+static pthread_mutex_t events_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct sync_event events[MAX_EVENTS];
+static int nevents;
+static bool logging;
+
+ssize_t __real_pwrite(int fd, const void *buf, size_t n, off_t off);
+int __real_fdatasync(int fd);
+
+static void
+log_event(int fd, bool sync, off_t off, size_t len, const void *buf)
+{
+	struct sync_event *e;
+
+	pthread_mutex_lock(&events_mtx);
+	if (logging && nevents < MAX_EVENTS) {
+		e = &events[nevents++];
+		e->fd = fd;
+		e->sync = sync;
+		e->off = off;
+		e->len = len;
+		e->val = 0;
+		if (len == sizeof(uint64_t))
+			memcpy(&e->val, buf, sizeof(uint64_t));
+	}
+	pthread_mutex_unlock(&events_mtx);
+}
+
+ssize_t
+__wrap_pwrite(int fd, const void *buf, size_t n, off_t off)
+{
+	log_event(fd, false, off, n, buf);
+	return __real_pwrite(fd, buf, n, off);
+}
+
+int
+__wrap_fdatasync(int fd)
+{
+	log_event(fd, true, 0, 0, NULL);
+	return __real_fdatasync(fd);
+}
+
+/* the requests, completed by the I/O threads */
+struct test_req {
+	struct blockif_req	br;
+	struct iovec		iov[2];
+	int			err;
+	bool			done;
+	uint64_t		done_ns;
+};
+
+static pthread_mutex_t done_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+req_done(struct blockif_req *br, int err)
+{
+	struct test_req *r = br->param;
+
+	pthread_mutex_lock(&done_mtx);
+	r->err = err;
+	r->done_ns = now_ns();
+	r->done = true;
+	pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&done_mtx);
+}
+
+/* len bytes at off, in two iovecs split at split if it's within */
+static void
+req_init(struct test_req *r, off_t off, uint8_t *buf, size_t len,
+	 size_t split)
+{
+	memset(r, 0, sizeof(*r));
+	r->iov[0].iov_base = buf;
+	r->iov[0].iov_len = len;
+	r->br.iovcnt = 1;
+	if (split && split < len) {
+		r->iov[0].iov_len = split;
+		r->iov[1].iov_base = buf + split;
+		r->iov[1].iov_len = len - split;
+		r->br.iovcnt = 2;
+	}
+	r->br.iov = r->iov;
+	r->br.offset = off;
+	r->br.resid = len;
+	r->br.callback = req_done;
+	r->br.param = r;
+}
+
+static int
+req_submit(struct blockif_ctxt *bc, struct test_req *r, bool write)
+{
+	int err;
+
+	err = write ? blockif_write(bc, &r->br) : blockif_read(bc, &r->br);
+	if (err)
+		fprintf(stderr, "request at %ld not queued: %d\n",
+			r->br.offset, err);
+	return err;
+}
+
+/* Wait for the n requests for ms at most, returns the number done */
+static int
+req_wait(struct test_req *r, int n, int ms)
+{
+	struct timespec ts;
+	int i, done;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * NS_PER_MS;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&done_mtx);
+	for (;;) {
+		for (i = 0, done = 0; i < n; i++)
+			done += r[i].done;
+		if (done == n || ms == 0 ||
+		    pthread_cond_timedwait(&done_cond, &done_mtx, &ts))
+			break;
+	}
+	for (i = 0, done = 0; i < n; i++)
+		done += r[i].done;
+	pthread_mutex_unlock(&done_mtx);
+	return done;
+}
+
+static int
+req_run(struct blockif_ctxt *bc, struct test_req *r, bool write)
+{
+	if (req_submit(bc, r, write))
+		return -1;
+	if (req_wait(r, 1, 1000) != 1) {
+		fprintf(stderr, "request at %ld not completed\n",
+			r->br.offset);
+		return -1;
+	}
+	return r->err;
+}
+
+/* the content of the files, different in each sector and for each seed */
+static uint8_t
+pattern(off_t pos, int seed)
+{
+	return (uint8_t)((pos >> 9) * 7 + (pos & 0xff) + seed);
+}
+
+static void
+fill(uint8_t *buf, off_t off, size_t len, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = pattern(off + i, seed);
+}
+
+static int
+check(const uint8_t *buf, off_t off, size_t len, int seed, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != pattern(off + i, seed)) {
+			fprintf(stderr, "%s: byte at %ld is 0x%x, not 0x%x\n",
+				what, off + i, buf[i],
+				pattern(off + i, seed));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+create_file(const char *path, int seed)
+{
+	static uint8_t buf[COW_CLUSTER_SZ];
+	off_t off;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "failed to create %s: %d\n", path, errno);
+		return -1;
+	}
+	for (off = 0; off < FILE_SIZE; off += sizeof(buf)) {
+		fill(buf, off, sizeof(buf), seed);
+		if (__real_pwrite(fd, buf, sizeof(buf), off) != sizeof(buf)) {
+			fprintf(stderr, "failed to write %s: %d\n", path,
+				errno);
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static off_t
+file_size(const char *path)
+{
+	struct stat sbuf;
+
+	return stat(path, &sbuf) ? -1 : sbuf.st_size;
+}
+
+static struct blockif_ctxt *
+open_bc(const char *path, const char *opts, const char *ident)
+{
+	struct blockif_ctxt *bc;
+	char optstr[512];
+
+	snprintf(optstr, sizeof(optstr), "%s%s%s", path, opts, engine);
+	bc = blockif_open(optstr, ident);
+	if (!bc)
+		fprintf(stderr, "failed to open %s\n", optstr);
+	return bc;
+}
+
+/*
+ * Each table entry written points to a cluster written, then synced,
+ * before it.
+ */
+static int
+check_sync_order(int *nentries)
+{
+	struct sync_event *e;
+	int i, j, k;
+
+	*nentries = 0;
+	for (i = 0; i < nevents; i++) {
+		e = &events[i];
+		if (e->sync || e->len != sizeof(uint64_t) || e->val == 0)
+			continue;
+		for (j = i - 1; j >= 0; j--) {
+			if (!events[j].sync && events[j].fd == e->fd &&
+			    events[j].off == e->val &&
+			    events[j].len == COW_CLUSTER_SZ)
+				break;
+		}
+		for (k = j + 1; j >= 0 && k < i; k++) {
+			if (events[k].sync && events[k].fd == e->fd)
+				break;
+		}
+		if (j < 0 || k >= i) {
+			fprintf(stderr, "overlay: entry at %ld points to the "
+				"cluster at %lu, %s\n", e->off, e->val,
+				j < 0 ? "never written" : "not synced");
+			return -1;
+		}
+		(*nentries)++;
+	}
+	return 0;
+}
+
+/* the whole drive is the backing file, but for the bytes written */
+static int
+check_overlay(struct blockif_ctxt *bc, const char *what)
+{
+	static uint8_t buf[FILE_SIZE];
+	struct test_req r;
+	off_t off;
+
+	memset(buf, 0, sizeof(buf));
+	req_init(&r, 0, buf, sizeof(buf), 3 * COW_CLUSTER_SZ + 512);
+	if (req_run(bc, &r, false) || r.br.resid) {
+		fprintf(stderr, "%s: read failed %d, %ld left\n", what,
+			r.err, r.br.resid);
+		return -1;
+	}
+	for (off = 0; off < FILE_SIZE; off += BLK) {
+		/* the two writes of test_cow() */
+		if ((off >= 3 * COW_CLUSTER_SZ + BLK &&
+		     off < 3 * COW_CLUSTER_SZ + 3 * BLK) ||
+		    (off >= 5 * COW_CLUSTER_SZ - BLK &&
+		     off < 5 * COW_CLUSTER_SZ + BLK)) {
+			if (check(buf + off, off, BLK, 2, what))
+				return -1;
+		} else if (check(buf + off, off, BLK, 1, what))
+			return -1;
+	}
+	return 0;
+}
+
+static int
+test_cow(void)
+{
+	static uint8_t buf[4 * BLK], data[2 * BLK];
+	char backing[320], overlay[320];
+	struct blockif_ctxt *bc;
+	struct test_req r[2];
+	off_t size;
+	int ret = -1, nentries;
+
+	snprintf(backing, sizeof(backing), "%s/backing", dir);
+	snprintf(overlay, sizeof(overlay), "%s/overlay", dir);
+	if (create_file(backing, 1))
+		return -1;
+
+	snprintf((char *)buf, sizeof(buf), ",cow=%s", backing);
+	bc = open_bc(overlay, (char *)buf, "cow");
+	if (!bc)
+		return -1;
+	size = file_size(overlay);
+
+	/* read through, across a cluster boundary */
+	req_init(&r[0], COW_CLUSTER_SZ - BLK, buf, 4 * BLK, BLK + 512);
+	if (req_run(bc, &r[0], false) || r[0].br.resid ||
+	    check(buf, COW_CLUSTER_SZ - BLK, 4 * BLK, 1, "read through"))
+		goto out;
+	if (file_size(overlay) != size) {
+		fprintf(stderr, "overlay: grew on a read\n");
+		goto out;
+	}
+
+	/*
+	 * Within a cluster, then across two: the L2 table and three clusters
+	 * allocated, each synced before the entry pointing to it is written.
+	 */
+	logging = true;
+	fill(data, 3 * COW_CLUSTER_SZ + BLK, 2 * BLK, 2);
+	req_init(&r[0], 3 * COW_CLUSTER_SZ + BLK, data, 2 * BLK, 0);
+	if (req_run(bc, &r[0], true) || r[0].br.resid)
+		goto out;
+	fill(data, 5 * COW_CLUSTER_SZ - BLK, 2 * BLK, 2);
+	req_init(&r[1], 5 * COW_CLUSTER_SZ - BLK, data, 2 * BLK, BLK / 2);
+	if (req_run(bc, &r[1], true) || r[1].br.resid)
+		goto out;
+	logging = false;
+
+	if (file_size(overlay) != size + 4 * COW_CLUSTER_SZ) {
+		fprintf(stderr, "overlay: %ld bytes, not %ld\n",
+			file_size(overlay), size + 4 * COW_CLUSTER_SZ);
+		goto out;
+	}
+	if (check_sync_order(&nentries))
+		goto out;
+	if (nentries != 4) {
+		fprintf(stderr, "overlay: %d entries written, not 4\n",
+			nentries);
+		goto out;
+	}
+	if (check_overlay(bc, "overlay"))
+		goto out;
+	blockif_close(bc);
+
+	/* the backing file is in the header */
+	bc = open_bc(overlay, ",cow", "cow");
+	if (!bc)
+		goto out;
+	if (check_overlay(bc, "overlay reopened"))
+		goto out;
+	blockif_close(bc);
+	bc = NULL;
+
+	/* and was left as it was */
+	bc = open_bc(backing, ",ro", "backing");
+	if (!bc)
+		goto out;
+	req_init(&r[0], 3 * COW_CLUSTER_SZ, buf, 4 * BLK, 0);
+	if (req_run(bc, &r[0], false) ||
+	    check(buf, 3 * COW_CLUSTER_SZ, 4 * BLK, 1, "backing file"))
+		goto out;
+
+	printf("overlay: read through, 3 clusters allocated by 2 writes, "
+		"%d table entries written after their cluster was synced, "
+		"reopened: OK\n", nentries);
+	ret = 0;
+out:
+	logging = false;
+	if (bc)
+		blockif_close(bc);
+	unlink(overlay);
+	unlink(backing);
+	return ret;
+}
+
+static int
+test_throttle(void)
+{
+	static uint8_t buf[6][BLK], data[BLK];
+	char path[320];
+	struct blockif_ctxt *bc;
+	struct blockif_stats stats;
+	struct test_req r[7];
+	uint64_t start, last = 0;
+	int i, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/raw", dir);
+	if (create_file(path, 1))
+		return -1;
+	bc = open_bc(path, ",iops_rd=10:1", "thr");
+	if (!bc)
+		goto out;
+
+	/*
+	 * 10 reads a second, 1 in advance: the first two go through, the
+	 * next ones a tenth of a second apart. The write isn't held back.
+	 */
+	start = now_ns();
+	for (i = 0; i < 6; i++) {
+		req_init(&r[i], i * COW_CLUSTER_SZ, buf[i], BLK, 0);
+		if (req_submit(bc, &r[i], false))
+			goto out;
+	}
+	fill(data, FILE_SIZE / 2, BLK, 1);
+	req_init(&r[6], FILE_SIZE / 2, data, BLK, 0);
+	if (req_submit(bc, &r[6], true))
+		goto out;
+	if (req_wait(r, 7, 3000) != 7) {
+		fprintf(stderr, "throttle: requests not completed\n");
+		goto out;
+	}
+	for (i = 0; i < 6; i++) {
+		if (r[i].err || r[i].br.resid ||
+		    check(buf[i], i * COW_CLUSTER_SZ, BLK, 1, "throttle"))
+			goto out;
+		if (r[i].done_ns > last)
+			last = r[i].done_ns;
+	}
+	blockif_get_stats(bc, &stats);
+	if (last - start < 300 * NS_PER_MS || last - start > 2000 * NS_PER_MS ||
+	    r[6].err || r[6].done_ns >= last || stats.throttled < 3) {
+		fprintf(stderr, "throttle: reads in %lu ms, the write in %lu "
+			"ms, %lu throttled\n", (last - start) / NS_PER_MS,
+			(r[6].done_ns - start) / NS_PER_MS, stats.throttled);
+		goto out;
+	}
+	printf("throttle: 6 reads at 10/s in %lu ms, the write let through "
+		"in %lu ms, %lu reads held back: OK\n",
+		(last - start) / NS_PER_MS, (r[6].done_ns - start) / NS_PER_MS,
+		stats.throttled);
+
+	/*
+	 * 1 read a second: after two, the next three are held back for
+	 * seconds, unless the limit is removed.
+	 */
+	if (blockif_set_throttle(bc, "iops_rd=x") == 0 ||
+	    blockif_set_throttle(bc, "iops_rd=1:1"))
+		goto out;
+	for (i = 0; i < 2; i++) {
+		req_init(&r[i], i * COW_CLUSTER_SZ, buf[i], BLK, 0);
+		if (req_run(bc, &r[i], false))
+			goto out;
+	}
+	for (i = 2; i < 5; i++) {
+		req_init(&r[i], i * COW_CLUSTER_SZ, buf[i], BLK, 0);
+		if (req_submit(bc, &r[i], false))
+			goto out;
+	}
+	usleep(100 * 1000);
+	if (req_wait(&r[2], 3, 0) != 0) {
+		fprintf(stderr, "throttle: reads not held back at 1/s\n");
+		goto out;
+	}
+	start = now_ns();
+	if (blockif_set_throttle(bc, "iops_rd=0") ||
+	    req_wait(&r[2], 3, 3000) != 3)
+		goto out;
+	for (i = 2, last = 0; i < 5; i++) {
+		if (r[i].err || r[i].br.resid ||
+		    check(buf[i], i * COW_CLUSTER_SZ, BLK, 1, "throttle"))
+			goto out;
+		if (r[i].done_ns > last)
+			last = r[i].done_ns;
+	}
+	if (last - start > 500 * NS_PER_MS) {
+		fprintf(stderr, "throttle: reads released in %lu ms\n",
+			(last - start) / NS_PER_MS);
+		goto out;
+	}
+	printf("throttle: 3 reads held back released in %lu ms by "
+		"blockif_set_throttle(): OK\n", (last - start) / NS_PER_MS);
+	ret = 0;
+out:
+	if (bc)
+		blockif_close(bc);
+	unlink(path);
+	return ret;
+}
+
+/*
+ * Hold three contiguous requests back, two done at 1 a second, and let
+ * them through together: the first one takes the two others.
+ */
+static int
+hold_and_release(struct blockif_ctxt *bc, struct test_req *r, bool write,
+		 const char *limit)
+{
+	uint8_t tmp[2][BLK];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		fill(tmp[i], i * BLK, BLK, 1);
+		req_init(&r[i], i * BLK, tmp[i], BLK, 0);
+		if (req_run(bc, &r[i], write))
+			return -1;
+	}
+	for (i = 2; i < 5; i++) {
+		if (req_submit(bc, &r[i], write))
+			return -1;
+	}
+	usleep(100 * 1000);
+	if (req_wait(&r[2], 3, 0) != 0) {
+		fprintf(stderr, "merge: requests not held back\n");
+		return -1;
+	}
+	if (blockif_set_throttle(bc, limit) || req_wait(&r[2], 3, 3000) != 3) {
+		fprintf(stderr, "merge: requests not completed\n");
+		return -1;
+	}
+	for (i = 2; i < 5; i++) {
+		if (r[i].err) {
+			fprintf(stderr, "merge: request at %ld failed %d\n",
+				r[i].br.offset, r[i].err);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+test_merge(void)
+{
+	static uint8_t buf[4 * BLK];
+	char path[320];
+	struct blockif_ctxt *bc;
+	struct blockif_stats stats;
+	struct test_req r[5];
+	int fd, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/raw", dir);
+	if (create_file(path, 1))
+		return -1;
+	bc = open_bc(path, ",merge,iops_rd=1:1,iops_wr=1:1", "mrg");
+	if (!bc)
+		goto out;
+
+	/* the last of the three reads is past the end, nothing read */
+	memset(buf, 0xee, sizeof(buf));
+	req_init(&r[2], FILE_SIZE - 3 * BLK, buf, 2 * BLK, 3 * 1024);
+	req_init(&r[3], FILE_SIZE - BLK, buf + 2 * BLK, BLK, 0);
+	req_init(&r[4], FILE_SIZE, buf + 3 * BLK, BLK, 1024);
+	if (hold_and_release(bc, r, false, "iops_rd=0"))
+		goto out;
+	if (r[2].br.resid || r[3].br.resid || r[4].br.resid != BLK ||
+	    check(buf, FILE_SIZE - 3 * BLK, 3 * BLK, 1, "merge") ||
+	    buf[3 * BLK] != 0xee || buf[4 * BLK - 1] != 0xee) {
+		fprintf(stderr, "merge: reads split back with %ld, %ld, %ld "
+			"bytes left\n", r[2].br.resid, r[3].br.resid,
+			r[4].br.resid);
+		goto out;
+	}
+	blockif_get_stats(bc, &stats);
+	if (stats.merged != 2 || stats.merges != 1) {
+		fprintf(stderr, "merge: %lu reads merged into %lu\n",
+			stats.merged, stats.merges);
+		goto out;
+	}
+
+	fill(buf, FILE_SIZE / 2, 4 * BLK, 2);
+	req_init(&r[2], FILE_SIZE / 2, buf, 2 * BLK, 5 * 1024);
+	req_init(&r[3], FILE_SIZE / 2 + 2 * BLK, buf + 2 * BLK, BLK, 1024);
+	req_init(&r[4], FILE_SIZE / 2 + 3 * BLK, buf + 3 * BLK, BLK, 0);
+	if (hold_and_release(bc, r, true, "iops_wr=0"))
+		goto out;
+	blockif_get_stats(bc, &stats);
+	if (r[2].br.resid || r[3].br.resid || r[4].br.resid ||
+	    stats.merged != 4 || stats.merges != 2) {
+		fprintf(stderr, "merge: %lu writes merged into %lu\n",
+			stats.merged - 2, stats.merges - 1);
+		goto out;
+	}
+	memset(buf, 0, sizeof(buf));
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || pread(fd, buf, sizeof(buf), FILE_SIZE / 2) !=
+			sizeof(buf) ||
+	    check(buf, FILE_SIZE / 2, sizeof(buf), 2, "merge")) {
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	close(fd);
+
+	printf("merge: 3 reads merged and split back, the one past the end "
+		"left unread, 3 writes merged: OK\n");
+	ret = 0;
+out:
+	if (bc)
+		blockif_close(bc);
+	unlink(path);
+	return ret;
+}
+
+static void
+usage(const char *prog)
+{
+	printf("Usage: %s [-d directory] [-u] [-v]\n"
+		"  -d  directory of the test files (default /tmp)\n"
+		"  -u  io_uring engine, instead of the I/O threads\n"
+		"  -v  print the messages of the block interface\n",
+		prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *base = "/tmp";
+	bool uring = false;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "hd:uv")) != -1) {
+		switch (opt) {
+		case 'd':
+			base = optarg;
+			break;
+		case 'u':
+			uring = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* pinned, the completions are reaped without the mevent thread */
+	if (uring)
+		engine = ",aio=io_uring,cpu=0";
+
+	snprintf(dir, sizeof(dir), "%s/block_if_test-XXXXXX", base);
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "failed to create a directory in %s: %d\n",
+			base, errno);
+		return 1;
+	}
+
+	ret = test_cow();
+	if (!ret)
+		ret = test_throttle();
+	/* io_uring runs each request on its own */
+	if (!ret && !uring)
+		ret = test_merge();
+
+	rmdir(dir);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * AF_PACKET ring test.
+ *
+ * Sends frames through the device model AF_PACKET ring
+ * (devicemodel/hw/packet_ring.c) opened on one end of a veth pair, and
+ * receives them with another ring on the other end:
+ * - numbered frames, checked as they come back, with the number of TX
+ *   flushes and RX blocks it took;
+ * - a TCP/IPv4 GSO packet with its checksum left to the stack, which must
+ *   come out of the other end whole, with the same virtio-net header.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "packet_ring.h"
+#include "log.h"
+
+#define ETH_HLEN	14
+#define IP_HLEN		20
+#define TCP_HLEN	20
+#define TEST_ETHERTYPE	0x88b5		/* local experimental */
+#define TX_BATCH	16
+#define RX_TIMEOUT_MS	1000
+
+/* struct virtio_net_hdr */
+struct vnet_hdr {
+	uint8_t		flags;
+	uint8_t		gso_type;
+	uint16_t	hdr_len;
+	uint16_t	gso_size;
+	uint16_t	csum_start;
+	uint16_t	csum_offset;
+} __attribute__((packed));
+
+#define VNET_HDR_F_NEEDS_CSUM	1
+#define VNET_HDR_GSO_TCPV4	1
+
+static const uint8_t mac_a[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x0a };
+static const uint8_t mac_b[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x0b };
+
+static uint8_t frame[4096];
+static bool verbose;
+
+/* the logging service packet_ring.c relies on */
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Take the next frame of ours off the ring, waiting for it up to timeout
+ * ms. Other frames, the IPv6 noise of the link, are skipped.
+ */
+static uint8_t *
+rx_frame(struct packet_ring *r, int *len, int timeout)
+{
+	struct pollfd pfd = { .fd = packet_ring_fd(r), .events = POLLIN };
+	uint64_t end = now_ms() + timeout;
+	uint8_t *pkt;
+
+	for (;;) {
+		while ((pkt = packet_ring_rx_peek(r, len)) != NULL) {
+			if (*len >= ETH_HLEN && !memcmp(pkt + 6, mac_a, 6))
+				return pkt;
+			packet_ring_rx_next(r);
+		}
+		if (now_ms() >= end)
+			return NULL;
+		(void)poll(&pfd, 1, 10);
+	}
+}
+
+/*
+ * Check the numbered frames received, from *next up to last, waiting for
+ * them up to timeout ms.
+ */
+static int
+rx_frames(struct packet_ring *r, uint32_t *next, uint32_t last, int len,
+	  int timeout)
+{
+	struct vnet_hdr *vh;
+	uint8_t *pkt;
+	int rlen;
+
+	for (; *next < last; (*next)++) {
+		pkt = rx_frame(r, &rlen, timeout);
+		if (pkt == NULL)
+			return timeout ? -1 : 0;
+		vh = (struct vnet_hdr *)(pkt - PACKET_RING_VNET_HDRLEN);
+		memcpy(frame + ETH_HLEN, next, sizeof(*next));
+		if (rlen != len || memcmp(pkt, frame, len) ||
+		    vh->gso_type != 0) {
+			fprintf(stderr, "frame %u: bad frame of %d bytes\n",
+				*next, rlen);
+			return -1;
+		}
+		packet_ring_rx_next(r);
+	}
+	return 0;
+}
+
+static int
+test_frames(struct packet_ring *ra, struct packet_ring *rb, uint32_t nframes,
+	    int len)
+{
+	struct vnet_hdr hdr;
+	struct packet_ring_stats sa, sb;
+	struct iovec iov;
+	uint32_t seq, next = 0;
+	int i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(frame, mac_b, 6);
+	memcpy(frame + 6, mac_a, 6);
+	frame[12] = TEST_ETHERTYPE >> 8;
+	frame[13] = TEST_ETHERTYPE & 0xff;
+	for (i = ETH_HLEN + sizeof(seq); i < len; i++)
+		frame[i] = i;
+	iov.iov_base = frame;
+	iov.iov_len = len;
+
+	/* the frames received so far are checked after each TX batch */
+	for (seq = 0; seq < nframes; seq++) {
+		memcpy(frame + ETH_HLEN, &seq, sizeof(seq));
+		if (packet_ring_tx(ra, &hdr, &iov, 1, len)) {
+			fprintf(stderr, "frame %u dropped on TX\n", seq);
+			return -1;
+		}
+		if ((seq + 1) % TX_BATCH == 0) {
+			packet_ring_tx_flush(ra);
+			if (rx_frames(rb, &next, seq + 1, len, 0))
+				return -1;
+		}
+	}
+	packet_ring_tx_flush(ra);
+
+	if (rx_frames(rb, &next, nframes, len, RX_TIMEOUT_MS)) {
+		fprintf(stderr, "frame %u not received\n", next);
+		return -1;
+	}
+
+	packet_ring_get_stats(ra, &sa);
+	packet_ring_get_stats(rb, &sb);
+	printf("%u frames of %d bytes went through in %lu TX flushes and "
+		"were received in %lu RX blocks: OK\n", nframes, len,
+		sa.tx_flushes, sb.rx_blocks);
+	return 0;
+}
+
+static uint16_t
+csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static uint16_t
+ip_csum(const uint8_t *p, int len)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	if (i < len)
+		sum += p[i] << 8;
+	return ~csum_fold(sum) & 0xffff;
+}
+
+/*
+ * A TCP/IPv4 packet of payload bytes, to be segmented in mss bytes ones,
+ * with its TCP checksum left to the stack.
+ */
+static int
+build_gso(struct vnet_hdr *hdr, int payload, int mss)
+{
+	uint8_t *ip = frame + ETH_HLEN, *tcp = ip + IP_HLEN;
+	int len = ETH_HLEN + IP_HLEN + TCP_HLEN + payload;
+	uint32_t sum;
+	uint16_t v;
+	int i;
+
+	memset(frame, 0, ETH_HLEN + IP_HLEN + TCP_HLEN);
+	memcpy(frame, mac_b, 6);
+	memcpy(frame + 6, mac_a, 6);
+	frame[12] = 0x08;			/* IPv4 */
+
+	ip[0] = 0x45;
+	v = htons(IP_HLEN + TCP_HLEN + payload);
+	memcpy(ip + 2, &v, 2);
+	ip[8] = 64;				/* ttl */
+	ip[9] = 6;				/* TCP */
+	memcpy(ip + 12, "\x0a\x00\x00\x0a", 4);
+	memcpy(ip + 16, "\x0a\x00\x00\x0b", 4);
+	v = htons(ip_csum(ip, IP_HLEN));
+	memcpy(ip + 10, &v, 2);
+
+	tcp[0] = 0x9c; tcp[1] = 0x40;		/* 40000 */
+	tcp[2] = 0x9c; tcp[3] = 0x41;		/* 40001 */
+	tcp[12] = (TCP_HLEN / 4) << 4;
+	tcp[13] = 0x18;				/* PSH ACK */
+	tcp[14] = 0xff; tcp[15] = 0xff;		/* window */
+	for (i = 0; i < payload; i++)
+		tcp[TCP_HLEN + i] = i;
+
+	/* the pseudo header sum, the stack adds the rest */
+	sum = (ip[12] << 8 | ip[13]) + (ip[14] << 8 | ip[15]) +
+		(ip[16] << 8 | ip[17]) + (ip[18] << 8 | ip[19]) + 6 +
+		TCP_HLEN + payload;
+	v = htons(csum_fold(sum));
+	memcpy(tcp + 16, &v, 2);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->flags = VNET_HDR_F_NEEDS_CSUM;
+	hdr->gso_type = VNET_HDR_GSO_TCPV4;
+	hdr->hdr_len = ETH_HLEN + IP_HLEN + TCP_HLEN;
+	hdr->gso_size = mss;
+	hdr->csum_start = ETH_HLEN + IP_HLEN;
+	hdr->csum_offset = 16;
+	return len;
+}
+
+static int
+test_gso(struct packet_ring *ra, struct packet_ring *rb, int payload,
+	 int mss)
+{
+	struct vnet_hdr hdr, *vh;
+	struct iovec iov;
+	uint8_t *pkt;
+	int len, rlen;
+
+	len = build_gso(&hdr, payload, mss);
+	iov.iov_base = frame;
+	iov.iov_len = len;
+	if (packet_ring_tx(ra, &hdr, &iov, 1, len)) {
+		fprintf(stderr, "GSO packet dropped on TX\n");
+		return -1;
+	}
+	packet_ring_tx_flush(ra);
+
+	pkt = rx_frame(rb, &rlen, RX_TIMEOUT_MS);
+	if (pkt == NULL) {
+		fprintf(stderr, "GSO packet not received\n");
+		return -1;
+	}
+	vh = (struct vnet_hdr *)(pkt - PACKET_RING_VNET_HDRLEN);
+	if (verbose)
+		printf("received %d bytes: flags %u gso_type %u hdr_len %u "
+			"gso_size %u csum_start %u csum_offset %u\n", rlen,
+			vh->flags, vh->gso_type, vh->hdr_len, vh->gso_size,
+			vh->csum_start, vh->csum_offset);
+	if (rlen != len || memcmp(pkt, frame, len) ||
+	    !(vh->flags & VNET_HDR_F_NEEDS_CSUM) ||
+	    vh->gso_type != hdr.gso_type || vh->gso_size != hdr.gso_size ||
+	    vh->csum_start != hdr.csum_start ||
+	    vh->csum_offset != hdr.csum_offset) {
+		fprintf(stderr, "GSO packet received as %d bytes, gso_type "
+			"%u gso_size %u\n", rlen, vh->gso_type, vh->gso_size);
+		return -1;
+	}
+	packet_ring_rx_next(rb);
+
+	printf("TCP/IPv4 GSO packet of %d bytes in %d bytes segments "
+		"received whole, with its header: OK\n", payload, mss);
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	printf("Usage: %s -a <interface> -b <interface> [-n frames] "
+		"[-l length] [-v]\n"
+		"  -a  interface the frames are sent on\n"
+		"  -b  its veth peer, the frames are received on\n"
+		"  -n  number of frames (default 1000)\n"
+		"  -l  frame length, 64 to 1514 (default 1000)\n"
+		"  -v  print the header of the GSO packet received\n",
+		prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *ifa = NULL, *ifb = NULL;
+	struct packet_ring *ra, *rb;
+	int opt, len = 1000, ret;
+	long nframes = 1000;
+
+	while ((opt = getopt(argc, argv, "ha:b:n:l:v")) != -1) {
+		switch (opt) {
+		case 'a':
+			ifa = optarg;
+			break;
+		case 'b':
+			ifb = optarg;
+			break;
+		case 'n':
+			nframes = atol(optarg);
+			break;
+		case 'l':
+			len = atoi(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	/* the frames are of the default MTU at most */
+	if (!ifa || !ifb || nframes < 1 || nframes > UINT32_MAX ||
+	    len < 64 || len > ETH_HLEN + 1500) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ra = packet_ring_open(ifa, 0);
+	if (!ra)
+		return 1;
+	rb = packet_ring_open(ifb, 0);
+	if (!rb) {
+		packet_ring_close(ra);
+		return 1;
+	}
+
+	ret = test_frames(ra, rb, nframes, len);
+	if (!ret)
+		ret = test_gso(ra, rb, 3000, 1000);
+
+	packet_ring_close(rb);
+	packet_ring_close(ra);
+	return ret ? 1 : 0;
+}
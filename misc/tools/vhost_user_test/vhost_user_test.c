@@ -0,0 +1,901 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * vhost-user test backend.
+ *
+ * A minimal vhost-user backend for virtio-net, which loops the packets
+ * the guest sends on its TX queue back to its RX queue. It serves the
+ * virtqueues with the device model virtqueue code, on guest memory mapped
+ * from the fds of SET_MEM_TABLE, and kicks and interrupts through the
+ * eventfds of SET_VRING_KICK and SET_VRING_CALL.
+ *
+ * With -s, it listens on a unix socket for an acrn-dm started with
+ * "-s <slot>,virtio-net,vhost-user=<path>". Without, it runs a self test:
+ * the device model vhost-user transport (hw/pci/virtio/vhost.c and
+ * vhost_user.c) is driven against the backend in the same process, with
+ * a memfd as guest memory and a minimal guest driver, and the packets
+ * sent are checked as they come back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vhost.h"
+#include "vhost_user.h"
+#include "vmmapi.h"
+#include "timer.h"
+#include "log.h"
+#include <atomic.h>
+
+#define NR_VQS		2	/* RX and TX, no control queue */
+#define RXQ		0
+#define TXQ		1
+#define MAX_SEGS	16
+#define NET_HDR_LEN	12	/* virtio 1.0 header, with num_buffers */
+
+#define BE_FEATURES	((1UL << VIRTIO_F_VERSION_1) |		\
+			 (1UL << VIRTIO_RING_F_INDIRECT_DESC) |	\
+			 (1UL << VIRTIO_RING_F_EVENT_IDX) |		\
+			 (1UL << VIRTIO_F_NOTIFY_ON_EMPTY) |	\
+			 (1UL << 15) /* VIRTIO_NET_F_MRG_RXBUF */)
+
+/* self test guest memory layout */
+#define GUEST_MEM_SIZE	(4UL << 20)
+#define RING_GPA(q)	(0x10000UL * (q))
+#define AVAIL_OFF	0x1000UL
+#define USED_OFF	0x2000UL
+#define BUF_GPA(q, id)	(0x100000UL * ((q) + 1) + (uint64_t)(id) * BUF_SIZE)
+#define BUF_SIZE	2048U
+#define QSIZE		256U
+
+static bool verbose;
+
+/*
+ * The device model services virtio.c and vhost.c rely on. Guest physical
+ * addresses are the backend's, translated by its memory table; vm_*fd()
+ * have nothing to register, the guest driver uses the eventfds directly.
+ */
+struct be_region {
+	uint64_t gpa;
+	uint64_t size;
+	uint64_t uaddr;
+	uint8_t *hva;
+	void *map;
+	size_t maplen;
+};
+
+struct be_vring {
+	struct virtio_vq_info vq;
+	int kickfd;
+	int callfd;
+	uint16_t num;
+	uint16_t base;
+	uint8_t *desc, *avail, *used;
+	bool started;
+};
+
+static struct backend {
+	int fd;
+	struct virtio_base base;
+	struct pci_vdev dev;
+	struct be_vring vr[NR_VQS];
+	struct be_region regions[VHOST_USER_MAX_REGIONS];
+	int nregions;
+	uint64_t features;
+	unsigned long nmsgs;
+	unsigned long npkts;
+	unsigned long nintrs;
+} be;
+
+static struct virtio_ops be_ops = {
+	"vhost_user_test",	/* our name */
+	NR_VQS,			/* RX and TX */
+	0,			/* config reg size */
+	NULL,			/* reset */
+	NULL,			/* device-wide qnotify */
+	NULL,			/* read virtio config */
+	NULL,			/* write virtio config */
+	NULL,			/* apply negotiated features */
+	NULL,			/* called on guest set status */
+};
+
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t gaddr, size_t len)
+{
+	struct be_region *r;
+	int i;
+
+	for (i = 0; i < be.nregions; i++) {
+		r = &be.regions[i];
+		if (gaddr >= r->gpa && gaddr + len <= r->gpa + r->size)
+			return r->hva + (gaddr - r->gpa);
+	}
+	return NULL;
+}
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > LOG_WARNING)
+		return;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+void
+pci_generate_msix(struct pci_vdev *dev, int index)
+{
+	uint64_t val = 1;
+
+	if (index < NR_VQS && be.vr[index].callfd >= 0 &&
+	    write(be.vr[index].callfd, &val, sizeof(val)) == sizeof(val))
+		be.nintrs++;
+}
+
+int pci_msix_enabled(struct pci_vdev *pi) { return 1; }
+void pci_generate_msi(struct pci_vdev *dev, int index) {}
+void pci_lintr_assert(struct pci_vdev *dev) {}
+void pci_lintr_deassert(struct pci_vdev *dev) {}
+void pci_lintr_request(struct pci_vdev *pi) {}
+int pci_msix_table_bar(struct pci_vdev *pi) { return -1; }
+int pci_msix_pba_bar(struct pci_vdev *pi) { return -1; }
+int pci_emul_add_msicap(struct pci_vdev *pi, int msgnum) { return 0; }
+int pci_emul_add_msixcap(struct pci_vdev *pi, int msgnum, int barnum) { return 0; }
+int pci_emul_alloc_bar(struct pci_vdev *pdi, int idx, enum pcibar_type type,
+		uint64_t size) { return 0; }
+int pci_emul_add_capability(struct pci_vdev *dev, u_char *capdata,
+		int caplen) { return 0; }
+int pci_emul_find_capability(struct pci_vdev *dev, uint8_t capid,
+		int *p_capoff) { return -1; }
+int pci_emul_msix_twrite(struct pci_vdev *pi, uint64_t offset, int size,
+		uint64_t value) { return 0; }
+uint64_t pci_emul_msix_tread(struct pci_vdev *pi, uint64_t offset,
+		int size) { return 0; }
+int32_t acrn_timer_init(struct acrn_timer *timer,
+		void (*cb)(void *, uint64_t), void *param) { return 0; }
+void acrn_timer_deinit(struct acrn_timer *timer) {}
+int32_t acrn_timer_settime(struct acrn_timer *timer,
+		const struct itimerspec *new_value) { return 0; }
+int vm_ioeventfd(struct vmctx *ctx, struct acrn_ioeventfd *args) { return 0; }
+int vm_irqfd(struct vmctx *ctx, struct acrn_irqfd *args) { return 0; }
+
+/* the self test guest memory, one memfd */
+static int guest_memfd = -1;
+static uint8_t *guest_mem;
+
+int
+hugetlb_get_mem_regions(struct vmctx *ctx, struct hugetlb_mem_region *regions,
+		int max)
+{
+	if (max < 1 || guest_memfd < 0)
+		return 0;
+	regions[0].gpa = 0;
+	regions[0].size = GUEST_MEM_SIZE;
+	regions[0].hva = guest_mem;
+	regions[0].fd = guest_memfd;
+	regions[0].offset = 0;
+	return 1;
+}
+
+/*
+ * Backend
+ */
+static uint8_t *
+be_ua2hva(uint64_t ua, size_t len)
+{
+	struct be_region *r;
+	int i;
+
+	for (i = 0; i < be.nregions; i++) {
+		r = &be.regions[i];
+		if (ua >= r->uaddr && ua + len <= r->uaddr + r->size)
+			return r->hva + (ua - r->uaddr);
+	}
+	return NULL;
+}
+
+static void
+be_unmap(void)
+{
+	int i;
+
+	for (i = 0; i < be.nregions; i++)
+		munmap(be.regions[i].map, be.regions[i].maplen);
+	be.nregions = 0;
+}
+
+static void
+be_stop_vring(struct be_vring *vr)
+{
+	vr->started = false;
+	vr->vq.flags = 0;
+	vr->base = vr->vq.last_avail;
+	if (vr->kickfd >= 0) {
+		close(vr->kickfd);
+		vr->kickfd = -1;
+	}
+}
+
+static int
+be_start_vring(struct be_vring *vr, int idx)
+{
+	struct virtio_vq_info *vq = &vr->vq;
+
+	if (!vr->desc || !vr->avail || !vr->used || vr->num == 0) {
+		fprintf(stderr, "backend: vring %d is not set up\n", idx);
+		return -1;
+	}
+
+	memset(vq, 0, sizeof(*vq));
+	vq->base = &be.base;
+	vq->num = idx;
+	vq->msix_idx = idx;
+	vq->qsize = vr->num;
+	vq->desc = (struct vring_desc *)vr->desc;
+	vq->avail = (struct vring_avail *)vr->avail;
+	vq->used = (struct vring_used *)vr->used;
+	vq->last_avail = vr->base;
+	vq->save_used = vq->used->idx;
+	mb();
+	vq->flags = VQ_ALLOC;
+	vr->started = true;
+	return 0;
+}
+
+/*
+ * Copy each TX packet, virtio-net header included, to an RX buffer, as
+ * long as there are both. The rings are left with avail_event set if
+ * EVENT_IDX is in use, so that the guest kicks for the next ones.
+ */
+static void
+be_loopback(void)
+{
+	struct virtio_vq_info *rxq = &be.vr[RXQ].vq, *txq = &be.vr[TXQ].vq;
+	struct iovec tiov[MAX_SEGS], riov[MAX_SEGS];
+	uint16_t tidx, ridx;
+	size_t off, toff, chunk;
+	int tn, rn, t, r, len;
+
+	if (!be.vr[RXQ].started || !be.vr[TXQ].started)
+		return;
+
+again:
+	while (vq_has_descs(txq) && vq_has_descs(rxq)) {
+		tn = vq_getchain(txq, &tidx, tiov, MAX_SEGS, NULL);
+		rn = vq_getchain(rxq, &ridx, riov, MAX_SEGS, NULL);
+		if (tn <= 0 || tn > MAX_SEGS || rn <= 0 || rn > MAX_SEGS) {
+			fprintf(stderr, "backend: bad chains %d %d\n", tn, rn);
+			return;
+		}
+
+		len = 0;
+		for (t = 0, r = 0, toff = 0, off = 0; t < tn && r < rn;) {
+			chunk = MIN(tiov[t].iov_len - toff,
+				riov[r].iov_len - off);
+			memcpy((uint8_t *)riov[r].iov_base + off,
+				(uint8_t *)tiov[t].iov_base + toff, chunk);
+			len += chunk;
+			toff += chunk;
+			off += chunk;
+			if (toff == tiov[t].iov_len) {
+				t++;
+				toff = 0;
+			}
+			if (off == riov[r].iov_len) {
+				r++;
+				off = 0;
+			}
+		}
+
+		/* num_buffers */
+		if (riov[0].iov_len >= NET_HDR_LEN)
+			*(uint16_t *)((uint8_t *)riov[0].iov_base + 10) = 1;
+
+		vq_relchain(rxq, ridx, len);
+		vq_relchain(txq, tidx, 0);
+		be.npkts++;
+	}
+
+	vq_endchains(txq, 1);
+	vq_endchains(rxq, 1);
+
+	vq_clear_used_ring_flags(&be.base, txq);
+	vq_clear_used_ring_flags(&be.base, rxq);
+	mb();
+	if (vq_has_descs(txq) && vq_has_descs(rxq))
+		goto again;
+}
+
+static int
+be_recv(struct vhost_user_msg *msg, int *fds, int *nfds)
+{
+	char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+	struct msghdr msgh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t rc;
+
+	iov.iov_base = msg;
+	iov.iov_len = VHOST_USER_HDR_SIZE;
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control;
+	msgh.msg_controllen = sizeof(control);
+
+	rc = recvmsg(be.fd, &msgh, MSG_CMSG_CLOEXEC);
+	if (rc != VHOST_USER_HDR_SIZE)
+		return -1;
+
+	*nfds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg;
+	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+		}
+	}
+
+	if (msg->size > sizeof(msg->payload))
+		return -1;
+	if (msg->size > 0 &&
+	    recv(be.fd, &msg->payload, msg->size, MSG_WAITALL) != msg->size)
+		return -1;
+
+	be.nmsgs++;
+	return 0;
+}
+
+static int
+be_reply(struct vhost_user_msg *msg, uint32_t size)
+{
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+	msg->size = size;
+	if (send(be.fd, msg, VHOST_USER_HDR_SIZE + size, MSG_NOSIGNAL) !=
+	    (ssize_t)(VHOST_USER_HDR_SIZE + size))
+		return -1;
+	return 0;
+}
+
+static int
+be_set_mem_table(struct vhost_user_msg *msg, int *fds, int nfds)
+{
+	struct vhost_user_memory mem = msg->payload.memory;
+	struct be_region *r;
+	uint32_t i;
+
+	if (mem.nregions > VHOST_USER_MAX_REGIONS ||
+	    mem.nregions != (uint32_t)nfds)
+		return -1;
+
+	be_unmap();
+	for (i = 0; i < mem.nregions; i++) {
+		r = &be.regions[i];
+		r->gpa = mem.regions[i].guest_phys_addr;
+		r->size = mem.regions[i].memory_size;
+		r->uaddr = mem.regions[i].userspace_addr;
+		r->maplen = r->size + mem.regions[i].mmap_offset;
+		r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fds[i], 0);
+		close(fds[i]);
+		if (r->map == MAP_FAILED) {
+			fprintf(stderr, "backend: mmap failed: %d\n", errno);
+			return -1;
+		}
+		r->hva = (uint8_t *)r->map + mem.regions[i].mmap_offset;
+		be.nregions++;
+	}
+
+	return 0;
+}
+
+/* handle one message, returns -1 when the connection is to be closed */
+static int
+be_handle_msg(void)
+{
+	struct vhost_user_msg msg;
+	struct vhost_vring_addr addr;
+	struct be_vring *vr;
+	int fds[VHOST_USER_MAX_REGIONS];
+	int i, nfds, idx;
+
+	if (be_recv(&msg, fds, &nfds))
+		return -1;
+
+	if (verbose)
+		printf("backend: request %u, size %u, %d fds\n",
+			msg.request, msg.size, nfds);
+
+	switch (msg.request) {
+	case VHOST_USER_GET_FEATURES:
+		msg.payload.u64 = BE_FEATURES;
+		return be_reply(&msg, sizeof(msg.payload.u64));
+	case VHOST_USER_SET_FEATURES:
+		be.features = msg.payload.u64 & BE_FEATURES;
+		be.base.negotiated_caps = be.features;
+		break;
+	case VHOST_USER_SET_OWNER:
+		break;
+	case VHOST_USER_RESET_OWNER:
+		for (i = 0; i < NR_VQS; i++)
+			be_stop_vring(&be.vr[i]);
+		break;
+	case VHOST_USER_SET_MEM_TABLE:
+		if (be_set_mem_table(&msg, fds, nfds))
+			return -1;
+		return 0;
+	case VHOST_USER_SET_VRING_NUM:
+	case VHOST_USER_SET_VRING_BASE:
+	case VHOST_USER_GET_VRING_BASE:
+		idx = msg.payload.state.index;
+		if (idx >= NR_VQS)
+			return -1;
+		vr = &be.vr[idx];
+		if (msg.request == VHOST_USER_SET_VRING_NUM)
+			vr->num = msg.payload.state.num;
+		else if (msg.request == VHOST_USER_SET_VRING_BASE)
+			vr->base = msg.payload.state.num;
+		else {
+			be_stop_vring(vr);
+			msg.payload.state.num = vr->base;
+			return be_reply(&msg, sizeof(msg.payload.state));
+		}
+		break;
+	case VHOST_USER_SET_VRING_ADDR:
+		addr = msg.payload.addr;
+		if (addr.index >= NR_VQS)
+			return -1;
+		vr = &be.vr[addr.index];
+		vr->desc = be_ua2hva(addr.desc_user_addr, 1);
+		vr->avail = be_ua2hva(addr.avail_user_addr, 1);
+		vr->used = be_ua2hva(addr.used_user_addr, 1);
+		break;
+	case VHOST_USER_SET_VRING_KICK:
+	case VHOST_USER_SET_VRING_CALL:
+		idx = msg.payload.u64 & VHOST_USER_VRING_IDX_MASK;
+		if (idx >= NR_VQS) {
+			for (i = 0; i < nfds; i++)
+				close(fds[i]);
+			return -1;
+		}
+		vr = &be.vr[idx];
+		if (msg.request == VHOST_USER_SET_VRING_CALL) {
+			if (vr->callfd >= 0)
+				close(vr->callfd);
+			vr->callfd = nfds > 0 ? fds[0] : -1;
+			break;
+		}
+		if (vr->kickfd >= 0)
+			close(vr->kickfd);
+		vr->kickfd = nfds > 0 ? fds[0] : -1;
+		/* the ring starts with its kick fd */
+		if (be_start_vring(vr, idx))
+			return -1;
+		be_loopback();
+		break;
+	default:
+		/* nothing asks for a reply we don't know how to make */
+		fprintf(stderr, "backend: request %u ignored\n", msg.request);
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		break;
+	}
+
+	return 0;
+}
+
+static void
+be_init(void)
+{
+	int i;
+
+	memset(&be, 0, sizeof(be));
+	be.fd = -1;
+	be.base.vops = &be_ops;
+	be.base.dev = &be.dev;
+	be.base.queues = &be.vr[0].vq;
+	for (i = 0; i < NR_VQS; i++) {
+		be.vr[i].kickfd = -1;
+		be.vr[i].callfd = -1;
+	}
+}
+
+/* serve one connection till it's closed */
+static void
+be_serve(int fd)
+{
+	struct pollfd pfd[1 + NR_VQS];
+	uint64_t val;
+	int i;
+
+	be.fd = fd;
+	for (;;) {
+		pfd[0].fd = be.fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < NR_VQS; i++) {
+			pfd[1 + i].fd = be.vr[i].started ? be.vr[i].kickfd : -1;
+			pfd[1 + i].events = POLLIN;
+		}
+		if (poll(pfd, 1 + NR_VQS, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents & (POLLIN | POLLHUP)) {
+			if (be_handle_msg())
+				break;
+			continue;
+		}
+
+		for (i = 0; i < NR_VQS; i++) {
+			if (pfd[1 + i].revents & POLLIN &&
+			    read(be.vr[i].kickfd, &val, sizeof(val)) < 0)
+				continue;
+		}
+		be_loopback();
+	}
+
+	for (i = 0; i < NR_VQS; i++) {
+		be_stop_vring(&be.vr[i]);
+		if (be.vr[i].callfd >= 0)
+			close(be.vr[i].callfd);
+	}
+	be_unmap();
+	close(be.fd);
+}
+
+static int
+be_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 1) < 0) {
+		fprintf(stderr, "failed to listen on %s: %d\n", path, errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void *
+be_thread(void *arg)
+{
+	int lfd = *(int *)arg, fd;
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd >= 0)
+		be_serve(fd);
+	return NULL;
+}
+
+/*
+ * Self test: the frontend is the device model vhost_dev, the guest
+ * driver posts the RX buffers once and sends packets numbered from 0.
+ */
+struct guest_vq {
+	volatile struct vring_desc *desc;
+	volatile struct vring_avail *avail;
+	volatile struct vring_used *used;
+	uint16_t avail_idx;
+	uint16_t used_idx;
+};
+
+static struct guest_vq gvq[NR_VQS];
+
+static void
+guest_post(int q, uint16_t id, uint32_t len, bool write)
+{
+	struct guest_vq *g = &gvq[q];
+
+	g->desc[id].addr = BUF_GPA(q, id);
+	g->desc[id].len = len;
+	g->desc[id].flags = write ? VRING_DESC_F_WRITE : 0;
+	g->avail->ring[g->avail_idx & (QSIZE - 1)] = id;
+	atomic_signal_fence();
+	g->avail->idx = ++g->avail_idx;
+}
+
+static void
+guest_kick(struct vhost_dev *vdev, int q)
+{
+	uint64_t val = 1;
+
+	if (write(vdev->vqs[q].kick_fd, &val, sizeof(val)) < 0)
+		perror("kick");
+}
+
+static int
+self_test(unsigned long npkts, int pktlen)
+{
+	struct virtio_vq_info fe_vqs[NR_VQS];
+	struct msix_table_entry msix[NR_VQS];
+	struct vhost_vq vhost_vqs[NR_VQS];
+	struct virtio_base fe_base;
+	struct vhost_dev vdev;
+	struct pci_vdev dev;
+	struct vmctx ctx;
+	struct virtio_ops fe_ops = be_ops;
+	struct pollfd pfd[NR_VQS];
+	struct timespec start, end;
+	char path[64];
+	pthread_t tid;
+	unsigned long sent = 0, recvd = 0;
+	uint16_t id, txfree[QSIZE];
+	uint32_t len, seq;
+	uint64_t val, ns;
+	uint8_t *buf;
+	int q, lfd, fd, ntxfree = QSIZE, progress, ret = -1;
+
+	guest_memfd = memfd_create("vhost_user_test", MFD_CLOEXEC);
+	if (guest_memfd < 0 || ftruncate(guest_memfd, GUEST_MEM_SIZE) < 0) {
+		perror("memfd");
+		return -1;
+	}
+	guest_mem = mmap(NULL, GUEST_MEM_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, guest_memfd, 0);
+	if (guest_mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/tmp/vhost_user_test.%d.sock", getpid());
+	be_init();
+	lfd = be_listen(path);
+	if (lfd < 0)
+		return -1;
+	pthread_create(&tid, NULL, be_thread, &lfd);
+
+	/* what acrn-dm sets up for a device, reduced to what vhost needs */
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.lowmem = GUEST_MEM_SIZE;
+	ctx.baseaddr = (char *)guest_mem;
+	memset(&dev, 0, sizeof(dev));
+	memset(msix, 0, sizeof(msix));
+	dev.vmctx = &ctx;
+	dev.msix.table = msix;
+	memset(&fe_base, 0, sizeof(fe_base));
+	memset(fe_vqs, 0, sizeof(fe_vqs));
+	fe_base.vops = &fe_ops;
+	fe_base.dev = &dev;
+	fe_base.queues = fe_vqs;
+	for (q = 0; q < NR_VQS; q++) {
+		gvq[q].desc = (struct vring_desc *)(guest_mem + RING_GPA(q));
+		gvq[q].avail = (struct vring_avail *)(guest_mem +
+			RING_GPA(q) + AVAIL_OFF);
+		gvq[q].used = (struct vring_used *)(guest_mem +
+			RING_GPA(q) + USED_OFF);
+		fe_vqs[q].qsize = QSIZE;
+		fe_vqs[q].msix_idx = q;
+		fe_vqs[q].desc = (struct vring_desc *)gvq[q].desc;
+		fe_vqs[q].avail = (struct vring_avail *)gvq[q].avail;
+		fe_vqs[q].used = (struct vring_used *)gvq[q].used;
+	}
+
+	fd = vhost_user_connect(path);
+	if (fd < 0)
+		goto out;
+
+	memset(&vdev, 0, sizeof(vdev));
+	vdev.vqs = vhost_vqs;
+	vdev.nvqs = NR_VQS;
+	vdev.ops = &vhost_user_ops;
+	/* the guest driver doesn't do EVENT_IDX, it wants every interrupt */
+	if (vhost_dev_init(&vdev, &fe_base, fd, 0, BE_FEATURES &
+			~(1UL << VIRTIO_RING_F_EVENT_IDX), 0, 0)) {
+		fprintf(stderr, "vhost_dev_init failed\n");
+		goto out;
+	}
+	fe_base.negotiated_caps = vdev.vhost_features;
+	fe_base.status = VIRTIO_CONFIG_S_DRIVER_OK;
+
+	for (id = 0; id < QSIZE; id++) {
+		guest_post(RXQ, id, BUF_SIZE, true);
+		txfree[id] = id;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (vhost_dev_start(&vdev)) {
+		fprintf(stderr, "vhost_dev_start failed\n");
+		goto out_deinit;
+	}
+
+	while (recvd < npkts) {
+		progress = 0;
+		while (ntxfree > 0 && sent < npkts) {
+			id = txfree[--ntxfree];
+			buf = guest_mem + BUF_GPA(TXQ, id);
+			memset(buf, 0, NET_HDR_LEN);
+			seq = sent;
+			memcpy(buf + NET_HDR_LEN, &seq, sizeof(seq));
+			memset(buf + NET_HDR_LEN + sizeof(seq), seq & 0xff,
+				pktlen - sizeof(seq));
+			guest_post(TXQ, id, NET_HDR_LEN + pktlen, false);
+			sent++;
+			progress = 1;
+		}
+		if (progress)
+			guest_kick(&vdev, TXQ);
+
+		while (gvq[TXQ].used_idx != gvq[TXQ].used->idx) {
+			atomic_signal_fence();
+			txfree[ntxfree++] = gvq[TXQ].used->ring[
+				gvq[TXQ].used_idx++ & (QSIZE - 1)].id;
+			progress = 1;
+		}
+
+		while (gvq[RXQ].used_idx != gvq[RXQ].used->idx) {
+			atomic_signal_fence();
+			id = gvq[RXQ].used->ring[gvq[RXQ].used_idx &
+				(QSIZE - 1)].id;
+			len = gvq[RXQ].used->ring[gvq[RXQ].used_idx &
+				(QSIZE - 1)].len;
+			gvq[RXQ].used_idx++;
+			buf = guest_mem + BUF_GPA(RXQ, id);
+			memcpy(&seq, buf + NET_HDR_LEN, sizeof(seq));
+			if (len != NET_HDR_LEN + pktlen || seq != recvd ||
+			    *(uint16_t *)(buf + 10) != 1 ||
+			    buf[len - 1] != (seq & 0xff)) {
+				fprintf(stderr, "packet %lu: bad len %u seq %u\n",
+					recvd, len, seq);
+				goto out_stop;
+			}
+			recvd++;
+			guest_post(RXQ, id, BUF_SIZE, true);
+			progress = 2;
+		}
+		if (progress == 2)
+			guest_kick(&vdev, RXQ);
+
+		if (progress)
+			continue;
+		for (q = 0; q < NR_VQS; q++) {
+			pfd[q].fd = vhost_vqs[q].call_fd;
+			pfd[q].events = POLLIN;
+		}
+		if (poll(pfd, NR_VQS, 1000) == 0) {
+			fprintf(stderr, "timeout, %lu sent, %lu received\n",
+				sent, recvd);
+			goto out_stop;
+		}
+		for (q = 0; q < NR_VQS; q++) {
+			if ((pfd[q].revents & POLLIN) &&
+			    read(pfd[q].fd, &val, sizeof(val)) < 0)
+				perror("call");
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ret = 0;
+
+out_stop:
+	vhost_dev_stop(&vdev);
+	/*
+	 * GET_VRING_BASE brought back where the backend stopped, past all
+	 * it has used
+	 */
+	for (q = 0; q < NR_VQS; q++) {
+		if (fe_vqs[q].last_avail != gvq[q].used->idx) {
+			fprintf(stderr, "vq %d stopped at %u, %u used\n",
+				q, fe_vqs[q].last_avail, gvq[q].used->idx);
+			ret = -1;
+		}
+	}
+out_deinit:
+	vhost_dev_deinit(&vdev);
+out:
+	pthread_join(tid, NULL);
+	close(lfd);
+	unlink(path);
+
+	if (ret == 0) {
+		ns = (end.tv_sec - start.tv_sec) * 1000000000UL +
+			end.tv_nsec - start.tv_nsec;
+		printf("%lu packets of %d bytes looped back in %lu ms, "
+			"%.1f ns/packet, %lu messages, %lu interrupts: OK\n",
+			recvd, pktlen, ns / 1000000, (double)ns / recvd,
+			be.nmsgs, be.nintrs);
+	} else
+		printf("FAILED\n");
+
+	munmap(guest_mem, GUEST_MEM_SIZE);
+	close(guest_memfd);
+	return ret;
+}
+
+static void
+usage(const char *prog)
+{
+	printf("Usage: %s [-s socket] [-n packets] [-l length] [-v]\n"
+		"  -s  serve acrn-dm on this unix socket, instead of the"
+		" self test\n"
+		"  -n  packets of the self test (default 1000000)\n"
+		"  -l  packet length of the self test (default 64)\n"
+		"  -v  print the messages\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = NULL;
+	unsigned long npkts = 1000000UL;
+	int c, lfd, fd, pktlen = 64;
+
+	while ((c = getopt(argc, argv, "s:n:l:vh")) != -1) {
+		switch (c) {
+		case 's':
+			path = optarg;
+			break;
+		case 'n':
+			npkts = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			pktlen = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (pktlen < (int)sizeof(uint32_t) ||
+	    pktlen > (int)(BUF_SIZE - NET_HDR_LEN)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!path)
+		return self_test(npkts, pktlen) ? 1 : 0;
+
+	lfd = be_listen(path);
+	if (lfd < 0)
+		return 1;
+	for (;;) {
+		printf("waiting for acrn-dm on %s\n", path);
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			break;
+		be_init();
+		be_serve(fd);
+		printf("%lu packets looped back, %lu messages\n",
+			be.npkts, be.nmsgs);
+	}
+
+	close(lfd);
+	return 0;
+}
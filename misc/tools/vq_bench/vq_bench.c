@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2020 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Virtqueue micro-benchmark.
+ *
+ * Runs the device model virtqueue code (devicemodel/hw/pci/virtio/virtio.c)
+ * against a minimal guest driver, on two threads pinned to different CPUs,
+ * to measure the cost of moving requests through split and packed rings:
+ * the guest thread keeps the ring full of chains and reaps the used ones,
+ * the device thread does vq_getchain(), vq_relchain() and vq_endchains(),
+ * or vq_getchains_bulk() and vq_relchains_bulk() with -b, as the VBS-U
+ * backends do.  Both sides poll, no notification is involved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "timer.h"
+#include "log.h"
+#include <atomic.h>
+
+#define GUEST_MEM_SIZE		(16UL << 20)
+#define RING_GPA		0x0UL
+#define DRIVER_AREA_GPA		0x80000UL
+#define DEVICE_AREA_GPA		0x100000UL
+#define BUF_GPA			0x200000UL
+#define BUF_SIZE		256U
+#define MAX_SEGS		16
+#define MAX_BATCH		64
+
+static char *guest_mem;
+static unsigned long nr_intr;
+
+/*
+ * The device model services virtio.c relies on, reduced to what the ring
+ * code needs: guest memory is one flat buffer, interrupts are counted.
+ */
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t gaddr, size_t len)
+{
+	if (gaddr + len > GUEST_MEM_SIZE)
+		return NULL;
+	return guest_mem + gaddr;
+}
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > LOG_WARNING)
+		return;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+int pci_msix_enabled(struct pci_vdev *pi) { return 1; }
+void pci_generate_msix(struct pci_vdev *dev, int index) { nr_intr++; }
+void pci_generate_msi(struct pci_vdev *dev, int index) { nr_intr++; }
+void pci_lintr_assert(struct pci_vdev *dev) {}
+void pci_lintr_deassert(struct pci_vdev *dev) {}
+void pci_lintr_request(struct pci_vdev *pi) {}
+int pci_msix_table_bar(struct pci_vdev *pi) { return -1; }
+int pci_msix_pba_bar(struct pci_vdev *pi) { return -1; }
+int pci_emul_add_msicap(struct pci_vdev *pi, int msgnum) { return 0; }
+int pci_emul_add_msixcap(struct pci_vdev *pi, int msgnum, int barnum) { return 0; }
+int pci_emul_alloc_bar(struct pci_vdev *pdi, int idx, enum pcibar_type type,
+		uint64_t size) { return 0; }
+int pci_emul_add_capability(struct pci_vdev *dev, u_char *capdata,
+		int caplen) { return 0; }
+int pci_emul_find_capability(struct pci_vdev *dev, uint8_t capid,
+		int *p_capoff) { return -1; }
+int pci_emul_msix_twrite(struct pci_vdev *pi, uint64_t offset, int size,
+		uint64_t value) { return 0; }
+uint64_t pci_emul_msix_tread(struct pci_vdev *pi, uint64_t offset,
+		int size) { return 0; }
+int32_t acrn_timer_init(struct acrn_timer *timer,
+		void (*cb)(void *, uint64_t), void *param) { return 0; }
+void acrn_timer_deinit(struct acrn_timer *timer) {}
+int32_t acrn_timer_settime(struct acrn_timer *timer,
+		const struct itimerspec *new_value) { return 0; }
+
+static void bench_reset(void *vdev) {}
+
+static struct virtio_ops bench_ops = {
+	"vq_bench",	/* our name */
+	1,		/* we support 1 virtqueue */
+	0,		/* config reg size */
+	bench_reset,	/* reset */
+	NULL,		/* device-wide qnotify */
+	NULL,		/* read virtio config */
+	NULL,		/* write virtio config */
+	NULL,		/* apply negotiated features */
+	NULL,		/* called on guest set status */
+};
+
+struct bench {
+	struct virtio_base base;
+	struct virtio_vq_info vq;
+	struct pci_vdev dev;
+
+	bool packed;
+	uint16_t qsize;
+	int nsegs;
+	int batch;
+	unsigned long nreqs;
+	volatile bool stop;
+
+	/* guest driver state, counts are modulo 2^16 like the device's */
+	uint16_t avail_idx;
+	uint16_t used_idx;
+	uint16_t *free_ids;
+	int nfree;
+};
+
+static int guest_cpu = 0;
+static int device_cpu = 1;
+
+static void
+relax(int *spins)
+{
+	if (++(*spins) < 64) {
+		asm volatile("pause");
+	} else {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+static void
+pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "failed to pin to cpu %d\n", cpu);
+}
+
+static void
+bench_cfg_write(struct bench *b, int offset, int size, uint64_t value)
+{
+	virtio_pci_write(NULL, 0, &b->dev, VIRTIO_MODERN_MMIO_BAR_IDX,
+		VIRTIO_CAP_COMMON_OFFSET + offset, size, value);
+}
+
+/* negotiate the features and enable the queue the way a guest does */
+static void
+bench_setup(struct bench *b)
+{
+	uint32_t features_hi;
+
+	memset(guest_mem, 0, GUEST_MEM_SIZE);
+	virtio_linkup(&b->base, &bench_ops, b, &b->dev, &b->vq, BACKEND_VBSU);
+	b->base.device_caps = VIRTIO_PACKED_HOSTCAPS;
+	b->base.legacy_pio_bar_idx = VIRTIO_LEGACY_PIO_BAR_IDX;
+	b->base.modern_mmio_bar_idx = VIRTIO_MODERN_MMIO_BAR_IDX;
+	virtio_reset_dev(&b->base);
+	b->vq.qsize = b->qsize;
+
+	features_hi = 1U << (VIRTIO_F_VERSION_1 - 32);
+	if (b->packed)
+		features_hi |= 1U << (VIRTIO_F_RING_PACKED - 32);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_GFSELECT, 4, 1);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_GF, 4, features_hi);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_SELECT, 2, 0);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_DESCLO, 4, RING_GPA);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_DESCHI, 4, 0);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_AVAILLO, 4, DRIVER_AREA_GPA);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_AVAILHI, 4, 0);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_USEDLO, 4, DEVICE_AREA_GPA);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_USEDHI, 4, 0);
+	bench_cfg_write(b, VIRTIO_PCI_COMMON_Q_ENABLE, 2, 1);
+
+	/* the guest polls the used ring, no interrupt wanted */
+	if (b->packed)
+		((struct vring_packed_desc_event *)(guest_mem +
+			DRIVER_AREA_GPA))->flags =
+			VRING_PACKED_EVENT_FLAG_DISABLE;
+	else
+		((struct vring_avail *)(guest_mem + DRIVER_AREA_GPA))->flags =
+			VRING_AVAIL_F_NO_INTERRUPT;
+
+	b->avail_idx = 0;
+	b->used_idx = 0;
+	b->nfree = 0;
+	while (b->nfree < b->qsize / b->nsegs) {
+		b->free_ids[b->nfree] = b->nfree;
+		b->nfree++;
+	}
+}
+
+static uint64_t
+buf_gpa(struct bench *b, uint16_t id, int seg)
+{
+	return BUF_GPA + ((uint64_t)id * b->nsegs + seg) * BUF_SIZE;
+}
+
+/*
+ * Split ring guest side: buffer id n always uses the descriptors
+ * [n * nsegs, (n + 1) * nsegs), linked once here.
+ */
+static void
+split_init_descs(struct bench *b)
+{
+	volatile struct vring_desc *desc =
+		(struct vring_desc *)(guest_mem + RING_GPA);
+	int i;
+
+	for (i = 0; i < (b->qsize / b->nsegs) * b->nsegs; i++) {
+		desc[i].addr = buf_gpa(b, i / b->nsegs, i % b->nsegs);
+		desc[i].len = BUF_SIZE;
+		desc[i].flags = ((i + 1) % b->nsegs) ? VRING_DESC_F_NEXT : 0;
+		desc[i].next = i + 1;
+	}
+}
+
+static void
+split_post(struct bench *b, uint16_t id)
+{
+	volatile struct vring_avail *avail =
+		(struct vring_avail *)(guest_mem + DRIVER_AREA_GPA);
+
+	avail->ring[b->avail_idx & (b->qsize - 1)] = id * b->nsegs;
+	atomic_signal_fence();
+	avail->idx = ++b->avail_idx;
+}
+
+static int
+split_reap(struct bench *b)
+{
+	volatile struct vring_used *used =
+		(struct vring_used *)(guest_mem + DEVICE_AREA_GPA);
+	int n = 0;
+
+	while (b->used_idx != used->idx) {
+		atomic_signal_fence();
+		b->free_ids[b->nfree++] =
+			used->ring[b->used_idx & (b->qsize - 1)].id / b->nsegs;
+		b->used_idx++;
+		n++;
+	}
+
+	return n;
+}
+
+/* Packed ring guest side, the head descriptor is made available last */
+static void
+packed_post(struct bench *b, uint16_t id)
+{
+	volatile struct vring_packed_desc *desc =
+		(struct vring_packed_desc *)(guest_mem + RING_GPA);
+	volatile struct vring_packed_desc *vd;
+	uint16_t idx, flags, head_flags = 0;
+	int i;
+
+	for (i = 0; i < b->nsegs; i++) {
+		idx = b->avail_idx + i;
+		vd = &desc[idx & (b->qsize - 1)];
+		vd->addr = buf_gpa(b, id, i);
+		vd->len = BUF_SIZE;
+		vd->id = id;
+		flags = (i < b->nsegs - 1) ? VRING_DESC_F_NEXT : 0;
+		if ((idx & b->qsize) == 0)
+			flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+		else
+			flags |= 1 << VRING_PACKED_DESC_F_USED;
+		if (i == 0)
+			head_flags = flags;
+		else
+			vd->flags = flags;
+	}
+	atomic_signal_fence();
+	desc[b->avail_idx & (b->qsize - 1)].flags = head_flags;
+	b->avail_idx += b->nsegs;
+}
+
+static int
+packed_reap(struct bench *b)
+{
+	volatile struct vring_packed_desc *desc =
+		(struct vring_packed_desc *)(guest_mem + RING_GPA);
+	volatile struct vring_packed_desc *vd;
+	uint16_t flags;
+	int wrap, n = 0;
+
+	for (;;) {
+		vd = &desc[b->used_idx & (b->qsize - 1)];
+		flags = vd->flags;
+		wrap = (b->used_idx & b->qsize) == 0;
+		if (((flags >> VRING_PACKED_DESC_F_AVAIL) & 1) != wrap ||
+		    ((flags >> VRING_PACKED_DESC_F_USED) & 1) != wrap)
+			break;
+		atomic_signal_fence();
+		b->free_ids[b->nfree++] = vd->id;
+		b->used_idx += b->nsegs;
+		n++;
+	}
+
+	return n;
+}
+
+/* the same with vq_getchains_bulk() and vq_relchains_bulk() */
+static void *
+device_thread_bulk(void *arg)
+{
+	struct bench *b = arg;
+	struct virtio_vq_info *vq = &b->vq;
+	struct vq_chain chains[MAX_BATCH];
+	struct iovec iov[MAX_BATCH][MAX_SEGS];
+	int i, n, spins = 0;
+
+	for (i = 0; i < b->batch; i++) {
+		chains[i].iov = iov[i];
+		chains[i].flags = NULL;
+		chains[i].n_iov = MAX_SEGS;
+		chains[i].iolen = 0;
+	}
+
+	pin_to_cpu(device_cpu);
+	while (!b->stop) {
+		if (!vq_has_descs(vq)) {
+			relax(&spins);
+			continue;
+		}
+		do {
+			n = vq_getchains_bulk(vq, chains, b->batch);
+			for (i = 0; i < n; i++) {
+				if (chains[i].n <= 0) {
+					fprintf(stderr, "vq_getchains_bulk failed: %d\n",
+						chains[i].n);
+					exit(1);
+				}
+			}
+			vq_relchains_bulk(vq, chains, n);
+		} while (vq_has_descs(vq));
+		vq_endchains(vq, 1);
+	}
+
+	return NULL;
+}
+
+static void *
+device_thread(void *arg)
+{
+	struct bench *b = arg;
+	struct virtio_vq_info *vq = &b->vq;
+	struct iovec iov[MAX_SEGS];
+	uint16_t idx;
+	int n, spins = 0;
+
+	pin_to_cpu(device_cpu);
+	while (!b->stop) {
+		if (!vq_has_descs(vq)) {
+			relax(&spins);
+			continue;
+		}
+		do {
+			n = vq_getchain(vq, &idx, iov, MAX_SEGS, NULL);
+			if (n <= 0) {
+				fprintf(stderr, "vq_getchain failed: %d\n", n);
+				exit(1);
+			}
+			vq_relchain(vq, idx, 0);
+		} while (vq_has_descs(vq));
+		vq_endchains(vq, 1);
+	}
+
+	return NULL;
+}
+
+static void
+run(struct bench *b)
+{
+	struct timespec start, end;
+	unsigned long posted = 0, done = 0;
+	pthread_t tid;
+	uint64_t ns;
+	int spins = 0, n;
+
+	bench_setup(b);
+	if (!b->packed)
+		split_init_descs(b);
+	nr_intr = 0;
+	b->stop = false;
+
+	pin_to_cpu(guest_cpu);
+	pthread_create(&tid, NULL,
+		b->batch > 1 ? device_thread_bulk : device_thread, b);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (done < b->nreqs) {
+		while (b->nfree > 0 && posted < b->nreqs) {
+			if (b->packed)
+				packed_post(b, b->free_ids[--b->nfree]);
+			else
+				split_post(b, b->free_ids[--b->nfree]);
+			posted++;
+		}
+		n = b->packed ? packed_reap(b) : split_reap(b);
+		if (n == 0)
+			relax(&spins);
+		done += n;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	b->stop = true;
+	pthread_join(tid, NULL);
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000UL +
+		end.tv_nsec - start.tv_nsec;
+	printf("%-6s qsize %u segs %d batch %d: %lu requests in %lu ms, "
+		"%.1f ns/request, %lu interrupts\n",
+		b->packed ? "packed" : "split", b->qsize, b->nsegs, b->batch,
+		done, ns / 1000000, (double)ns / done, nr_intr);
+}
+
+static void
+usage(const char *prog)
+{
+	printf("Usage: %s [-q qsize] [-s segs] [-b batch] [-n requests]"
+		" [-r split|packed] [-g guest_cpu] [-d device_cpu]\n"
+		"  -q  queue size, a power of 2 (default 256)\n"
+		"  -s  descriptors per request (default 1)\n"
+		"  -b  chains taken at once with the bulk API (default 1,"
+		" one by one)\n"
+		"  -n  number of requests (default 10000000)\n"
+		"  -r  ring layout to run, both by default\n"
+		"  -g  cpu of the guest driver thread (default 0)\n"
+		"  -d  cpu of the device thread (default 1)\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench b;
+	const char *ring = NULL;
+	int c;
+
+	memset(&b, 0, sizeof(b));
+	b.qsize = 256;
+	b.nsegs = 1;
+	b.batch = 1;
+	b.nreqs = 10000000UL;
+
+	while ((c = getopt(argc, argv, "q:s:b:n:r:g:d:h")) != -1) {
+		switch (c) {
+		case 'q':
+			b.qsize = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			b.nsegs = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			b.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.nreqs = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			ring = optarg;
+			break;
+		case 'g':
+			guest_cpu = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			device_cpu = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (b.qsize == 0 || b.qsize > 4096 || (b.qsize & (b.qsize - 1)) ||
+	    b.nsegs < 1 || b.nsegs > MAX_SEGS || b.nsegs > b.qsize ||
+	    b.batch < 1 || b.batch > MAX_BATCH ||
+	    BUF_GPA + (uint64_t)b.qsize * BUF_SIZE > GUEST_MEM_SIZE) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* on one CPU the threads take turns, no cache line moves */
+	if (guest_cpu == device_cpu || sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		fprintf(stderr, "warning: the guest and device threads share a "
+			"cpu, the results don't compare the ring layouts\n");
+
+	guest_mem = aligned_alloc(4096, GUEST_MEM_SIZE);
+	b.free_ids = calloc(b.qsize, sizeof(uint16_t));
+	if (guest_mem == NULL || b.free_ids == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	if (ring == NULL || strcmp(ring, "split") == 0) {
+		b.packed = false;
+		run(&b);
+	}
+	if (ring == NULL || strcmp(ring, "packed") == 0) {
+		b.packed = true;
+		run(&b);
+	}
+
+	free(b.free_ids);
+	free(guest_mem);
+	return 0;
+}